@@ -0,0 +1,239 @@
+/*
+*****************************************************************
+* adc_cal_check.c - ADC Correction Table Against A Bent ADC     *
+*****************************************************************
+
+  Models an ESP32-like ADC: a dead zone at the bottom, a full scale
+  short of SUPPLY_VOLTAGE, a bow in the middle of the range and the
+  gain falling off towards the top, plus a little noise.  Builds
+  correction tables from a linear characterization (what the eFuse
+  gives), from two bench points and from a dozen, and runs
+  emon_calcIrms over sines of growing amplitude with each of them.
+  Prints the error against the true RMS and the cost per sample of
+  the table against working the correction out per sample.  Exits
+  non-zero if the multi-point table is not better than raw counts
+  or is off by more than MAX_ERR.
+
+  usage: adc_cal_check [-n samples] [-w windows] [-s seed]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "dizon_EmonLib.h"
+#include "dizon_adc_cal.h"
+#include "waveform.h"
+
+#define DEAD_ZONE_MV    28          // Reads 0 below this
+#define FULL_SCALE_MV   1085        // Reads 4095 from about here, the reference is low
+#define BOW_COUNTS      22          // Mid-range bow of the transfer curve
+#define KNEE_MV         900         // Gain falls off above this
+#define KNEE_COUNTS     60          // Counts lost by the top of the range
+#define NOISE_COUNTS    0.7         // RMS
+#define MID_MV          573         // Divider midpoint
+#define SAMPLE_RATE     6000
+#define MAINS_HZ        60
+#define TABLE_LEN       60000       // Whole cycles
+#define MAX_ERR         0.005
+#define WARMUP_WINDOWS  40
+
+// What the ADC reads for mv at its input, without noise
+static double model_raw(double mv)
+{
+    double x = (mv - DEAD_ZONE_MV) / (FULL_SCALE_MV - DEAD_ZONE_MV);
+    double knee = mv > KNEE_MV ? (mv - KNEE_MV) / (FULL_SCALE_MV - KNEE_MV) : 0;
+    double raw = x * (ADC_COUNTS - 1) + BOW_COUNTS * sin(M_PI * x) - KNEE_COUNTS * knee * knee;
+    return raw < 0 ? 0 : raw > ADC_COUNTS - 1 ? ADC_COUNTS - 1 : raw;
+}
+
+// The characterization only knows the straight line from the dead zone to full scale
+static uint32_t linear_mv(void* ctx, int raw)
+{
+    (void)ctx;
+    return (uint32_t)(DEAD_ZONE_MV + raw * (double)(FULL_SCALE_MV - DEAD_ZONE_MV) / (ADC_COUNTS - 1) + 0.5);
+}
+
+// Bench points: a known input and the averaged reading
+static size_t measure_points(adc_cal_point* points, const double* mv, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        points[i].mv = (uint16_t)mv[i];
+        points[i].raw = (uint16_t)(model_raw(mv[i]) + 0.5);
+    }
+    return n;
+}
+
+//--------------------------------------------------------------------------------------
+// Provider over a table of raw conversions, read raw, through a table, or with the
+// piecewise correction worked out on every read
+//--------------------------------------------------------------------------------------
+typedef struct cal_table {
+    uint16_t raw[TABLE_LEN];
+    size_t pos;
+    const adc_cal* cal;
+    const adc_cal_point* points;
+    size_t n_points;
+    emon_sample_provider provider;
+} cal_table;
+
+static cal_table s_table;
+
+static inline int next_raw(cal_table* t)
+{
+    int v = t->raw[t->pos];
+    if (++t->pos == TABLE_LEN) {
+        t->pos = 0;
+    }
+    return v;
+}
+
+static int read_raw(void* ctx, int channel)
+{
+    (void)channel;
+    return next_raw(ctx);
+}
+
+static int read_lut(void* ctx, int channel)
+{
+    (void)channel;
+    cal_table* t = ctx;
+    return adc_cal_apply(t->cal, next_raw(t));
+}
+
+static int piecewise(const adc_cal_point* p, size_t n, int raw)
+{
+    size_t seg = 0;
+    while (seg + 2 < n && raw > p[seg + 1].raw) {
+        seg++;
+    }
+    double mv = p[seg].mv + (double)(raw - p[seg].raw) * ((double)p[seg + 1].mv - p[seg].mv) /
+                            (p[seg + 1].raw - p[seg].raw);
+    return adc_cal_counts(mv);
+}
+
+static int read_piecewise(void* ctx, int channel)
+{
+    (void)channel;
+    cal_table* t = ctx;
+    return piecewise(t->points, t->n_points, next_raw(t));
+}
+
+static int64_t table_micros(void* ctx)
+{
+    (void)ctx;                  // Not timed
+    return 0;
+}
+
+typedef struct run_result {
+    double err;                 // Worst window, relative
+    double ns;                  // Per sample
+} run_result;
+
+static void run(int (*read)(void*, int), unsigned samples, unsigned windows, double analytic, run_result* r)
+{
+    energy_mon emon;
+    s_table.pos = 0;
+    s_table.provider.ctx = &s_table;
+    s_table.provider.setup = NULL;
+    s_table.provider.read = read;
+    s_table.provider.micros = table_micros;
+    emon_init(&emon, &s_table.provider);
+    emon_current(&emon, 6, WAVE_ICAL);
+    for (unsigned w = 0; w < WARMUP_WINDOWS; w++) {
+        emon_calcIrms(&emon, samples);
+    }
+
+    memset(r, 0, sizeof(*r));
+    double t0 = waveform_now_s();
+    for (unsigned w = 0; w < windows; w++) {
+        double err = fabs(emon_calcIrms(&emon, samples) - analytic) / analytic;
+        r->err = err > r->err ? err : r->err;
+    }
+    r->ns = (waveform_now_s() - t0) * 1e9 / ((double)samples * windows);
+}
+
+int main(int argc, char** argv)
+{
+    static const double amplitudes[] = { 50, 150, 300, 450, 530 };     // Peak mV
+    static const double two_mv[] = { 150, 1000 };
+    static adc_cal linear, two, multi;
+    adc_cal_point two_pts[2], multi_pts[12];
+    double multi_mv[12];
+    unsigned samples = 1500;     // Whole cycles, so what is left is the ADC
+    unsigned windows = 200;
+    unsigned seed = 1;
+    int failures = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:w:s:")) != -1) {
+        switch (opt) {
+        case 'n': samples = (unsigned)atoi(optarg); break;
+        case 'w': windows = (unsigned)atoi(optarg); break;
+        case 's': seed = (unsigned)atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n samples] [-w windows] [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    srand(seed);
+
+    for (size_t i = 0; i < 12; i++) {
+        multi_mv[i] = 40 + 95 * i;
+    }
+    adc_cal_from_fn(&linear, linear_mv, NULL);
+    if (adc_cal_from_points(&two, two_pts, measure_points(two_pts, two_mv, 2)) != 0 ||
+        adc_cal_from_points(&multi, multi_pts, measure_points(multi_pts, multi_mv, 12)) != 0) {
+        printf("building the tables failed\n");
+        return 1;
+    }
+    // The table has to be the piecewise correction, just looked up
+    for (int raw = 0; raw < ADC_COUNTS; raw++) {
+        if (multi.lut[raw] != piecewise(multi_pts, 12, raw)) {
+            printf("table has %u for raw %d, piecewise %d\n", multi.lut[raw], raw, piecewise(multi_pts, 12, raw));
+            failures++;
+            break;
+        }
+    }
+    adc_cal_point bad[2] = { { 100, 50 }, { 100, 60 } };
+    if (adc_cal_from_points(&two, bad, 2) == 0 || adc_cal_from_points(&two, two_pts, 1) == 0) {
+        printf("bad calibration points were taken\n");
+        failures++;
+    }
+    adc_cal_from_points(&two, two_pts, 2);
+
+    const double ratio = WAVE_ICAL * ((SUPPLY_VOLTAGE / 1000.0) / ADC_COUNTS);
+    printf("%d..%d mV range, %d counts of bow, %d counts lost at the top, %.1f counts noise\n\n",
+           DEAD_ZONE_MV, FULL_SCALE_MV, BOW_COUNTS, KNEE_COUNTS, NOISE_COUNTS);
+    printf("%8s %10s %10s %10s %10s %10s   %s\n", "peak mV", "raw", "eFuse", "2-point", "12-point", "analytic",
+           "worst window error, Irms in A");
+    run_result raw_r, lin_r, two_r, multi_r, pw_r;
+    for (size_t a = 0; a < sizeof(amplitudes) / sizeof(amplitudes[0]); a++) {
+        for (size_t k = 0; k < TABLE_LEN; k++) {
+            double mv = MID_MV + amplitudes[a] * sin(2 * M_PI * MAINS_HZ * k / SAMPLE_RATE);
+            double raw = model_raw(mv) + NOISE_COUNTS * waveform_gaussian() + 0.5;
+            s_table.raw[k] = raw < 0 ? 0 : raw > ADC_COUNTS - 1 ? ADC_COUNTS - 1 : (uint16_t)raw;
+        }
+        double analytic = ratio * amplitudes[a] * ADC_COUNTS / SUPPLY_VOLTAGE / sqrt(2);
+
+        run(read_raw, samples, windows, analytic, &raw_r);
+        s_table.cal = &linear;
+        run(read_lut, samples, windows, analytic, &lin_r);
+        s_table.cal = &two;
+        run(read_lut, samples, windows, analytic, &two_r);
+        s_table.cal = &multi;
+        run(read_lut, samples, windows, analytic, &multi_r);
+        s_table.points = multi_pts;
+        s_table.n_points = 12;
+        run(read_piecewise, samples, windows, analytic, &pw_r);
+
+        printf("%8.0f %9.3f%% %9.3f%% %9.3f%% %9.3f%% %10.5f\n", amplitudes[a], 100 * raw_r.err, 100 * lin_r.err,
+               100 * two_r.err, 100 * multi_r.err, analytic);
+        if (multi_r.err > MAX_ERR || multi_r.err >= raw_r.err) {
+            printf("  12-point table off by %.3f%%, raw counts %.3f%%\n", 100 * multi_r.err, 100 * raw_r.err);
+            failures++;
+        }
+    }
+    printf("\nns/sample: raw %.2f, table %.2f, piecewise per sample %.2f\n", raw_r.ns, multi_r.ns, pw_r.ns);
+    return failures ? 1 : 0;
+}
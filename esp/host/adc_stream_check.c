@@ -0,0 +1,246 @@
+/*
+*****************************************************************
+* adc_stream_check.c - Block Handoff And Rate Against The Sim   *
+*****************************************************************
+
+  Streams a counting signal from the simulated ADC through the
+  double buffered adc_stream.  Blocks are lost in the simulated DMA
+  buffer at random points, and the consumer sometimes falls behind
+  or holds on to a block while the producer carries on.  Every
+  sample that went missing has to show up as lost in the source or
+  in a block the stream dropped and counted, and every read that
+  lost samples as an overrun, or as thrown away by a flush.  A
+  flush on a source that always has a block ready has to stop after
+  ADC_STREAM_FLUSH_MAX samples.  Then it runs the simulated
+  converter clock some ppm off and checks the measured rate against
+  it, with and without a flush on the way.
+  Exits non-zero on a mismatch.
+
+  usage: adc_stream_check [-b blocks] [-s seed]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include "dizon_adc_sim.h"
+
+#define BLOCK_LEN       256
+#define CHUNK           64              // Four reads to a block
+#define SAMPLE_RATE_HZ  6000
+#define COUNT_MASK      0xfff           // The signal counts up in 12 bits
+#define RATE_SECONDS    60
+#define RATE_TOLERANCE_PPM 1.0
+
+// Sample n is n itself, so a gap in the stream is the number of samples missing
+static uint16_t counting(void* user, uint64_t n)
+{
+    (void)user;
+    return (uint16_t)(n & COUNT_MASK);
+}
+
+typedef struct seen {
+    uint16_t next;              // Count the next sample should have
+    uint32_t next_seq;
+    uint64_t missing;           // Samples that never reached the consumer
+    uint64_t seq_gaps;          // Blocks that never reached the consumer
+} seen;
+
+static void check_block(seen* s, const adc_block* b)
+{
+    for (size_t i = 0; i < b->len; i++) {
+        s->missing += (uint16_t)(b->samples[i] - s->next) & COUNT_MASK;
+        s->next = (b->samples[i] + 1) & COUNT_MASK;
+    }
+    s->seq_gaps += b->seq - s->next_seq;
+    s->next_seq = b->seq + 1;
+}
+
+// Fills until count more blocks have completed
+static void fill_blocks(adc_stream* stream, int count)
+{
+    while (count > 0) {
+        count -= adc_stream_fill(stream, 0) == 1;
+    }
+}
+
+static int check_lost(unsigned blocks)
+{
+    static adc_stream stream;
+    adc_sim sim;
+    adc_block b;
+    seen s = { 0 };
+    uint32_t losses = 0;
+    int failures = 0;
+
+    adc_stream_init(&stream, adc_sim_init(&sim, counting, NULL, CHUNK), SAMPLE_RATE_HZ, BLOCK_LEN);
+    adc_stream_start(&stream);
+    for (unsigned i = 0; i < blocks; i++) {
+        switch (rand() % 20) {
+        case 0:
+            // Up to three blocks go in the DMA buffer, anywhere in a block
+            for (int k = rand() % (BLOCK_LEN / CHUNK); k > 0; k--) {
+                adc_stream_fill(&stream, 0);
+            }
+            adc_sim_lose(&sim, (1 + rand() % 3) * BLOCK_LEN);
+            losses++;
+            break;
+        case 1:
+            // Too slow to take one, the older of the two goes
+            fill_blocks(&stream, 2);
+            break;
+        case 2:
+            // Still working on one while the producer completes more
+            if (adc_stream_next(&stream, &b, 0)) {
+                fill_blocks(&stream, 1 + rand() % 2);
+                check_block(&s, &b);
+                adc_stream_release(&stream, &b);
+            }
+            break;
+        case 3:
+            // What the sampling task does before every window
+            adc_stream_flush(&stream);
+            break;
+        default:
+            break;
+        }
+        if (adc_stream_next(&stream, &b, 0)) {
+            check_block(&s, &b);
+            adc_stream_release(&stream, &b);
+        }
+    }
+    adc_stream_stop(&stream);
+
+    // Every sample the simulator counted off is in a block taken, missing or still filling
+    uint64_t handed = s.missing + stream.blocks_taken * (uint64_t)BLOCK_LEN + stream.fill;
+    uint64_t accounted = sim.lost + stream.blocks_dropped * (uint64_t)BLOCK_LEN + stream.flushed;
+    printf("Lost blocks: %u losses of %llu samples, %u blocks taken, %u dropped, %u overruns, "
+           "%llu samples flushed\n", losses, (unsigned long long)sim.lost, stream.blocks_taken,
+           stream.blocks_dropped, stream.overruns, (unsigned long long)stream.flushed);
+    if (s.missing != accounted || handed != sim.n) {
+        printf("%llu samples missing from the blocks taken, %llu lost in the source, dropped or flushed\n",
+               (unsigned long long)s.missing, (unsigned long long)accounted);
+        failures++;
+    }
+    if (s.seq_gaps != stream.blocks_dropped) {
+        printf("%llu blocks missing from the sequence, %u counted as dropped\n",
+               (unsigned long long)s.seq_gaps, stream.blocks_dropped);
+        failures++;
+    }
+    if (stream.overruns != losses) {
+        printf("%u overruns for %u losses\n", stream.overruns, losses);
+        failures++;
+    }
+    if (stream.blocks_filled != stream.blocks_taken + stream.blocks_dropped) {
+        printf("%u blocks filled, %u taken and %u dropped\n", stream.blocks_filled, stream.blocks_taken,
+               stream.blocks_dropped);
+        failures++;
+    }
+    if (losses == 0 || stream.blocks_dropped == 0 || stream.flushed == 0) {
+        printf("Nothing was lost, dropped or flushed, run more blocks\n");
+        failures++;
+    }
+    return failures;
+}
+
+// The simulated source hands over a whole block on every read, like a DMA buffer that
+// never drains, so only ADC_STREAM_FLUSH_MAX ends the flush
+static int check_flush(void)
+{
+    static adc_stream stream;
+    adc_sim sim;
+    adc_block b;
+    int failures = 0;
+
+    adc_stream_init(&stream, adc_sim_init(&sim, counting, NULL, BLOCK_LEN), SAMPLE_RATE_HZ, BLOCK_LEN);
+    adc_stream_start(&stream);
+    for (int i = 0; i < 3; i++) {
+        uint64_t before = stream.flushed;
+        adc_stream_flush(&stream);
+        uint64_t flushed = stream.flushed - before;
+        if (flushed < ADC_STREAM_FLUSH_MAX || flushed > ADC_STREAM_FLUSH_MAX + BLOCK_LEN) {
+            printf("Flush of a source that never runs dry threw away %llu samples\n",
+                   (unsigned long long)flushed);
+            failures++;
+        }
+        // The next block starts right after what the flush read
+        if (!adc_stream_next(&stream, &b, 0) || b.samples[0] != (uint16_t)((sim.n - BLOCK_LEN) & COUNT_MASK)) {
+            printf("No fresh block after a flush\n");
+            failures++;
+        } else {
+            adc_stream_release(&stream, &b);
+        }
+    }
+    adc_stream_stop(&stream);
+    printf("Flush: %llu samples thrown away in 3 flushes of a source that never runs dry\n",
+           (unsigned long long)stream.flushed);
+    return failures;
+}
+
+static int check_rate(void)
+{
+    static const int32_t PPM[] = { 0, 20, -20, 150, -150, 1000 };
+    static adc_stream stream;
+    adc_sim sim;
+    adc_block b;
+    int failures = 0;
+
+    printf("\n%8s %14s %14s %10s\n", "clock", "expected Hz", "measured Hz", "error ppm");
+    for (size_t i = 0; i < sizeof(PPM) / sizeof(PPM[0]); i++) {
+        const adc_block_source* src = adc_sim_init(&sim, counting, NULL, CHUNK);
+        sim.clock_error_ppm = PPM[i];
+        adc_stream_init(&stream, src, SAMPLE_RATE_HZ, BLOCK_LEN);
+        adc_stream_start(&stream);
+        adc_stream_fill(&stream, 0);
+        if (adc_stream_measured_rate(&stream) != 0) {
+            printf("%+d ppm: a rate after one read\n", PPM[i]);
+            failures++;
+        }
+        for (int half = 0; half < 2; half++) {
+            // The second half starts from a flush, which restarts the rate accounting
+            if (half) {
+                adc_stream_flush(&stream);
+            }
+            while (stream.samples < (uint64_t)RATE_SECONDS * SAMPLE_RATE_HZ / 2) {
+                if (adc_stream_next(&stream, &b, 0)) {
+                    adc_stream_release(&stream, &b);
+                }
+            }
+        }
+        adc_stream_stop(&stream);
+
+        double expected = SAMPLE_RATE_HZ * (1.0 + PPM[i] / 1e6);
+        double measured = adc_stream_measured_rate(&stream);
+        double error_ppm = (measured / expected - 1) * 1e6;
+        printf("%+6d ppm %14.3f %14.3f %10.3f\n", PPM[i], expected, measured, error_ppm);
+        if (fabs(error_ppm) > RATE_TOLERANCE_PPM) {
+            failures++;
+        }
+    }
+    return failures;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned blocks = 20000, seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:s:")) != -1) {
+        switch (opt) {
+        case 'b': blocks = (unsigned)atoi(optarg); break;
+        case 's': seed = (unsigned)atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-b blocks] [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    srand(seed);
+
+    int failures = check_lost(blocks) + check_flush() + check_rate();
+    if (failures) {
+        printf("%d failures\n", failures);
+    } else {
+        printf("ADC stream ok\n");
+    }
+    return failures ? 1 : 0;
+}
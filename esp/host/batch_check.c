@@ -0,0 +1,115 @@
+/*
+*****************************************************************
+* batch_check.c - Flush Policy And Record Ages Of The Batcher   *
+*****************************************************************
+
+  Runs the telemetry batcher through scripted arrivals: a batch
+  due on its record count, one taken in two payloads because only
+  two records fit in one, where the records left behind must only
+  come due on their own age, a full batch that drops its oldest
+  record, and a record taken back with batch_pop.  Exits non-zero
+  on a mismatch.
+
+  usage: batch_check
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include "dizon_batch.h"
+
+#define ID      "A4CF12B3C4D8"
+#define TOPIC   "esptest/batch"
+#define S       1000000LL
+#define AGE_MS  30000
+
+static int s_failures;
+
+static void expect(bool ok, const char* what)
+{
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        s_failures++;
+    }
+}
+
+static sump_record record(uint32_t seq)
+{
+    sump_record rec = { .seq = seq, .irms = 1.5f, .irms_min = 1.5f, .irms_max = 1.5f, .free_mem = 65536 };
+    return rec;
+}
+
+static void count_due(void)
+{
+    static telemetry_batch b;
+    const batch_policy policy = { .max_records = 3, .max_age_ms = 0, .max_bytes = BATCH_MAX_BYTES };
+    sump_record rec = record(1);
+
+    batch_init(&b, &telemetry_json, ID, TOPIC, &policy);
+    expect(!batch_add(&b, &rec, 0) && !batch_add(&b, &rec, 1 * S), "due before max_records");
+    expect(batch_add(&b, &rec, 2 * S), "not due at max_records");
+    expect(batch_ms_until_due(&b, 2 * S) == UINT32_MAX, "an age limit with max_age_ms 0");
+}
+
+// Records arrive at 0, 10, 20 and 25 s, two to a payload.  What is left after the
+// first payload went at 30 s is 10 s old, not 30.
+static void leftover_age(void)
+{
+    static telemetry_batch b;
+    static uint8_t buf[BATCH_MAX_BYTES];
+    const int64_t arrive[] = { 0, 10 * S, 20 * S, 25 * S };
+    sump_record recs[3] = { record(1), record(1), record(1) };
+    const uint8_t* payload;
+    size_t used;
+
+    // The length of three records is too short for them, JSON also wants room to close
+    size_t two = telemetry_json.encode(ID, recs, 2, buf, sizeof(buf), &used);
+    size_t three = telemetry_json.encode(ID, recs, 3, buf, sizeof(buf), &used);
+    batch_policy policy = { .max_records = BATCH_MAX_RECORDS, .max_age_ms = AGE_MS, .max_bytes = (uint32_t)three };
+    batch_init(&b, &telemetry_json, ID, TOPIC, &policy);
+    for (int i = 0; i < 4; i++) {
+        sump_record rec = record(1);
+        batch_add(&b, &rec, arrive[i]);
+    }
+    expect(batch_ms_until_due(&b, 20 * S) == 10000, "oldest record 20 s old, 10 s to go");
+
+    expect(batch_take_payload(&b, &payload) == two && batch_pending(&b) == 2, "two records to a payload");
+    expect(b.oldest_us == 20 * S, "oldest_us is the oldest record left");
+    expect(batch_ms_until_due(&b, 30 * S) == 20000, "leftovers due 30 s after they arrived");
+
+    // With room for all of them only the age decides
+    policy.max_bytes = BATCH_MAX_BYTES;
+    batch_set_policy(&b, &policy);
+    expect(!batch_due(&b, 30 * S), "leftovers due on the age of records already sent");
+    expect(!batch_due(&b, 50 * S - 1), "leftovers due early");
+    expect(batch_due(&b, 50 * S), "leftovers not due at their own age");
+
+    batch_take_payload(&b, &payload);
+    expect(batch_pending(&b) == 0 && batch_ms_until_due(&b, 50 * S) == UINT32_MAX, "empty batch has an age");
+}
+
+// The publisher never flushed: the oldest goes, and its age with it
+static void full_batch(void)
+{
+    static telemetry_batch b;
+    const batch_policy policy = { .max_records = BATCH_MAX_RECORDS, .max_age_ms = AGE_MS, .max_bytes = 0 };
+    sump_record rec;
+
+    batch_init(&b, &telemetry_json, ID, TOPIC, &policy);
+    for (uint32_t i = 0; i <= BATCH_MAX_RECORDS; i++) {
+        rec = record(i);
+        batch_add(&b, &rec, i * S);
+    }
+    expect(batch_pending(&b) == BATCH_MAX_RECORDS && b.stats.dropped == 1, "oldest dropped from a full batch");
+    expect(b.records[0].seq == 1 && b.oldest_us == 1 * S, "age of the dropped record kept");
+
+    expect(batch_pop(&b, &rec) && rec.seq == 1 && b.oldest_us == 2 * S, "age of a popped record kept");
+}
+
+int main(void)
+{
+    count_due();
+    leftover_age();
+    full_batch();
+    printf("%s\n", s_failures ? "Batch FAILED" : "Batch ok");
+    return s_failures ? 1 : 0;
+}
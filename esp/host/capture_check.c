@@ -0,0 +1,288 @@
+/*
+*****************************************************************
+* capture_check.c - Waveform Capture Against Scripted Events    *
+*****************************************************************
+
+  Plays scripted currents through the per-cycle RMS window and the
+  capture, in blocks of random length the way the DMA hands them
+  over: a pump starting, one stopping, a load step, a CT stuck at
+  full scale, every slot left waiting for upload, and a pump that
+  chatters on and off faster than the holdoff.  Each capture is
+  pulled out in chunks, parsed back and checked for its trigger,
+  its timing and that the samples are the stream's own.  Then
+  times capture_push per sample.  Exits non-zero on a violation.
+
+  usage: capture_check [-s seed]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "dizon_capture.h"
+#include "dizon_emon_window.h"
+#include "waveform.h"
+
+#define SAMPLE_RATE     6000
+#define MAINS_HZ        60
+#define PRE_MS          250
+#define POST_MS         750
+#define MAX_BLOCK       300
+#define CHUNK_SAMPLES   256
+#define MAX_SEGMENTS    24
+#define MAX_EXPECT      4
+#define MAX_SAMPLES     (SAMPLE_RATE * 12)
+
+typedef enum { OFF, ON, STUCK } segment_kind;
+
+typedef struct segment {
+    uint32_t ms;
+    segment_kind kind;
+    double amplitude;               // Peak counts, ON
+} segment;
+
+typedef struct expect {
+    capture_reason reason;
+    uint32_t at_ms;                 // Of the event, the trigger comes up to a few cycles later
+} expect;
+
+typedef struct scenario {
+    const char* name;
+    segment segments[MAX_SEGMENTS];
+    float step_amps;
+    float threshold_amps;
+    uint16_t zc_cycles;
+    uint32_t holdoff_ms;
+    uint8_t slots;
+    bool hold;                      // Never upload, every slot fills up
+    int expected;                   // Captures, -1 for at most one per holdoff
+    expect expect[MAX_EXPECT];
+} scenario;
+
+#define CHATTER(ms) { ms, ON, 600 }, { ms + 250, OFF, 0 }
+
+static const scenario SCENARIOS[] = {
+    { "start",   { { 0, OFF, 0 }, { 2000, ON, 600 } }, 0, 1.0f, 0, 0, 2, false,
+      1, { { CAPTURE_THRESHOLD, 2000 } } },
+    { "stop",    { { 0, ON, 600 }, { 2000, OFF, 0 } }, 0, 1.0f, 0, 0, 2, false,
+      1, { { CAPTURE_THRESHOLD, 2000 } } },
+    { "step",    { { 0, ON, 300 }, { 2000, ON, 600 } }, 1.0f, 1.0f, 0, 0, 2, false,
+      1, { { CAPTURE_STEP, 2000 } } },
+    { "stuck",   { { 0, ON, 600 }, { 2000, STUCK, 0 } }, 0, 0, 3, 0, 2, false,
+      1, { { CAPTURE_ZERO_CROSS, 2000 } } },
+    { "full",    { { 0, OFF, 0 }, CHATTER(1000), CHATTER(2500), CHATTER(4000), CHATTER(5500) },
+      0, 1.0f, 0, 0, 2, true, 2, { { CAPTURE_THRESHOLD, 1000 }, { CAPTURE_THRESHOLD, 2500 } } },
+    { "chatter", { { 0, OFF, 0 }, CHATTER(1000), CHATTER(1500), CHATTER(2000), CHATTER(2500), CHATTER(3000),
+                   CHATTER(3500), CHATTER(4000), CHATTER(4500), CHATTER(5000), CHATTER(5500) },
+      0, 1.0f, 0, 2000, 2, false, -1, { { 0 } } },
+};
+
+static uint16_t s_stream[MAX_SAMPLES];
+static uint16_t s_arena[CAPTURE_MAX_SLOTS * (SAMPLE_RATE * (PRE_MS + POST_MS) / 1000)];
+static uint16_t s_out[SAMPLE_RATE * (PRE_MS + POST_MS) / 1000];
+
+static int64_t sample_us(size_t k)
+{
+    return (int64_t)k * 1000000 / SAMPLE_RATE;
+}
+
+// Each segment runs from its ms to the next one's, the last one for 2 s
+static size_t generate(const scenario* sc)
+{
+    size_t n = 0;
+    for (int i = 0; i < MAX_SEGMENTS && (i == 0 || sc->segments[i].ms); i++) {
+        const segment* seg = &sc->segments[i];
+        size_t end = i + 1 < MAX_SEGMENTS && sc->segments[i + 1].ms ?
+                     (size_t)sc->segments[i + 1].ms * SAMPLE_RATE / 1000 :
+                     (size_t)(seg->ms + 2000) * SAMPLE_RATE / 1000;
+        for (; n < end && n < MAX_SAMPLES; n++) {
+            double v = ADC_COUNTS / 2 + 2 * waveform_gaussian();
+            if (seg->kind == ON) {
+                v += seg->amplitude * sin(2 * M_PI * MAINS_HZ * n / SAMPLE_RATE);
+            } else if (seg->kind == STUCK) {
+                v = ADC_COUNTS - 1;
+            }
+            s_stream[n] = v < 0 ? 0 : v > ADC_COUNTS - 1 ? ADC_COUNTS - 1 : (uint16_t)(v + 0.5);
+        }
+    }
+    return n;
+}
+
+static void on_rms(void* user, int64_t t_us, float irms)
+{
+    capture_rms(user, t_us, irms);
+}
+
+// Pulls a capture out chunk by chunk and checks it against the stream and what was expected
+static int upload(const scenario* sc, capture* c, capture_slot* s, int index, size_t stream_len)
+{
+    static uint8_t buf[CAPTURE_CHUNK_HEADER + 2 * CHUNK_SAMPLES];
+    capture_chunk_header hdr;
+    const uint8_t* p;
+    uint32_t offset = 0;
+    int failures = 0;
+    size_t len;
+
+    while ((len = capture_chunk(s, offset, SAMPLE_RATE, s->info.trigger_us, CHUNK_SAMPLES, buf, sizeof(buf))) > 0) {
+        if ((p = capture_chunk_parse(buf, len, &hdr)) == NULL || hdr.offset != offset || hdr.id != s->info.id) {
+            printf("%s: capture %u chunk at %u does not parse back\n", sc->name, s->info.id, offset);
+            return 1;
+        }
+        for (uint16_t i = 0; i < hdr.count; i++) {
+            s_out[offset + i] = (uint16_t)(p[2 * i] | p[2 * i + 1] << 8);
+        }
+        offset += hdr.count;
+    }
+    if (offset != s->info.len || s->info.len != c->slot_len || s->info.pre != c->cfg.pre_samples) {
+        printf("%s: capture %u has %u of %u samples, %u before the trigger\n", sc->name, s->info.id, offset,
+               c->slot_len, s->info.pre);
+        failures++;
+    }
+    // Where it sits in the stream, give or take the rounding of the trigger time
+    int64_t trigger = (s->info.trigger_us * SAMPLE_RATE + 999999) / 1000000;
+    bool found = false;
+    for (int64_t k0 = trigger - s->info.pre - 2; k0 <= trigger - s->info.pre + 2 && !found; k0++) {
+        found = k0 >= 0 && (size_t)k0 + offset <= stream_len && memcmp(&s_stream[k0], s_out, offset * sizeof(uint16_t)) == 0;
+    }
+    if (!found) {
+        printf("%s: capture %u is not the stream around %.3f s\n", sc->name, s->info.id, s->info.trigger_us / 1e6);
+        failures++;
+    }
+    if (sc->expected >= 0 && index < sc->expected) {
+        const expect* e = &sc->expect[index];
+        int64_t late_us = (s->info.trigger_us - e->at_ms * 1000LL);
+        int64_t limit_us = (sc->zc_cycles + 2) * 1000000LL / MAINS_HZ;
+        if (s->info.reason != e->reason || late_us < 0 || late_us > limit_us) {
+            printf("%s: capture %u is %s at %.3f s, expected %s within %lld ms of %.3f s\n", sc->name, s->info.id,
+                   capture_reason_name(s->info.reason), s->info.trigger_us / 1e6, capture_reason_name(e->reason),
+                   (long long)(limit_us / 1000), e->at_ms / 1e3);
+            failures++;
+        }
+    }
+    printf("  #%u %-10s at %7.3f s  %.2f -> %.2f A\n", s->info.id, capture_reason_name(s->info.reason),
+           s->info.trigger_us / 1e6, s->info.irms_before, s->info.irms_after);
+    return failures;
+}
+
+static int run(const scenario* sc)
+{
+    static const emon_sample_provider none = { 0 };     // The window only uses ICAL and the filter
+    const capture_config cfg = {
+        .sample_rate_hz = SAMPLE_RATE,
+        .mains_hz = MAINS_HZ,
+        .pre_samples = SAMPLE_RATE * PRE_MS / 1000,
+        .post_samples = SAMPLE_RATE * POST_MS / 1000,
+        .step_amps = sc->step_amps,
+        .threshold_amps = sc->threshold_amps,
+        .zc_cycles = sc->zc_cycles,
+        .zc_band = 20,
+        .zc_min_amps = 0.5f,
+        .holdoff_ms = sc->holdoff_ms,
+    };
+    energy_mon emon;
+    emon_window w;
+    capture c;
+    size_t len = generate(sc), pos = 0;
+    int failures = 0, taken = 0;
+
+    emon_init(&emon, &none);
+    emon_current(&emon, 6, WAVE_ICAL);
+    emon_window_init(&w, &emon, SAMPLE_RATE, MAINS_HZ, 1, 1);
+    emon_window_set_callback(&w, on_rms, &c);
+    if (capture_init(&c, &cfg, s_arena, sizeof(s_arena) / sizeof(s_arena[0]), sc->slots) != 0) {
+        printf("%s: capture_init failed\n", sc->name);
+        return 1;
+    }
+    printf("%s\n", sc->name);
+    while (pos < len) {
+        size_t n = 1 + rand() % MAX_BLOCK;
+        n = n < len - pos ? n : len - pos;
+        // Same order as the sampling task: the capture sees a block before the RMS of it triggers
+        capture_push(&c, &s_stream[pos], n, sample_us(pos));
+        emon_window_push(&w, &s_stream[pos], n, sample_us(pos));
+        pos += n;
+        capture_slot* s;
+        while (!sc->hold && (s = capture_ready(&c)) != NULL) {
+            failures += upload(sc, &c, s, taken++, len);
+            capture_release(&c, s);
+        }
+    }
+    if (sc->hold) {
+        capture_slot* s;
+        while ((s = capture_ready(&c)) != NULL) {
+            failures += upload(sc, &c, s, taken++, len);
+            capture_release(&c, s);
+        }
+        if (c.dropped == 0 || c.rec != NULL) {
+            printf("%s: %u dropped with every slot full\n", sc->name, c.dropped);
+            failures++;
+        }
+        // Released, the next trigger is taken again
+        capture_push(&c, s_stream, 1, sample_us(len));
+        if (c.rec == NULL || !capture_trigger(&c, CAPTURE_MANUAL, sample_us(len))) {
+            printf("%s: no recording after the slots were released\n", sc->name);
+            failures++;
+        }
+    }
+    uint32_t bound = (uint32_t)(len * 1000 / SAMPLE_RATE / (sc->holdoff_ms ? sc->holdoff_ms : 1)) + 1;
+    if (sc->expected >= 0 ? taken != sc->expected : (taken == 0 || (uint32_t)taken > bound)) {
+        printf("%s: %d captures, expected %d\n", sc->name, taken, sc->expected >= 0 ? sc->expected : (int)bound);
+        failures++;
+    }
+    capture_print(&c);
+    return failures;
+}
+
+// Recording with nothing triggering, what every block costs
+static void bench(void)
+{
+    const capture_config cfg = {
+        .sample_rate_hz = SAMPLE_RATE, .mains_hz = MAINS_HZ,
+        .pre_samples = SAMPLE_RATE * PRE_MS / 1000, .post_samples = SAMPLE_RATE * POST_MS / 1000,
+        .zc_cycles = 3, .zc_band = 20, .zc_min_amps = 0.5f,
+    };
+    const unsigned reps = 20;
+    capture c;
+    size_t len = generate(&SCENARIOS[0]);
+
+    capture_init(&c, &cfg, s_arena, sizeof(s_arena) / sizeof(s_arena[0]), 2);
+    double t0 = waveform_now_s();
+    for (unsigned r = 0; r < reps; r++) {
+        for (size_t pos = 0; pos < len; pos += MAX_BLOCK) {
+            capture_push(&c, &s_stream[pos], len - pos < MAX_BLOCK ? len - pos : MAX_BLOCK, sample_us(pos));
+        }
+    }
+    printf("\nns/sample: capture_push %.2f, %u bytes of arena per slot\n",
+           (waveform_now_s() - t0) * 1e9 / ((double)len * reps), c.slot_len * 2);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned seed = 1;
+    int failures = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        switch (opt) {
+        case 's': seed = (unsigned)atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    srand(seed);
+
+    for (size_t i = 0; i < sizeof(SCENARIOS) / sizeof(SCENARIOS[0]); i++) {
+        failures += run(&SCENARIOS[i]);
+    }
+
+    uint8_t junk[CAPTURE_CHUNK_HEADER + 8] = { CAPTURE_CHUNK_VERSION, 0, 9 };
+    capture_chunk_header hdr;
+    if (capture_chunk_parse(junk, sizeof(junk), &hdr) != NULL) {
+        printf("a chunk with the wrong sample count was parsed\n");
+        failures++;
+    }
+
+    bench();
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,176 @@
+/*
+*****************************************************************
+* deadband_check.c - Report-By-Exception Filter On A Script     *
+*****************************************************************
+
+  Steps the deadband through a scripted trace: the first reading
+  always goes out, readings inside the band around the last one
+  sent are held back, the relative band widens with a running pump,
+  a reading past the band goes out with the count held back before
+  it, and a steady reading goes out again once heartbeat_s has
+  passed, unless the heartbeat is off.  Then a long random walk,
+  where every reading must be sent or counted exactly once, every
+  held back one must be inside the band, and no two sent ones
+  further apart than the heartbeat.  Exits non-zero on a mismatch.
+
+  usage: deadband_check [-s seed]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include "dizon_deadband.h"
+
+#define WALK_READINGS   1000000
+
+typedef struct step {
+    double t_s;
+    float amps;
+    deadband_verdict verdict;
+    uint32_t suppressed;        // Reported with it when it goes out
+} step;
+
+static const deadband_config CFG = { .abs_amps = 0.05f, .rel = 0.1f, .heartbeat_s = 60 };
+
+static const step SCRIPT[] = {
+    { 0, 0.02f, DEADBAND_FIRST, 0 },
+    { 1, 0.05f, DEADBAND_SUPPRESS, 0 },     // Idle noise, inside the 50 mA band
+    { 2, 0.06f, DEADBAND_SUPPRESS, 0 },
+    { 3, 0.00f, DEADBAND_SUPPRESS, 0 },
+    { 4, 0.09f, DEADBAND_CHANGE, 3 },
+    { 5, 6.00f, DEADBAND_CHANGE, 0 },       // Pump starts
+    { 6, 6.50f, DEADBAND_SUPPRESS, 0 },     // 10 % of 6 A is 600 mA
+    { 7, 5.50f, DEADBAND_SUPPRESS, 0 },
+    { 8, 6.70f, DEADBAND_CHANGE, 2 },
+    { 9, 6.70f, DEADBAND_SUPPRESS, 0 },
+    { 67.5, 6.70f, DEADBAND_SUPPRESS, 0 },  // 58.5 s since the last one sent
+    { 68, 6.70f, DEADBAND_HEARTBEAT, 2 },
+    { 69, 6.80f, DEADBAND_SUPPRESS, 0 },
+    { 70, 0.03f, DEADBAND_CHANGE, 1 },      // Pump stops
+};
+
+static int scripted(void)
+{
+    deadband db;
+    int failures = 0;
+    uint32_t sent = 0, held = 0;
+
+    deadband_init(&db, &CFG);
+    for (size_t i = 0; i < sizeof(SCRIPT) / sizeof(SCRIPT[0]); i++) {
+        const step* s = &SCRIPT[i];
+        uint32_t suppressed = UINT32_MAX;
+        deadband_verdict v = deadband_check(&db, s->amps, (int64_t)(s->t_s * 1e6), &suppressed);
+        if (v != s->verdict || (v != DEADBAND_SUPPRESS && suppressed != s->suppressed)) {
+            printf("%.1f s, %.2f A: %s with %u held back, expected %s with %u\n", s->t_s, s->amps,
+                   deadband_verdict_name(v), suppressed, deadband_verdict_name(s->verdict), s->suppressed);
+            failures++;
+        }
+        if (v == DEADBAND_SUPPRESS) {
+            held++;
+        } else {
+            sent++;
+        }
+    }
+    if (db.passed != sent || db.suppressed_total != held || db.heartbeats != 1) {
+        printf("Counted %u sent, %u held back, %u heartbeats; expected %u, %u, 1\n", db.passed,
+               db.suppressed_total, db.heartbeats, sent, held);
+        failures++;
+    }
+
+    // Forced out with whatever was held back, then the band is around it
+    uint32_t suppressed;
+    deadband_check(&db, 0.04f, 71000000, &suppressed);
+    deadband_pass(&db, 0.04f, 72000000, &suppressed);
+    if (suppressed != 1 || deadband_check(&db, 0.06f, 73000000, &suppressed) != DEADBAND_SUPPRESS) {
+        printf("deadband_pass: %u held back reported\n", suppressed);
+        failures++;
+    }
+
+    // No heartbeat: a steady reading is held back for good
+    deadband_config quiet = CFG;
+    quiet.heartbeat_s = 0;
+    deadband_init(&db, &quiet);
+    deadband_check(&db, 1.0f, 0, &suppressed);
+    for (int64_t t = 1; t <= 86400; t++) {
+        if (deadband_check(&db, 1.0f, t * 1000000, &suppressed) != DEADBAND_SUPPRESS) {
+            printf("Heartbeat off, a steady reading went out after %lld s\n", (long long)t);
+            failures++;
+            break;
+        }
+    }
+
+    deadband_config bad = CFG;
+    bad.abs_amps = -1;
+    if (deadband_init(&db, &bad) == 0) {
+        printf("Negative band accepted\n");
+        failures++;
+    }
+    return failures;
+}
+
+static int walk(void)
+{
+    deadband db;
+    float amps = 0.1f, last_sent = 0;
+    int64_t last_us = 0;
+    uint64_t reported = 0, sent = 0;
+    int failures = 0;
+
+    deadband_init(&db, &CFG);
+    for (uint32_t i = 0; i < WALK_READINGS && failures < 10; i++) {
+        int64_t t_us = i * 1000000LL;
+        uint32_t suppressed;
+        amps += (rand() % 2001 - 1000) / 20000.0f;
+        amps = amps < 0 ? 0 : amps > 20 ? 20 : amps;
+        deadband_verdict v = deadband_check(&db, amps, t_us, &suppressed);
+        if (v == DEADBAND_SUPPRESS) {
+            if (fabsf(amps - last_sent) > fmaxf(CFG.abs_amps, CFG.rel * fabsf(last_sent))) {
+                printf("%.3f A held back, %.3f A sent last\n", amps, last_sent);
+                failures++;
+            }
+            if (t_us - last_us >= CFG.heartbeat_s * 1000000LL) {
+                printf("Nothing sent for %lld s\n", (long long)((t_us - last_us) / 1000000));
+                failures++;
+            }
+            continue;
+        }
+        reported += suppressed;
+        sent++;
+        last_sent = amps;
+        last_us = t_us;
+    }
+    reported += db.suppressed;
+    printf("Random walk: %llu sent of %u, %u heartbeats\n", (unsigned long long)sent, WALK_READINGS,
+           db.heartbeats);
+    if (sent + reported != WALK_READINGS) {
+        printf("%llu sent and %llu reported held back, %u readings\n", (unsigned long long)sent,
+               (unsigned long long)reported, WALK_READINGS);
+        failures++;
+    }
+    return failures;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        switch (opt) {
+        case 's': seed = (unsigned)atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    srand(seed);
+
+    int failures = scripted() + walk();
+    if (failures) {
+        printf("%d failures\n", failures);
+    } else {
+        printf("Deadband ok\n");
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,531 @@
+/*
+*****************************************************************
+* emon_bench.c - Host Benchmark For The Energy Monitor Math     *
+*****************************************************************
+
+  Runs emon_calcIrms, emon_calcIrms_stream, emon_calcVI (double
+  and fixed point) and the per-cycle sliding window over synthetic
+  waveforms and reports throughput and the error against the
+  analytic RMS.  With more than one channel it then measures that
+  many pumps on one ADC, once as one emon_calcIrms per channel and
+  once as a single interleaved scan (emon_multi), polled and pushed
+  from a buffer, and compares the total current with and without
+  the correction for the skew between channels.
+
+  usage: emon_bench [-a amplitude] [-n samples] [-w windows] [-r rate] [-f mains_hz]
+                    [-c channels]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "dizon_EmonLib.h"
+#include "dizon_adc_sim.h"
+#include "dizon_emon_window.h"
+#include "dizon_emon_multi.h"
+#include "waveform.h"
+
+#define TABLE_LEN 60000         // Whole number of cycles at the default rates
+#define CURRENT_CHANNEL 6       // Same as ADC1_CHANNEL_6 on the device
+#define VOLTAGE_CHANNEL 7
+#define WARMUP_WINDOWS 40       // Lets the offset filter settle before we measure error
+
+static const double VCAL = 234.26;
+
+// Pumps on the same ESP32 for the multi-channel runs: pin, ICAL, share of -a, phase
+static const struct {
+    int pin;
+    double ical;
+    double share;
+    double phase_deg;
+} MULTI[EMON_MULTI_MAX] = {
+    { 6, 29.0, 1.0, 0 },
+    { 7, 29.0, 0.8, 35 },
+    { 4, 15.0, 0.6, 120 },
+    { 5, 60.0, 0.4, 250 },
+};
+
+//--------------------------------------------------------------------------------------
+// Table provider: replays pre-generated samples so the benchmark times EmonLib and
+// not sin()
+//--------------------------------------------------------------------------------------
+typedef struct table_provider {
+    uint16_t i_tab[TABLE_LEN];
+    uint16_t v_tab[TABLE_LEN];
+    size_t i_pos, v_pos;
+    uint64_t reads;
+    double us_per_read;
+    emon_sample_provider provider;
+} table_provider;
+
+static table_provider s_table;
+
+static int table_read(void* ctx, int channel)
+{
+    table_provider* t = ctx;
+    int v;
+    t->reads++;
+    if (channel == VOLTAGE_CHANNEL) {
+        v = t->v_tab[t->v_pos];
+        if (++t->v_pos == TABLE_LEN) {
+            t->v_pos = 0;
+        }
+    } else {
+        v = t->i_tab[t->i_pos];
+        if (++t->i_pos == TABLE_LEN) {
+            t->i_pos = 0;
+        }
+    }
+    return v;
+}
+
+static int64_t table_micros(void* ctx)
+{
+    table_provider* t = ctx;
+    return (int64_t)(t->reads * t->us_per_read);
+}
+
+static uint16_t table_generator(void* ctx, uint64_t n)
+{
+    table_provider* t = ctx;
+    return t->i_tab[n % TABLE_LEN];
+}
+
+// interleaved: the tables hold alternate conversions, voltage first, as emon_calcVI reads them
+static const emon_sample_provider* table_load(waveform* wf, bool interleaved)
+{
+    table_provider* t = &s_table;
+    for (size_t k = 0; k < TABLE_LEN; k++) {
+        if (interleaved) {
+            t->v_tab[k] = waveform_voltage(wf, 2 * k);
+            t->i_tab[k] = waveform_current(wf, 2 * k + 1);
+        } else {
+            t->v_tab[k] = waveform_voltage(wf, k);
+            t->i_tab[k] = waveform_current(wf, k);
+        }
+    }
+    t->i_pos = t->v_pos = 0;
+    t->reads = 0;
+    t->us_per_read = 1e6 / wf->sample_rate_hz;
+    t->provider.ctx = t;
+    t->provider.setup = NULL;
+    t->provider.read = table_read;
+    t->provider.micros = table_micros;
+    return &t->provider;
+}
+
+typedef struct bench_result {
+    uint64_t samples;
+    double seconds;
+    double irms;                // Mean over the measured windows
+    double max_err;             // Worst single window, relative
+} bench_result;
+
+static void report(const char* wave, const char* path, const bench_result* r, double analytic)
+{
+    printf("%-10s %-14s %12.0f %9.2f %10.5f %10.5f %+9.4f%% %9.4f%%\n",
+           wave, path, r->samples / r->seconds, r->seconds * 1e9 / r->samples,
+           r->irms, analytic, 100 * (r->irms - analytic) / analytic, 100 * r->max_err);
+}
+
+static void bench_irms(waveform* wf, emon_math math, unsigned samples, unsigned windows, double analytic, bench_result* r)
+{
+    energy_mon emon;
+    emon_init(&emon, table_load(wf, false));
+    emon_current(&emon, CURRENT_CHANNEL, WAVE_ICAL);
+    emon_set_math(&emon, math);
+    for (unsigned w = 0; w < WARMUP_WINDOWS; w++) {
+        emon_calcIrms(&emon, samples);
+    }
+
+    memset(r, 0, sizeof(*r));
+    double t0 = waveform_now_s();
+    for (unsigned w = 0; w < windows; w++) {
+        double irms = emon_calcIrms(&emon, samples);
+        double err = fabs(irms - analytic) / analytic;
+        r->irms += irms;
+        r->max_err = err > r->max_err ? err : r->max_err;
+    }
+    r->seconds = waveform_now_s() - t0;
+    r->samples = (uint64_t)samples * windows;
+    r->irms /= windows;
+}
+
+static void bench_stream(waveform* wf, emon_math math, unsigned samples, unsigned windows, double analytic, bench_result* r)
+{
+    static adc_stream stream;
+    adc_sim sim;
+    energy_mon emon;
+
+    table_load(wf, false);
+    adc_stream_init(&stream, adc_sim_init(&sim, table_generator, &s_table, 256),
+                    (uint32_t)wf->sample_rate_hz, 300);
+    adc_stream_start(&stream);
+    emon_init(&emon, &s_table.provider);
+    emon_current(&emon, CURRENT_CHANNEL, WAVE_ICAL);
+    emon_set_math(&emon, math);
+    for (unsigned w = 0; w < WARMUP_WINDOWS; w++) {
+        emon_calcIrms_stream(&emon, &stream, samples);
+    }
+
+    memset(r, 0, sizeof(*r));
+    uint64_t start = stream.samples;
+    double t0 = waveform_now_s();
+    for (unsigned w = 0; w < windows; w++) {
+        double irms = emon_calcIrms_stream(&emon, &stream, samples);
+        double err = fabs(irms - analytic) / analytic;
+        r->irms += irms;
+        r->max_err = err > r->max_err ? err : r->max_err;
+    }
+    r->seconds = waveform_now_s() - t0;
+    r->samples = stream.samples - start;
+    r->irms /= windows;
+    adc_stream_stop(&stream);
+}
+
+static void bench_window(waveform* wf, unsigned samples, unsigned windows, double analytic, bench_result* r)
+{
+    emon_window w;
+    emon_window_stats stats;
+    energy_mon emon;
+    emon_init(&emon, table_load(wf, false));
+    emon_current(&emon, CURRENT_CHANNEL, WAVE_ICAL);
+    emon_window_init(&w, &emon, (uint32_t)wf->sample_rate_hz, (uint32_t)wf->mains_hz, 1, 1);
+
+    const uint16_t* tab = s_table.i_tab;
+    size_t pos = 0;
+    for (unsigned k = 0; k < WARMUP_WINDOWS * samples; k += 300) {
+        emon_window_push(&w, &tab[pos], 300, 0);
+        pos = (pos + 300) % TABLE_LEN;
+    }
+    emon_window_take_stats(&w, &stats);
+
+    // Same sample count as the other paths, in 300 sample blocks like the DMA hands over
+    memset(r, 0, sizeof(*r));
+    double t0 = waveform_now_s();
+    for (uint64_t k = 0; k < (uint64_t)samples * windows; k += 300) {
+        emon_window_push(&w, &tab[pos], 300, 0);
+        pos = (pos + 300) % TABLE_LEN;
+    }
+    r->seconds = waveform_now_s() - t0;
+    r->samples = ((uint64_t)samples * windows + 299) / 300 * 300;
+    emon_window_take_stats(&w, &stats);
+    r->irms = stats.mean;
+    r->max_err = fmax(fabs(stats.max - analytic), fabs(stats.min - analytic)) / analytic;
+}
+
+static void bench_vi(waveform* wf, emon_math math, unsigned windows, double analytic, bench_result* r)
+{
+    energy_mon emon;
+    const emon_sample_provider* p = table_load(wf, true);
+    emon_init(&emon, p);
+    emon_voltage(&emon, VOLTAGE_CHANNEL, VCAL, 1.7);
+    emon_current(&emon, CURRENT_CHANNEL, WAVE_ICAL);
+    emon_set_math(&emon, math);
+    for (unsigned w = 0; w < WARMUP_WINDOWS; w++) {
+        emon_calcVI(&emon, 20, 2000);
+    }
+
+    memset(r, 0, sizeof(*r));
+    uint64_t start = s_table.reads;
+    double t0 = waveform_now_s();
+    for (unsigned w = 0; w < windows; w++) {
+        emon_calcVI(&emon, 20, 2000);
+        double err = fabs(emon.Irms - analytic) / analytic;
+        r->irms += emon.Irms;
+        r->max_err = err > r->max_err ? err : r->max_err;
+    }
+    r->seconds = waveform_now_s() - t0;
+    r->samples = (s_table.reads - start) / 2;      // One sample is a voltage and current pair
+    r->irms /= windows;
+}
+
+//--------------------------------------------------------------------------------------
+// Several pumps: one table per channel, each filled at its own conversion index in the
+// scan (channel k of scan j is conversion j * n + k) so the skew between them is real
+//--------------------------------------------------------------------------------------
+typedef struct multi_table {
+    uint16_t tab[EMON_MULTI_MAX][TABLE_LEN];
+    uint16_t scans[TABLE_LEN * EMON_MULTI_MAX];     // Same samples interleaved, as the DMA hands them over
+    size_t pos[EMON_MULTI_MAX];
+    size_t n;
+    uint64_t reads;
+    double us_per_read;
+    emon_sample_provider provider;
+} multi_table;
+
+static multi_table s_multi;
+
+static int multi_read(void* ctx, int channel)
+{
+    multi_table* t = ctx;
+    size_t k = 0;
+    while (k + 1 < t->n && MULTI[k].pin != channel) {
+        k++;
+    }
+    t->reads++;
+    int v = t->tab[k][t->pos[k]];
+    if (++t->pos[k] == TABLE_LEN) {
+        t->pos[k] = 0;
+    }
+    return v;
+}
+
+static int64_t multi_micros(void* ctx)
+{
+    multi_table* t = ctx;
+    return (int64_t)(t->reads * t->us_per_read);
+}
+
+// Fills the tables, returns the analytic RMS of the sum of the channels in amps
+static double multi_load(double amplitude, double mains, double rate, size_t n, double* analytic)
+{
+    multi_table* t = &s_multi;
+    double re = 0, im = 0;
+    for (size_t k = 0; k < n; k++) {
+        waveform wf;
+        waveform_init(&wf, WAVE_SINE, amplitude, mains, rate);
+        wf.v_amplitude = amplitude * MULTI[k].share;
+        wf.phase_deg = MULTI[k].phase_deg;
+        for (size_t j = 0; j < TABLE_LEN; j++) {
+            t->tab[k][j] = waveform_voltage(&wf, j * n + k);
+            t->scans[j * n + k] = t->tab[k][j];
+        }
+        double peak = MULTI[k].ical * ((SUPPLY_VOLTAGE / 1000.0) / ADC_COUNTS) * wf.v_amplitude;
+        analytic[k] = peak / sqrt(2);
+        re += peak * cos(wf.phase_deg * M_PI / 180);
+        im += peak * sin(wf.phase_deg * M_PI / 180);
+        t->pos[k] = 0;
+    }
+    t->n = n;
+    t->reads = 0;
+    t->us_per_read = 1e6 / rate;
+    t->provider.ctx = t;
+    t->provider.setup = NULL;
+    t->provider.read = multi_read;
+    t->provider.micros = multi_micros;
+    return sqrt(re * re + im * im) / sqrt(2);
+}
+
+typedef struct multi_result {
+    uint64_t samples;           // Conversions, all channels
+    double seconds;
+    double max_err;             // Worst channel in the worst window, relative
+    double total;               // Mean RMS of the sum of the channels, 0 when the path has none
+} multi_result;
+
+static void report_multi(const char* path, const multi_result* r, double total)
+{
+    if (r->total > 0) {
+        printf("%-18s %12.0f %9.2f %9.4f%% %10.5f %10.5f %+9.4f%%\n",
+               path, r->samples / r->seconds, r->seconds * 1e9 / r->samples, 100 * r->max_err,
+               r->total, total, 100 * (r->total - total) / total);
+    } else {
+        printf("%-18s %12.0f %9.2f %9.4f%% %10s %10s %10s\n",
+               path, r->samples / r->seconds, r->seconds * 1e9 / r->samples, 100 * r->max_err, "-", "-", "-");
+    }
+}
+
+static double worst_channel(const double* irms, const double* analytic, size_t n, double worst)
+{
+    for (size_t k = 0; k < n; k++) {
+        double err = fabs(irms[k] - analytic[k]) / analytic[k];
+        worst = err > worst ? err : worst;
+    }
+    return worst;
+}
+
+// What the firmware does without emon_multi: one emon_calcIrms after the other
+static void bench_separate(size_t n, emon_math math, unsigned samples, unsigned windows, const double* analytic, multi_result* r)
+{
+    energy_mon emon[EMON_MULTI_MAX];
+    double irms[EMON_MULTI_MAX];
+    for (size_t k = 0; k < n; k++) {
+        emon_init(&emon[k], &s_multi.provider);
+        emon_current(&emon[k], MULTI[k].pin, MULTI[k].ical);
+        emon_set_math(&emon[k], math);
+    }
+    for (unsigned w = 0; w < WARMUP_WINDOWS; w++) {
+        for (size_t k = 0; k < n; k++) {
+            emon_calcIrms(&emon[k], samples);
+        }
+    }
+
+    memset(r, 0, sizeof(*r));
+    uint64_t start = s_multi.reads;
+    double t0 = waveform_now_s();
+    for (unsigned w = 0; w < windows; w++) {
+        for (size_t k = 0; k < n; k++) {
+            irms[k] = emon_calcIrms(&emon[k], samples);
+        }
+        r->max_err = worst_channel(irms, analytic, n, r->max_err);
+    }
+    r->seconds = waveform_now_s() - t0;
+    r->samples = s_multi.reads - start;
+}
+
+static void multi_setup(emon_multi* m, size_t n, emon_math math, bool deskew)
+{
+    emon_multi_channel ch[EMON_MULTI_MAX];
+    for (size_t k = 0; k < n; k++) {
+        ch[k].pin = MULTI[k].pin;
+        ch[k].ical = MULTI[k].ical;
+    }
+    emon_multi_init(m, &s_multi.provider, ch, n);
+    emon_multi_set_math(m, math);
+    if (!deskew) {
+        memset(m->lag, 0, sizeof(m->lag));
+        memset(m->lag_q, 0, sizeof(m->lag_q));
+    }
+}
+
+// One interleaved scan, polled a conversion at a time
+static void bench_multi(size_t n, emon_math math, bool deskew, unsigned samples, unsigned windows, const double* analytic, multi_result* r)
+{
+    emon_multi m;
+    multi_setup(&m, n, math, deskew);
+    for (unsigned w = 0; w < WARMUP_WINDOWS; w++) {
+        emon_multi_calc(&m, samples);
+    }
+
+    memset(r, 0, sizeof(*r));
+    uint64_t start = s_multi.reads;
+    double t0 = waveform_now_s();
+    for (unsigned w = 0; w < windows; w++) {
+        emon_multi_calc(&m, samples);
+        r->max_err = worst_channel(m.irms, analytic, n, r->max_err);
+        r->total += m.total_irms;
+    }
+    r->seconds = waveform_now_s() - t0;
+    r->samples = s_multi.reads - start;
+    r->total /= windows;
+}
+
+// The same from the interleaved buffer, in blocks of whole scans like the DMA delivers
+static void bench_multi_push(size_t n, emon_math math, unsigned samples, unsigned windows, const double* analytic, multi_result* r)
+{
+    const size_t block = ADC_STREAM_MAX_BLOCK / n;     // Scans per block
+    emon_multi m;
+    size_t pos = 0;
+    multi_setup(&m, n, math, true);
+
+    memset(r, 0, sizeof(*r));
+    double t0 = 0;
+    for (unsigned w = 0; w < WARMUP_WINDOWS + windows; w++) {
+        if (w == WARMUP_WINDOWS) {
+            t0 = waveform_now_s();
+        }
+        for (unsigned done = 0; done < samples; ) {
+            size_t len = samples - done < block ? samples - done : block;
+            len = TABLE_LEN - pos < len ? TABLE_LEN - pos : len;
+            emon_multi_push(&m, &s_multi.scans[pos * n], len * n);
+            pos = (pos + len) % TABLE_LEN;
+            done += (unsigned)len;
+        }
+        emon_multi_finish(&m);
+        if (w >= WARMUP_WINDOWS) {
+            r->max_err = worst_channel(m.irms, analytic, n, r->max_err);
+            r->total += m.total_irms;
+        }
+    }
+    r->seconds = waveform_now_s() - t0;
+    r->samples = (uint64_t)samples * windows * n;
+    r->total /= windows;
+}
+
+static void bench_channels(size_t n, double amplitude, double mains, double rate, unsigned samples, unsigned windows)
+{
+    double analytic[EMON_MULTI_MAX];
+    multi_result r;
+    double total = multi_load(amplitude, mains, rate, n, analytic);
+
+    printf("\n%zu channels on one ADC, %.0f conversions/s shared, %u samples per channel x %u windows\n\n",
+           n, rate, samples, windows);
+    printf("%-18s %12s %9s %10s %10s %10s %10s\n",
+           "path", "samples/s", "ns/sample", "worst ch", "total", "analytic", "error");
+
+    bench_separate(n, EMON_MATH_DOUBLE, samples, windows, analytic, &r);
+    report_multi("calcIrms-each", &r, total);
+    bench_separate(n, EMON_MATH_FIXED, samples, windows, analytic, &r);
+    report_multi("calcIrms-each-q", &r, total);
+    bench_multi(n, EMON_MATH_DOUBLE, true, samples, windows, analytic, &r);
+    report_multi("multi", &r, total);
+    bench_multi(n, EMON_MATH_FIXED, true, samples, windows, analytic, &r);
+    report_multi("multi-q", &r, total);
+    bench_multi_push(n, EMON_MATH_DOUBLE, samples, windows, analytic, &r);
+    report_multi("multi-push", &r, total);
+    bench_multi_push(n, EMON_MATH_FIXED, samples, windows, analytic, &r);
+    report_multi("multi-push-q", &r, total);
+    bench_multi(n, EMON_MATH_DOUBLE, false, samples, windows, analytic, &r);
+    report_multi("multi-no-deskew", &r, total);
+    bench_multi(n, EMON_MATH_FIXED, false, samples, windows, analytic, &r);
+    report_multi("multi-no-deskew-q", &r, total);
+}
+
+int main(int argc, char** argv)
+{
+    double amplitude = 500;
+    double rate = 6000;
+    double mains = 60;
+    unsigned samples = 1480;
+    unsigned windows = 2000;
+    unsigned channels = 4;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:n:w:r:f:c:")) != -1) {
+        switch (opt) {
+        case 'a': amplitude = atof(optarg); break;
+        case 'n': samples = (unsigned)atoi(optarg); break;
+        case 'w': windows = (unsigned)atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'f': mains = atof(optarg); break;
+        case 'c': channels = (unsigned)atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-a amplitude] [-n samples] [-w windows] [-r rate] [-f mains_hz] [-c channels]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (channels > EMON_MULTI_MAX) {
+        fprintf(stderr, "at most %d channels\n", EMON_MULTI_MAX);
+        return 1;
+    }
+
+    const double i_ratio = WAVE_ICAL * ((SUPPLY_VOLTAGE / 1000.0) / ADC_COUNTS);
+    printf("amplitude %.0f counts, %.0f Hz sampling, %.0f Hz mains, %u samples x %u windows\n\n",
+           amplitude, rate, mains, samples, windows);
+    printf("%-10s %-14s %12s %9s %10s %10s %10s %10s\n",
+           "waveform", "path", "samples/s", "ns/sample", "Irms", "analytic", "error", "worst");
+
+    for (int kind = WAVE_SINE; kind <= WAVE_HARMONIC; kind++) {
+        waveform wf;
+        bench_result r;
+        waveform_init(&wf, kind, amplitude, mains, rate);
+        wf.v_channel = VOLTAGE_CHANNEL;
+        const char* name = waveform_name(kind);
+        double analytic = i_ratio * waveform_analytic_rms(&wf);
+
+        bench_irms(&wf, EMON_MATH_DOUBLE, samples, windows, analytic, &r);
+        report(name, "calcIrms", &r, analytic);
+        bench_irms(&wf, EMON_MATH_FIXED, samples, windows, analytic, &r);
+        report(name, "calcIrms-q", &r, analytic);
+        bench_stream(&wf, EMON_MATH_DOUBLE, samples, windows, analytic, &r);
+        report(name, "stream", &r, analytic);
+        bench_stream(&wf, EMON_MATH_FIXED, samples, windows, analytic, &r);
+        report(name, "stream-q", &r, analytic);
+        bench_window(&wf, samples, windows, analytic, &r);
+        report(name, "cycle-window", &r, analytic);
+
+        // emon_calcVI alternates voltage and current conversions, each channel at half the rate
+        bench_vi(&wf, EMON_MATH_DOUBLE, windows / 10 + 1, analytic, &r);
+        report(name, "calcVI", &r, analytic);
+        bench_vi(&wf, EMON_MATH_FIXED, windows / 10 + 1, analytic, &r);
+        report(name, "calcVI-q", &r, analytic);
+    }
+
+    if (channels > 1) {
+        bench_channels(channels, amplitude, mains, rate, samples, windows);
+    }
+    return 0;
+}
@@ -0,0 +1,349 @@
+/*
+*****************************************************************
+* encode_check.c - Round Trip And Size Check For The Encoders   *
+*****************************************************************
+
+  Encodes batches of random records with every telemetry encoder,
+  decodes the ones that have a decoder and checks what comes back,
+  feeds the decoder every truncated and a few corrupted payloads,
+  decodes payloads as earlier firmware versions wrote them and
+  refuses ones with a record form newer than their version, and
+  prints bytes per record and encode time against the original
+  one-publish-per-reading JSON.  Exits non-zero on a mismatch.
+
+  usage: encode_check [-n batches] [-s seed]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "dizon_encode.h"
+#include "dizon_batch.h"
+
+#define ID "A4CF12B3C4D8"
+
+static const telemetry_encoder* const s_encoders[] = { &telemetry_json, &telemetry_cbor };
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static float rand_amps(void)
+{
+    return (rand() % 2000000) / 1e4f;        // 0 to 200 A
+}
+
+static void rand_record(sump_record* rec, uint32_t seq, time_t t)
+{
+    memset(rec, 0, sizeof(*rec));
+    rec->seq = seq;
+    rec->epoch_us = t * 1000000LL + (t ? rand() % 1000000 : 0);
+    rec->irms = rand_amps();
+    rec->free_mem = 100000 + rand() % 100000;
+    if (rand() % 2) {
+        rec->irms_min = rand_amps();
+        rec->irms_max = rand_amps();
+        rec->cycles = 1 + rand() % 60;
+    } else {
+        rec->irms_min = rec->irms_max = rec->irms;
+    }
+    rec->suppressed = rand() % 3 ? 0 : rand() % 1000;
+    if (rand() % 2) {
+        rec->has_level = true;
+        rec->level_cm = (rand() % 10000) / 100.0f;
+        rec->level_rate = (rand() % 20000) / 100.0f - 100;
+    }
+    if (rand() % 4 == 0) {
+        rec->extra_channels = 1 + rand() % SUMP_EXTRA_CHANNELS;
+        for (uint8_t k = 0; k < rec->extra_channels; k++) {
+            rec->irms_extra[k] = rand_amps();
+        }
+    }
+}
+
+// What send_aws_msg publishes for one reading
+static int legacy_json(char* buf, size_t len, const sump_record* rec)
+{
+    char tbuf[24];
+    struct tm info;
+    time_t t = (time_t)(rec->epoch_us / 1000000);
+    gmtime_r(&t, &info);
+    strftime(tbuf, sizeof(tbuf), "%Y-%m-%dT%H:%M:%SZ", &info);
+    if (rec->cycles) {
+        return snprintf(buf, len, "{ \"ID\":\"%s\", \"time\":\"%s\",\"Irms\":\"%f\", \"IrmsMin\":\"%f\", "
+                        "\"IrmsMax\":\"%f\", \"cycles\":\"%u\", \"memFree\":\"%u\" }",
+                        ID, tbuf, rec->irms, rec->irms_min, rec->irms_max, rec->cycles, (unsigned)rec->free_mem);
+    }
+    return snprintf(buf, len, "{ \"ID\":\"%s\", \"time\":\"%s\",\"Irms\":\"%f\", \"memFree\":\"%u\" }",
+                    ID, tbuf, rec->irms, (unsigned)rec->free_mem);
+}
+
+// Irms goes over the wire in whole milliamps
+#define AMPS_TOLERANCE 0.00051f
+#define LEVEL_TOLERANCE 0.051f         // Level and rate go as tenths
+
+static int same_extra(const sump_record* a, const sump_record* b)
+{
+    if (a->extra_channels != b->extra_channels) {
+        return 0;
+    }
+    for (uint8_t k = 0; k < a->extra_channels; k++) {
+        if (fabsf(a->irms_extra[k] - b->irms_extra[k]) > AMPS_TOLERANCE) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int same(const sump_record* a, const sump_record* b)
+{
+    // CBOR and the flash log keep whole seconds
+    return a->seq == b->seq && a->epoch_us / 1000000 == b->epoch_us / 1000000 && a->cycles == b->cycles &&
+           a->suppressed == b->suppressed &&
+           a->free_mem == b->free_mem && fabsf(a->irms - b->irms) <= AMPS_TOLERANCE &&
+           fabsf(a->irms_min - b->irms_min) <= AMPS_TOLERANCE && fabsf(a->irms_max - b->irms_max) <= AMPS_TOLERANCE &&
+           a->has_level == b->has_level &&
+           (!a->has_level || (fabsf(a->level_cm - b->level_cm) <= LEVEL_TOLERANCE &&
+                              fabsf(a->level_rate - b->level_rate) <= LEVEL_TOLERANCE)) &&
+           same_extra(a, b);
+}
+
+static int check_round_trip(const telemetry_encoder* enc, unsigned batches)
+{
+    static sump_record in[BATCH_MAX_RECORDS], out[BATCH_MAX_RECORDS];
+    static uint8_t buf[BATCH_MAX_BYTES];
+    char id[33];
+    int failures = 0;
+    unsigned corrupt_ok = 0, corrupt_tries = 0;
+
+    for (unsigned b = 0; b < batches; b++) {
+        size_t n = 1 + rand() % BATCH_MAX_RECORDS;
+        // Start before SNTP sync now and then, and let the clock step back or forward
+        time_t t = rand() % 8 ? 1700000000 + rand() % 100000000 : 0;
+        for (size_t i = 0; i < n; i++) {
+            rand_record(&in[i], b * BATCH_MAX_RECORDS + i, t);
+            t += rand() % 16 ? 1 : (rand() % 20000) - 10000;
+        }
+        size_t used, got;
+        size_t cap = 64 + rand() % (sizeof(buf) - 64);
+        size_t len = enc->encode(ID, in, n, buf, cap, &used);
+        if (len > cap || (len == 0) != (used == 0)) {
+            printf("%s: batch %u wrote %zu of %zu bytes for %zu records\n", enc->name, b, len, cap, used);
+            failures++;
+            continue;
+        }
+        if (used == 0) {
+            continue;
+        }
+        if (enc->decode(buf, len, id, sizeof(id), out, BATCH_MAX_RECORDS, &got) != 0 || got != used ||
+            strcmp(id, ID) != 0) {
+            printf("%s: batch %u did not decode (%zu of %zu records)\n", enc->name, b, got, used);
+            failures++;
+            continue;
+        }
+        for (size_t i = 0; i < used; i++) {
+            if (!same(&in[i], &out[i])) {
+                printf("%s: batch %u record %zu differs\n", enc->name, b, i);
+                failures++;
+                break;
+            }
+        }
+        // Every strict prefix must be rejected
+        for (size_t cut = 0; cut < len; cut++) {
+            if (enc->decode(buf, cut, id, sizeof(id), out, BATCH_MAX_RECORDS, &got) == 0) {
+                printf("%s: batch %u decoded from %zu of %zu bytes\n", enc->name, b, cut, len);
+                failures++;
+                break;
+            }
+        }
+        // Flipped bytes must not crash, most are caught
+        for (int k = 0; k < 8; k++) {
+            size_t at = rand() % len;
+            uint8_t keep = buf[at];
+            buf[at] ^= 1 << (rand() % 8);
+            corrupt_tries++;
+            corrupt_ok += enc->decode(buf, len, id, sizeof(id), out, BATCH_MAX_RECORDS, &got) == 0;
+            buf[at] = keep;
+        }
+    }
+    printf("%-5s round trip: %u batches, %s, %u of %u corrupted payloads still parse\n",
+           enc->name, batches, failures ? "FAILED" : "ok", corrupt_ok, corrupt_tries);
+    return failures;
+}
+
+//--------------------------------------------------------------------------------------
+// CBOR payloads as older firmware sent them, byte for byte
+//--------------------------------------------------------------------------------------
+#define OLD_BASE_S  1700000000LL
+#define OLD_HEAD(version, records) \
+    0xa4, 0x00, (version), 0x01, 0x6c, 'A', '4', 'C', 'F', '1', '2', 'B', '3', 'C', '4', 'D', '8', \
+    0x02, 0x1a, 0x65, 0x53, 0xf1, 0x00, 0x03, 0x80 + (records)
+// seq 1, base + 0, 1000 mA, 65536 free
+#define OLD_SHORT   0x84, 0x01, 0x00, 0x19, 0x03, 0xe8, 0x1a, 0x00, 0x01, 0x00, 0x00
+// seq 2, base + 1, 2000 mA, 65536 free, 1800 to 2200 mA over 50 cycles
+#define OLD_LONG    0x87, 0x02, 0x01, 0x19, 0x07, 0xd0, 0x1a, 0x00, 0x01, 0x00, 0x00, \
+                    0x19, 0x07, 0x08, 0x19, 0x08, 0x98, 0x18, 0x32
+// Version 2: seq 3, base + 2, 1000 mA with 7 held back before it
+#define OLD_SHORT_SUPP  0x85, 0x03, 0x02, 0x19, 0x03, 0xe8, 0x1a, 0x00, 0x01, 0x00, 0x00, 0x07
+// seq 4, base + 3, as OLD_LONG with 12 held back
+#define OLD_LONG_SUPP   0x88, 0x04, 0x03, 0x19, 0x07, 0xd0, 0x1a, 0x00, 0x01, 0x00, 0x00, \
+                        0x19, 0x07, 0x08, 0x19, 0x08, 0x98, 0x18, 0x32, 0x0c
+// Version 3: seq 5, base + 4, 3000 mA, the pit at 333.3 cm and falling 1.5 cm/h
+#define OLD_LEVEL   0x8a, 0x05, 0x04, 0x19, 0x0b, 0xb8, 0x1a, 0x00, 0x01, 0x00, 0x00, \
+                    0x19, 0x0b, 0xb8, 0x19, 0x0b, 0xb8, 0x00, 0x00, 0x19, 0x0d, 0x05, 0x2e
+// Version 4: seq 6, base + 5, 1000 mA and two more pumps at 500 and 600 mA
+#define OLD_EXTRA   0x85, 0x06, 0x05, 0x19, 0x03, 0xe8, 0x1a, 0x00, 0x01, 0x00, 0x00, \
+                    0x82, 0x19, 0x01, 0xf4, 0x19, 0x02, 0x58
+
+static const uint8_t V1[] = { OLD_HEAD(1, 2), OLD_SHORT, OLD_LONG };
+static const uint8_t V2[] = { OLD_HEAD(2, 4), OLD_SHORT, OLD_LONG, OLD_SHORT_SUPP, OLD_LONG_SUPP };
+static const uint8_t V1_SUPP[] = { OLD_HEAD(1, 1), OLD_SHORT_SUPP };
+static const uint8_t V3[] = { OLD_HEAD(3, 5), OLD_SHORT, OLD_LONG, OLD_SHORT_SUPP, OLD_LONG_SUPP, OLD_LEVEL };
+static const uint8_t V2_LEVEL[] = { OLD_HEAD(2, 1), OLD_LEVEL };
+static const uint8_t V4[] = { OLD_HEAD(4, 6), OLD_SHORT, OLD_LONG, OLD_SHORT_SUPP, OLD_LONG_SUPP, OLD_LEVEL,
+                              OLD_EXTRA };
+static const uint8_t V3_EXTRA[] = { OLD_HEAD(3, 1), OLD_EXTRA };
+static const uint8_t V0[] = { OLD_HEAD(0, 1), OLD_SHORT };
+static const uint8_t V_NEXT[] = { OLD_HEAD(CBOR_BATCH_VERSION + 1, 1), OLD_SHORT };
+
+static const sump_record OLD_RECS[] = {
+    { .seq = 1, .epoch_us = OLD_BASE_S * 1000000, .irms = 1.0f, .irms_min = 1.0f, .irms_max = 1.0f,
+      .free_mem = 65536 },
+    { .seq = 2, .epoch_us = (OLD_BASE_S + 1) * 1000000, .irms = 2.0f, .irms_min = 1.8f, .irms_max = 2.2f,
+      .cycles = 50, .free_mem = 65536 },
+    { .seq = 3, .epoch_us = (OLD_BASE_S + 2) * 1000000, .irms = 1.0f, .irms_min = 1.0f, .irms_max = 1.0f,
+      .free_mem = 65536, .suppressed = 7 },
+    { .seq = 4, .epoch_us = (OLD_BASE_S + 3) * 1000000, .irms = 2.0f, .irms_min = 1.8f, .irms_max = 2.2f,
+      .cycles = 50, .free_mem = 65536, .suppressed = 12 },
+    { .seq = 5, .epoch_us = (OLD_BASE_S + 4) * 1000000, .irms = 3.0f, .irms_min = 3.0f, .irms_max = 3.0f,
+      .free_mem = 65536, .has_level = true, .level_cm = 333.3f, .level_rate = -1.5f },
+    { .seq = 6, .epoch_us = (OLD_BASE_S + 5) * 1000000, .irms = 1.0f, .irms_min = 1.0f, .irms_max = 1.0f,
+      .free_mem = 65536, .extra_channels = 2, .irms_extra = { 0.5f, 0.6f } },
+};
+
+typedef struct old_payload {
+    const char* name;
+    const uint8_t* buf;
+    size_t len;
+    const sump_record* want;    // NULL if it must be refused
+    size_t n;
+} old_payload;
+
+#define OLD_OK(name, buf, want, n)  { name, buf, sizeof(buf), want, n }
+#define OLD_BAD(name, buf)          { name, buf, sizeof(buf), NULL, 0 }
+
+static const old_payload OLD_PAYLOADS[] = {
+    OLD_OK("version 1", V1, OLD_RECS, 2),
+    OLD_OK("version 2", V2, OLD_RECS, 4),
+    OLD_BAD("version 1 with a held back count", V1_SUPP),
+    OLD_OK("version 3", V3, OLD_RECS, 5),
+    OLD_BAD("version 2 with a level", V2_LEVEL),
+    OLD_OK("version 4", V4, OLD_RECS, 6),
+    OLD_BAD("version 3 with more pumps", V3_EXTRA),
+    OLD_BAD("version 0", V0),
+    OLD_BAD("a version from the future", V_NEXT),
+};
+
+static int check_old_versions(void)
+{
+    sump_record out[8];
+    char id[33];
+    size_t got;
+    int failures = 0;
+
+    for (size_t i = 0; i < sizeof(OLD_PAYLOADS) / sizeof(OLD_PAYLOADS[0]); i++) {
+        const old_payload* p = &OLD_PAYLOADS[i];
+        int rc = telemetry_cbor.decode(p->buf, p->len, id, sizeof(id), out, 8, &got);
+        if (p->want == NULL) {
+            if (rc == 0) {
+                printf("cbor: %s decoded\n", p->name);
+                failures++;
+            }
+            continue;
+        }
+        if (rc != 0 || got != p->n || strcmp(id, ID) != 0) {
+            printf("cbor: %s did not decode\n", p->name);
+            failures++;
+            continue;
+        }
+        for (size_t k = 0; k < got; k++) {
+            if (!same(&p->want[k], &out[k])) {
+                printf("cbor: %s record %zu differs\n", p->name, k);
+                failures++;
+            }
+        }
+    }
+    printf("cbor  old versions: %zu payloads, %s\n", sizeof(OLD_PAYLOADS) / sizeof(OLD_PAYLOADS[0]),
+           failures ? "FAILED" : "ok");
+    return failures;
+}
+
+static void report_size(const telemetry_encoder* enc, size_t n, int reps)
+{
+    static sump_record recs[BATCH_MAX_RECORDS];
+    static uint8_t buf[BATCH_MAX_BYTES];
+    size_t used = 0, len = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        rand_record(&recs[i], i, 1760000000 + i);
+    }
+    double t0 = now_s();
+    for (int r = 0; r < reps; r++) {
+        len = enc->encode(ID, recs, n, buf, sizeof(buf), &used);
+    }
+    double ns = (now_s() - t0) * 1e9 / reps / used;
+    printf("%-8s %7zu %9zu %12.1f %14.1f %11.0f\n", enc->name, used, len, (double)len / used,
+           (double)batch_air_bytes(len, strlen("esptest/batch")) / used, ns);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned batches = 2000;
+    unsigned seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+        case 'n': batches = (unsigned)atoi(optarg); break;
+        case 's': seed = (unsigned)atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n batches] [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    srand(seed);
+
+    int failures = 0;
+    for (size_t e = 0; e < sizeof(s_encoders) / sizeof(s_encoders[0]); e++) {
+        if (s_encoders[e]->decode) {
+            failures += check_round_trip(s_encoders[e], batches);
+        }
+    }
+    failures += check_old_versions();
+
+    printf("\n%-8s %7s %9s %12s %14s %11s\n", "encoder", "records", "payload", "bytes/rec", "on air/rec", "ns/rec");
+    {
+        sump_record rec;
+        char buf[256];
+        int len = 0, reps = 20000;
+        rand_record(&rec, 1, 1760000000);
+        double t0 = now_s();
+        for (int r = 0; r < reps; r++) {
+            len = legacy_json(buf, sizeof(buf), &rec);
+        }
+        double ns = (now_s() - t0) * 1e9 / reps;
+        printf("%-8s %7d %9d %12.1f %14.1f %11.0f\n", "single", 1, len, (double)len,
+               (double)batch_air_bytes(len, strlen("esptest/")), ns);
+    }
+    for (size_t e = 0; e < sizeof(s_encoders) / sizeof(s_encoders[0]); e++) {
+        report_size(s_encoders[e], 1, 20000);
+        report_size(s_encoders[e], 30, 2000);
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,214 @@
+/*
+*****************************************************************
+* flashlog_check.c - Wrap-Around And Power-Cut Check For Flashlog *
+*****************************************************************
+
+  Runs the store-and-forward log on simulated NOR flash: an outage
+  long enough to wrap the ring, replay in batches with some sends
+  failing, and power cuts at random points in appends, commits and
+  sector erases.  After every cut the log is reopened and has to
+  hand back, in order, what was not committed.  Only a batch whose
+  commit was cut short may be sent twice, and every record that
+  never arrives must have been counted as lost to wrap-around.
+  Exits non-zero on a violation.
+
+  usage: flashlog_check [-c cuts] [-n sectors] [-s seed]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "dizon_flashlog.h"
+#include "dizon_flash_sim.h"
+
+#define SECTOR_SIZE 4096
+#define MAX_SECTORS 64
+#define BATCH 30
+#define MAX_RECORDS (1 << 20)
+
+static uint8_t s_mem[MAX_SECTORS * SECTOR_SIZE];
+static uint32_t s_erases[MAX_SECTORS];
+static uint8_t s_seen[MAX_RECORDS];
+
+static sump_record make_record(uint32_t seq)
+{
+    sump_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.seq = seq;
+    rec.epoch_us = (1760000000LL + seq) * 1000000;
+    rec.irms = seq * 0.001f;
+    rec.irms_min = rec.irms_max = rec.irms;
+    return rec;
+}
+
+typedef struct receiver {
+    uint8_t* seen;              // One per record written
+    uint32_t delivered;         // Records seen at least once
+    uint32_t last;              // Newest record whose commit went through, UINT32_MAX for none
+    uint32_t unsure_lo;         // Sent but the commit was cut short, may come again
+    uint32_t unsure_hi;
+} receiver;
+
+// Send everything pending, failing one send in fail_one_in. Records must come in
+// increasing order and never again once committed. Returns -1 on a violation.
+static int drain(flashlog* log, receiver* rx, int fail_one_in)
+{
+    sump_record recs[BATCH];
+    uint32_t prev = rx->last;
+    size_t n;
+
+    while ((n = flashlog_replay(log, recs, BATCH)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            uint32_t seq = recs[i].seq;
+            bool again = seq >= rx->unsure_lo && seq <= rx->unsure_hi;
+            if (prev != UINT32_MAX && seq <= prev && !again) {
+                printf("record %u replayed after %u\n", seq, prev);
+                return -1;
+            }
+            if (recs[i].epoch_us != (1760000000LL + seq) * 1000000) {
+                printf("record %u came back damaged\n", seq);
+                return -1;
+            }
+            prev = seq;
+        }
+        if (fail_one_in && rand() % fail_one_in == 0) {
+            flashlog_rewind(log);
+            prev = rx->last;
+            continue;
+        }
+        // Sometimes only part of the batch fits in a payload
+        size_t sent = n > 1 && rand() % 4 == 0 ? n / 2 : n;
+        for (size_t i = 0; i < sent; i++) {
+            if (!rx->seen[recs[i].seq]) {
+                rx->seen[recs[i].seq] = 1;
+                rx->delivered++;
+            }
+        }
+        if (flashlog_commit(log, sent) != 0) {
+            // Power went mid commit, these may be sent again after the reopen
+            rx->unsure_lo = recs[0].seq;
+            rx->unsure_hi = recs[sent - 1].seq;
+            return 0;
+        }
+        rx->last = prev = recs[sent - 1].seq;
+    }
+    return 0;
+}
+
+static int check_wrap(uint32_t sectors)
+{
+    flash_sim sim;
+    flashlog log;
+    receiver rx = { .seen = s_seen, .last = UINT32_MAX, .unsure_lo = 1, .unsure_hi = 0 };
+    const flash_ops* flash = flash_sim_init(&sim, s_mem, sectors * SECTOR_SIZE, SECTOR_SIZE, s_erases);
+
+    memset(s_erases, 0, sizeof(s_erases));
+    memset(s_seen, 0, sizeof(s_seen));
+    flashlog_format(&(flashlog){ .flash = flash });
+    if (flashlog_open(&log, flash) != 0) {
+        printf("open failed\n");
+        return 1;
+    }
+    // Offline for three times what the ring holds
+    uint32_t total = 3 * sectors * SECTOR_SIZE / FLASHLOG_ENTRY_SIZE;
+    for (uint32_t seq = 0; seq < total; seq++) {
+        sump_record rec = make_record(seq);
+        flashlog_append(&log, &rec);
+    }
+    uint32_t pending = flashlog_pending(&log);
+    if (drain(&log, &rx, 3) != 0) {
+        return 1;
+    }
+    uint32_t min_e = UINT32_MAX, max_e = 0;
+    for (uint32_t s = 0; s < sectors; s++) {
+        min_e = s_erases[s] < min_e ? s_erases[s] : min_e;
+        max_e = s_erases[s] > max_e ? s_erases[s] : max_e;
+    }
+    int bad = rx.last != total - 1 || rx.delivered != pending || pending + log.lost != total;
+    printf("wrap: %u records into %u sectors, %u kept, %u lost, %u delivered, newest %u, "
+           "erases per sector %u..%u  %s\n",
+           total, sectors, pending, log.lost, rx.delivered, rx.last, min_e, max_e, bad ? "FAILED" : "ok");
+    return bad;
+}
+
+static int check_cuts(uint32_t sectors, unsigned cuts)
+{
+    flash_sim sim;
+    flashlog log;
+    receiver rx = { .seen = s_seen, .last = UINT32_MAX, .unsure_lo = 1, .unsure_hi = 0 };
+    const flash_ops* flash = flash_sim_init(&sim, s_mem, sectors * SECTOR_SIZE, SECTOR_SIZE, NULL);
+    uint32_t seq = 0, lost = 0, missing = 0;
+    int failures = 0;
+
+    memset(s_seen, 0, sizeof(s_seen));
+    flashlog_format(&(flashlog){ .flash = flash });
+    flashlog_open(&log, flash);
+    for (unsigned c = 0; c < cuts && seq < MAX_RECORDS - 8 * SECTOR_SIZE; c++) {
+        // Run a while with the broker up and down, then pull the plug somewhere
+        flash_sim_cut_after(&sim, rand() % (8 * SECTOR_SIZE));
+        while (sim.powered) {
+            int outage = rand() % 200;
+            for (int i = 0; i < outage && sim.powered; i++) {
+                sump_record rec = make_record(seq);
+                if (flashlog_append(&log, &rec) == 0) {
+                    seq++;
+                }
+            }
+            if (sim.powered && drain(&log, &rx, 5) != 0) {
+                failures++;
+            }
+        }
+        flash_sim_power_on(&sim);
+        // Counted when the sector erase started, the erase may not have finished
+        lost += log.lost;
+        if (flashlog_open(&log, flash) != 0) {
+            printf("reopen failed\n");
+            return 1;
+        }
+        // Whatever is left must pick up where delivery stopped
+        if (drain(&log, &rx, 0) != 0) {
+            printf("after cut %u\n", c);
+            failures++;
+        }
+        rx.unsure_lo = 1;
+        rx.unsure_hi = 0;
+    }
+    lost += log.lost;
+    for (uint32_t k = 0; k < seq; k++) {
+        missing += !s_seen[k];
+    }
+    if (missing > lost) {
+        failures++;
+    }
+    printf("power cuts: %u records written, %u delivered, %u never delivered, %u counted lost "
+           "to wrap-around, %s\n", seq, rx.delivered, missing, lost, failures ? "FAILED" : "ok");
+    return failures;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned cuts = 2000;
+    uint32_t sectors = 4;
+    unsigned seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:n:s:")) != -1) {
+        switch (opt) {
+        case 'c': cuts = (unsigned)atoi(optarg); break;
+        case 'n': sectors = (uint32_t)atoi(optarg); break;
+        case 's': seed = (unsigned)atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-c cuts] [-n sectors] [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (sectors < 2 || sectors > MAX_SECTORS) {
+        fprintf(stderr, "sectors must be 2..%d\n", MAX_SECTORS);
+        return 1;
+    }
+    srand(seed);
+    int failures = check_wrap(sectors);
+    failures += check_cuts(sectors, cuts);
+    return failures ? 1 : 0;
+}
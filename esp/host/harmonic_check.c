@@ -0,0 +1,246 @@
+/*
+*****************************************************************
+* harmonic_check.c - Harmonic Analysis Against Known Spectra    *
+*****************************************************************
+
+  Builds currents with a known spectrum: a clean sine, a motor
+  with 3rd, 5th and 7th harmonics, a stalled rotor with even ones,
+  50 Hz mains, a sample rate that is not a multiple of the mains,
+  a DC shift with noise, and a second channel interleaved with the
+  first.  Pushes them through the harmonic analyser in blocks of
+  random length and checks each harmonic and the THD against what
+  was put in, and that the windows come at the configured period.
+  Then times the Goertzel filters per sample against the sliding
+  per-cycle RMS that runs on every block anyway.  Exits non-zero
+  on a violation.
+
+  usage: harmonic_check [-c cycles] [-s seed]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "dizon_harmonic.h"
+#include "dizon_emon_window.h"
+#include "waveform.h"
+
+#define MAX_ORDER       9
+#define AMPLITUDE       600.0       // Fundamental peak in counts
+#define PERIOD_MS       1000
+#define SECONDS         10
+#define MAX_BLOCK       300
+#define TOLERANCE       0.002       // Of the fundamental, per harmonic
+#define THD_TOLERANCE   0.002
+
+static const uint8_t ORDERS[HARMONIC_MAX] = { 1, 2, 3, 5, 7 };
+
+typedef struct spectrum {
+    const char* name;
+    uint32_t mains_hz;
+    uint32_t rate_hz;
+    double level[MAX_ORDER + 1];    // Relative to the fundamental, [1] is 1
+    double dc_shift;                // Counts away from mid-scale
+    double noise;                   // RMS, relative to the fundamental peak
+    uint8_t stride;                 // Channels in the scan, ours is the first
+} spectrum;
+
+static const spectrum SPECTRA[] = {
+    { "sine",        60, 6000, { [1] = 1 }, 0, 0, 1 },
+    { "motor",       60, 6000, { [1] = 1, [3] = 0.20, [5] = 0.10, [7] = 0.05 }, 0, 0, 1 },
+    { "stalled",     60, 6000, { [1] = 1, [2] = 0.25, [3] = 0.08, [4] = 0.06 }, 0, 0, 1 },
+    { "motor-50hz",  50, 6000, { [1] = 1, [3] = 0.20, [5] = 0.10, [7] = 0.05 }, 0, 0, 1 },
+    { "odd-rate",    60, 5000, { [1] = 1, [3] = 0.20, [5] = 0.10, [9] = 0.05 }, 0, 0, 1 },
+    { "dc-noise",    60, 6000, { [1] = 1, [3] = 0.15, [5] = 0.05 }, 300, 0.02, 1 },
+    { "interleaved", 60, 3000, { [1] = 1, [2] = 0.10, [5] = 0.07 }, 0, 0, 2 },
+};
+
+// Whole seconds of scans, each harmonic at its own phase
+static uint16_t* generate(const spectrum* sp, size_t* len)
+{
+    size_t scans = (size_t)sp->rate_hz * SECONDS;
+    uint16_t* buf = malloc(scans * sp->stride * sizeof(uint16_t));
+    for (size_t j = 0; j < scans; j++) {
+        double theta = 2 * M_PI * sp->mains_hz * j / sp->rate_hz;
+        double v = ADC_COUNTS / 2 + sp->dc_shift + sp->noise * AMPLITUDE * waveform_gaussian();
+        for (int h = 1; h <= MAX_ORDER; h++) {
+            v += AMPLITUDE * sp->level[h] * sin(h * theta + 0.7 * h);
+        }
+        buf[j * sp->stride] = (uint16_t)(v + 0.5);
+        for (uint8_t k = 1; k < sp->stride; k++) {
+            buf[j * sp->stride + k] = (uint16_t)(rand() % ADC_COUNTS);   // Someone else's pump
+        }
+    }
+    *len = scans * sp->stride;
+    return buf;
+}
+
+static int check_spectrum(const spectrum* sp, uint16_t cycles)
+{
+    const double ratio = WAVE_ICAL * ((SUPPLY_VOLTAGE / 1000.0) / ADC_COUNTS);
+    const harmonic_config cfg = {
+        .sample_rate_hz = sp->rate_hz,
+        .mains_hz = sp->mains_hz,
+        .cycles = cycles,
+        .period_ms = PERIOD_MS,
+        .orders = { 1, 2, 3, 5, 7 },
+        .stride = sp->stride,
+        .ical = WAVE_ICAL,
+    };
+    harmonic h;
+    harmonic_result r;
+    size_t len, pos = 0;
+    uint16_t* buf = generate(sp, &len);
+    int failures = 0;
+    double worst = 0, worst_thd = 0;
+    unsigned windows = 0, done = 0;
+
+    if (harmonic_init(&h, &cfg) != 0) {
+        printf("%s: harmonic_init failed\n", sp->name);
+        free(buf);
+        return 1;
+    }
+    // Expected THD over the orders analysed, anything else has to stay out of them
+    double above = 0;
+    for (int k = 0; k < HARMONIC_MAX && ORDERS[k]; k++) {
+        above += ORDERS[k] > 1 ? sp->level[ORDERS[k]] * sp->level[ORDERS[k]] : 0;
+    }
+    double thd = sqrt(above);
+    double fundamental = ratio * AMPLITUDE / sqrt(2);
+    // Noise in a bin, 3 sigma
+    double noise = 3 * ratio * sp->noise * AMPLITUDE * sqrt(2.0 / h.window_len);
+
+    while (pos < len) {
+        size_t n = 1 + rand() % MAX_BLOCK;
+        n = n < len - pos ? n : len - pos;
+        done += harmonic_push(&h, &buf[pos], n);
+        pos += n;
+        if (!harmonic_take(&h, &r)) {
+            continue;
+        }
+        windows++;
+        if (windows == 1) {
+            continue;               // The DC estimate is mid-scale until the first window
+        }
+        for (uint8_t k = 0; k < r.count; k++) {
+            double want = fundamental * sp->level[r.orders[k]];
+            double err = fabs(r.irms[k] - want) / fundamental;
+            worst = err > worst ? err : worst;
+            if (fabs(r.irms[k] - want) > TOLERANCE * fundamental + noise) {
+                printf("%s: window %u harmonic %u is %.4f A, expected %.4f A\n",
+                       sp->name, windows, r.orders[k], r.irms[k], want);
+                failures++;
+            }
+        }
+        double thd_err = fabs(r.thd - thd);
+        worst_thd = thd_err > worst_thd ? thd_err : worst_thd;
+        if (thd_err > THD_TOLERANCE + noise / fundamental * 2) {
+            printf("%s: window %u THD %.4f, expected %.4f\n", sp->name, windows, r.thd, thd);
+            failures++;
+        }
+    }
+    unsigned expect = SECONDS * 1000 / PERIOD_MS;
+    if (done != expect || windows != expect) {
+        printf("%s: %u windows completed, %u taken, expected %u\n", sp->name, done, windows, expect);
+        failures++;
+    }
+    printf("%-12s %5u %6u %8u %9.3f%% %9.3f%% %11.3f%% %11.3f%%   %s\n", sp->name, sp->mains_hz, sp->rate_hz,
+           h.window_len, 100 * thd, 100 * r.thd, 100 * worst, 100 * worst_thd, failures ? "FAIL" : "ok");
+    free(buf);
+    return failures;
+}
+
+// Per sample cost of the filters while a window runs, and of the per-cycle RMS
+static void bench(uint16_t cycles)
+{
+    const spectrum* sp = &SPECTRA[1];
+    const unsigned reps = 20;
+    size_t len;
+    uint16_t* buf = generate(sp, &len);
+    harmonic_config cfg = {
+        .sample_rate_hz = sp->rate_hz,
+        .mains_hz = sp->mains_hz,
+        .cycles = cycles,
+        .period_ms = (cycles * 1000 + sp->mains_hz - 1) / sp->mains_hz,     // Back to back, the worst case
+        .orders = { 1, 2, 3, 5, 7 },
+        .stride = 1,
+        .ical = WAVE_ICAL,
+    };
+    harmonic h;
+    if (harmonic_init(&h, &cfg) != 0) {
+        free(buf);
+        return;
+    }
+    double t0 = waveform_now_s();
+    for (unsigned r = 0; r < reps; r++) {
+        for (size_t pos = 0; pos < len; pos += MAX_BLOCK) {
+            harmonic_push(&h, &buf[pos], len - pos < MAX_BLOCK ? len - pos : MAX_BLOCK);
+        }
+    }
+    double goertzel = (waveform_now_s() - t0) * 1e9 / ((double)len * reps);
+
+    static const emon_sample_provider none = { 0 };    // The window only uses ICAL and the filter
+    energy_mon emon;
+    emon_window w;
+    emon_init(&emon, &none);
+    emon_current(&emon, 6, WAVE_ICAL);
+    emon_window_init(&w, &emon, sp->rate_hz, sp->mains_hz, 1, 1);
+    t0 = waveform_now_s();
+    for (unsigned r = 0; r < reps; r++) {
+        for (size_t pos = 0; pos < len; pos += MAX_BLOCK) {
+            emon_window_push(&w, &buf[pos], len - pos < MAX_BLOCK ? len - pos : MAX_BLOCK, 0);
+        }
+    }
+    double rms = (waveform_now_s() - t0) * 1e9 / ((double)len * reps);
+    double duty = (double)h.window_len / (sp->rate_hz * PERIOD_MS / 1000.0);
+
+    printf("\nns/sample: Goertzel x5 %.2f during a window, %.3f averaged at one %u cycle window per %d ms; "
+           "per-cycle RMS %.2f\n", goertzel, goertzel * duty, cycles, PERIOD_MS, rms);
+    free(buf);
+}
+
+int main(int argc, char** argv)
+{
+    uint16_t cycles = 10;
+    unsigned seed = 1;
+    int failures = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:s:")) != -1) {
+        switch (opt) {
+        case 'c': cycles = (uint16_t)atoi(optarg); break;
+        case 's': seed = (unsigned)atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-c cycles] [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (cycles == 0 || cycles > HARMONIC_MAX_CYCLES || (unsigned)cycles * 1000 / 50 > PERIOD_MS) {
+        fprintf(stderr, "cycles must be 1 to %d and fit in %d ms at 50 Hz\n", HARMONIC_MAX_CYCLES, PERIOD_MS);
+        return 1;
+    }
+    srand(seed);
+
+    printf("%-12s %5s %6s %8s %10s %10s %12s %12s\n", "spectrum", "mains", "rate", "window", "THD in", "THD out",
+           "worst h err", "worst THD");
+    for (size_t i = 0; i < sizeof(SPECTRA) / sizeof(SPECTRA[0]); i++) {
+        failures += check_spectrum(&SPECTRA[i], cycles);
+    }
+
+    harmonic h;
+    harmonic_config bad = { .sample_rate_hz = 6000, .mains_hz = 60, .cycles = 10, .period_ms = 1000,
+                            .orders = { 1, 51 }, .ical = WAVE_ICAL };
+    if (harmonic_init(&h, &bad) == 0) {
+        printf("an order past Nyquist was taken\n");
+        failures++;
+    }
+    bad.orders[1] = 3;
+    bad.period_ms = 100;
+    if (harmonic_init(&h, &bad) == 0) {
+        printf("a window longer than the period was taken\n");
+        failures++;
+    }
+
+    bench(cycles);
+    return failures ? 1 : 0;
+}
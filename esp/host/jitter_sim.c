@@ -0,0 +1,423 @@
+/*
+*****************************************************************
+* jitter_sim.c - RMS Error From Sampling Jitter, Offline        *
+*****************************************************************
+
+  Reads the JITTER lines CONFIG_EMON_PROFILE prints for every
+  window (-f, - for stdin), or makes its own by running a simulated
+  polled ADC through emon_profile: intervals of -m us with -j us
+  of gaussian jitter, and a -g us gap every -e ms the way Wi-Fi
+  beacons take the CPU.  -v prints those the way the device would.
+
+  Each window's intervals are then replayed, in shuffled order with
+  its longest gaps where they happened, to sample a sine with a
+  3rd harmonic at a random phase, and the result of emon_calcIrms
+  and emon_calcIrms_cycles compared with the analytic RMS.  Next to
+  that the same windows are sampled evenly at the same rate, which
+  is the error jitter adds, and by a timer with -t us of jitter and
+  the DMA, both at -r Hz (the polled rate by default).  Prints the
+  bias, spread and worst error of each.
+
+  usage: jitter_sim [-f log] [-m mean_us] [-j jitter_us] [-g gap_us] [-e every_ms]
+                    [-n samples] [-w windows] [-c cycles] [-t timer_us] [-r rate]
+                    [-3 third] [-s seed] [-v]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "dizon_EmonLib.h"
+#include "dizon_emon_profile.h"
+#include "waveform.h"
+
+#define CURRENT_CHANNEL 6
+#define AMPLITUDE       600.0           // Peak counts
+#define LINE_HZ         60.0
+#define WARMUP_WINDOWS  40
+#define TIMEOUT_MS      2000
+#define MAX_LOGS        4096
+#define BIN_NS          1000
+
+typedef struct window_log {
+    uint32_t bin_ns;
+    uint32_t n;
+    uint32_t bins[EMON_PROFILE_BINS];
+    uint8_t gap_count;
+    uint32_t gap_index[EMON_PROFILE_GAPS];
+    double gap_us[EMON_PROFILE_GAPS];
+} window_log;
+
+static window_log s_logs[MAX_LOGS];
+static size_t s_log_count;
+
+//--------------------------------------------------------------------------------------
+// JITTER bin_ns=1000 n=1480 bins=0,3,..  gaps=903:812.00,120:455.20
+//--------------------------------------------------------------------------------------
+static bool parse_line(const char* line, window_log* w)
+{
+    const char* p = strstr(line, "JITTER ");
+    char* end;
+
+    memset(w, 0, sizeof(*w));
+    if (p == NULL || sscanf(p, "JITTER bin_ns=%u n=%u", &w->bin_ns, &w->n) != 2 || w->bin_ns == 0 ||
+        (p = strstr(p, "bins=")) == NULL) {
+        return false;
+    }
+    p += 5;
+    for (int b = 0; b < EMON_PROFILE_BINS; b++) {
+        w->bins[b] = (uint32_t)strtoul(p, &end, 10);
+        if (end == p) {
+            return false;
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+    if ((p = strstr(p, "gaps=")) == NULL) {
+        return false;
+    }
+    p += 5;
+    while (w->gap_count < EMON_PROFILE_GAPS) {
+        uint32_t index = (uint32_t)strtoul(p, &end, 10);
+        if (end == p || *end != ':') {
+            break;
+        }
+        p = end + 1;
+        w->gap_index[w->gap_count] = index;
+        w->gap_us[w->gap_count++] = strtod(p, &end);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return w->n > 1;
+}
+
+static void load(FILE* f)
+{
+    char line[2048];
+    while (s_log_count < MAX_LOGS && fgets(line, sizeof(line), f)) {
+        if (parse_line(line, &s_logs[s_log_count])) {
+            s_log_count++;
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------
+// Simulated polled ADC, its intervals through emon_profile as on the device
+//--------------------------------------------------------------------------------------
+typedef struct poller {
+    double mean_us, jitter_us, gap_us, every_us;
+    double t_us;
+    double next_gap_us;
+    emon_sample_provider provider;
+} poller;
+
+static int poll_read(void* ctx, int channel)
+{
+    poller* p = ctx;
+    (void)channel;
+    double dt = p->mean_us + p->jitter_us * waveform_gaussian();
+    p->t_us += dt > 0.2 * p->mean_us ? dt : 0.2 * p->mean_us;
+    if (p->gap_us > 0 && p->t_us >= p->next_gap_us) {
+        p->t_us += p->gap_us;
+        p->next_gap_us += p->every_us;
+    }
+    return ADC_COUNTS / 2;
+}
+
+static int64_t poll_micros(void* ctx)
+{
+    return (int64_t)((poller*)ctx)->t_us;
+}
+
+static uint32_t poll_ticks(void* ctx)
+{
+    return (uint32_t)(uint64_t)(((poller*)ctx)->t_us * 1000);    // ns, wrapping like the cycle counter
+}
+
+static void synthesize(poller* p, unsigned windows, unsigned samples, bool verbose)
+{
+    emon_profile prof;
+    energy_mon emon;
+
+    p->t_us = 0;
+    p->next_gap_us = p->every_us * waveform_uniform();
+    p->provider = (emon_sample_provider){ .ctx = p, .read = poll_read, .micros = poll_micros };
+    emon_profile_init(&prof, &p->provider, poll_ticks, p, 1000, BIN_NS);
+    emon_init(&emon, &prof.provider);
+    emon_current(&emon, CURRENT_CHANNEL, WAVE_ICAL);
+    for (unsigned i = 0; i < windows && s_log_count < MAX_LOGS; i++) {
+        window_log* w = &s_logs[s_log_count++];
+        emon_profile_begin(&prof);
+        emon_calcIrms(&emon, samples);
+        p->t_us += 1000 * waveform_uniform();            // The task sleeps between windows
+        if (verbose) {
+            emon_profile_print(&prof);
+        }
+        w->bin_ns = prof.bin_ns;
+        w->n = prof.n;
+        memcpy(w->bins, prof.bins, sizeof(w->bins));
+        w->gap_count = prof.gap_count;
+        for (uint8_t g = 0; g < prof.gap_count; g++) {
+            w->gap_index[g] = prof.gaps[g].index;
+            w->gap_us[g] = prof.gaps[g].ticks / 1000.0;
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------
+// A window's intervals in random order, the longest ones back where they were.  What
+// fell past the last bin and is not among those gets the bin's lower edge.
+//--------------------------------------------------------------------------------------
+static size_t replay(const window_log* w, double* out)
+{
+    static double pool[1 << 16];
+    const size_t intervals = w->n - 1 < (1 << 16) ? w->n - 1 : (1 << 16);
+    const double bin_us = w->bin_ns / 1000.0;
+    uint32_t bins[EMON_PROFILE_BINS];
+    size_t k = 0;
+
+    // The gaps are counted in the bins too
+    memcpy(bins, w->bins, sizeof(bins));
+    for (uint8_t g = 0; g < w->gap_count; g++) {
+        size_t b = (size_t)(w->gap_us[g] / bin_us);
+        b = b < EMON_PROFILE_BINS ? b : EMON_PROFILE_BINS - 1;
+        bins[b] -= bins[b] > 0;
+    }
+    for (int b = 0; b < EMON_PROFILE_BINS; b++) {
+        for (uint32_t i = 0; i < bins[b] && k < intervals; i++) {
+            pool[k++] = (b + (b < EMON_PROFILE_BINS - 1 ? waveform_uniform() : 0)) * bin_us;
+        }
+    }
+    for (size_t i = k; i > 1; i--) {
+        size_t j = (size_t)(waveform_uniform() * i) % i;
+        double t = pool[i - 1];
+        pool[i - 1] = pool[j];
+        pool[j] = t;
+    }
+    size_t taken = 0;
+    for (size_t i = 0; i < intervals; i++) {
+        double gap = -1;
+        for (uint8_t g = 0; g < w->gap_count; g++) {
+            if (w->gap_index[g] == i + 1) {
+                gap = w->gap_us[g];
+            }
+        }
+        out[i] = gap >= 0 ? gap : taken < k ? pool[taken++] : bin_us;
+    }
+    return intervals;
+}
+
+static double mean_interval(const window_log* w)
+{
+    static double out[1 << 16];
+    double sum = 0;
+    size_t n = replay(w, out);
+    for (size_t i = 0; i < n; i++) {
+        sum += out[i];
+    }
+    return sum / n;
+}
+
+//--------------------------------------------------------------------------------------
+// Sampler: the instant of every conversion, one strategy at a time
+//--------------------------------------------------------------------------------------
+typedef enum { POLLED, POLLED_EVEN, TIMER, DMA } strategy;
+
+static const char* const STRATEGY_NAMES[] = { "polled", "polled, no jitter", "timer", "dma" };
+
+typedef struct sampler {
+    strategy how;
+    double third;
+    double t_us;                    // Of the next conversion
+    double even_us;                 // Spacing of everything but POLLED
+    double jitter_us;               // TIMER, around each slot
+    uint64_t k;                     // Conversions since the last start
+    double start_us;
+    size_t log;                     // POLLED, window being replayed
+    double intervals[1 << 16];
+    size_t count, pos;
+    emon_sample_provider provider;
+} sampler;
+
+static void next_log(sampler* s)
+{
+    s->log = (s->log + 1) % s_log_count;
+    s->count = replay(&s_logs[s->log], s->intervals);
+    s->pos = 0;
+}
+
+// A new window: a random phase of the line, and the next logged window for POLLED
+static void sampler_start(sampler* s)
+{
+    s->t_us += 1e6 / LINE_HZ * waveform_uniform() + 1000;
+    s->start_us = s->t_us;
+    s->k = 0;
+    if (s->how == POLLED) {
+        next_log(s);
+    }
+}
+
+static int sampler_read(void* ctx, int channel)
+{
+    sampler* s = ctx;
+    double t = s->t_us;
+    (void)channel;
+
+    switch (s->how) {
+    case POLLED:
+        if (s->pos == s->count) {
+            next_log(s);            // A window of whole cycles can outrun the one logged
+        }
+        s->t_us += s->intervals[s->pos++];
+        break;
+    case TIMER:
+        t += s->jitter_us * waveform_gaussian();
+        /* fall through */
+    default:
+        s->t_us = s->start_us + ++s->k * s->even_us;
+        break;
+    }
+    double w = 2 * M_PI * LINE_HZ * t * 1e-6;
+    double v = ADC_COUNTS / 2 + AMPLITUDE * (sin(w) + s->third * sin(3 * w + 1.1));
+    return (int)(v + 0.5);
+}
+
+static int64_t sampler_micros(void* ctx)
+{
+    return (int64_t)((sampler*)ctx)->t_us;
+}
+
+typedef struct result {
+    double sum, sumsq, worst;       // Relative errors
+    unsigned n;
+} result;
+
+static void run(sampler* s, bool cycles, unsigned samples, unsigned cycle_count, unsigned windows, result* r)
+{
+    const double i_ratio = WAVE_ICAL * ((SUPPLY_VOLTAGE / 1000.0) / ADC_COUNTS);
+    const double irms = i_ratio * AMPLITUDE * sqrt((1 + s->third * s->third) / 2);
+    energy_mon emon;
+
+    s->provider = (emon_sample_provider){ .ctx = s, .read = sampler_read, .micros = sampler_micros };
+    s->t_us = 0;
+    s->log = 0;
+    emon_init(&emon, &s->provider);
+    emon_current(&emon, CURRENT_CHANNEL, WAVE_ICAL);
+    memset(r, 0, sizeof(*r));
+    for (unsigned w = 0; w < WARMUP_WINDOWS + windows; w++) {
+        sampler_start(s);
+        unsigned n = s->how == POLLED ? s_logs[s->log].n : samples;
+        double value = cycles ? emon_calcIrms_cycles(&emon, cycle_count, TIMEOUT_MS) : emon_calcIrms(&emon, n);
+        if (w >= WARMUP_WINDOWS) {
+            double err = (value - irms) / irms;
+            r->sum += err;
+            r->sumsq += err * err;
+            r->worst = fabs(err) > r->worst ? fabs(err) : r->worst;
+            r->n++;
+        }
+    }
+}
+
+static void report(const char* name, const char* spacing, const result* r)
+{
+    double mean = r->sum / r->n;
+    double var = r->sumsq / r->n - mean * mean;
+    printf("  %-18s %-16s bias %+8.4f%%  sd %7.4f%%  worst %7.4f%%\n",
+           name, spacing, 100 * mean, 100 * sqrt(var > 0 ? var : 0), 100 * r->worst);
+}
+
+int main(int argc, char** argv)
+{
+    static sampler s;
+    poller p = { .mean_us = 40, .jitter_us = 2, .gap_us = 0, .every_us = 102400 };
+    const char* file = NULL;
+    unsigned samples = 1480, windows = 200, cycles = 10, seed = 1;
+    double timer_us = 1.0, rate = 0, third = 0.1;
+    bool verbose = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:m:j:g:e:n:w:c:t:r:3:s:v")) != -1) {
+        switch (opt) {
+        case 'f': file = optarg; break;
+        case 'm': p.mean_us = atof(optarg); break;
+        case 'j': p.jitter_us = atof(optarg); break;
+        case 'g': p.gap_us = atof(optarg); break;
+        case 'e': p.every_us = atof(optarg) * 1000; break;
+        case 'n': samples = (unsigned)atoi(optarg); break;
+        case 'w': windows = (unsigned)atoi(optarg); break;
+        case 'c': cycles = (unsigned)atoi(optarg); break;
+        case 't': timer_us = atof(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case '3': third = atof(optarg); break;
+        case 's': seed = (unsigned)atoi(optarg); break;
+        case 'v': verbose = true; break;
+        default:
+            fprintf(stderr, "usage: %s [-f log] [-m mean_us] [-j jitter_us] [-g gap_us] [-e every_ms]\n"
+                            "       [-n samples] [-w windows] [-c cycles] [-t timer_us] [-r rate]\n"
+                            "       [-3 third] [-s seed] [-v]\n", argv[0]);
+            return 1;
+        }
+    }
+    srand(seed);
+
+    if (file) {
+        FILE* f = strcmp(file, "-") == 0 ? stdin : fopen(file, "r");
+        if (f == NULL) {
+            perror(file);
+            return 1;
+        }
+        load(f);
+        if (f != stdin) {
+            fclose(f);
+        }
+    } else if (samples < 2 || p.mean_us <= 0) {
+        fprintf(stderr, "need 2 or more samples and a mean interval\n");
+        return 1;
+    } else {
+        synthesize(&p, windows, samples, verbose);
+    }
+    if (s_log_count == 0) {
+        fprintf(stderr, "no JITTER lines\n");
+        return 1;
+    }
+    if (verbose && file == NULL) {
+        return 0;
+    }
+
+    double interval = 0;
+    uint32_t n = 0;
+    for (size_t i = 0; i < s_log_count; i++) {
+        interval += mean_interval(&s_logs[i]);
+        n += s_logs[i].n;
+    }
+    interval /= s_log_count;
+    n /= s_log_count;
+    double even_rate = rate > 0 ? rate : 1e6 / interval;
+    unsigned even_samples = (unsigned)(n * interval * even_rate / 1e6 + 0.5);
+    printf("%u windows of %u conversions, polled at %.0f Hz (%.2f us), timer and dma at %.0f Hz, %u samples\n",
+           (unsigned)s_log_count, n, 1e6 / interval, interval, even_rate, even_samples);
+
+    for (int c = 0; c < 2; c++) {
+        if (c) {
+            printf("\nemon_calcIrms_cycles, %u cycles:\n", cycles);
+        } else {
+            printf("\nemon_calcIrms, a fixed count:\n");
+        }
+        for (strategy how = POLLED; how <= DMA; how++) {
+            result r;
+            char spacing[32];
+            s.how = how;
+            s.third = third;
+            s.even_us = how == POLLED_EVEN ? interval : 1e6 / even_rate;
+            s.jitter_us = timer_us;
+            if (how == POLLED) {
+                snprintf(spacing, sizeof(spacing), "as logged");
+            } else if (how == TIMER) {
+                snprintf(spacing, sizeof(spacing), "%.1f us jitter", timer_us);
+            } else {
+                snprintf(spacing, sizeof(spacing), "even");
+            }
+            run(&s, c == 1, how == POLLED_EVEN ? n : even_samples, cycles, windows, &r);
+            report(STRATEGY_NAMES[how], spacing, &r);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,177 @@
+/*
+*****************************************************************
+* level_check.c - Echo Filter Check For The Water Level         *
+*****************************************************************
+
+  Feeds the level filter simulated ultrasonic echo times for a sump
+  that fills at a steady rate and is pumped down whenever it reaches
+  the float.  Pings get timing noise, some get no
+  echo and some come back from the pit wall instead of the water.
+  Checks the echo to distance math, that almost every reading is
+  within a centimetre of the water and that the rate of rise holds
+  while the pit is filling.  Exits non-zero on a violation.
+
+  usage: level_check [-n bursts] [-p pings] [-e no_echo_percent]
+                     [-o outlier_percent] [-r rise_cm_h] [-s seed]
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "dizon_level.h"
+
+#define MOUNT_CM     60.0f
+#define TEMP_C       15.0f
+#define PERIOD_S     5
+#define LOW_CM       10.0          // Pump stops here
+#define HIGH_CM      40.0          // and the float starts it here
+#define DRAIN_CM_H   (-2400.0)
+#define NOISE_CM     0.3           // One sigma of the ping to ping distance noise
+
+#define LEVEL_TOLERANCE_CM 1.0f
+#define WRONG_FRACTION     0.001   // Readings allowed outside the tolerance
+#define RATE_TOLERANCE     0.15    // of the rise, but never tighter than
+#define RATE_NOISE_CM_H    20.0    //  about 5 sigma of NOISE_CM over the 120 s window
+
+static double gauss(void)
+{
+    double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+static uint32_t echo_for(double cm)
+{
+    return (uint32_t)(cm / level_echo_cm(1000000, TEMP_C) * 1e6 + 0.5);
+}
+
+static int check_math(void)
+{
+    int failures = 0;
+    // 343.4 m/s at 20 C, a metre away is 2 m of travel
+    float cm = level_echo_cm(5824, 20.0f);
+    if (fabsf(cm - 100.0f) > 0.05f) {
+        printf("5824 us at 20 C gave %.3f cm, not 100\n", cm);
+        failures++;
+    }
+    if (level_echo_cm(0, 20.0f) != 0) {
+        printf("No echo is not 0 cm\n");
+        failures++;
+    }
+    return failures;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned bursts = 20000;
+    unsigned pings = 5;
+    unsigned no_echo_pct = 10;
+    unsigned outlier_pct = 10;
+    double rise = 60;
+    unsigned seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:p:e:o:r:s:")) != -1) {
+        switch (opt) {
+        case 'n': bursts = (unsigned)atoi(optarg); break;
+        case 'p': pings = (unsigned)atoi(optarg); break;
+        case 'e': no_echo_pct = (unsigned)atoi(optarg); break;
+        case 'o': outlier_pct = (unsigned)atoi(optarg); break;
+        case 'r': rise = atof(optarg); break;
+        case 's': seed = (unsigned)atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n bursts] [-p pings] [-e no_echo_percent] [-o outlier_percent] "
+                    "[-r rise_cm_h] [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (pings == 0 || pings > LEVEL_MAX_PINGS || rise <= 0) {
+        fprintf(stderr, "pings must be 1..%d and the rise positive\n", LEVEL_MAX_PINGS);
+        return 1;
+    }
+    srand(seed);
+    int failures = check_math();
+
+    const level_config cfg = {
+        .mount_cm = MOUNT_CM,
+        .min_cm = 2,
+        .max_cm = MOUNT_CM + 2,
+        .temp_c = TEMP_C,
+        .spread_cm = 2,
+        .min_pings = (pings + 1) / 2,
+        .rate_window_s = 120,
+    };
+    level lv;
+    if (level_init(&lv, &cfg) != 0) {
+        fprintf(stderr, "bad level config\n");
+        return 1;
+    }
+
+    double water = LOW_CM, phase_s = 0, worst = 0, sq = 0, worst_rate = 0;
+    bool filling = true;
+    unsigned wrong = 0, rate_checked = 0, rate_wrong = 0;
+    uint32_t echo[LEVEL_MAX_PINGS];
+    level_reading r;
+
+    for (unsigned b = 0; b < bursts; b++) {
+        for (unsigned i = 0; i < pings; i++) {
+            int roll = rand() % 100;
+            if (roll < (int)no_echo_pct) {
+                echo[i] = 0;
+            } else if (roll < (int)(no_echo_pct + outlier_pct)) {
+                echo[i] = echo_for(5 + (rand() % 5500) / 100.0);     // Off the wall or the pump
+            } else {
+                echo[i] = echo_for(MOUNT_CM - water + NOISE_CM * gauss());
+            }
+        }
+        if (level_burst(&lv, echo, pings, (int64_t)b * PERIOD_S * 1000000, &r) == 0) {
+            double err = fabs(r.level_cm - water);
+            sq += err * err;
+            worst = err > worst ? err : worst;
+            if (err > LEVEL_TOLERANCE_CM) {
+                wrong++;
+            }
+            // Only once the whole window is inside the current fill
+            if (filling && r.have_rate && phase_s > cfg.rate_window_s) {
+                double rate_err = fabs(r.rate_cm_h - rise);
+                worst_rate = rate_err > worst_rate ? rate_err : worst_rate;
+                rate_checked++;
+                if (rate_err > fmax(RATE_TOLERANCE * rise, RATE_NOISE_CM_H)) {
+                    rate_wrong++;
+                }
+            }
+        }
+
+        water += (filling ? rise : DRAIN_CM_H) * PERIOD_S / 3600;
+        phase_s += PERIOD_S;
+        if (filling && water >= HIGH_CM) {
+            filling = false;
+            phase_s = 0;
+        } else if (!filling && water <= LOW_CM) {
+            water = LOW_CM;
+            filling = true;
+            phase_s = 0;
+        }
+    }
+
+    level_print(&lv);
+    printf("level error rms %.3f cm, worst %.2f cm, %u over %.1f cm\n",
+           lv.readings ? sqrt(sq / lv.readings) : 0.0, worst, wrong, LEVEL_TOLERANCE_CM);
+    printf("rate checked %u times while filling at %.0f cm/h, worst error %.1f cm/h, %u off\n",
+           rate_checked, rise, worst_rate, rate_wrong);
+
+    if (lv.readings < bursts * 0.9) {
+        printf("only %u of %u bursts gave a reading\n", lv.readings, bursts);
+        failures++;
+    }
+    if (wrong > lv.readings * WRONG_FRACTION) {
+        printf("too many readings off the water\n");
+        failures++;
+    }
+    if (rate_checked == 0 || rate_wrong > rate_checked * WRONG_FRACTION) {
+        printf("rate of rise does not hold\n");
+        failures++;
+    }
+    return failures ? 1 : 0;
+}
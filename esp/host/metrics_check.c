@@ -0,0 +1,283 @@
+/*
+*****************************************************************
+* metrics_check.c - Histograms Against Exact Percentiles         *
+*****************************************************************
+
+  Records a few latency distributions, a wide one, a narrow one,
+  one running past the last bucket and one of zeros, and checks
+  every percentile against the exact one from the sorted values:
+  never below it, never above the largest value, and at most twice
+  it once past the first bucket.  Then several threads record and
+  count into the same histogram while another keeps taking
+  summaries, and nothing may be lost or counted twice.  Last it
+  times metrics_record alone and with every thread on it.  Exits
+  non-zero on a violation.
+
+  usage: metrics_check [-s seed] [-t threads]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "dizon_metrics.h"
+
+#define VALUES          100000
+#define PER_THREAD      2000000
+#define MAX_THREADS     16
+
+typedef enum { UNIFORM, LOGNORMAL, ZERO } shape;
+
+typedef struct scenario {
+    const char* name;
+    shape shape;
+    uint8_t shift;
+    double a, b;                    // Range for UNIFORM, median and sigma for LOGNORMAL
+} scenario;
+
+static const scenario SCENARIOS[] = {
+    { "window 0.1-1.2 s", UNIFORM, 10, 100000, 1200000 },
+    { "publish ~300 us", LOGNORMAL, 6, 300, 0.6 },
+    { "latency ~20 s", LOGNORMAL, 14, 20e6, 1.0 },
+    { "past the last bucket", UNIFORM, 6, 500000, 4000000000.0 },
+    { "all zero", ZERO, 6, 0, 0 },
+};
+
+static uint32_t s_values[VALUES];
+
+static double uniform(void)
+{
+    return (rand() + 1.0) / (RAND_MAX + 2.0);
+}
+
+static uint32_t draw(const scenario* sc)
+{
+    double v;
+    switch (sc->shape) {
+    case UNIFORM:
+        v = sc->a + (sc->b - sc->a) * uniform();
+        break;
+    case LOGNORMAL:
+        v = sc->a * exp(sc->b * sqrt(-2 * log(uniform())) * cos(2 * M_PI * uniform()));
+        break;
+    default:
+        v = 0;
+        break;
+    }
+    return v >= 4294967295.0 ? UINT32_MAX : (uint32_t)v;
+}
+
+static int cmp_u32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int check_percentile(const char* name, const char* which, uint32_t got, uint32_t exact, uint32_t max,
+                            uint8_t shift)
+{
+    uint32_t first_top = (1u << shift) - 1;
+    uint64_t limit = exact > first_top ? 2ull * exact : first_top;
+
+    if (got < exact || got > max || (exact < (1u << (shift + METRICS_BUCKETS - 2)) && got > limit)) {
+        printf("%s: %s %u, exact %u, max %u\n", name, which, got, exact, max);
+        return 1;
+    }
+    return 0;
+}
+
+static int run(const scenario* sc)
+{
+    metrics_hist h;
+    metrics_summary s;
+    int failures = 0;
+
+    metrics_hist_init(&h, sc->shift);
+    for (size_t i = 0; i < VALUES; i++) {
+        s_values[i] = draw(sc);
+        metrics_record(&h, s_values[i]);
+    }
+    metrics_take(&h, &s);
+    qsort(s_values, VALUES, sizeof(s_values[0]), cmp_u32);
+
+    uint32_t p50 = s_values[(VALUES * 500 + 999) / 1000 - 1];
+    uint32_t p90 = s_values[(VALUES * 900 + 999) / 1000 - 1];
+    uint32_t p99 = s_values[(VALUES * 990 + 999) / 1000 - 1];
+    uint32_t max = s_values[VALUES - 1];
+    printf("%-22s p50 %10u (%10u)  p90 %10u (%10u)  p99 %10u (%10u)  max %10u\n",
+           sc->name, s.p50, p50, s.p90, p90, s.p99, p99, s.max);
+
+    if (s.count != VALUES || s.max != max) {
+        printf("%s: %u values, max %u, recorded %u, max %u\n", sc->name, s.count, s.max, VALUES, max);
+        failures++;
+    }
+    failures += check_percentile(sc->name, "p50", s.p50, p50, max, sc->shift);
+    failures += check_percentile(sc->name, "p90", s.p90, p90, max, sc->shift);
+    failures += check_percentile(sc->name, "p99", s.p99, p99, max, sc->shift);
+
+    metrics_take(&h, &s);
+    if (s.count != 0 || s.max != 0 || s.p50 != 0) {
+        printf("%s: %u values left after the take\n", sc->name, s.count);
+        failures++;
+    }
+    return failures;
+}
+
+static metrics_hist s_shared;
+static uint32_t s_counter;
+static volatile int s_running;
+
+typedef struct worker {
+    pthread_t thread;
+    unsigned seed;
+    uint32_t max;                   // Largest value this thread recorded
+} worker;
+
+static void* record_loop(void* arg)
+{
+    worker* w = arg;
+    uint32_t x = w->seed | 1;
+
+    for (uint32_t i = 0; i < PER_THREAD; i++) {
+        x ^= x << 13;               // xorshift32, rand() takes a lock
+        x ^= x >> 17;
+        x ^= x << 5;
+        uint32_t v = x >> (x & 31);
+        w->max = v > w->max ? v : w->max;
+        metrics_record(&s_shared, v);
+        metrics_add(&s_counter, 1);
+    }
+    return NULL;
+}
+
+typedef struct totals {
+    uint64_t count;
+    uint64_t counted;
+    uint32_t max;
+    unsigned takes;
+} totals;
+
+static void take_into(totals* t)
+{
+    metrics_summary s;
+    metrics_take(&s_shared, &s);
+    t->count += s.count;
+    t->counted += metrics_take_count(&s_counter);
+    t->max = s.max > t->max ? s.max : t->max;
+    t->takes++;
+}
+
+static void* take_loop(void* arg)
+{
+    while (s_running) {
+        take_into(arg);
+        usleep(200);
+    }
+    return NULL;
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns ns per record over every thread
+static double hammer(int threads, bool with_reader, totals* t, uint32_t* max)
+{
+    worker workers[MAX_THREADS];
+    pthread_t reader;
+
+    memset(t, 0, sizeof(*t));
+    metrics_hist_init(&s_shared, 6);
+    s_counter = 0;
+    s_running = 1;
+    if (with_reader) {
+        pthread_create(&reader, NULL, take_loop, t);
+    }
+    double t0 = now_s();
+    for (int i = 0; i < threads; i++) {
+        workers[i].seed = (unsigned)rand();
+        workers[i].max = 0;
+        pthread_create(&workers[i].thread, NULL, record_loop, &workers[i]);
+    }
+    *max = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        *max = workers[i].max > *max ? workers[i].max : *max;
+    }
+    double elapsed = now_s() - t0;
+    s_running = 0;
+    if (with_reader) {
+        pthread_join(reader, NULL);
+    }
+    take_into(t);
+    return elapsed * 1e9 / ((double)PER_THREAD * threads);
+}
+
+static int concurrent(int threads)
+{
+    totals t;
+    uint32_t max;
+    int failures = 0;
+
+    hammer(threads, true, &t, &max);
+    printf("\n%d threads recording, %u takes meanwhile: %llu recorded, %llu counted, max %u\n",
+           threads, t.takes, (unsigned long long)t.count, (unsigned long long)t.counted, t.max);
+    if (t.count != (uint64_t)PER_THREAD * threads || t.counted != (uint64_t)PER_THREAD * threads) {
+        printf("lost or doubled: %llu recorded and %llu counted of %llu\n", (unsigned long long)t.count,
+               (unsigned long long)t.counted, (unsigned long long)PER_THREAD * threads);
+        failures++;
+    }
+    if (t.max != max) {
+        printf("max %u, recorded %u\n", t.max, max);
+        failures++;
+    }
+    return failures;
+}
+
+static void bench(int threads)
+{
+    totals t;
+    uint32_t max;
+
+    double alone = hammer(1, false, &t, &max);
+    double shared = hammer(threads, false, &t, &max);
+    printf("\nns/record (with its counter): %.1f alone, %.1f each with %d threads on one histogram\n",
+           alone, shared * threads, threads);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned seed = 1;
+    int threads = 4;
+    int failures = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:t:")) != -1) {
+        switch (opt) {
+        case 's': seed = (unsigned)atoi(optarg); break;
+        case 't': threads = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-s seed] [-t threads]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (threads < 1 || threads > MAX_THREADS) {
+        fprintf(stderr, "threads 1 to %d\n", MAX_THREADS);
+        return 1;
+    }
+    srand(seed);
+
+    printf("Percentiles in us, exact ones in brackets\n");
+    for (size_t i = 0; i < sizeof(SCENARIOS) / sizeof(SCENARIOS[0]); i++) {
+        failures += run(&SCENARIOS[i]);
+    }
+    failures += concurrent(threads);
+    bench(threads);
+    return failures ? 1 : 0;
+}
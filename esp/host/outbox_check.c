@@ -0,0 +1,514 @@
+/*
+*****************************************************************
+* outbox_check.c - QoS 1 Outbox Against A Simulated Broker      *
+*****************************************************************
+
+  Runs the outbox over a simulated link with a round trip time and
+  an uplink rate: acks in order and out of order, lost acks, a
+  broker slower than the retry time, an outage that loses every ack
+  in flight, and an arena too small for the load.  Every message
+  carries its sequence number and a pattern the broker checks, so
+  a message the arena wrapped over or lost shows up.  Exits non-zero
+  if one never arrives, arrives corrupt, or the outbox does not
+  give all its space back at the end.
+
+  Then sweeps the in-flight window for throughput and latency, on
+  the simulated link or with -b against a real broker (a local
+  Mosquitto: mosquitto -p 1883), over plain MQTT 3.1.1 on TCP.
+
+  usage: outbox_check [-b host[:port]] [-n messages] [-l bytes] [-r rtt_ms] [-s seed]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "dizon_outbox.h"
+
+#define TOPIC           "esptest/outbox_check"
+#define MAX_MESSAGES    4096
+#define MAX_ACKS        256
+#define WIRE_OVERHEAD   100             // MQTT, TLS, TCP/IP and 802.11 bytes per publish, roughly
+#define SWEEP_ARENA     (16 * 1024)
+
+static uint8_t s_arena[64 * 1024];
+
+//--------------------------------------------------------------------------------------
+// Payloads: the sequence number, then a pattern that depends on it
+//--------------------------------------------------------------------------------------
+static size_t make_payload(uint8_t* buf, uint32_t seq, size_t len)
+{
+    len = len < 4 ? 4 : len;
+    memcpy(buf, &seq, 4);
+    for (size_t i = 4; i < len; i++) {
+        buf[i] = (uint8_t)(seq * 31 + i);
+    }
+    return len;
+}
+
+static bool payload_ok(const uint8_t* buf, size_t len, uint32_t* seq)
+{
+    if (len < 4) {
+        return false;
+    }
+    memcpy(seq, buf, 4);
+    for (size_t i = 4; i < len; i++) {
+        if (buf[i] != (uint8_t)(*seq * 31 + i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//--------------------------------------------------------------------------------------
+// Simulated broker: publishes queue on the uplink, the ack comes back a round trip
+// after the last byte went out
+//--------------------------------------------------------------------------------------
+typedef struct pending_ack {
+    int msg_id;
+    int64_t due_us;
+} pending_ack;
+
+typedef struct sim_link {
+    double rtt_us;
+    double bytes_per_us;
+    int64_t now_us;
+    int64_t busy_until_us;
+    bool up;
+    uint32_t lose_every;                // Every nth ack never comes back, 0 for none
+    bool shuffle;                       // Acks due together come back in any order
+    pending_ack acks[MAX_ACKS];
+    int n_acks;
+    int next_id;
+    uint32_t sends;
+    uint32_t corrupt;
+    uint16_t delivered[MAX_MESSAGES];   // Times each sequence number got through
+    double ack_wait_us;                 // Send to ack, summed
+    uint32_t acks_back;
+} sim_link;
+
+static int sim_send(void* ctx, const char* topic, const uint8_t* data, size_t len)
+{
+    sim_link* l = ctx;
+    uint32_t seq;
+
+    if (!l->up || l->n_acks == MAX_ACKS) {
+        return -1;
+    }
+    if (strcmp(topic, TOPIC) != 0 || !payload_ok(data, len, &seq) || seq >= MAX_MESSAGES) {
+        l->corrupt++;
+    } else {
+        l->delivered[seq]++;
+    }
+    int64_t start = l->busy_until_us > l->now_us ? l->busy_until_us : l->now_us;
+    l->busy_until_us = start + (int64_t)((len + strlen(topic) + WIRE_OVERHEAD) / l->bytes_per_us);
+    l->next_id = l->next_id == 65535 ? 1 : l->next_id + 1;
+    if (l->lose_every == 0 || ++l->sends % l->lose_every != 0) {
+        l->acks[l->n_acks].msg_id = l->next_id;
+        l->acks[l->n_acks].due_us = l->busy_until_us + (int64_t)l->rtt_us;
+        l->ack_wait_us += l->acks[l->n_acks].due_us - l->now_us;
+        l->n_acks++;
+    }
+    return l->next_id;
+}
+
+// Moves the clock to the next ack, or to limit_us, and hands over every ack due by then
+static void sim_advance(sim_link* l, outbox* ob, int64_t limit_us)
+{
+    int64_t next = limit_us;
+    for (int i = 0; i < l->n_acks; i++) {
+        next = l->acks[i].due_us < next ? l->acks[i].due_us : next;
+    }
+    l->now_us = next > l->now_us ? next : l->now_us;
+
+    int due = 0;
+    for (int i = 0; i < l->n_acks; i++) {
+        if (l->acks[i].due_us <= l->now_us) {
+            pending_ack a = l->acks[i];
+            l->acks[i] = l->acks[due];
+            l->acks[due++] = a;
+        }
+    }
+    for (int i = due - 1; l->shuffle && i > 0; i--) {
+        int j = rand() % (i + 1);
+        pending_ack a = l->acks[i];
+        l->acks[i] = l->acks[j];
+        l->acks[j] = a;
+    }
+    for (int i = 0; i < due; i++) {
+        outbox_ack(ob, l->acks[i].msg_id);
+        l->acks_back++;
+    }
+    memmove(l->acks, l->acks + due, (l->n_acks - due) * sizeof(pending_ack));
+    l->n_acks -= due;
+}
+
+static void sim_init(sim_link* l, double rtt_ms, double kbit_s)
+{
+    memset(l, 0, sizeof(*l));
+    l->rtt_us = rtt_ms * 1000;
+    l->bytes_per_us = kbit_s / 8000;
+    l->up = true;
+}
+
+//--------------------------------------------------------------------------------------
+// Scenarios
+//--------------------------------------------------------------------------------------
+typedef struct scenario {
+    const char* name;
+    uint8_t window;
+    uint32_t arena;
+    uint32_t count;
+    uint32_t min_len, max_len;
+    double rtt_ms;
+    double kbit_s;
+    uint32_t retry_ms;
+    uint32_t lose_every;
+    bool shuffle;
+    uint32_t outage_at_ms, outage_ms;   // Link down for a while, every ack in flight lost
+    uint32_t produce_ms;                // Between messages, 0 to keep the outbox full
+} scenario;
+
+static const scenario SCENARIOS[] = {
+    { "in order",    4,  4096,  400, 4,   600,  80,  1000, 3000, 0, false, 0,    0,    0 },
+    { "reordered",   16, 4096,  400, 4,   600,  80,  1000, 3000, 0, true,  0,    0,    0 },
+    { "lost acks",   4,  4096,  400, 4,   600,  80,  1000, 1000, 7, false, 0,    0,    0 },
+    { "slow broker", 8,  8192,  200, 100, 300,  1500, 1000, 500, 0, false, 0,    0,    0 },
+    { "outage",      8,  8192,  300, 4,   300,  80,  1000, 2000, 0, false, 3000, 8000, 20 },
+    { "small arena", 4,  1024,  400, 200, 1000, 80,  1000, 3000, 0, false, 0,    0,    0 },
+};
+
+static int run(const scenario* sc)
+{
+    static uint8_t payload[4096];
+    const outbox_config cfg = { .max_inflight = sc->window, .retry_ms = sc->retry_ms };
+    sim_link l;
+    outbox ob;
+    uint32_t seq = 0, backpressure = 0, lost = 0, dups = 0;
+    int64_t next_produce = 0;
+    int failures = 0;
+
+    sim_init(&l, sc->rtt_ms, sc->kbit_s);
+    l.lose_every = sc->lose_every;
+    l.shuffle = sc->shuffle;
+    if (outbox_init(&ob, &cfg, s_arena, sc->arena) != 0) {
+        printf("%s: bad config\n", sc->name);
+        return 1;
+    }
+    for (int steps = 0; steps < 1000000 && (seq < sc->count || outbox_pending(&ob) > 0); steps++) {
+        int64_t t = l.now_us / 1000;
+        bool down = sc->outage_ms && t >= sc->outage_at_ms && t < sc->outage_at_ms + sc->outage_ms;
+        if (down && l.up) {
+            l.n_acks = 0;               // Dropped with the connection
+        }
+        l.up = !down;
+        while (seq < sc->count && l.now_us >= next_produce) {
+            size_t len = make_payload(payload, seq, sc->min_len + rand() % (sc->max_len - sc->min_len + 1));
+            if (outbox_push(&ob, TOPIC, payload, len, l.now_us) != 0) {
+                backpressure++;         // The producer holds on to it and tries again later
+                break;
+            }
+            seq++;
+            next_produce = sc->produce_ms ? l.now_us + sc->produce_ms * 1000LL : 0;
+        }
+        if (ob.used > ob.arena_len || ob.stats.high_water_bytes > ob.arena_len) {
+            printf("%s: %u bytes held in a %u byte arena\n", sc->name, ob.used, ob.arena_len);
+            failures++;
+            break;
+        }
+        outbox_pump(&ob, l.now_us, sim_send, &l);
+        // Wake up for the next ack, the next retry or the next message, whichever is first
+        int64_t limit = l.now_us + (int64_t)sc->retry_ms * 1000;
+        if (seq < sc->count && next_produce > l.now_us && next_produce < limit) {
+            limit = next_produce;
+        }
+        if (sc->outage_ms && l.now_us < sc->outage_at_ms * 1000LL && limit > sc->outage_at_ms * 1000LL) {
+            limit = sc->outage_at_ms * 1000LL;
+        }
+        sim_advance(&l, &ob, limit);
+    }
+    outbox_pump(&ob, l.now_us, sim_send, &l);
+
+    for (uint32_t i = 0; i < sc->count; i++) {
+        lost += l.delivered[i] == 0;
+        dups += l.delivered[i] > 1 ? l.delivered[i] - 1 : 0;
+    }
+    if (lost || l.corrupt || outbox_pending(&ob) || ob.used || ob.inflight || dups > ob.stats.retries) {
+        failures++;
+    }
+    printf("%-12s %3u %6u %6u %6u %8u %8u %8u %8u %8u %9.1f   %s\n", sc->name, sc->window, sc->arena, sc->count,
+           ob.stats.high_water_bytes, backpressure, ob.stats.retries, dups, ob.stats.unknown_acks, lost + l.corrupt,
+           ob.stats.acked ? ob.stats.latency_sum_us / 1000.0 / ob.stats.acked : 0.0, failures ? "FAIL" : "ok");
+    return failures;
+}
+
+//--------------------------------------------------------------------------------------
+// Window sweep on the simulated link, the producer keeps the outbox full
+//--------------------------------------------------------------------------------------
+static void sweep_sim(uint32_t count, size_t len, double rtt_ms, double kbit_s)
+{
+    static uint8_t payload[4096];
+    static const uint8_t windows[] = { 1, 2, 4, 8, 16, 32 };
+
+    printf("\nsimulated link, %.0f ms round trip, %.0f kbit/s, %u messages of %u bytes\n", rtt_ms, kbit_s, count,
+           (unsigned)len);
+    printf("%6s %10s %10s %12s %12s\n", "window", "msg/s", "kbit/s", "ack ms", "queued ms");
+    for (size_t w = 0; w < sizeof(windows); w++) {
+        const outbox_config cfg = { .max_inflight = windows[w], .retry_ms = 60000 };
+        sim_link l;
+        outbox ob;
+        uint32_t seq = 0;
+
+        sim_init(&l, rtt_ms, kbit_s);
+        outbox_init(&ob, &cfg, s_arena, SWEEP_ARENA);
+        while (seq < count || outbox_pending(&ob) > 0) {
+            while (seq < count && outbox_room(&ob, strlen(TOPIC), len)) {
+                outbox_push(&ob, TOPIC, payload, make_payload(payload, seq++, len), l.now_us);
+            }
+            outbox_pump(&ob, l.now_us, sim_send, &l);
+            if (l.n_acks == 0) {
+                break;
+            }
+            sim_advance(&l, &ob, INT64_MAX);
+        }
+        outbox_pump(&ob, l.now_us, sim_send, &l);
+        double s = l.now_us / 1e6;
+        printf("%6u %10.1f %10.1f %12.1f %12.1f\n", windows[w], ob.stats.acked / s, ob.stats.acked * len * 8 / s / 1000,
+               l.ack_wait_us / 1000.0 / (l.acks_back ? l.acks_back : 1),
+               ob.stats.latency_sum_us / 1000.0 / (ob.stats.acked ? ob.stats.acked : 1));
+    }
+}
+
+//--------------------------------------------------------------------------------------
+// The same against a real broker, MQTT 3.1.1 over TCP with just what QoS 1 needs
+//--------------------------------------------------------------------------------------
+typedef struct broker {
+    int fd;
+    int next_id;
+    uint8_t rx[4096];
+    size_t rx_len;
+} broker;
+
+static int64_t wall_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static size_t put_length(uint8_t* p, size_t len)
+{
+    size_t n = 0;
+    do {
+        p[n] = (uint8_t)(len % 128);
+        len /= 128;
+        p[n] |= len ? 0x80 : 0;
+        n++;
+    } while (len);
+    return n;
+}
+
+static bool write_all(int fd, const uint8_t* p, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, 0);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static int broker_send(void* ctx, const char* topic, const uint8_t* data, size_t len)
+{
+    broker* b = ctx;
+    uint8_t hdr[8 + OUTBOX_TOPIC_MAX];
+    size_t topic_len = strlen(topic);
+    size_t n = 0;
+
+    b->next_id = b->next_id == 65535 ? 1 : b->next_id + 1;
+    hdr[n++] = 0x32;                    // PUBLISH, QoS 1
+    n += put_length(hdr + n, 2 + topic_len + 2 + len);
+    hdr[n++] = (uint8_t)(topic_len >> 8);
+    hdr[n++] = (uint8_t)topic_len;
+    memcpy(hdr + n, topic, topic_len);
+    n += topic_len;
+    hdr[n++] = (uint8_t)(b->next_id >> 8);
+    hdr[n++] = (uint8_t)b->next_id;
+    if (!write_all(b->fd, hdr, n) || !write_all(b->fd, data, len)) {
+        return -1;
+    }
+    return b->next_id;
+}
+
+// Reads what the broker sent within timeout_ms, PUBACKs go to the outbox.  -1 on a
+// closed connection.
+static int broker_read(broker* b, outbox* ob, int timeout_ms, bool* connack)
+{
+    struct pollfd pfd = { .fd = b->fd, .events = POLLIN };
+
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+        return 0;
+    }
+    ssize_t n = recv(b->fd, b->rx + b->rx_len, sizeof(b->rx) - b->rx_len, 0);
+    if (n <= 0) {
+        return -1;
+    }
+    b->rx_len += (size_t)n;
+    size_t at = 0;
+    while (b->rx_len - at >= 2) {
+        size_t len = 0, shift = 0, k = at + 1;
+        while (k < b->rx_len && (b->rx[k] & 0x80) && shift < 21) {
+            len |= (size_t)(b->rx[k++] & 0x7f) << shift;
+            shift += 7;
+        }
+        if (k >= b->rx_len) {
+            break;
+        }
+        len |= (size_t)(b->rx[k++] & 0x7f) << shift;
+        if (b->rx_len - k < len) {
+            break;
+        }
+        uint8_t type = b->rx[at] >> 4;
+        if (type == 4 && len >= 2 && ob != NULL) {
+            outbox_ack(ob, b->rx[k] << 8 | b->rx[k + 1]);
+        } else if (type == 2 && connack != NULL) {
+            *connack = len >= 2 && b->rx[k + 1] == 0;
+        }
+        at = k + len;
+    }
+    memmove(b->rx, b->rx + at, b->rx_len - at);
+    b->rx_len -= at;
+    return 1;
+}
+
+static int broker_connect(broker* b, const char* where)
+{
+    char host[128];
+    const char* port = "1883";
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *res;
+
+    snprintf(host, sizeof(host), "%s", where);
+    char* colon = strchr(host, ':');
+    if (colon) {
+        *colon = 0;
+        port = colon + 1;
+    }
+    memset(b, 0, sizeof(*b));
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        return -1;
+    }
+    b->fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (b->fd < 0 || connect(b->fd, res->ai_addr, res->ai_addrlen) != 0) {
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+    // One publish in flight would otherwise wait on the delayed ack every time
+    int one = 1;
+    setsockopt(b->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    static const uint8_t connect_pkt[] = {
+        0x10, 24, 0, 4, 'M', 'Q', 'T', 'T', 4, 0x02, 0, 60,         // Clean session, 60 s keepalive
+        0, 12, 'o', 'u', 't', 'b', 'o', 'x', '_', 'c', 'h', 'e', 'c', 'k',
+    };
+    bool connack = false;
+    if (!write_all(b->fd, connect_pkt, sizeof(connect_pkt))) {
+        return -1;
+    }
+    for (int i = 0; i < 50 && !connack; i++) {
+        if (broker_read(b, NULL, 100, &connack) < 0) {
+            return -1;
+        }
+    }
+    return connack ? 0 : -1;
+}
+
+static int sweep_broker(const char* where, uint32_t count, size_t len)
+{
+    static uint8_t payload[4096];
+    static const uint8_t windows[] = { 1, 2, 4, 8, 16, 32 };
+    broker b;
+
+    if (broker_connect(&b, where) != 0) {
+        printf("\ncannot connect to %s\n", where);
+        return 1;
+    }
+    printf("\nbroker %s, %u messages of %u bytes\n", where, count, (unsigned)len);
+    printf("%6s %10s %10s %12s %12s\n", "window", "msg/s", "kbit/s", "queued ms", "max ms");
+    for (size_t w = 0; w < sizeof(windows); w++) {
+        const outbox_config cfg = { .max_inflight = windows[w], .retry_ms = 10000 };
+        outbox ob;
+        uint32_t seq = 0;
+
+        outbox_init(&ob, &cfg, s_arena, SWEEP_ARENA);
+        int64_t start = wall_us();
+        while ((seq < count || outbox_pending(&ob) > 0) && wall_us() - start < 60000000) {
+            while (seq < count && outbox_room(&ob, strlen(TOPIC), len)) {
+                outbox_push(&ob, TOPIC, payload, make_payload(payload, seq++, len), wall_us());
+            }
+            outbox_pump(&ob, wall_us(), broker_send, &b);
+            if (broker_read(&b, &ob, 1000, NULL) < 0) {
+                printf("broker closed the connection\n");
+                close(b.fd);
+                return 1;
+            }
+        }
+        outbox_pump(&ob, wall_us(), broker_send, &b);
+        double s = (wall_us() - start) / 1e6;
+        printf("%6u %10.1f %10.1f %12.2f %12.2f%s\n", windows[w], ob.stats.acked / s,
+               ob.stats.acked * len * 8 / s / 1000, ob.stats.latency_sum_us / 1000.0 / (ob.stats.acked ? ob.stats.acked : 1),
+               ob.stats.latency_max_us / 1000.0, ob.stats.acked < count ? "   timed out" : "");
+    }
+    static const uint8_t disconnect_pkt[] = { 0xe0, 0 };
+    write_all(b.fd, disconnect_pkt, sizeof(disconnect_pkt));
+    close(b.fd);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    const char* broker_at = NULL;
+    uint32_t count = 2000;
+    size_t len = 256;
+    double rtt_ms = 80;
+    unsigned seed = 1;
+    int failures = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:n:l:r:s:")) != -1) {
+        switch (opt) {
+        case 'b': broker_at = optarg; break;
+        case 'n': count = (uint32_t)atoi(optarg); break;
+        case 'l': len = (size_t)atoi(optarg); break;
+        case 'r': rtt_ms = atof(optarg); break;
+        case 's': seed = (unsigned)atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-b host[:port]] [-n messages] [-l bytes] [-r rtt_ms] [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    len = len < 4 ? 4 : len > sizeof(s_arena) / 4 ? sizeof(s_arena) / 4 : len;
+    srand(seed);
+
+    printf("%-12s %3s %6s %6s %6s %8s %8s %8s %8s %8s %9s\n", "scenario", "win", "arena", "msgs", "high", "refused",
+           "retries", "dups", "unknown", "lost", "queued ms");
+    for (size_t i = 0; i < sizeof(SCENARIOS) / sizeof(SCENARIOS[0]); i++) {
+        failures += run(&SCENARIOS[i]);
+    }
+
+    if (broker_at) {
+        failures += sweep_broker(broker_at, count, len);
+    } else {
+        sweep_sim(count, len, rtt_ms, 1000);
+    }
+    return failures ? 1 : 0;
+}
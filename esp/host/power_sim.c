@@ -0,0 +1,218 @@
+/*
+*****************************************************************
+* power_sim.c - Battery Life Simulation For The Sleep Scheduler *
+*****************************************************************
+
+  Runs the sleep scheduler against a simulated clock and a current
+  trace (CSV of "seconds,irms" per line, or a synthetic day) with a
+  rough ESP32 current budget, and compares the average draw with
+  staying connected.  Reports how long pump starts take to be seen
+  with the radio up and whether any run was slept through.  Exits
+  non-zero if a buffered reading goes missing or a run at least
+  wake_s long is never seen.
+
+  usage: power_sim [-w wake_s] [-i idle_s] [-u upload_s] [-f upload_fill]
+                   [-b battery_mAh] [trace.csv]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "dizon_power.h"
+
+#define MAX_SECONDS (7 * 86400)
+
+// Rough budget for a dev board on battery
+#define SLEEP_MA    0.15        // Deep sleep plus the regulator and CT bias
+#define WAKE_MA     40.0        // Boot from deep sleep and one 1480 sample reading
+#define WAKE_S      0.3
+#define RADIO_MA    120.0       // Wi-Fi associated, sampling once a second
+#define CONNECT_S   4           // Association, DHCP, TLS and MQTT connect
+
+static float s_trace[MAX_SECONDS];
+static size_t s_len;
+
+// Pump runs as they are in the trace, and whether the device was awake for any of them
+typedef struct run_tracker {
+    uint32_t next;              // Next second of the trace to look at
+    bool in_run;
+    bool seen;                  // Awake for at least one second of the current run
+    bool reported;              // and has been connected since it started
+    uint32_t start;
+    uint32_t runs;
+    uint32_t missed;
+    uint32_t missed_long;       // Missed runs of at least wake_s
+    double latency_sum;
+    double latency_max;
+} run_tracker;
+
+static run_tracker s_runs;
+
+// Walk the trace up to and including t, the device was asleep before t
+static void track(const power_config* cfg, uint32_t t, bool connected)
+{
+    run_tracker* r = &s_runs;
+    for (; r->next <= t && r->next < s_len; r->next++) {
+        float irms = s_trace[r->next];
+        if (irms >= cfg->on_amps && !r->in_run) {
+            r->in_run = true;
+            r->seen = r->reported = false;
+            r->start = r->next;
+            r->runs++;
+        } else if (irms <= cfg->off_amps && r->in_run) {
+            r->in_run = false;
+            if (!r->seen) {
+                r->missed++;
+                r->missed_long += r->next - r->start >= cfg->wake_s;
+            }
+        }
+    }
+    if (r->in_run) {
+        r->seen = true;
+        if (connected && !r->reported) {
+            double latency = t - r->start;
+            r->latency_sum += latency;
+            r->latency_max = latency > r->latency_max ? latency : r->latency_max;
+            r->reported = true;
+        }
+    }
+}
+
+// One reading a second: idle for hours, a wet spell with regular runs, then short cycling
+static void synthetic(void)
+{
+    srand(1);
+    s_len = 86400;
+    for (size_t t = 0; t < s_len; t++) {
+        int hour = (int)(t / 3600);
+        int period = hour >= 12 && hour < 14 ? 150 : 600;
+        int run = hour >= 12 && hour < 14 ? 20 : 45;
+        bool wet = hour >= 6 && hour < 14;
+        float noise = (rand() % 100) / 1000.0f;
+        s_trace[t] = wet && (t % period) < (size_t)run ? 6.0f + noise * 5 : 0.02f + noise;
+    }
+}
+
+static int load(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    char line[128];
+    double t;
+    float irms, last = 0;
+
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%lf,%f", &t, &irms) != 2 || t < 0 || t >= MAX_SECONDS) {
+            continue;
+        }
+        // Hold the last value over gaps in the trace
+        for (; s_len < (size_t)t; s_len++) {
+            s_trace[s_len] = last;
+        }
+        s_trace[s_len++] = last = irms;
+    }
+    fclose(f);
+    return s_len ? 0 : -1;
+}
+
+int main(int argc, char** argv)
+{
+    power_config cfg = {
+        .on_amps = 1.0f,
+        .off_amps = 0.5f,
+        .wake_s = 30,
+        .idle_s = 60,
+        .upload_s = 3600,
+        .upload_fill = 120,
+    };
+    double battery = 2000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w:i:u:f:b:")) != -1) {
+        switch (opt) {
+        case 'w': cfg.wake_s = atoi(optarg); break;
+        case 'i': cfg.idle_s = atoi(optarg); break;
+        case 'u': cfg.upload_s = atoi(optarg); break;
+        case 'f': cfg.upload_fill = atoi(optarg); break;
+        case 'b': battery = atof(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-w wake_s] [-i idle_s] [-u upload_s] [-f upload_fill] "
+                    "[-b battery_mAh] [trace.csv]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (power_check_config(&cfg) != 0) {
+        fprintf(stderr, "bad scheduler config\n");
+        return 1;
+    }
+    if (optind < argc ? load(argv[optind]) != 0 : (synthetic(), 0)) {
+        return 1;
+    }
+
+    static power_state ps;
+    power_sample sent[POWER_BUFFER_SAMPLES];
+    double mas = 0, radio_s = 0;        // mA seconds, seconds with the radio up
+    uint64_t delivered = 0;
+    uint32_t t = 0, connected_at = 0, sleep_s;
+    bool radio = true;
+
+    power_init(&ps, 0);
+    connected_at = CONNECT_S;
+    while (t < s_len) {
+        float irms = s_trace[t];
+        track(&cfg, t, radio && t >= connected_at);
+        if (radio && t >= connected_at && power_pending(&ps)) {
+            size_t n = power_peek(&ps, sent, POWER_BUFFER_SAMPLES);
+            power_sent(&ps, n, t);
+            delivered += n;
+        }
+
+        power_action a = power_decide(&ps, &cfg, t, irms, &sleep_s);
+
+        if (a == POWER_SLEEP) {
+            if (radio && t < connected_at && power_pending(&ps)) {
+                power_sent(&ps, 0, t);
+            }
+            radio = false;
+            mas += sleep_s * SLEEP_MA + WAKE_S * WAKE_MA;
+            t += sleep_s;
+        } else {
+            if (!radio) {
+                radio = true;
+                connected_at = t + CONNECT_S;
+            }
+            mas += RADIO_MA;
+            radio_s += 1;
+            t += 1;
+        }
+    }
+
+    double hours = s_len / 3600.0;
+    double avg_ma = mas / s_len;
+    printf("%.1f h simulated, wake %u s, idle %u s, upload every %u s or %u readings\n",
+           hours, cfg.wake_s, cfg.idle_s, cfg.upload_s, cfg.upload_fill);
+    power_print(&ps);
+    printf("radio up %.1f%% of the time, average %.2f mA against %.0f mA connected\n",
+           100 * radio_s / s_len, avg_ma, RADIO_MA);
+    printf("%.0f mAh lasts %.1f days duty cycling, %.1f days connected\n",
+           battery, battery / avg_ma / 24, battery / RADIO_MA / 24);
+    uint32_t seen = s_runs.runs - s_runs.missed;
+    printf("%u pump runs, seen with the radio up after %.1f s on average, %.0f s worst, %u slept through\n",
+           s_runs.runs, seen ? s_runs.latency_sum / seen : 0.0, s_runs.latency_max, s_runs.missed);
+
+    // Every reading taken while duty cycling is buffered once
+    int failures = 0;
+    if (ps.wakes != delivered + ps.overflows + power_pending(&ps)) {
+        printf("%u buffered, %llu delivered, %u overwritten, %zu pending do not add up\n",
+               ps.wakes, (unsigned long long)delivered, ps.overflows, power_pending(&ps));
+        failures++;
+    }
+    if (s_runs.missed_long) {
+        printf("%u runs of at least wake_s were slept through\n", s_runs.missed_long);
+        failures++;
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,238 @@
+/*
+*****************************************************************
+* pump_replay.c - Replay Current Traces Through The Detector    *
+*****************************************************************
+
+  Feeds a recorded trace (CSV of "seconds,irms" per line, as pulled
+  from the telemetry table) or a synthetic one through the pump
+  run-cycle detector and prints the events it would have published,
+  and through the deadband to count the readings report-by-exception
+  would still send.
+
+  usage: pump_replay [-o on_amps] [-f off_amps] [-d debounce_ms] [-r max_run_s]
+                     [-c max_cycles_per_hour] [-S summary_s]
+                     [-a deadband_mA] [-p deadband_percent] [-H heartbeat_s] [trace.csv]
+  With no trace file it runs synthetic scenarios instead: normal
+  cycling, a short cycling spell and a stuck float.  Each one checks
+  the starts, the length of every run and the alarms raised and
+  cleared against what was generated, with the default detector
+  settings, and the exit status is non-zero on a mismatch.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "dizon_pump.h"
+#include "dizon_deadband.h"
+
+static const pump_config DEFAULTS = {
+    .on_amps = 1.0f,
+    .off_amps = 0.5f,
+    .debounce_ms = 2000,
+    .max_run_s = 600,
+    .max_cycles_per_hour = 12,
+    .summary_s = 3600,
+};
+
+static uint64_t s_records;
+static uint64_t s_events;
+static uint32_t s_starts;
+static deadband s_deadband;
+
+// What a synthetic scenario produced, the runs checked as they stop
+typedef struct tally {
+    uint32_t run_s;             // Length of the runs being generated, 0 for a trace
+    uint32_t want_run_s;        // of the run in progress
+    uint32_t starts;
+    uint32_t raised[3];         // Indexed by pump_alarm
+    uint32_t cleared[3];
+    uint32_t bad_runs;
+} tally;
+
+static tally s_tally;
+
+static void feed(pump_detector* det, double t_s, float irms)
+{
+    pump_event ev[PUMP_MAX_EVENTS];
+    uint32_t held;
+    deadband_check(&s_deadband, irms, (int64_t)(t_s * 1e6), &held);
+    int n = pump_update(det, (int64_t)(t_s * 1e6), irms, ev);
+    s_records++;
+    for (int i = 0; i < n; i++) {
+        s_events++;
+        printf("%10.1f  %-11s", ev[i].t_us / 1e6, pump_event_name(ev[i].type));
+        switch (ev[i].type) {
+        case PUMP_EVENT_START:
+            printf(" %.2f A  %u/h\n", ev[i].amps, ev[i].cycles_per_hour);
+            s_starts++;
+            s_tally.starts++;
+            s_tally.want_run_s = s_tally.run_s;
+            break;
+        case PUMP_EVENT_STOP:
+            printf(" ran %.1f s  peak %.2f A  %u/h\n", ev[i].run_ms / 1e3, ev[i].amps, ev[i].cycles_per_hour);
+            if (s_tally.want_run_s && ev[i].run_ms != s_tally.want_run_s * 1000) {
+                printf("            expected a %u s run\n", s_tally.want_run_s);
+                s_tally.bad_runs++;
+            }
+            break;
+        case PUMP_EVENT_SUMMARY:
+            printf(" duty %.1f%%  starts %u  %u/h  %s\n", 100 * ev[i].duty, ev[i].starts,
+                   ev[i].cycles_per_hour, ev[i].running ? "running" : "idle");
+            break;
+        case PUMP_EVENT_ALARM:
+        case PUMP_EVENT_ALARM_CLEAR:
+            printf(" %s  run %.1f s  %u/h\n", pump_alarm_name(ev[i].alarm), ev[i].run_ms / 1e3,
+                   ev[i].cycles_per_hour);
+            if (ev[i].type == PUMP_EVENT_ALARM) {
+                s_tally.raised[ev[i].alarm]++;
+            } else {
+                s_tally.cleared[ev[i].alarm]++;
+            }
+            break;
+        }
+    }
+}
+
+// Whole periods of run_s seconds on, then off
+typedef struct phase {
+    uint32_t duration_s;
+    uint32_t period_s;
+    uint32_t run_s;
+} phase;
+
+#define MAX_PHASES 3
+
+typedef struct scenario {
+    const char* name;
+    phase phases[MAX_PHASES];   // Up to the first with no duration
+    uint32_t starts;
+    uint32_t raised[3];         // Alarms raised and cleared, indexed by pump_alarm
+    uint32_t cleared[3];
+} scenario;
+
+static const scenario SCENARIOS[] = {
+    { "normal cycling", { { 6 * 3600, 600, 45 } }, 36, { 0 }, { 0 } },
+    // 24 starts an hour for two hours, cleared an hour into normal cycling
+    { "short cycling", { { 2 * 3600, 150, 20 }, { 2 * 3600, 600, 45 } }, 60,
+      { [PUMP_ALARM_CYCLE_RATE] = 1 }, { [PUMP_ALARM_CYCLE_RATE] = 1 } },
+    // The float sticks and the pump runs half an hour, past max_run_s
+    { "stuck float", { { 3600, 600, 45 }, { 3600, 3600, 1800 }, { 3600, 600, 45 } }, 13,
+      { [PUMP_ALARM_RUN_TIME] = 1 }, { [PUMP_ALARM_RUN_TIME] = 1 } },
+};
+
+// One reading a second: idle noise floor around 0.05 A, the pump draws about 6 A
+static int run_scenario(const scenario* sc, double* t)
+{
+    pump_detector det;
+    int failures = 0;
+
+    printf("%s\n", sc->name);
+    pump_init(&det, &DEFAULTS);
+    s_tally = (tally){ 0 };
+    for (int p = 0; p < MAX_PHASES && sc->phases[p].duration_s; p++) {
+        const phase* ph = &sc->phases[p];
+        s_tally.run_s = ph->run_s;
+        for (uint32_t s = 0; s < ph->duration_s; s++, *t += 1) {
+            float noise = (rand() % 100) / 1000.0f;
+            bool on = (s % ph->period_s) < ph->run_s;
+            float irms = on ? 6.0f + noise * 5 : 0.02f + noise;
+            if (on && (s % ph->period_s) == 0) {
+                irms = 18.0f;                                   // Inrush
+            }
+            feed(&det, *t, irms);
+        }
+    }
+
+    if (s_tally.starts != sc->starts) {
+        printf("%s: %u starts, expected %u\n", sc->name, s_tally.starts, sc->starts);
+        failures++;
+    }
+    if (s_tally.bad_runs) {
+        printf("%s: %u runs of the wrong length\n", sc->name, s_tally.bad_runs);
+        failures++;
+    }
+    for (int a = PUMP_ALARM_RUN_TIME; a <= PUMP_ALARM_CYCLE_RATE; a++) {
+        if (s_tally.raised[a] != sc->raised[a] || s_tally.cleared[a] != sc->cleared[a]) {
+            printf("%s: %s alarm raised %u and cleared %u times, expected %u and %u\n", sc->name,
+                   pump_alarm_name((pump_alarm)a), s_tally.raised[a], s_tally.cleared[a], sc->raised[a],
+                   sc->cleared[a]);
+            failures++;
+        }
+    }
+    printf("%s: %s\n\n", sc->name, failures ? "FAILED" : "ok");
+    return failures;
+}
+
+int main(int argc, char** argv)
+{
+    pump_config cfg = DEFAULTS;
+    deadband_config db_cfg = {
+        .abs_amps = 0.1f,
+        .rel = 0.05f,
+        .heartbeat_s = 300,
+    };
+    int opt, failures = 0;
+
+    while ((opt = getopt(argc, argv, "o:f:d:r:c:S:a:p:H:")) != -1) {
+        switch (opt) {
+        case 'o': cfg.on_amps = atof(optarg); break;
+        case 'f': cfg.off_amps = atof(optarg); break;
+        case 'd': cfg.debounce_ms = atoi(optarg); break;
+        case 'r': cfg.max_run_s = atoi(optarg); break;
+        case 'c': cfg.max_cycles_per_hour = atoi(optarg); break;
+        case 'S': cfg.summary_s = atoi(optarg); break;
+        case 'a': db_cfg.abs_amps = atof(optarg) / 1000; break;
+        case 'p': db_cfg.rel = atof(optarg) / 100; break;
+        case 'H': db_cfg.heartbeat_s = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-o on] [-f off] [-d debounce_ms] [-r max_run_s] "
+                    "[-c max_cycles_per_hour] [-S summary_s] [-a deadband_mA] [-p deadband_percent] "
+                    "[-H heartbeat_s] [trace.csv]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    pump_detector det;
+    if (pump_init(&det, &cfg) != 0) {
+        fprintf(stderr, "off threshold must be below the on threshold\n");
+        return 1;
+    }
+    if (deadband_init(&s_deadband, &db_cfg) != 0) {
+        fprintf(stderr, "deadband widths must not be negative\n");
+        return 1;
+    }
+
+    if (optind < argc) {
+        FILE* f = fopen(argv[optind], "r");
+        char line[128];
+        double t;
+        float irms;
+        if (f == NULL) {
+            perror(argv[optind]);
+            return 1;
+        }
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "%lf,%f", &t, &irms) == 2) {
+                feed(&det, t, irms);
+            }
+        }
+        fclose(f);
+    } else {
+        double t = 0;
+        srand(1);
+        for (size_t i = 0; i < sizeof(SCENARIOS) / sizeof(SCENARIOS[0]); i++) {
+            failures += run_scenario(&SCENARIOS[i], &t);
+        }
+    }
+
+    printf("\n%llu readings in, %llu events out (%.0f:1), %u starts\n",
+           (unsigned long long)s_records, (unsigned long long)s_events,
+           s_events ? (double)s_records / s_events : 0.0, s_starts);
+    printf("deadband %.0f mA / %.0f%%, heartbeat %u s: %u readings sent (%.1f%%), %u heartbeats\n",
+           db_cfg.abs_amps * 1000, db_cfg.rel * 100, db_cfg.heartbeat_s, s_deadband.passed,
+           s_records ? 100.0 * s_deadband.passed / s_records : 0.0, s_deadband.heartbeats);
+    if (failures) {
+        printf("%d failures\n", failures);
+    }
+    return failures ? 1 : 0;
+}
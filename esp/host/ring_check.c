@@ -0,0 +1,256 @@
+/*
+*****************************************************************
+* ring_check.c - Record Ring Across Two Threads                 *
+*****************************************************************
+
+  First a few pushes and pops on one thread, to pin down
+  high_water and the overflow count on a full ring.  Then one
+  thread pushes millions of numbered records while another pops
+  them.  Both stall now and then, so the ring runs both empty and
+  full.  On a full ring the producer mostly yields and tries the
+  same record again, and sometimes drops it like the sampling task
+  does.  Every record popped must carry the payload its number
+  gives, come after the one before it, and only skip the numbers
+  the producer dropped.  At the end every push the ring refused is
+  an overflow, every record is pushed or dropped, every one pushed
+  is popped, and high_water is at least the most the consumer ever
+  saw waiting and at most the capacity.  Exits non-zero on a
+  mismatch.
+
+  usage: ring_check [-n records] [-c capacity] [-s seed]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include "dizon_ring.h"
+
+#define MAX_CAPACITY    4096
+#define STALL_ONE_IN    4096            // Records between stalls, on average
+#define STALL_SPINS     20000
+#define DROP_ONE_IN     4               // Refused pushes given up on, the rest are retried
+
+static sump_record s_slots[MAX_CAPACITY];
+static record_ring s_ring;
+static uint32_t s_records;
+static volatile int s_producing;
+
+static uint32_t xorshift(uint32_t* x)
+{
+    *x ^= *x << 13;                 // rand() takes a lock
+    *x ^= *x >> 17;
+    *x ^= *x << 5;
+    return *x;
+}
+
+// Every byte follows from seq, so a torn or stale slot shows whatever the record holds
+static void make_record(uint32_t seq, sump_record* rec)
+{
+    uint8_t* p = (uint8_t*)rec;
+    uint32_t x = (seq * 2654435761u) | 1;
+    for (size_t i = 0; i < sizeof(*rec); i++) {
+        p[i] = (uint8_t)xorshift(&x);
+    }
+    rec->seq = seq;
+}
+
+static bool intact(const sump_record* rec)
+{
+    sump_record want;
+    make_record(rec->seq, &want);
+    return memcmp(rec, &want, sizeof(want)) == 0;
+}
+
+static void stall(uint32_t* x)
+{
+    if (xorshift(x) % STALL_ONE_IN == 0) {
+        for (volatile int i = 0; i < STALL_SPINS; i++) {
+        }
+    }
+}
+
+typedef struct side {
+    pthread_t thread;
+    uint32_t seed;
+    uint32_t count;                 // Pushed or popped
+    uint32_t refused;               // Producer: pushes the ring turned down
+    uint32_t dropped;               // Producer: records given up after a refused push
+    uint32_t skipped;               // Consumer: numbers never popped
+    uint32_t out_of_order;
+    uint32_t torn;
+    uint32_t most_waiting;          // Consumer: largest ring_count it saw
+} side;
+
+static void* produce(void* arg)
+{
+    side* p = arg;
+    sump_record rec;
+
+    for (uint32_t seq = 0; seq < s_records; seq++) {
+        bool pushed;
+        make_record(seq, &rec);
+        while (!(pushed = ring_push(&s_ring, &rec))) {
+            p->refused++;
+            if (xorshift(&p->seed) % DROP_ONE_IN == 0) {
+                p->dropped++;
+                break;
+            }
+            sched_yield();
+        }
+        p->count += pushed;
+        stall(&p->seed);
+    }
+    __atomic_store_n(&s_producing, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void* consume(void* arg)
+{
+    side* c = arg;
+    sump_record rec;
+    uint32_t next = 0;
+
+    for (;;) {
+        uint32_t waiting = ring_count(&s_ring);
+        c->most_waiting = waiting > c->most_waiting ? waiting : c->most_waiting;
+        if (!ring_pop(&s_ring, &rec)) {
+            // Only stop once the producer is done and the ring is empty behind it
+            if (!__atomic_load_n(&s_producing, __ATOMIC_ACQUIRE) && ring_count(&s_ring) == 0) {
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+        c->count++;
+        if (rec.seq < next) {
+            c->out_of_order++;
+        } else {
+            c->skipped += rec.seq - next;
+            next = rec.seq + 1;
+        }
+        c->torn += !intact(&rec);
+        stall(&c->seed);
+    }
+    c->skipped += s_records - next;
+    return NULL;
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int single_thread(uint32_t capacity)
+{
+    sump_record rec;
+    int failures = 0;
+
+    make_record(0, &rec);
+    ring_init(&s_ring, s_slots, capacity);
+    for (uint32_t i = 0; i < 3; i++) {
+        ring_push(&s_ring, &rec);
+    }
+    for (uint32_t i = 0; i < 3; i++) {
+        ring_pop(&s_ring, &rec);
+    }
+    ring_push(&s_ring, &rec);
+    if (s_ring.high_water != 3) {
+        printf("high_water %u after 3 waiting, then 1\n", s_ring.high_water);
+        failures++;
+    }
+
+    for (uint32_t i = 1; i < capacity; i++) {
+        ring_push(&s_ring, &rec);
+    }
+    if (ring_push(&s_ring, &rec) || s_ring.overflows != 1 || s_ring.high_water != capacity) {
+        printf("Full ring: %u overflows, high_water %u of %u\n", s_ring.overflows, s_ring.high_water, capacity);
+        failures++;
+    }
+    if (ring_init(&s_ring, s_slots, 0) == 0 || ring_init(&s_ring, s_slots, 1) == 0 ||
+        ring_init(&s_ring, s_slots, 3) == 0 || ring_init(&s_ring, NULL, capacity) == 0) {
+        printf("ring_init took a capacity that is not a power of two, or no slots\n");
+        failures++;
+    }
+    return failures;
+}
+
+static int two_threads(uint32_t capacity, uint32_t seed)
+{
+    side p = { .seed = seed | 1 }, c = { .seed = (seed * 2654435761u) | 1 };
+    int failures = 0;
+
+    ring_init(&s_ring, s_slots, capacity);
+    s_producing = 1;
+    double start = now_s();
+    pthread_create(&c.thread, NULL, consume, &c);
+    pthread_create(&p.thread, NULL, produce, &p);
+    pthread_join(p.thread, NULL);
+    pthread_join(c.thread, NULL);
+    double elapsed = now_s() - start;
+
+    printf("%u records through %u slots in %.2f s: %u pushed, %u popped, %u overflows, %u dropped, "
+           "high_water %u\n", s_records, capacity, elapsed, s_ring.pushed, s_ring.popped, s_ring.overflows,
+           p.dropped, s_ring.high_water);
+    if (c.out_of_order || c.torn) {
+        printf("%u records out of order, %u with a payload that does not match their number\n",
+               c.out_of_order, c.torn);
+        failures++;
+    }
+    if (s_ring.pushed + p.dropped != s_records || s_ring.pushed != s_ring.popped) {
+        printf("%u records, %u pushed, %u dropped, %u popped\n", s_records, s_ring.pushed, p.dropped,
+               s_ring.popped);
+        failures++;
+    }
+    if (p.count != s_ring.pushed || p.refused != s_ring.overflows || c.count != s_ring.popped) {
+        printf("Producer saw %u pushed and %u refused, consumer %u popped\n", p.count, p.refused, c.count);
+        failures++;
+    }
+    if (c.skipped != p.dropped) {
+        printf("%u numbers never popped, %u dropped\n", c.skipped, p.dropped);
+        failures++;
+    }
+    if (s_ring.high_water > capacity || s_ring.high_water < c.most_waiting || s_ring.high_water == 0 ||
+        (s_ring.overflows && s_ring.high_water != capacity)) {
+        printf("high_water %u, consumer saw up to %u waiting, capacity %u\n", s_ring.high_water,
+               c.most_waiting, capacity);
+        failures++;
+    }
+    return failures;
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t capacity = 64;
+    unsigned seed = 1;
+    int opt;
+
+    s_records = 4000000;
+    while ((opt = getopt(argc, argv, "n:c:s:")) != -1) {
+        switch (opt) {
+        case 'n': s_records = (uint32_t)atol(optarg); break;
+        case 'c': capacity = (uint32_t)atoi(optarg); break;
+        case 's': seed = (unsigned)atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n records] [-c capacity] [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (capacity < 4 || capacity > MAX_CAPACITY || (capacity & (capacity - 1)) != 0) {
+        fprintf(stderr, "capacity must be a power of two from 4 to %d\n", MAX_CAPACITY);
+        return 1;
+    }
+
+    int failures = single_thread(capacity) + two_threads(capacity, seed);
+    if (failures) {
+        printf("%d failures\n", failures);
+    } else {
+        printf("Ring ok\n");
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,395 @@
+/*
+*****************************************************************
+* rollup_check.c - Rollups Against Sums Over The Raw Readings   *
+*****************************************************************
+
+  Feeds days of one second readings with jitter, pump runs, level
+  drop outs, late and repeated readings, a run across a long gap
+  and a few hours with the device off, into the rollups, and keeps
+  the same minutes, hours and days the slow way from the raw
+  readings alongside.  Run time is counted a millisecond at a time
+  on that side.  Every so often the state is copied somewhere else
+  and carried on from there, as a soft reset does with RTC memory,
+  and every closed hour is sealed and kept as the NVS copy.  At the
+  end every bucket left in every ring, and the open ones, must
+  match, down to float rounding in the sums.
+
+  Then the last NVS copy is restored, as after a power cut, and
+  must hold the hours up to it and take readings again from where
+  it stopped; damaged copies and one caught mid update must be
+  refused.  Exits non-zero on a mismatch.
+
+  usage: rollup_check [-s seed] [-d days]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "dizon_rollup.h"
+
+#define MAX_DAYS        30
+#define START_MS        1700000000137LL     // 2023-11-14T22:13:20.137Z, off every boundary
+#define PUMP_PERIOD_S   431                 // A run every 7 minutes or so, 47 s long
+#define PUMP_RUN_S      47
+#define OFF_AT_S        (29 * 3600 + 1234)  // Device off for three hours from here
+#define OFF_S           (3 * 3600 + 77)
+#define GAP_AT_S        (40 * 3600 + 20)    // A 25 s hole in the readings in the middle of a run
+#define GAP_S           25
+
+typedef struct ref_bucket {
+    uint32_t count;
+    uint32_t level_count;
+    uint32_t on_ms;
+    uint16_t starts;
+    double irms_min, irms_max, irms_sum, irms_sumsq;
+    double level_min, level_max, level_sum, level_sumsq;
+} ref_bucket;
+
+typedef struct reference {
+    uint32_t base;                          // Start of bucket 0, per level
+    size_t size;
+    ref_bucket* b;
+} reference;
+
+static reference s_ref[ROLLUP_LEVELS];
+static rollup s_a, s_b;                     // Live state, moved from one to the other on a reset
+static rollup s_nvs;
+static int s_failures;
+
+static void ref_init(int days)
+{
+    for (int l = 0; l < ROLLUP_LEVELS; l++) {
+        uint32_t w = rollup_seconds((rollup_level)l);
+        s_ref[l].base = (uint32_t)(START_MS / 1000) - (uint32_t)(START_MS / 1000) % w;
+        s_ref[l].size = (size_t)days * 86400 / w + 2;
+        s_ref[l].b = calloc(s_ref[l].size, sizeof(ref_bucket));
+    }
+}
+
+static ref_bucket* ref_at(int l, int64_t ms)
+{
+    return &s_ref[l].b[((uint32_t)(ms / 1000) - s_ref[l].base) / rollup_seconds((rollup_level)l)];
+}
+
+static bool ref_empty(const ref_bucket* b)
+{
+    return b->count == 0 && b->on_ms == 0 && b->starts == 0;
+}
+
+static void ref_add(int64_t ms, const sump_record* rec, bool running, int64_t last_ms, bool was_running)
+{
+    if (was_running && last_ms > 0) {
+        int64_t end = ms - last_ms < ROLLUP_MAX_GAP_MS ? ms : last_ms + ROLLUP_MAX_GAP_MS;
+        for (int64_t m = last_ms; m < end; m++) {
+            for (int l = 0; l < ROLLUP_LEVELS; l++) {
+                ref_at(l, m)->on_ms++;
+            }
+        }
+    }
+    for (int l = 0; l < ROLLUP_LEVELS; l++) {
+        ref_bucket* b = ref_at(l, ms);
+        if (b->count == 0) {
+            b->irms_min = b->irms_max = rec->irms;
+        }
+        b->count++;
+        b->irms_min = fmin(b->irms_min, rec->irms);
+        b->irms_max = fmax(b->irms_max, rec->irms);
+        b->irms_sum += rec->irms;
+        b->irms_sumsq += (double)rec->irms * rec->irms;
+        if (rec->has_level) {
+            if (b->level_count == 0) {
+                b->level_min = b->level_max = rec->level_cm;
+            }
+            b->level_count++;
+            b->level_min = fmin(b->level_min, rec->level_cm);
+            b->level_max = fmax(b->level_max, rec->level_cm);
+            b->level_sum += rec->level_cm;
+            b->level_sumsq += (double)rec->level_cm * rec->level_cm;
+        }
+        if (running && !was_running) {
+            b->starts++;
+        }
+    }
+}
+
+static bool near(double got, double want)
+{
+    return fabs(got - want) <= 1e-6 * fabs(want) + 1e-6;
+}
+
+static int compare(const char* what, const char* level, const rollup_bucket* got, const ref_bucket* want)
+{
+    double irms_min = want->count ? want->irms_min : 0, irms_max = want->count ? want->irms_max : 0;
+    double level_min = want->level_count ? want->level_min : 0;
+    double level_max = want->level_count ? want->level_max : 0;
+
+    if (got->count != want->count || got->level_count != want->level_count || got->on_ms != want->on_ms ||
+        got->starts != want->starts || got->irms.min != irms_min || got->irms.max != irms_max ||
+        !near(got->irms.sum, want->irms_sum) || !near(got->irms.sumsq, want->irms_sumsq) ||
+        got->level.min != level_min || got->level.max != level_max ||
+        !near(got->level.sum, want->level_sum) || !near(got->level.sumsq, want->level_sumsq)) {
+        printf("%s %s at %u: n %u/%u level n %u/%u on %u/%u ms starts %u/%u Irms %g..%g sum %g/%g, "
+               "level %g..%g sum %g/%g\n", what, level, got->start, got->count, want->count,
+               got->level_count, want->level_count, got->on_ms, want->on_ms, got->starts, want->starts,
+               got->irms.min, got->irms.max, got->irms.sum, want->irms_sum, got->level.min, got->level.max,
+               got->level.sum, want->level_sum);
+        return 1;
+    }
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------
+// Every ring holds the last buckets with anything in them before the open one, in order
+//--------------------------------------------------------------------------------------
+static int check_rings(const char* what, const rollup* r, bool check_open)
+{
+    int failures = 0;
+
+    for (int l = 0; l < ROLLUP_LEVELS; l++) {
+        rollup_level level = (rollup_level)l;
+        const char* name = rollup_level_name(level);
+        uint32_t w = rollup_seconds(level);
+        rollup_bucket open;
+        size_t n = rollup_count(r, level);
+
+        if (!rollup_current(r, level, &open)) {
+            printf("%s: no open %s\n", what, name);
+            return failures + 1;
+        }
+        size_t at = (open.start - s_ref[l].base) / w;
+        if (check_open) {
+            failures += compare(what, name, &open, &s_ref[l].b[at]);
+        }
+        size_t expect = 0;
+        for (size_t k = at; k-- > 0 && expect < rollup_capacity(level);) {
+            if (ref_empty(&s_ref[l].b[k])) {
+                continue;
+            }
+            expect++;
+            const rollup_bucket* b = rollup_get(r, level, n - expect);
+            if (b == NULL || b->start != s_ref[l].base + k * w) {
+                printf("%s: %s %zu back should start at %u, is %u\n", what, name, expect,
+                       (unsigned)(s_ref[l].base + k * w), b ? b->start : 0);
+                failures++;
+                break;
+            }
+            failures += compare(what, name, b, &s_ref[l].b[k]);
+        }
+        if (n != expect) {
+            printf("%s: %zu %ss kept, %zu expected\n", what, n, name, expect);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+static int boundary_split(void)
+{
+    rollup r;
+    sump_record rec = { 0 };
+    const rollup_bucket* b;
+    int failures = 0;
+
+    // 23:59:58.500 running, then 00:00:03.500 the next day: 1.5 s before midnight and 3.5 after
+    rollup_init(&r);
+    rec.irms = 6;
+    rec.epoch_us = (1700006400LL - 2) * 1000000 + 500000;
+    rollup_add(&r, &rec, true);
+    rec.epoch_us += 5000000;
+    unsigned closed = rollup_add(&r, &rec, true);
+    if (closed != ROLLUP_ALL) {
+        printf("Midnight closed levels %#x\n", closed);
+        failures++;
+    }
+    for (int l = 0; l < ROLLUP_LEVELS; l++) {
+        rollup_bucket open;
+        b = rollup_get(&r, (rollup_level)l, 0);
+        rollup_current(&r, (rollup_level)l, &open);
+        if (b == NULL || b->on_ms != 1500 || b->starts != 1 || open.on_ms != 3500 || open.starts != 0) {
+            printf("Across midnight, %s: %u ms and %u starts before, %u ms and %u after\n",
+                   rollup_level_name((rollup_level)l), b ? b->on_ms : 0, b ? b->starts : 0, open.on_ms,
+                   open.starts);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+static sump_record reading(int64_t ms, uint32_t k, bool* running)
+{
+    sump_record rec = { 0 };
+    uint32_t s = (uint32_t)(ms / 1000);
+    uint32_t phase = s % PUMP_PERIOD_S;
+
+    *running = phase < PUMP_RUN_S;
+    rec.epoch_us = ms * 1000;
+    rec.irms = *running ? 6.5f + 0.3f * sinf(k * 0.1f) : 0.04f + 0.01f * (rand() % 5);
+    rec.has_level = k % 7 != 0;
+    rec.level_cm = *running ? 40.0f - 0.4f * phase : 21.2f + 0.05f * (phase - PUMP_RUN_S);
+    return rec;
+}
+
+static int run(int days)
+{
+    rollup* live = &s_a;
+    int64_t end_ms = START_MS + days * 86400000LL;
+    int64_t last_ms = 0;
+    bool was_running = false;
+    bool sealed = false;
+    uint32_t late = 0, resets = 0, checkpoints = 0;
+    int failures = 0;
+
+    rollup_init(live);
+    for (uint32_t k = 0; ; k++) {
+        int64_t t = (last_ms ? last_ms : START_MS) + 1000 + rand() % 81 - 40;
+        int64_t since = t - START_MS;
+        if (since >= OFF_AT_S * 1000LL && since < OFF_AT_S * 1000LL + 1100) {
+            t += OFF_S * 1000LL;
+        }
+        if (since >= GAP_AT_S * 1000LL && since < GAP_AT_S * 1000LL + 1100) {
+            t += GAP_S * 1000LL;
+        }
+        if (t >= end_ms) {
+            break;
+        }
+        bool running;
+        sump_record rec = reading(t, k, &running);
+
+        ref_add(t, &rec, running, last_ms, was_running);
+        unsigned closed = rollup_add(live, &rec, running);
+        last_ms = t;
+        was_running = running;
+
+        if (rand() % 500 == 0) {
+            // Queued twice, or from before a clock step
+            sump_record old = reading(t - 1 - rand() % 2000, k, &running);
+            rollup_add(live, &old, running);
+            late++;
+        }
+        if (closed & (1u << ROLLUP_HOUR)) {
+            rollup_seal(live);
+            s_nvs = *live;
+            sealed = true;
+            checkpoints++;
+        }
+        if (rand() % 20000 == 0) {
+            rollup* next = live == &s_a ? &s_b : &s_a;
+            *next = *live;
+            if (!rollup_valid(next)) {
+                printf("Copy refused after %u readings\n", k);
+                return failures + 1;
+            }
+            live = next;
+            resets++;
+        }
+    }
+    printf("%d days, %u soft resets, %u checkpoints, %u late readings\n", days, resets, checkpoints, late);
+    rollup_print(live);
+    failures += check_rings("Live", live, true);
+    if (live->late != late) {
+        printf("%u late readings counted, %u sent\n", live->late, late);
+        failures++;
+    }
+
+    if (!sealed || !rollup_intact(&s_nvs)) {
+        printf("No good checkpoint\n");
+        return failures + 1;
+    }
+    // Power cut: what is in NVS up to its last closed hour is all there is
+    rollup restored = s_nvs;
+    rollup_bucket open;
+    rollup_current(&restored, ROLLUP_HOUR, &open);
+    const rollup_bucket* hour = rollup_get(&restored, ROLLUP_HOUR, rollup_count(&restored, ROLLUP_HOUR) - 1);
+    uint32_t at = (hour->start - s_ref[ROLLUP_HOUR].base) / 3600;
+    failures += compare("Restored", "hour", hour, &s_ref[ROLLUP_HOUR].b[at]);
+    if (open.count != 1) {
+        printf("Restored open hour has %u readings, the one that closed the last should be alone\n", open.count);
+        failures++;
+    }
+    // A minute and a half on, the same hour
+    bool running;
+    sump_record rec = reading(restored.last_ms + 90000, 1, &running);
+    rollup_bucket minute;
+    rollup_add(&restored, &rec, running);
+    rollup_current(&restored, ROLLUP_MINUTE, &minute);
+    rollup_current(&restored, ROLLUP_HOUR, &open);
+    if (!rollup_valid(&restored) || minute.start != (uint32_t)(rec.epoch_us / 1000000) / 60 * 60 ||
+        minute.count != 1 || open.count != 2) {
+        printf("Restored copy did not carry on: minute at %u with %u readings, hour with %u\n",
+               minute.start, minute.count, open.count);
+        failures++;
+    }
+
+    rollup bad = s_nvs;
+    bad.slots[ROLLUP_MINUTES + 3].on_ms ^= 1;
+    if (rollup_intact(&bad)) {
+        printf("Damaged checkpoint taken\n");
+        failures++;
+    }
+    bad = s_nvs;
+    bad.updating = 1;
+    if (rollup_valid(&bad)) {
+        printf("State from the middle of an update taken\n");
+        failures++;
+    }
+    memset(&bad, 0xa5, sizeof(bad));
+    if (rollup_valid(&bad)) {
+        printf("Uninitialised RTC memory taken\n");
+        failures++;
+    }
+    return failures;
+}
+
+static int requests(void)
+{
+    static const struct { const char* text; int rc; unsigned levels; } cases[] = {
+        { "minute", 0, 1u << ROLLUP_MINUTE }, { " hour\n", 0, 1u << ROLLUP_HOUR }, { "day", 0, 1u << ROLLUP_DAY },
+        { "all", 0, ROLLUP_ALL }, { "hours", -1, 0 }, { "", -1, 0 }, { "min", -1, 0 },
+    };
+    int failures = 0;
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        unsigned levels = 0;
+        int rc = rollup_parse_request(cases[i].text, (int)strlen(cases[i].text), &levels);
+        if (rc != cases[i].rc || (rc == 0 && levels != cases[i].levels)) {
+            printf("Request \"%s\": %d, levels %#x\n", cases[i].text, rc, levels);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned seed = 1;
+    int days = 9;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:d:")) != -1) {
+        switch (opt) {
+        case 's': seed = (unsigned)atoi(optarg); break;
+        case 'd': days = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-s seed] [-d days]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (days < 2 || days > MAX_DAYS) {
+        fprintf(stderr, "days 2 to %d\n", MAX_DAYS);
+        return 1;
+    }
+    srand(seed);
+    printf("State %zu bytes\n", sizeof(rollup));
+    ref_init(days);
+    s_failures += boundary_split();
+    s_failures += requests();
+    s_failures += run(days);
+    if (s_failures) {
+        printf("%d failures\n", s_failures);
+    } else {
+        printf("All rollups match\n");
+    }
+    return s_failures ? 1 : 0;
+}
@@ -0,0 +1,255 @@
+/*
+*****************************************************************
+* sync_check.c - Cycle Synchronised Windows On Jittery Mains    *
+*****************************************************************
+
+  Samples synthetic mains at rates that are not a multiple of the
+  line frequency, off-nominal and 50 Hz lines, with gaussian noise,
+  a 3rd harmonic and jitter on the sampling instants like a polled
+  ADC has.  Runs emon_calcIrms over a fixed sample count next to
+  emon_calcIrms_cycles, emon_calcIrms_stream_cycles (double and
+  fixed point) and emon_calcVI, and prints the worst window error
+  against the analytic RMS and the worst line frequency error.
+  With the pump off it checks that the windows still end at the
+  timeout.  Exits non-zero if a synchronised window is off by more
+  than its tolerance, which the noise sets, or the frequency by
+  more than its own.
+
+  usage: sync_check [-c cycles] [-w windows] [-s seed]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "dizon_EmonLib.h"
+#include "dizon_adc_sim.h"
+#include "waveform.h"
+
+#define CURRENT_CHANNEL 6
+#define VOLTAGE_CHANNEL 7
+#define FIXED_SAMPLES   1480            // What the firmware used to take
+#define WARMUP_WINDOWS  40
+#define V_AMPLITUDE     1000.0
+#define TIMEOUT_MS      2000
+#define TOLERANCE_CYCLES 10             // The tolerances below are for windows this long
+
+static const double VCAL = 234.26;
+
+typedef struct mains {
+    const char* name;
+    double rate_hz;                 // Conversions per second
+    double line_hz;
+    double amplitude;               // Current peak in counts
+    double third;                   // 3rd harmonic relative to the fundamental
+    double noise;                   // RMS counts, on every conversion
+    double jitter_us;               // RMS, of each sampling instant around its slot
+    double max_err;                 // Of a synchronised window, relative
+    double hz_tolerance;
+} mains;
+
+static const mains MAINS[] = {
+    { "clean",       4937, 60.0,  600, 0,    0,   0,  0.0025, 0.01 },
+    { "50hz",        4937, 50.0,  600, 0,    0,   0,  0.0025, 0.01 },
+    { "off-nominal", 4937, 59.62, 600, 0,    0,   0,  0.0025, 0.01 },
+    { "noisy",       4937, 60.0,  600, 0,    6,   0,  0.005,  0.05 },
+    { "jittery",     4937, 60.0,  600, 0,    0,   25, 0.0025, 0.05 },
+    { "motor",       6000, 60.13, 600, 0.2,  4,   15, 0.005,  0.05 },
+    { "low",         4937, 60.0,  45,  0,    2.5, 15, 0.02,   0.3 },
+};
+
+//--------------------------------------------------------------------------------------
+// Provider: every read is a conversion at its own instant, in turn on whichever channel
+//--------------------------------------------------------------------------------------
+typedef struct line_provider {
+    const mains* m;
+    uint64_t k;
+    emon_sample_provider provider;
+} line_provider;
+
+static uint16_t clamp(double v)
+{
+    return v < 0 ? 0 : v > ADC_COUNTS - 1 ? ADC_COUNTS - 1 : (uint16_t)(v + 0.5);
+}
+
+static uint16_t current_at(const mains* m, double t)
+{
+    double w = 2 * M_PI * m->line_hz * t;
+    return clamp(ADC_COUNTS / 2 + m->amplitude * (sin(w + 0.4) + m->third * sin(3 * w + 1.1)) +
+                 m->noise * waveform_gaussian());
+}
+
+static uint16_t voltage_at(const mains* m, double t)
+{
+    return clamp(ADC_COUNTS / 2 + V_AMPLITUDE * sin(2 * M_PI * m->line_hz * t) + m->noise * waveform_gaussian());
+}
+
+static int line_read(void* ctx, int channel)
+{
+    line_provider* p = ctx;
+    double t = (p->k++ + p->m->jitter_us * 1e-6 * p->m->rate_hz * waveform_gaussian()) / p->m->rate_hz;
+    return channel == VOLTAGE_CHANNEL ? voltage_at(p->m, t) : current_at(p->m, t);
+}
+
+static int64_t line_micros(void* ctx)
+{
+    line_provider* p = ctx;
+    return (int64_t)(p->k * 1e6 / p->m->rate_hz);
+}
+
+// The DMA is clocked, no jitter on a stream
+static uint16_t line_generator(void* ctx, uint64_t n)
+{
+    line_provider* p = ctx;
+    return current_at(p->m, n / p->m->rate_hz);
+}
+
+static const emon_sample_provider* line_init(line_provider* p, const mains* m)
+{
+    p->m = m;
+    p->k = 0;
+    p->provider.ctx = p;
+    p->provider.setup = NULL;
+    p->provider.read = line_read;
+    p->provider.micros = line_micros;
+    return &p->provider;
+}
+
+typedef struct result {
+    double err;                     // Worst window, relative
+    double hz_err;                  // Worst, absolute
+} result;
+
+static void fold(result* r, double value, double analytic, double hz, double line_hz)
+{
+    double err = fabs(value - analytic) / analytic;
+    r->err = err > r->err ? err : r->err;
+    if (hz >= 0) {
+        r->hz_err = fabs(hz - line_hz) > r->hz_err ? fabs(hz - line_hz) : r->hz_err;
+    }
+}
+
+typedef enum { FIXED_COUNT, CYCLES, STREAM_CYCLES, VI } path;
+
+static void run(const mains* m, path how, emon_math math, unsigned cycles, unsigned windows, result* r)
+{
+    static adc_stream stream;
+    line_provider lp;
+    adc_sim sim;
+    energy_mon emon;
+    const double i_ratio = WAVE_ICAL * ((SUPPLY_VOLTAGE / 1000.0) / ADC_COUNTS);
+    const double v_ratio = VCAL * ((SUPPLY_VOLTAGE / 1000.0) / ADC_COUNTS);
+    const double irms = i_ratio * sqrt(m->amplitude * m->amplitude * (1 + m->third * m->third) / 2 +
+                                       m->noise * m->noise);
+    const double vrms = v_ratio * sqrt(V_AMPLITUDE * V_AMPLITUDE / 2 + m->noise * m->noise);
+
+    emon_init(&emon, line_init(&lp, m));
+    if (how == VI) {
+        emon_voltage(&emon, VOLTAGE_CHANNEL, VCAL, 1.0);
+    }
+    emon_current(&emon, CURRENT_CHANNEL, WAVE_ICAL);
+    emon_set_math(&emon, math);
+    if (how == STREAM_CYCLES) {
+        adc_stream_init(&stream, adc_sim_init(&sim, line_generator, &lp, 256), (uint32_t)m->rate_hz, 300);
+        adc_stream_start(&stream);
+    }
+    memset(r, 0, sizeof(*r));
+    for (unsigned w = 0; w < WARMUP_WINDOWS + windows; w++) {
+        double value;
+        switch (how) {
+        case FIXED_COUNT:
+            value = emon_calcIrms(&emon, FIXED_SAMPLES);
+            emon.frequency = -1;
+            break;
+        case CYCLES:
+            value = emon_calcIrms_cycles(&emon, cycles, TIMEOUT_MS);
+            break;
+        case STREAM_CYCLES:
+            value = emon_calcIrms_stream_cycles(&emon, &stream, cycles);
+            break;
+        case VI:
+        default:
+            emon_calcVI(&emon, 2 * cycles, TIMEOUT_MS);
+            value = emon.Vrms;
+            break;
+        }
+        if (w >= WARMUP_WINDOWS) {
+            fold(r, value, how == VI ? vrms : irms, emon.frequency, m->line_hz);
+            if (how == VI) {
+                fold(r, emon.Irms, irms, -1, 0);
+            }
+        }
+    }
+    if (how == STREAM_CYCLES) {
+        adc_stream_stop(&stream);
+    }
+}
+
+// No current: nothing crosses, the window ends at the timeout with the noise in it
+static int check_off(unsigned cycles)
+{
+    const mains off = { "off", 4937, 60.0, 0, 0, 2.0, 0, 0, 0 };
+    line_provider lp;
+    energy_mon emon;
+    int failures = 0;
+
+    emon_init(&emon, line_init(&lp, &off));
+    emon_current(&emon, CURRENT_CHANNEL, WAVE_ICAL);
+    for (unsigned w = 0; w < 3; w++) {
+        uint64_t k = lp.k;
+        double irms = emon_calcIrms_cycles(&emon, cycles, 100);
+        double ms = (lp.k - k) * 1000.0 / off.rate_hz;
+        if (emon.frequency != 0 || ms < 99 || ms > 102 || irms > 0.1) {
+            printf("off: window of %.1f ms at %.3f Hz reads %.3f A\n", ms, emon.frequency, irms);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned cycles = 10;
+    unsigned windows = 200;
+    unsigned seed = 1;
+    int failures = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:w:s:")) != -1) {
+        switch (opt) {
+        case 'c': cycles = (unsigned)atoi(optarg) ? (unsigned)atoi(optarg) : 1; break;
+        case 'w': windows = (unsigned)atoi(optarg); break;
+        case 's': seed = (unsigned)atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-c cycles] [-w windows] [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    srand(seed);
+
+    printf("worst window error over %u windows, worst line frequency error; %u samples against %u cycles\n\n",
+           windows, FIXED_SAMPLES, cycles);
+    printf("%-12s %6s %7s %10s %10s %10s %10s %10s %9s\n", "mains", "rate", "line", "samples", "cycles", "cycles-q",
+           "stream", "calcVI", "Hz err");
+    for (size_t i = 0; i < sizeof(MAINS) / sizeof(MAINS[0]); i++) {
+        const mains* m = &MAINS[i];
+        result fixed, cyc, cyc_q, stream, vi;
+        run(m, FIXED_COUNT, EMON_MATH_DOUBLE, cycles, windows, &fixed);
+        run(m, CYCLES, EMON_MATH_DOUBLE, cycles, windows, &cyc);
+        run(m, CYCLES, EMON_MATH_FIXED, cycles, windows, &cyc_q);
+        run(m, STREAM_CYCLES, EMON_MATH_DOUBLE, cycles, windows, &stream);
+        run(m, VI, EMON_MATH_DOUBLE, cycles, windows, &vi);
+
+        double hz = fmax(fmax(cyc.hz_err, cyc_q.hz_err), fmax(stream.hz_err, vi.hz_err));
+        // Noise averages out over the root of the window length, the frequency over all of it
+        double worst = fmax(fmax(cyc.err, cyc_q.err), fmax(stream.err, vi.err));
+        bool ok = worst <= m->max_err * sqrt((double)TOLERANCE_CYCLES / cycles) &&
+                  hz <= m->hz_tolerance * TOLERANCE_CYCLES / cycles;
+        printf("%-12s %6.0f %7.2f %9.3f%% %9.3f%% %9.3f%% %9.3f%% %9.3f%% %9.4f   %s\n", m->name, m->rate_hz,
+               m->line_hz, 100 * fixed.err, 100 * cyc.err, 100 * cyc_q.err, 100 * stream.err, 100 * vi.err, hz,
+               ok ? "ok" : "FAIL");
+        failures += !ok;
+    }
+    failures += check_off(cycles);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,218 @@
+/*
+*****************************************************************
+* timestamp_check.c - Epoch Rebasing Check For The Time Service *
+*****************************************************************
+
+  Runs the timestamp clock against a simulated esp_timer that runs
+  off by a fixed number of ppm.  The RTC seeds it a little wrong
+  at boot, SNTP corrects that with a step a few minutes later and
+  then syncs once an hour with some network jitter, and halfway
+  through the server jumps by a second.  Readings held from before
+  the first SNTP sync are rebased after it.  Checks that held and
+  live readings land within the jitter plus the drift not yet
+  learned, that both steps are seen as steps and leave the drift
+  alone, and the ISO formatting against the C library.  Exits
+  non-zero on a violation.
+
+  usage: timestamp_check [-p drift_ppm] [-j jitter_ms] [-i sync_interval_s]
+                         [-h hours] [-s seed]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "dizon_timestamp.h"
+
+#define EPOCH_AT_BOOT   1760000000000000LL  // True epoch us at esp_timer 0
+#define RTC_ERROR_US    2500000LL           // RTC seed is this far off
+#define FIRST_SNTP_S    300                 // Held readings, one a second until here
+#define SERVER_JUMP_US  (-1000000LL)        // The server moves this far halfway through
+#define SAMPLE_S        10
+#define SLACK_US        1000                // Rounding on top of the budget
+
+static double s_ppm;
+static int64_t s_server_us;                 // What the server is off by, after the jump
+
+// What the epoch really was at esp_timer time mono_us, an esp_timer that is ppm slow
+static int64_t true_epoch(int64_t mono_us)
+{
+    return EPOCH_AT_BOOT + mono_us + (int64_t)(mono_us * s_ppm * 1e-6);
+}
+
+static int64_t jitter(int64_t jitter_us)
+{
+    return jitter_us ? rand() % (2 * jitter_us + 1) - jitter_us : 0;
+}
+
+static int64_t abs64(int64_t v)
+{
+    return v < 0 ? -v : v;
+}
+
+static int check_iso(void)
+{
+    static const struct {
+        int64_t us;
+        const char* iso;
+    } known[] = {
+        { 0, "1970-01-01T00:00:00.000Z" },
+        { 951782400123456LL, "2000-02-29T00:00:00.123Z" },
+        { 1709251199999999LL, "2024-02-29T23:59:59.999Z" },
+        { 1760000000000999LL, "2025-10-09T08:53:20.000Z" },
+        { -1000, "1969-12-31T23:59:59.999Z" },
+    };
+    char buf[TS_ISO_LEN], ref[32];
+    int failures = 0;
+
+    for (size_t i = 0; i < sizeof(known) / sizeof(known[0]); i++) {
+        if (ts_format_iso(known[i].us, buf, sizeof(buf)) != strlen(known[i].iso) || strcmp(buf, known[i].iso) != 0) {
+            printf("%lld us formatted as %s, not %s\n", (long long)known[i].us, buf, known[i].iso);
+            failures++;
+        }
+    }
+    // Anywhere from 1970 to 2100 against gmtime
+    for (int i = 0; i < 100000; i++) {
+        int64_t us = ((int64_t)rand() * RAND_MAX + rand()) % 4102444800LL * 1000000 + rand() % 1000000;
+        time_t t = (time_t)(us / 1000000);
+        struct tm info;
+        gmtime_r(&t, &info);
+        size_t n = strftime(ref, sizeof(ref), "%Y-%m-%dT%H:%M:%S", &info);
+        snprintf(ref + n, sizeof(ref) - n, ".%03dZ", (int)(us % 1000000 / 1000));
+        ts_format_iso(us, buf, sizeof(buf));
+        if (strcmp(buf, ref) != 0) {
+            printf("%lld us formatted as %s, gmtime has %s\n", (long long)us, buf, ref);
+            failures++;
+            break;
+        }
+    }
+    if (ts_format_iso(0, buf, TS_ISO_LEN - 1) != 0) {
+        printf("formatting into a short buffer did not fail\n");
+        failures++;
+    }
+    return failures;
+}
+
+int main(int argc, char** argv)
+{
+    int64_t jitter_us = 5000;
+    uint32_t interval_s = 3600;
+    unsigned hours = 48;
+    unsigned seed = 1;
+    int opt;
+
+    s_ppm = 40;
+    while ((opt = getopt(argc, argv, "p:j:i:h:s:")) != -1) {
+        switch (opt) {
+        case 'p': s_ppm = atof(optarg); break;
+        case 'j': jitter_us = atoi(optarg) * 1000LL; break;
+        case 'i': interval_s = (uint32_t)atoi(optarg); break;
+        case 'h': hours = (unsigned)atoi(optarg); break;
+        case 's': seed = (unsigned)atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-p drift_ppm] [-j jitter_ms] [-i sync_interval_s] [-h hours] [-s seed]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (interval_s < 60 || hours < 4 || s_ppm > TS_MAX_DRIFT_PPM || s_ppm < -TS_MAX_DRIFT_PPM) {
+        fprintf(stderr, "sync interval must be at least 60 s, hours at least 4 and the drift within %.0f ppm\n",
+                TS_MAX_DRIFT_PPM);
+        return 1;
+    }
+    srand(seed);
+    int failures = check_iso();
+
+    timestamp_clock tc;
+    ts_init(&tc);
+    if (ts_epoch_us(&tc, 1000000) != 0) {
+        printf("stamp before any sync is not 0\n");
+        failures++;
+    }
+
+    // Boot: the RTC is a bit off, readings go out stamped with it
+    ts_sync(&tc, 0, true_epoch(0) + RTC_ERROR_US);
+    int64_t rtc_stamp = ts_epoch_us(&tc, 60 * 1000000LL);
+
+    // First SNTP sync, a step, and the held readings rebased after it
+    int64_t mono = FIRST_SNTP_S * 1000000LL;
+    ts_sync(&tc, mono, true_epoch(mono) + jitter(jitter_us));
+    int64_t worst_held = 0;
+    for (int64_t t = 0; t < FIRST_SNTP_S; t++) {
+        int64_t err = abs64(ts_epoch_us(&tc, t * 1000000) - true_epoch(t * 1000000));
+        worst_held = err > worst_held ? err : worst_held;
+    }
+    int64_t held_budget = jitter_us + (int64_t)(abs64((int64_t)s_ppm) * FIRST_SNTP_S) + SLACK_US;
+    if (tc.steps != 1 || worst_held > held_budget) {
+        printf("held readings off by up to %lld us after the first SNTP sync, %u steps\n",
+               (long long)worst_held, tc.steps);
+        failures++;
+    }
+    // Stamped again now, a reading from before the step moves back by the RTC error
+    int64_t moved = ts_epoch_us(&tc, 60 * 1000000LL) - rtc_stamp;
+    if (abs64(moved + RTC_ERROR_US) > held_budget) {
+        printf("a reading from before the step moved %lld us when rebased, not %lld\n",
+               (long long)moved, (long long)-RTC_ERROR_US);
+        failures++;
+    }
+
+    // An hour between syncs, the server jumps halfway through
+    int64_t end = hours * 3600 * 1000000LL;
+    int64_t next_sync = mono + interval_s * 1000000LL;
+    int64_t jump_at = end / 2;
+    int64_t worst_learned = 0, worst_before = 0, prev = 0;
+    unsigned backwards = 0;
+    float drift_before_jump = 0;
+    bool jumped = false;
+    for (mono += SAMPLE_S * 1000000LL; mono < end; mono += SAMPLE_S * 1000000LL) {
+        if (mono >= next_sync) {
+            if (!jumped && mono >= jump_at) {
+                drift_before_jump = tc.drift_ppm;
+                s_server_us = SERVER_JUMP_US;
+                jumped = true;
+            }
+            ts_sync(&tc, mono, true_epoch(mono) + s_server_us + jitter(jitter_us));
+            next_sync += interval_s * 1000000LL;
+        }
+        int64_t stamp = ts_epoch_us(&tc, mono);
+        int64_t err = abs64(stamp - true_epoch(mono) - s_server_us);
+        backwards += stamp < prev;
+        prev = stamp;
+        if (tc.have_drift && tc.syncs > 4) {
+            worst_learned = err > worst_learned ? err : worst_learned;
+        } else {
+            worst_before = err > worst_before ? err : worst_before;
+        }
+    }
+
+    ts_print(&tc);
+    printf("esp_timer %.1f ppm slow, %lld ms jitter, sync every %u s for %u h\n",
+           s_ppm, (long long)(jitter_us / 1000), interval_s, hours);
+    printf("held readings within %lld us, live ones within %lld us before the drift was learned, %lld us after\n",
+           (long long)worst_held, (long long)worst_before, (long long)worst_learned);
+    printf("%u stamps went backwards at a sync\n", backwards);
+
+    // The drift learned with jitter_us on both ends of each interval
+    double drift_noise = 2.0 * jitter_us / interval_s;
+    if (tc.steps != 2) {
+        printf("%u steps, expected the RTC one and the server jump\n", tc.steps);
+        failures++;
+    }
+    if (!tc.have_drift || tc.drift_ppm < s_ppm - drift_noise - 1 || tc.drift_ppm > s_ppm + drift_noise + 1) {
+        printf("drift %.2f ppm, the timer is %.1f ppm slow\n", tc.drift_ppm, s_ppm);
+        failures++;
+    }
+    if (drift_before_jump - tc.drift_ppm > drift_noise + 1 || tc.drift_ppm - drift_before_jump > drift_noise + 1) {
+        printf("the server jump moved the drift from %.2f to %.2f ppm\n", drift_before_jump, tc.drift_ppm);
+        failures++;
+    }
+    // Jitter at the sync, plus the error in the drift carried over one interval
+    int64_t live_budget = jitter_us + (int64_t)(drift_noise * interval_s) + SLACK_US;
+    if (worst_learned > live_budget) {
+        printf("live readings off by up to %lld us once the drift was learned, budget %lld us\n",
+               (long long)worst_learned, (long long)live_budget);
+        failures++;
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,194 @@
+/*
+*****************************************************************
+* waveform.c - Synthetic Current/Voltage Waveforms For The Host *
+*****************************************************************
+*/
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "waveform.h"
+
+static const double MID_SCALE = ADC_COUNTS / 2;
+
+void waveform_init(waveform* wf, waveform_kind kind, double amplitude, double mains_hz, double sample_rate_hz)
+{
+    memset(wf, 0, sizeof(*wf));
+    wf->kind = kind;
+    wf->amplitude = amplitude;
+    wf->mains_hz = mains_hz;
+    wf->sample_rate_hz = sample_rate_hz;
+    wf->clip_level = amplitude * 0.7;
+    wf->dc_shift = 300;
+    wf->noise_rms = amplitude * 0.05;
+    // Typical of a motor on a distorted supply: strong 3rd and 5th, a little 7th
+    wf->harmonics[1] = 0.20;
+    wf->harmonics[3] = 0.10;
+    wf->harmonics[5] = 0.05;
+    wf->v_channel = -1;
+    wf->v_amplitude = 1000;
+    wf->phase_deg = 0;
+    wf->rng = 0x12345678;
+}
+
+const char* waveform_name(waveform_kind kind)
+{
+    switch (kind) {
+    case WAVE_SINE:      return "sine";
+    case WAVE_CLIPPED:   return "clipped";
+    case WAVE_DC_OFFSET: return "dc-offset";
+    case WAVE_NOISY:     return "noisy";
+    case WAVE_HARMONIC:  return "harmonic";
+    }
+    return "?";
+}
+
+// xorshift32, deterministic so runs are comparable
+static double uniform(waveform* wf)
+{
+    uint32_t x = wf->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    wf->rng = x;
+    return (x + 1.0) / 4294967297.0;
+}
+
+static double gaussian(waveform* wf)
+{
+    return sqrt(-2.0 * log(uniform(wf))) * cos(2 * M_PI * uniform(wf));
+}
+
+static uint16_t to_counts(double v)
+{
+    v = round(v);
+    if (v < 0) {
+        return 0;
+    }
+    if (v > ADC_COUNTS - 1) {
+        return ADC_COUNTS - 1;
+    }
+    return (uint16_t)v;
+}
+
+uint16_t waveform_current(waveform* wf, uint64_t n)
+{
+    double theta = 2 * M_PI * wf->mains_hz * n / wf->sample_rate_hz;
+    double i = wf->amplitude * sin(theta);
+    double centre = MID_SCALE;
+
+    switch (wf->kind) {
+    case WAVE_SINE:
+        break;
+    case WAVE_CLIPPED:
+        if (i > wf->clip_level) {
+            i = wf->clip_level;
+        } else if (i < -wf->clip_level) {
+            i = -wf->clip_level;
+        }
+        break;
+    case WAVE_DC_OFFSET:
+        centre += wf->dc_shift;
+        break;
+    case WAVE_NOISY:
+        i += wf->noise_rms * gaussian(wf);
+        break;
+    case WAVE_HARMONIC:
+        for (int k = 0; k < WAVE_MAX_HARMONICS; k++) {
+            i += wf->amplitude * wf->harmonics[k] * sin((k + 2) * theta);
+        }
+        break;
+    }
+    return to_counts(centre + i);
+}
+
+uint16_t waveform_voltage(const waveform* wf, uint64_t n)
+{
+    double theta = 2 * M_PI * wf->mains_hz * n / wf->sample_rate_hz;
+    return to_counts(MID_SCALE + wf->v_amplitude * sin(theta + wf->phase_deg * M_PI / 180));
+}
+
+void waveform_fill(waveform* wf, uint16_t* samples, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        samples[i] = waveform_current(wf, wf->n++);
+    }
+}
+
+double waveform_analytic_rms(const waveform* wf)
+{
+    double a = wf->amplitude;
+    double ms = a * a / 2;
+
+    switch (wf->kind) {
+    case WAVE_SINE:
+    case WAVE_DC_OFFSET:
+        break;
+    case WAVE_CLIPPED:
+        if (wf->clip_level < a) {
+            // Quarter cycle: a*sin(t) up to the clip angle, flat after it
+            double c = wf->clip_level;
+            double tc = asin(c / a);
+            ms = (2 / M_PI) * (a * a * (tc / 2 - sin(2 * tc) / 4) + c * c * (M_PI / 2 - tc));
+        }
+        break;
+    case WAVE_NOISY:
+        ms += wf->noise_rms * wf->noise_rms;
+        break;
+    case WAVE_HARMONIC:
+        for (int k = 0; k < WAVE_MAX_HARMONICS; k++) {
+            ms += a * a * wf->harmonics[k] * wf->harmonics[k] / 2;
+        }
+        break;
+    }
+    return sqrt(ms);
+}
+
+static int provider_read(void* ctx, int channel)
+{
+    waveform* wf = ctx;
+    uint64_t n = wf->n++;
+    if (channel == wf->v_channel) {
+        return waveform_voltage(wf, n);
+    }
+    return waveform_current(wf, n);
+}
+
+static int64_t provider_micros(void* ctx)
+{
+    waveform* wf = ctx;
+    return (int64_t)(wf->n * 1e6 / wf->sample_rate_hz);
+}
+
+const emon_sample_provider* waveform_provider(waveform* wf)
+{
+    wf->provider.ctx = wf;
+    wf->provider.setup = NULL;
+    wf->provider.read = provider_read;
+    wf->provider.micros = provider_micros;
+    return &wf->provider;
+}
+
+uint16_t waveform_generator(void* wf, uint64_t n)
+{
+    return waveform_current(wf, n);
+}
+
+double waveform_uniform(void)
+{
+    return (rand() + 1.0) / (RAND_MAX + 2.0);
+}
+
+double waveform_gaussian(void)
+{
+    double u = waveform_uniform(), v = waveform_uniform();
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+double waveform_now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
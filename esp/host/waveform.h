@@ -0,0 +1,75 @@
+/*
+*****************************************************************
+* waveform.h - Synthetic Current/Voltage Waveforms For The Host *
+*****************************************************************
+
+  Generates what the SCT-013 and the divider would present to the
+  ADC (12 bit counts around mid-scale) so the energy monitor math
+  can be run and measured without a device.
+  Also the calibration, noise and clock the host tools share.
+*/
+
+#ifndef WAVEFORM_H
+#define WAVEFORM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "dizon_EmonLib.h"
+
+#define WAVE_MAX_HARMONICS 8
+#define WAVE_ICAL          29.0     // The firmware's ICALIBRATION, for the host tools
+
+typedef enum {
+    WAVE_SINE,          // Clean fundamental
+    WAVE_CLIPPED,       // Fundamental flattened at +/- clip_level
+    WAVE_DC_OFFSET,     // Fundamental centred dc_shift counts away from mid-scale
+    WAVE_NOISY,         // Fundamental plus gaussian noise of noise_rms
+    WAVE_HARMONIC,      // Fundamental plus the harmonics[] table
+} waveform_kind;
+
+typedef struct waveform waveform;
+
+struct waveform
+{
+    waveform_kind kind;
+    double amplitude;           // Peak of the fundamental in counts
+    double mains_hz;
+    double sample_rate_hz;      // Conversions per second, every read is one conversion
+    double clip_level;          // WAVE_CLIPPED
+    double dc_shift;            // WAVE_DC_OFFSET
+    double noise_rms;           // WAVE_NOISY
+    double harmonics[WAVE_MAX_HARMONICS];   // WAVE_HARMONIC, [k] is harmonic k+2 relative to the fundamental
+
+    // Voltage channel for emon_calcVI, a clean sine leading the current by phase_deg
+    int v_channel;
+    double v_amplitude;
+    double phase_deg;
+
+    uint64_t n;                 // Conversions so far
+    uint32_t rng;
+    emon_sample_provider provider;
+};
+
+void waveform_init(waveform* wf, waveform_kind kind, double amplitude, double mains_hz, double sample_rate_hz);
+const char* waveform_name(waveform_kind kind);
+
+// Raw counts of the current (or voltage) channel at conversion n
+uint16_t waveform_current(waveform* wf, uint64_t n);
+uint16_t waveform_voltage(const waveform* wf, uint64_t n);
+void waveform_fill(waveform* wf, uint16_t* samples, size_t len);
+
+// RMS of the AC part of the current in counts, what a perfect filter would report
+double waveform_analytic_rms(const waveform* wf);
+
+// Provider that evaluates the waveform on every read, advancing one conversion each time
+const emon_sample_provider* waveform_provider(waveform* wf);
+// Generator for adc_sim
+uint16_t waveform_generator(void* wf, uint64_t n);
+
+// For noise the tools make themselves, drawn from rand() so their -s seed repeats it
+double waveform_uniform(void);          // (0, 1)
+double waveform_gaussian(void);         // Mean 0, standard deviation 1
+// Monotonic clock for the timing runs
+double waveform_now_s(void);
+
+#endif
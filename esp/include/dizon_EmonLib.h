@@ -9,10 +9,10 @@
 
 #include <math.h>
 #include <stdio.h>
-#include "esp_timer.h"
-#include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
-#include <driver/adc.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "dizon_adc_stream.h"
+#include "dizon_emon_sync.h"
 
 // ESP32 has 12 Bit ADC
 #define ADC_BITS    12
@@ -24,6 +24,39 @@
 // Which makes the ADC range 0->1146
 #define SUPPLY_VOLTAGE 1146
 
+// Fixed point path: DC offsets carry 16 fractional bits, filtered samples keep 4
+// and the phase calibration 14.  A filtered sample squared is at most 2^32 so the
+// sums of squares are 64 bit and good for ~2^31 samples.
+#define EMON_Q_OFFSET   16
+#define EMON_Q_FILTER   4
+#define EMON_Q_PHASECAL 14
+
+// Longest we wait on the ADC stream for a block before giving up on the window
+#define EMON_STREAM_TIMEOUT_MS 1000
+
+// Lowest line frequency a synchronised window waits for before it gives up on crossings
+#define EMON_SYNC_MIN_HZ 40
+
+typedef enum {
+  EMON_MATH_DOUBLE = 0,                  //Original double precision filter and sums
+  EMON_MATH_FIXED                        //Shift based filter, 64 bit integer sums
+} emon_math;
+
+//--------------------------------------------------------------------------------------
+// Where samples come from.  On the device this wraps adc1_get_raw() and esp_timer
+// (see emon_adc.h), on the host it is a synthetic waveform, which keeps all of the
+// math in here free of ESP-IDF.
+//--------------------------------------------------------------------------------------
+typedef struct emon_sample_provider emon_sample_provider;
+
+struct emon_sample_provider
+{
+  void* ctx;
+  void (*setup)(void* ctx, int channel);       //Optional, called when a pin is assigned
+  int (*read)(void* ctx, int channel);         //One raw 12 bit conversion
+  int64_t (*micros)(void* ctx);                //Monotonic time in microseconds
+};
+
 typedef struct energy_mon energy_mon;
 
 struct energy_mon
@@ -35,9 +68,10 @@ struct energy_mon
   double Vrms;
   double Irms;
   
-  //Set Voltage and current input pins
-  adc1_channel_t inPinV;
-  adc1_channel_t inPinI;
+  //Sample source and the voltage and current input channels
+  const emon_sample_provider* provider;
+  int inPinV;
+  int inPinI;
   //Calibration coefficients
   //These need to be set in order to obtain accurate results
   double VCAL;
@@ -59,16 +93,53 @@ struct energy_mon
 
   double sqV,sumV,sqI,sumI,instP,sumP;              //sq = squared, sum = Sum, inst = instantaneous
 
-  int startV;                                       //Instantaneous voltage at start of sample window.
+  //--------------------------------------------------------------------------------------
+  // Cycle synchronised windows
+  //--------------------------------------------------------------------------------------
+  double syncBand;                                  //Zero crossing hysteresis in counts, EMON_SYNC_BAND
+  emon_sync syncV, syncI;                           //Carried from one window to the next
+  double frequency;                                 //Line frequency over the last window, 0 if it found no crossings
 
-  bool lastVCross, checkVCross;                  //Used to measure number of times threshold is crossed.
+  //--------------------------------------------------------------------------------------
+  // Fixed point state, only used with EMON_MATH_FIXED
+  //--------------------------------------------------------------------------------------
+  emon_math math;
+  int32_t offsetV_q, offsetI_q;                     //Q16 low-pass filter output
+  int32_t lastFilteredV_q, filteredV_q, filteredI_q;   //Q4 filtered samples
+  int32_t PHASECAL_q;                               //Q14 phase calibration
+  int64_t sumV_q, sumI_q, sumP_q;                   //Q8 sums
 };
 
-void emon_voltage(energy_mon* emon, adc1_channel_t _inPinV, double _VCAL, double _PHASECAL);
-extern void emon_current(energy_mon* emon, adc1_channel_t _inPinI, double _ICAL);
+//--------------------------------------------------------------------------------------
+// Fixed point equivalent of the offset filter: offset += (sample - offset) / ADC_COUNTS
+// becomes a shift by ADC_BITS, the filtered sample keeps EMON_Q_FILTER fractional bits.
+//--------------------------------------------------------------------------------------
+static inline int32_t emon_filter_q(int32_t* offset_q, int sample)
+{
+  *offset_q += ((sample << EMON_Q_OFFSET) - *offset_q) >> ADC_BITS;
+  return ((sample << EMON_Q_OFFSET) - *offset_q) >> (EMON_Q_OFFSET - EMON_Q_FILTER);
+}
+
+//--------------------------------------------------------------------------------------
+// Amps per ADC count on the current channel
+//--------------------------------------------------------------------------------------
+static inline double emon_i_ratio(const energy_mon* emon)
+{
+  return emon->ICAL *((SUPPLY_VOLTAGE/1000.0) / (ADC_COUNTS));
+}
+
+void emon_init(energy_mon* emon, const emon_sample_provider* provider);
+void emon_voltage(energy_mon* emon, int _inPinV, double _VCAL, double _PHASECAL);
+extern void emon_current(energy_mon* emon, int _inPinI, double _ICAL);
+
+void emon_set_math(energy_mon* emon, emon_math math);
 
 void emon_calcVI(energy_mon* emon, unsigned int crossings, unsigned int timeout);
 double emon_calcIrms(energy_mon* emon, unsigned int NUMBER_OF_SAMPLES);
+double emon_calcIrms_stream(energy_mon* emon, adc_stream* stream, unsigned int NUMBER_OF_SAMPLES);
+// Over whole cycles of the current from one zero crossing to another, timeout in ms
+double emon_calcIrms_cycles(energy_mon* emon, unsigned int cycles, unsigned int timeout);
+double emon_calcIrms_stream_cycles(energy_mon* emon, adc_stream* stream, unsigned int cycles);
 void emon_print(energy_mon* emon);
 
 #endif
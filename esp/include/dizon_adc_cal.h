@@ -0,0 +1,65 @@
+/*
+*****************************************************************
+* adc_cal.h - ADC Non-Linearity Correction Table                *
+*****************************************************************
+
+  The ESP32 ADC is neither linear nor the same from chip to chip,
+  least of all near the ends of its range.  The correction is
+  worked out once, from the eFuse characterization or from a few
+  calibration points measured on the bench, into a table with the
+  corrected value of every raw count.  The sample loops then pay
+  one table load per conversion.
+
+  Corrected values are millivolts expressed in counts of an ideal
+  converter spanning SUPPLY_VOLTAGE, so they stay 12 bit and the
+  RMS math and ICAL keep their meaning.
+*/
+
+#ifndef DIZON_ADC_CAL_H
+#define DIZON_ADC_CAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "dizon_EmonLib.h"
+
+#define ADC_CAL_MAX_POINTS 16
+
+typedef struct adc_cal_point adc_cal_point;
+
+struct adc_cal_point
+{
+  uint16_t raw;               // What the ADC read
+  uint16_t mv;                // For this input
+};
+
+typedef struct adc_cal adc_cal;
+
+struct adc_cal
+{
+  uint16_t lut[ADC_COUNTS];   // Raw count to corrected count
+};
+
+// Raw counts passed through as they are
+void adc_cal_identity(adc_cal* cal);
+
+// Piecewise linear through n points with rising raw counts, the end segments are
+// extended past the first and last point.  Returns -1 for fewer than 2 points, more
+// than ADC_CAL_MAX_POINTS or raw counts that do not rise.
+int adc_cal_from_points(adc_cal* cal, const adc_cal_point* points, size_t n);
+
+// From a raw count to millivolts function, esp_adc_cal_raw_to_voltage on the device
+void adc_cal_from_fn(adc_cal* cal, uint32_t (*raw_to_mv)(void* ctx, int raw), void* ctx);
+
+static inline int adc_cal_apply(const adc_cal* cal, int raw)
+{
+  return cal->lut[raw & (ADC_COUNTS - 1)];
+}
+
+// Millivolts to counts of the ideal converter, clamped to 12 bits
+static inline uint16_t adc_cal_counts(double mv)
+{
+  double c = mv * ADC_COUNTS / SUPPLY_VOLTAGE + 0.5;
+  return c <= 0 ? 0 : c >= ADC_COUNTS - 1 ? ADC_COUNTS - 1 : (uint16_t)c;
+}
+
+#endif
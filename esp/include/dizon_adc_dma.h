@@ -0,0 +1,35 @@
+/*
+*****************************************************************
+* adc_dma.h - Continuous ADC1 Sampling Through The DMA Driver   *
+*****************************************************************
+
+  Block source for adc_stream backed by the ESP-IDF continuous
+  (DMA) ADC driver.  The converter runs at a fixed rate with no CPU
+  involvement, the reading task sleeps until a DMA frame is ready.
+  With several channels the pattern table converts them in turn
+  and blocks hold whole scans, channel 0 first, for emon_multi.
+*/
+
+#ifndef DIZON_ADC_DMA_H
+#define DIZON_ADC_DMA_H
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "soc/soc_caps.h"
+#include <driver/adc.h>
+#include "dizon_adc_stream.h"
+#include "dizon_adc_cal.h"
+
+// Bytes the driver hands over per DMA interrupt and keeps buffered for us
+#define ADC_DMA_FRAME_BYTES 256
+#define ADC_DMA_STORE_BYTES 4096
+#define ADC_DMA_MAX_CHANNELS 4
+
+const adc_block_source* adc_dma_source(adc1_channel_t channel);
+// Interleaved scans of n channels, the stream rate counts conversions of all of them
+// and its block length has to be a multiple of n.  NULL for more than ADC_DMA_MAX_CHANNELS.
+const adc_block_source* adc_dma_scan_source(const adc1_channel_t* channels, size_t n);
+// Every conversion goes through cal before it is averaged, NULL for raw counts
+void adc_dma_set_cal(const adc_cal* cal);
+
+#endif
@@ -0,0 +1,40 @@
+/*
+*****************************************************************
+* adc_sim.h - Simulated Block Source Standing In For ADC DMA    *
+*****************************************************************
+
+  Produces samples from a generator callback against a simulated
+  clock, in DMA sized chunks, so the block handoff and the rate
+  accounting in adc_stream can be exercised on the host.
+*/
+
+#ifndef DIZON_ADC_SIM_H
+#define DIZON_ADC_SIM_H
+
+#include <stdint.h>
+#include "dizon_adc_stream.h"
+
+typedef uint16_t (*adc_sim_generator)(void* user, uint64_t n);
+
+typedef struct adc_sim adc_sim;
+
+struct adc_sim
+{
+  adc_sim_generator generator;
+  void* user;
+  size_t chunk;               // Most samples returned per read, like one DMA interrupt
+  int32_t clock_error_ppm;    // How far off the simulated converter clock runs
+
+  uint32_t sample_rate_hz;
+  uint64_t n;                 // Next sample index
+  uint64_t lost;              // Samples skipped by adc_sim_lose
+  bool overrun;
+  bool running;
+  adc_block_source source;
+};
+
+const adc_block_source* adc_sim_init(adc_sim* sim, adc_sim_generator generator, void* user, size_t chunk);
+// Skip samples as if the DMA buffer had overflowed, the next read reports ADC_SOURCE_OVERRUN
+void adc_sim_lose(adc_sim* sim, uint64_t samples);
+
+#endif
@@ -0,0 +1,105 @@
+/*
+*******************************************************************
+* adc_stream.h - Double Buffered Blocks of Continuous ADC Samples *
+*******************************************************************
+
+  A block source (the ADC DMA driver on the ESP32, or a simulated
+  source on the host) fills one buffer at a fixed sample rate while
+  the RMS code works on the other one.  Nothing in here depends on
+  ESP-IDF so the handoff and rate accounting run on Linux as well.
+*/
+
+#ifndef DIZON_ADC_STREAM_H
+#define DIZON_ADC_STREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Largest block we will hand to the RMS code in one go
+#define ADC_STREAM_MAX_BLOCK 1024
+// Most samples adc_stream_flush throws away, more than the DMA driver keeps buffered
+#define ADC_STREAM_FLUSH_MAX (4 * ADC_STREAM_MAX_BLOCK)
+
+// Return codes for adc_block_source.read
+#define ADC_SOURCE_OK        0
+#define ADC_SOURCE_OVERRUN   1    // samples were returned but some were lost before them
+#define ADC_SOURCE_TIMEOUT  -1
+#define ADC_SOURCE_ERROR    -2
+
+typedef struct adc_block_source adc_block_source;
+
+struct adc_block_source
+{
+  void* ctx;
+  // Start converting at sample_rate_hz, returns 0 on success
+  int (*start)(void* ctx, uint32_t sample_rate_hz);
+  // Copy up to max_samples raw 12 bit samples, blocking up to timeout_ms for the first one
+  int (*read)(void* ctx, uint16_t* samples, size_t max_samples, size_t* got, uint32_t timeout_ms);
+  void (*stop)(void* ctx);
+  // Monotonic clock of the source in microseconds
+  int64_t (*now_us)(void* ctx);
+};
+
+typedef struct adc_block adc_block;
+
+struct adc_block
+{
+  const uint16_t* samples;
+  size_t len;
+  uint32_t seq;               // Sequence number of the block since start
+  int64_t start_us;           // Estimated time of the first sample
+  uint8_t index;              // Which of the two buffers this is (internal)
+};
+
+typedef struct adc_stream adc_stream;
+
+struct adc_stream
+{
+  const adc_block_source* source;
+  uint32_t sample_rate_hz;
+  size_t block_len;
+
+  uint16_t buf[2][ADC_STREAM_MAX_BLOCK];
+  uint8_t state[2];           // ADC_BUF_* below, changed atomically
+  uint32_t seq[2];
+  int64_t start_us[2];
+  uint8_t back;               // Buffer the producer is filling
+  size_t fill;                // Samples already in the back buffer
+  uint32_t next_seq;
+
+  // Rate accounting
+  uint64_t samples;           // Samples read from the source since start
+  uint64_t rate_samples;      // Samples read after the first read (denominator for the rate)
+  int64_t first_us;
+  int64_t last_us;
+  uint32_t blocks_filled;
+  uint32_t blocks_taken;
+  uint32_t blocks_dropped;    // Completed blocks the consumer never saw
+  uint32_t overruns;          // Reads where the source reported lost samples
+  uint32_t read_errors;
+  uint64_t flushed;           // Samples thrown away by adc_stream_flush
+};
+
+int adc_stream_init(adc_stream* stream, const adc_block_source* source, uint32_t sample_rate_hz, size_t block_len);
+int adc_stream_start(adc_stream* stream);
+void adc_stream_stop(adc_stream* stream);
+
+// Producer side: read from the source into the back buffer, returns 1 when a block was completed
+int adc_stream_fill(adc_stream* stream, uint32_t timeout_ms);
+// Throw away whatever the source has buffered, up to ADC_STREAM_FLUSH_MAX samples, and
+// restart the back buffer.  A read shorter than a block means the source has run dry.
+void adc_stream_flush(adc_stream* stream);
+
+// Consumer side: take the completed block (if any) and give it back when done
+bool adc_stream_take(adc_stream* stream, adc_block* block);
+void adc_stream_release(adc_stream* stream, const adc_block* block);
+
+// Single task convenience: fill until a block is ready and take it
+bool adc_stream_next(adc_stream* stream, adc_block* block, uint32_t timeout_ms);
+
+// Sample rate actually delivered by the source, 0 until two reads have happened
+double adc_stream_measured_rate(const adc_stream* stream);
+void adc_stream_print(const adc_stream* stream);
+
+#endif
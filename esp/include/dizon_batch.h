@@ -0,0 +1,96 @@
+/*
+*****************************************************************
+* batch.h - Batches Telemetry Records Into Fewer Publishes      *
+*****************************************************************
+
+  Collects records until the flush policy says to go (record count,
+  age of the oldest record, or encoded size) and then encodes them
+  into one payload.  Keeps an estimate of the bytes each publish
+  costs on the air, and of what the same records would have cost
+  one publish at a time, so the saving can be reported.
+*/
+
+#ifndef DIZON_BATCH_H
+#define DIZON_BATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "dizon_record.h"
+#include "dizon_encode.h"
+
+#define BATCH_MAX_RECORDS   64
+#define BATCH_MAX_BYTES     4096        // Payload buffer, well under the 128 KB AWS IoT limit
+
+// Per publish costs we do not see in the payload, used for the on-air estimate
+#define BATCH_MQTT_OVERHEAD 8           // Fixed header, remaining length, topic length, packet id
+#define BATCH_TLS_OVERHEAD  29          // Record header, explicit nonce and GCM tag
+#define BATCH_IP_OVERHEAD   40          // TCP and IPv4 headers
+#define BATCH_WIFI_OVERHEAD 36          // 802.11 MAC header, LLC/SNAP and FCS
+#define BATCH_WIFI_MTU      1460        // TCP payload per frame
+
+typedef struct batch_policy batch_policy;
+
+struct batch_policy
+{
+    uint16_t max_records;       // Flush at this many records, 1 disables batching
+    uint32_t max_age_ms;        // Flush when the oldest record is this old, 0 for no limit
+    uint32_t max_bytes;         // Flush before the payload would pass this, capped at BATCH_MAX_BYTES
+};
+
+typedef struct batch_stats batch_stats;
+
+struct batch_stats
+{
+    uint32_t publishes;
+    uint32_t records;
+    uint32_t dropped;           // Overflowed the batch or too big to encode
+    uint64_t payload_bytes;
+    uint64_t air_bytes;         // Estimated bytes on the air for what we sent
+    uint64_t single_air_bytes;  // Estimate for the same records sent one per publish
+};
+
+typedef struct telemetry_batch telemetry_batch;
+
+struct telemetry_batch
+{
+    batch_policy policy;
+    const telemetry_encoder* encoder;
+    const char* id;
+    size_t topic_len;
+
+    sump_record records[BATCH_MAX_RECORDS];
+    int64_t added_us[BATCH_MAX_RECORDS];    // When each pending record was added
+    uint16_t count;
+    int64_t oldest_us;          // added_us of the oldest pending record
+    size_t pending_bytes;       // Upper bound on the payload so far
+
+    uint8_t payload[BATCH_MAX_BYTES];
+    batch_stats stats;
+};
+
+int batch_init(telemetry_batch* b, const telemetry_encoder* encoder, const char* id, const char* topic,
+               const batch_policy* policy);
+void batch_set_policy(telemetry_batch* b, const batch_policy* policy);
+// Update policy from "records=30 age_ms=30000 bytes=2048", any subset, left alone on error
+int batch_parse_policy(const char* text, size_t len, batch_policy* policy);
+void batch_set_encoder(telemetry_batch* b, const telemetry_encoder* encoder);
+
+// Queue a record, returns true when the batch should be flushed now
+bool batch_add(telemetry_batch* b, const sump_record* rec, int64_t now_us);
+bool batch_due(const telemetry_batch* b, int64_t now_us);
+// Milliseconds until the age limit forces a flush, UINT32_MAX if nothing is pending
+uint32_t batch_ms_until_due(const telemetry_batch* b, int64_t now_us);
+
+// Encode the next payload from the pending records. Returns its length (0 if nothing
+// is pending) and removes the records it holds; call again while batch_pending().
+size_t batch_take_payload(telemetry_batch* b, const uint8_t** payload);
+uint16_t batch_pending(const telemetry_batch* b);
+// Take back the oldest record without sending it
+bool batch_pop(telemetry_batch* b, sump_record* rec);
+
+// Estimated bytes on the air for one publish of payload_len bytes
+size_t batch_air_bytes(size_t payload_len, size_t topic_len);
+void batch_print_stats(const telemetry_batch* b);
+
+#endif
@@ -0,0 +1,158 @@
+/*
+*****************************************************************
+* capture.h - Raw Waveform Capture Around Pump Events           *
+*****************************************************************
+
+  Keeps the last pre_samples raw ADC samples of the stream in a
+  circular slot and, when a trigger fires, records post_samples more
+  and freezes the slot for upload.  Triggers are a step in the RMS,
+  the RMS crossing a threshold (the pump starting or stopping) and
+  zero crossings going missing while the pump runs (a clipped CT, a
+  half-wave fault).
+
+  All memory is an arena handed to capture_init, split into slots
+  of pre + post samples.  The sampling task records into one slot
+  while the publishing task uploads frozen ones; a slot changes
+  hands with one atomic store, neither side locks or waits.  When
+  every slot is waiting for upload further triggers are dropped and
+  counted, recording picks up again once one is released.
+*/
+
+#ifndef DIZON_CAPTURE_H
+#define DIZON_CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define CAPTURE_MAX_SLOTS       4
+#define CAPTURE_CHUNK_VERSION   1
+#define CAPTURE_CHUNK_HEADER    32      // Bytes ahead of the samples in every chunk
+
+typedef enum {
+    CAPTURE_MANUAL,
+    CAPTURE_STEP,               // RMS moved by step_amps from one value to the next
+    CAPTURE_THRESHOLD,          // RMS crossed threshold_amps, either way
+    CAPTURE_ZERO_CROSS,         // No zero crossing for zc_cycles while running
+} capture_reason;
+
+typedef enum {
+    CAPTURE_SLOT_FREE,
+    CAPTURE_SLOT_RECORDING,     // Owned by the sampling side
+    CAPTURE_SLOT_READY,         // Owned by the upload side until capture_release
+} capture_slot_state;
+
+typedef struct capture_config capture_config;
+
+struct capture_config
+{
+    uint32_t sample_rate_hz;
+    uint32_t mains_hz;
+    uint32_t pre_samples;       // Kept ahead of the trigger
+    uint32_t post_samples;      // Recorded from the trigger on
+    float step_amps;            // 0 turns a trigger off
+    float threshold_amps;
+    uint16_t zc_cycles;         // Mains cycles without a crossing
+    uint16_t zc_band;           // Counts either side of the mean a crossing has to swing
+    float zc_min_amps;          // Missing crossings only count above this RMS
+    uint32_t holdoff_ms;        // After a trigger, before the next one is taken
+};
+
+typedef struct capture_info capture_info;
+
+struct capture_info
+{
+    uint32_t id;                // Counts up from 1 across all slots
+    capture_reason reason;
+    int64_t trigger_us;         // esp_timer time of the trigger sample
+    uint32_t pre;               // Samples ahead of the trigger, short of pre_samples right after a slot change
+    uint32_t len;               // Samples held
+    float irms_before;          // RMS values either side of an RMS trigger
+    float irms_after;
+};
+
+typedef struct capture_slot capture_slot;
+
+struct capture_slot
+{
+    uint16_t* samples;          // pre_samples + post_samples of the arena, circular
+    uint32_t head;              // Next sample written
+    uint32_t filled;            // Samples held, up to the slot length
+    uint32_t start;             // Oldest sample held, once frozen
+    capture_info info;
+    uint8_t state;              // capture_slot_state, handed over atomically
+};
+
+typedef struct capture_chunk_header capture_chunk_header;
+
+struct capture_chunk_header
+{
+    uint8_t version;
+    capture_reason reason;
+    uint16_t count;             // Samples in this chunk
+    uint32_t id;
+    uint32_t offset;            // Of the first sample in this chunk
+    uint32_t len;               // Of the whole capture
+    uint32_t pre;
+    uint32_t sample_rate_hz;
+    int64_t trigger_epoch_us;
+};
+
+typedef struct capture capture;
+
+struct capture
+{
+    capture_config cfg;
+    capture_slot slots[CAPTURE_MAX_SLOTS];
+    uint8_t n_slots;
+    uint32_t slot_len;
+    uint32_t holdoff_samples;
+    uint32_t zc_limit;          // Samples without a crossing that trigger
+
+    // Sampling side
+    capture_slot* rec;          // NULL while every slot waits for upload
+    bool triggered;
+    uint32_t post_left;         // Samples still to record after the trigger
+    uint32_t after;             // Recorded after the trigger so far
+    uint64_t total;             // Samples pushed since capture_init
+    uint64_t last_trigger;      // Of total, for the holdoff
+    int64_t block_us;           // Time of the first sample of the last block
+    uint32_t block_len;
+    int32_t dc_q16;             // Slow mean of the samples, 16.16
+    int8_t zc_sign;
+    uint32_t since_crossing;
+    bool have_rms;
+    float last_irms;
+    uint32_t next_id;
+    uint32_t triggers;
+    uint32_t captured;
+    uint32_t dropped;           // Triggers with no slot free, or during the holdoff
+};
+
+// arena holds n_slots * (pre_samples + post_samples) samples.  Returns -1 for a bad config.
+int capture_init(capture* c, const capture_config* cfg, uint16_t* arena, size_t arena_len, uint8_t n_slots);
+
+// Sampling side.  Consecutive raw samples, start_us is the time of samples[0].  True when a
+// capture was frozen and is ready for upload.
+bool capture_push(capture* c, const uint16_t* samples, size_t len, int64_t start_us);
+// Every RMS the window emits, fires the step and threshold triggers
+void capture_rms(capture* c, int64_t t_us, float irms);
+// Trigger at t_us, within or before the last block pushed.  False if it was dropped.
+bool capture_trigger(capture* c, capture_reason reason, int64_t t_us);
+
+// Upload side.  The oldest frozen capture, NULL if there is none.
+capture_slot* capture_ready(capture* c);
+// Copies up to max_samples of it from offset into buf as one chunk.  Returns the bytes used,
+// 0 past the end or if buf is too small.
+size_t capture_chunk(const capture_slot* s, uint32_t offset, uint32_t sample_rate_hz, int64_t trigger_epoch_us,
+                     uint32_t max_samples, uint8_t* buf, size_t size);
+// Done with it, the sampling side may record into it again
+void capture_release(capture* c, capture_slot* s);
+
+// Returns the samples of a chunk and fills in its header, NULL if it is not one
+const uint8_t* capture_chunk_parse(const uint8_t* buf, size_t len, capture_chunk_header* hdr);
+
+const char* capture_reason_name(capture_reason reason);
+void capture_print(const capture* c);
+
+#endif
@@ -0,0 +1,18 @@
+/*
+*****************************************************************
+* crc.h - CRC-32 Of What The Firmware Keeps In Flash And NVS    *
+*****************************************************************
+
+  The reflected CRC-32 of zlib and Ethernet, one bit at a time.
+  Only checks entries of a few dozen bytes, so no table.
+*/
+
+#ifndef DIZON_CRC_H
+#define DIZON_CRC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+uint32_t crc32_buf(const void* data, size_t len);
+
+#endif
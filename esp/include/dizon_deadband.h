@@ -0,0 +1,63 @@
+/*
+*****************************************************************
+* deadband.h - Report-By-Exception Filter For Readings          *
+*****************************************************************
+
+  Lets a reading through only when it has moved outside the band
+  around the last one sent, or when nothing has been sent for the
+  heartbeat interval.  The band is the larger of an absolute width
+  and a fraction of the last value sent, so the absolute part covers
+  the idle noise floor and the relative part a running pump.  The
+  readings held back are counted and reported with the next one
+  that goes out.
+*/
+
+#ifndef DIZON_DEADBAND_H
+#define DIZON_DEADBAND_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct deadband_config deadband_config;
+
+struct deadband_config
+{
+    float abs_amps;             // Band half width, 0 to leave it to the relative part
+    float rel;                  // Band half width as a fraction of the last value sent
+    uint32_t heartbeat_s;       // Send anyway after this long, 0 for never
+};
+
+typedef enum {
+    DEADBAND_SUPPRESS,
+    DEADBAND_FIRST,
+    DEADBAND_CHANGE,
+    DEADBAND_HEARTBEAT,
+} deadband_verdict;
+
+typedef struct deadband deadband;
+
+struct deadband
+{
+    deadband_config cfg;
+    bool have_last;
+    float last;                 // Last value let through
+    int64_t last_us;
+    uint32_t suppressed;        // Held back since the last one let through
+
+    // Since deadband_init
+    uint32_t passed;
+    uint32_t heartbeats;
+    uint32_t suppressed_total;
+};
+
+int deadband_init(deadband* db, const deadband_config* cfg);
+
+// Decide on a reading taken at t_us. When it goes out, *suppressed is how many were
+// held back before it and the count starts again.
+deadband_verdict deadband_check(deadband* db, float value, int64_t t_us, uint32_t* suppressed);
+// Let a reading through without checking, when something else in the record has to go out
+void deadband_pass(deadband* db, float value, int64_t t_us, uint32_t* suppressed);
+
+const char* deadband_verdict_name(deadband_verdict v);
+
+#endif
@@ -0,0 +1,40 @@
+/*
+*****************************************************************
+* emon_adc.h - ADC1 Sample Provider For The Energy Monitor      *
+*****************************************************************
+*/
+
+#ifndef DIZON_EMON_ADC_H
+#define DIZON_EMON_ADC_H
+
+#include "esp_timer.h"
+#include <driver/adc.h>
+#include "dizon_EmonLib.h"
+#include "dizon_adc_cal.h"
+
+// Bench calibration points in NVS, taken over the eFuse characterization when present
+#define ADC_CAL_NAMESPACE "adc_cal"
+#define ADC_CAL_KEY       "points"
+#define ADC_CAL_VERSION   1
+
+typedef struct adc_cal_blob adc_cal_blob;
+
+struct adc_cal_blob
+{
+    uint8_t version;
+    uint8_t count;
+    adc_cal_point points[ADC_CAL_MAX_POINTS];
+};
+
+// Polled adc1_get_raw() conversions timed with esp_timer
+const emon_sample_provider* emon_adc_provider(void);
+
+#ifdef CONFIG_EMON_ADC_CAL
+// Builds the correction table, from the points in NVS or else the eFuse characterization,
+// and has the provider apply it.  Call once NVS is up and before sampling starts.
+const adc_cal* emon_adc_calibrate(void);
+// Applies bench points and stores them for the next boot
+esp_err_t emon_adc_save_points(const adc_cal_point* points, size_t n);
+#endif
+
+#endif
@@ -0,0 +1,86 @@
+/*
+*****************************************************************
+* emon_multi.h - Current RMS For Several Pumps From One Scan     *
+*****************************************************************
+
+  Measures up to EMON_MULTI_MAX current transformers on different
+  ADC1 channels, each with its own calibration, from one
+  interleaved scan: channel 0, 1, .. n-1, then channel 0 again.
+  Every channel's RMS comes out of a single pass over the
+  interleaved samples, using the same offset filter as emon_calcIrms.
+
+  The channels are not converted at the same instant, channel k
+  trails channel 0 by k conversions.  That does not change a
+  channel's own RMS, but it does change the sum of the channels
+  (the current of the whole site) by skewing their phases.  The
+  total is taken after each channel is interpolated back onto
+  channel 0's conversion times.
+*/
+
+#ifndef DIZON_EMON_MULTI_H
+#define DIZON_EMON_MULTI_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "dizon_EmonLib.h"
+#include "dizon_adc_stream.h"
+
+#define EMON_MULTI_MAX 4
+
+typedef struct emon_multi_channel emon_multi_channel;
+
+struct emon_multi_channel
+{
+  int pin;                    // ADC1 channel
+  double ical;                // Same meaning as for emon_current
+};
+
+typedef struct emon_multi emon_multi;
+
+struct emon_multi
+{
+  const emon_sample_provider* provider;
+  emon_math math;
+  size_t n;
+  int pin[EMON_MULTI_MAX];
+  double ratio[EMON_MULTI_MAX];       // Amps per count
+  double lag[EMON_MULTI_MAX];         // How far channel k trails channel 0, in scans
+  int32_t lag_q[EMON_MULTI_MAX];      // Same, EMON_Q_PHASECAL
+  int32_t weight_q[EMON_MULTI_MAX];   // ratio[k] / ratio[0], EMON_Q_PHASECAL
+
+  // Per channel filter state, as in energy_mon
+  double offset[EMON_MULTI_MAX];
+  double last[EMON_MULTI_MAX];        // Previous filtered sample, for the skew correction
+  double sum[EMON_MULTI_MAX];
+  double sum_total;
+  int32_t offset_q[EMON_MULTI_MAX];
+  int32_t last_q[EMON_MULTI_MAX];
+  int64_t sum_q[EMON_MULTI_MAX];
+  int64_t sum_total_q;
+  unsigned scans;                     // In the sums so far
+
+  // Last window
+  double irms[EMON_MULTI_MAX];
+  double total_irms;                  // RMS of the sum of all channels, skew corrected
+  int64_t start_us;                   // First conversion of channel 0
+  double slot_us;                     // Conversion to conversion, channel k is k slots late
+};
+
+// Returns -1 for no channels or more than EMON_MULTI_MAX
+int emon_multi_init(emon_multi* m, const emon_sample_provider* provider, const emon_multi_channel* channels, size_t n);
+void emon_multi_set_math(emon_multi* m, emon_math math);
+
+// Polled scan, samples conversions of every channel
+void emon_multi_calc(emon_multi* m, unsigned samples);
+
+// Interleaved samples in scan order from the DMA, whole scans only (len a multiple of n)
+void emon_multi_push(emon_multi* m, const uint16_t* samples, size_t len);
+// Close the window over everything pushed since the last one, returns the scans in it
+unsigned emon_multi_finish(emon_multi* m);
+
+// Same as emon_calcIrms_stream for all channels, the stream delivers scans in order
+unsigned emon_multi_calc_stream(emon_multi* m, adc_stream* stream, unsigned samples);
+
+void emon_multi_print(const emon_multi* m);
+
+#endif
@@ -0,0 +1,83 @@
+/*
+*****************************************************************
+* emon_profile.h - Jitter Profiler For Polled ADC Sampling      *
+*****************************************************************
+
+  Sits between the energy monitor and its sample provider and stamps
+  every conversion with a free running tick counter, the CPU cycle
+  counter on the device.  Over a window (emon_profile_begin to
+  emon_profile_print) it keeps the interval between conversions in a
+  histogram of EMON_PROFILE_BINS fixed bins, their mean and spread,
+  and the EMON_PROFILE_GAPS longest ones with where in the window
+  they fell.  That gives the rate a polled emon_calcIrms actually
+  gets, and what Wi-Fi interrupts and the other core take out of it.
+
+  Each window is also printed as one JITTER line that
+  host/jitter_sim reads back, to work out the RMS error that jitter
+  costs next to timer and DMA sampling.
+
+  The profiler adds a counter read, a divide and a few adds to every
+  conversion, so the rate it reports is a little under the rate
+  without it.
+*/
+#ifndef DIZON_EMON_PROFILE_H
+#define DIZON_EMON_PROFILE_H
+
+#include <stdint.h>
+#include "dizon_EmonLib.h"
+
+#define EMON_PROFILE_BINS 64                     // The last one takes every longer interval
+#define EMON_PROFILE_GAPS 8
+
+typedef uint32_t (*emon_profile_ticks)(void* ctx);
+
+typedef struct emon_profile_gap emon_profile_gap;
+
+struct emon_profile_gap
+{
+  uint32_t index;                                //Conversion the gap ended at, from 1
+  uint32_t ticks;
+};
+
+typedef struct emon_profile emon_profile;
+
+struct emon_profile
+{
+  emon_sample_provider provider;                 //Hand this to emon_init
+  const emon_sample_provider* inner;
+  emon_profile_ticks ticks;
+  void* ticks_ctx;
+  uint32_t ticks_per_us;
+  uint32_t bin_ns;
+  uint32_t bin_ticks;
+
+  //Current window
+  uint32_t n;                                    //Conversions
+  uint32_t last;                                 //Ticks at the last one
+  uint32_t bins[EMON_PROFILE_BINS];
+  uint32_t min, max;                             //Intervals, in ticks
+  uint64_t sum, sumsq;
+  emon_profile_gap gaps[EMON_PROFILE_GAPS];      //Longest first
+  uint8_t gap_count;
+};
+
+typedef struct emon_profile_stats emon_profile_stats;
+
+struct emon_profile_stats
+{
+  uint32_t samples;
+  double span_us;                                //First conversion to last
+  double rate_hz;                                //Effective, over the span
+  double mean_us, sd_us, min_us, max_us;         //Of the intervals
+  double p50_us, p99_us, p999_us;                //Upper edge of their bin, the longest gap past the last
+};
+
+// ticks counts ticks_per_us a microsecond and may wrap, bin_ns is the histogram resolution
+int emon_profile_init(emon_profile* p, const emon_sample_provider* inner, emon_profile_ticks ticks,
+                      void* ticks_ctx, uint32_t ticks_per_us, uint32_t bin_ns);
+void emon_profile_begin(emon_profile* p);
+void emon_profile_summarize(const emon_profile* p, emon_profile_stats* s);
+// A summary line, then the window as a JITTER line
+void emon_profile_print(const emon_profile* p);
+
+#endif
@@ -0,0 +1,152 @@
+/*
+*****************************************************************
+* emon_sync.h - Zero Crossing Synchronised RMS Windows          *
+*****************************************************************
+
+  Finds the zero crossings of an offset-filtered signal so a window
+  can span an exact number of half cycles.  A crossing only counts
+  once the signal has been further than band from zero on the other
+  side since the last one, so noise around zero cannot add crossings.
+  Its position is interpolated between the two samples either side
+  of zero.  The window is sized by those positions and not by the
+  samples in it.  A window of whole cycles measured in fractional
+  samples has no truncation error, and the line frequency falls out
+  of its length.
+
+  The state carries over from one window to the next: the band
+  widens to a share of the last window's peak for big signals, and
+  a crossing sooner than half a half cycle of the last window after
+  the one before is a noise spike and is not counted.
+
+  The samples either side of a crossing are split between the two
+  windows by the fraction each side of it.
+*/
+
+#ifndef DIZON_EMON_SYNC_H
+#define DIZON_EMON_SYNC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+// Hysteresis in filtered ADC counts, above the noise of the ESP32 ADC, or this share of
+// the peak of the last window if that is more
+#define EMON_SYNC_BAND 8.0
+#define EMON_SYNC_BAND_SHARE 0.25
+// Of the last window's half cycle, the closest two crossings can be
+#define EMON_SYNC_HOLDOFF 0.5
+
+typedef enum {
+  EMON_SYNC_NONE = 0,
+  EMON_SYNC_START,                          //First crossing, the window opens in this sample
+  EMON_SYNC_CROSS,                          //A crossing inside the window
+  EMON_SYNC_END                             //Last crossing, the window closes in this sample
+} emon_sync_event;
+
+typedef struct emon_sync emon_sync;
+
+struct emon_sync
+{
+  double band;
+  double holdoff;                           //Samples after a crossing before the next counts
+  uint16_t half_cycles;                     //Window length in crossings
+  int8_t armed;                             //-1 was below -band, next is a rising crossing; +1 falling; 0 neither yet
+  double last;                              //Previous sample
+  double peak;                              //Largest magnitude seen, for the next window's band
+  double last_at;                           //Position of the last crossing counted
+  uint16_t crossings;                       //Counted from the opening one
+  uint32_t n;                               //Samples since emon_sync_begin
+  double start;                             //Position of the opening crossing, in samples
+  double length;                            //Of the window, in samples, once it closed
+};
+
+// Starts a window, from what the last one on the same signal found.  Zero the state first.
+static inline void emon_sync_begin(emon_sync* s, uint16_t half_cycles, double band)
+{
+  const double share = s->peak * EMON_SYNC_BAND_SHARE;
+  s->band = band > share ? band : share;
+  s->holdoff = s->length > 0 ? EMON_SYNC_HOLDOFF * s->length / s->half_cycles : 0;
+  s->peak = 0;
+  s->half_cycles = half_cycles ? half_cycles : 1;
+  s->armed = 0;
+  s->last = 0;
+  s->crossings = 0;
+  s->n = 0;
+  s->start = s->length = 0;
+}
+
+//--------------------------------------------------------------------------------------
+// One filtered sample.  On a crossing *frac is the part of the interval from the last
+// sample to this one that comes before the crossing, and so belongs to the window
+// that ends there.
+//--------------------------------------------------------------------------------------
+static inline emon_sync_event emon_sync_sample(emon_sync* s, double x, double* frac)
+{
+  double last = s->last;
+  bool cross = false;
+
+  s->n++;
+  s->last = x;
+  s->peak = fabs(x) > s->peak ? fabs(x) : s->peak;
+  if (s->armed < 0)
+  {
+    cross = x >= 0;
+  }
+  else if (s->armed > 0)
+  {
+    cross = x < 0;
+  }
+  if (!cross)
+  {
+    if (s->armed == 0)
+    {
+      s->armed = x < -s->band ? -1 : x > s->band ? 1 : 0;
+    }
+    return EMON_SYNC_NONE;
+  }
+
+  // Straight line between the samples either side of zero
+  *frac = last == x ? 1 : last / (last - x);
+  double at = s->n - 1 + *frac;
+  // Has to get out past the band on this side before the next one counts
+  s->armed = x < -s->band ? -1 : x > s->band ? 1 : 0;
+  if (s->crossings > 0 && at - s->last_at < s->holdoff)
+  {
+    return EMON_SYNC_NONE;
+  }
+  s->last_at = at;
+  if (s->crossings == 0)
+  {
+    s->crossings = 1;
+    s->start = at;
+    return EMON_SYNC_START;
+  }
+  if (s->crossings > s->half_cycles)
+  {
+    return EMON_SYNC_NONE;                  //Closed already
+  }
+  if (++s->crossings <= s->half_cycles)
+  {
+    return EMON_SYNC_CROSS;
+  }
+  s->length = at - s->start;
+  return EMON_SYNC_END;
+}
+
+// Samples the sums cover: the exact window once it closed, from the opening crossing
+// while it is open, everything before that
+static inline double emon_sync_covered(const emon_sync* s)
+{
+  if (s->crossings > s->half_cycles)
+  {
+    return s->length;
+  }
+  return s->crossings ? s->n - s->start : s->n;
+}
+
+static inline bool emon_sync_closed(const emon_sync* s)
+{
+  return s->crossings > s->half_cycles;
+}
+
+#endif
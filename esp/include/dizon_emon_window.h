@@ -0,0 +1,83 @@
+/*
+*****************************************************************
+* emon_window.h - Sliding Window Per-Cycle Current RMS          *
+*****************************************************************
+
+  Streams every sample from the ADC through the energy monitor's
+  offset filter and keeps the sum of squares of each mains cycle in
+  a circular window.  Every emit_cycles cycles it reports the RMS
+  over the last window_cycles cycles, so there is no dead time
+  between measurements.  The reported values are also folded into
+  min/max/mean statistics that the publisher collects once per
+  interval.
+*/
+
+#ifndef DIZON_EMON_WINDOW_H
+#define DIZON_EMON_WINDOW_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "dizon_EmonLib.h"
+
+#define EMON_WINDOW_MAX_CYCLES 60
+
+// Called for every RMS the window emits, t_us is the time of the last sample in it
+typedef void (*emon_window_cb)(void* user, int64_t t_us, float irms);
+
+typedef struct emon_window_stats emon_window_stats;
+
+struct emon_window_stats
+{
+  float min;
+  float max;
+  float mean;
+  uint32_t count;               // RMS values folded in, 0 if none were emitted
+};
+
+typedef struct emon_window emon_window;
+
+struct emon_window
+{
+  energy_mon* emon;             // Supplies the offset filter and ICAL
+  uint32_t sample_rate_hz;
+  uint32_t mains_hz;
+  uint16_t window_cycles;
+  uint16_t emit_cycles;
+  emon_window_cb callback;
+  void* user;
+
+  // Cycle currently being accumulated, boundaries are found Bresenham style so a
+  // fractional number of samples per cycle does not drift
+  int64_t cycle_sum;
+  uint32_t cycle_n;
+  uint32_t phase;
+
+  // Completed cycles in the window
+  int64_t sums[EMON_WINDOW_MAX_CYCLES];
+  uint32_t counts[EMON_WINDOW_MAX_CYCLES];
+  uint16_t next;
+  uint16_t filled;
+  int64_t window_sum;
+  uint32_t window_n;
+  uint16_t since_emit;
+
+  float last_irms;
+  uint64_t cycles;              // Total completed cycles
+
+  // Statistics since the last emon_window_take_stats
+  emon_window_stats stats;
+  double stats_sum;
+};
+
+int emon_window_init(emon_window* w, energy_mon* emon, uint32_t sample_rate_hz, uint32_t mains_hz,
+                     uint16_t window_cycles, uint16_t emit_cycles);
+void emon_window_set_callback(emon_window* w, emon_window_cb callback, void* user);
+
+// Feed consecutive samples, start_us is the time of samples[0]. Returns how many RMS values were emitted.
+int emon_window_push(emon_window* w, const uint16_t* samples, size_t len, int64_t start_us);
+
+// Statistics of the values emitted since the last call, then starts a new interval
+void emon_window_take_stats(emon_window* w, emon_window_stats* stats);
+
+#endif
@@ -0,0 +1,63 @@
+/*
+*****************************************************************
+* encode.h - Telemetry Payload Encoders                         *
+*****************************************************************
+
+  Turns a batch of sump_records into an MQTT payload.  The device
+  ID is written once per payload, records follow.
+
+  CBOR layout (RFC 8949), integer keys, version 4:
+    { 0: 4, 1: "ID", 2: base UTC seconds,
+      3: [ [seq, time - base, Irms mA, memFree], ...
+           [seq, time - base, Irms mA, memFree, IrmsMin mA, IrmsMax mA, cycles] ] }
+  The second record form is used when the record has per-cycle
+  values.  Either form gets one more element, the number of
+  readings the deadband held back, when that is not 0.  A record
+  with a water level always has all of those, then the level in mm
+  and the rate of rise in mm/h, 10 elements.  With more than one
+  pump any of these ends in an array of the other pumps' Irms in
+  mA, JSON has "Irms2".."Irms4" for them.  A JSON payload always
+  starts with '{', a CBOR one with 0xa4, so both can share a topic.
+  JSON times have milliseconds, CBOR ones are whole seconds.
+
+  Each version only added a record form: 2 the held back count, 3
+  the level, 4 the other pumps.  The decoder takes every version
+  from 1 on, by the length of each record, and refuses a record
+  form newer than its payload.
+*/
+
+#ifndef DIZON_ENCODE_H
+#define DIZON_ENCODE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "dizon_record.h"
+
+typedef struct telemetry_encoder telemetry_encoder;
+
+struct telemetry_encoder
+{
+    const char* name;
+    size_t header_bytes;        // Upper bound for the per-payload part
+    // Upper bound for one record
+    size_t (*record_bytes)(const sump_record* rec);
+    // Encode as many of recs[0..n) as fit in len bytes, *used says how many.
+    // Returns the payload length, 0 if not even one record fits.
+    size_t (*encode)(const char* id, const sump_record* recs, size_t n, uint8_t* buf, size_t len, size_t* used);
+    // Back to records, NULL if the encoder has no decoder. Returns 0, -1 on a malformed
+    // payload or if it holds more than max records.
+    int (*decode)(const uint8_t* buf, size_t len, char* id, size_t id_len,
+                  sump_record* recs, size_t max, size_t* n);
+};
+
+// The original quoted JSON fields, wrapped in { "ID":..., "records":[...] }
+extern const telemetry_encoder telemetry_json;
+// Compact binary, Irms in integer milliamps
+extern const telemetry_encoder telemetry_cbor;
+
+#define CBOR_BATCH_VERSION 4
+
+const telemetry_encoder* telemetry_encoder_find(const char* name);
+
+#endif
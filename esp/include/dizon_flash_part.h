@@ -0,0 +1,23 @@
+/*
+*****************************************************************
+* flash_part.h - Flash Log Storage In A Data Partition          *
+*****************************************************************
+
+  flash_ops over an esp_partition, the telemetry partition in
+  partitions.csv.
+*/
+
+#ifndef DIZON_FLASH_PART_H
+#define DIZON_FLASH_PART_H
+
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "dizon_flashlog.h"
+
+#define FLASH_PART_LABEL   "telemetry"
+#define FLASH_PART_SUBTYPE 0x40
+
+// NULL if the partition table has no such partition
+const flash_ops* flash_partition_ops(const char* label);
+
+#endif
@@ -0,0 +1,37 @@
+/*
+*****************************************************************
+* flash_sim.h - RAM Flash Standing In For A Flash Partition     *
+*****************************************************************
+
+  Behaves like NOR flash (erase to 0xff, writes only clear bits)
+  so the flash log, its wrap-around and its recovery can be run on
+  the host.  A power cut can be scheduled after a number of bytes
+  have been written or erased; the operation it lands in is left
+  half done, everything after it fails until flash_sim_power_on.
+*/
+
+#ifndef DIZON_FLASH_SIM_H
+#define DIZON_FLASH_SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "dizon_flashlog.h"
+
+typedef struct flash_sim flash_sim;
+
+struct flash_sim
+{
+    uint8_t* mem;
+    uint32_t* erase_counts;     // One per sector, optional
+    int64_t cut_after;          // Bytes until the power cut, -1 for none
+    bool powered;
+    uint64_t bytes_written;
+    flash_ops ops;
+};
+
+const flash_ops* flash_sim_init(flash_sim* sim, uint8_t* mem, uint32_t size, uint32_t sector_size,
+                                uint32_t* erase_counts);
+void flash_sim_cut_after(flash_sim* sim, int64_t bytes);
+void flash_sim_power_on(flash_sim* sim);
+
+#endif
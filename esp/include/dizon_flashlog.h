@@ -0,0 +1,90 @@
+/*
+*****************************************************************
+* flashlog.h - Store-And-Forward Record Log In A Flash Ring     *
+*****************************************************************
+
+  Keeps sump_records in flash while the broker cannot be reached
+  and hands them back oldest first once it can.
+
+  The area is split into fixed 32 byte entries, written strictly in
+  order around the ring, so every sector gets erased as often as
+  every other one.  Entering a sector erases it, which drops the
+  oldest records if nobody replayed them in time.  How far the
+  server has confirmed is itself an entry (COMMIT), never a fixed
+  location that would be rewritten over and over; the first entry
+  of every freshly erased sector repeats it so it cannot be erased
+  away.  Every entry carries a running sequence number and a CRC;
+  after a reset flashlog_open scans the area and picks up from the
+  newest valid entry, skipping anything torn by a power cut.
+
+  The flash itself is reached through flash_ops, backed by an
+  esp_partition on the device (dizon_flash_part.h) and by RAM on
+  the host (dizon_flash_sim.h).
+*/
+
+#ifndef DIZON_FLASHLOG_H
+#define DIZON_FLASHLOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "dizon_record.h"
+
+#define FLASHLOG_ENTRY_SIZE 32
+
+typedef struct flash_ops flash_ops;
+
+// NOR semantics: erase sets a sector to 0xff, write can only clear bits
+struct flash_ops
+{
+    void* ctx;
+    uint32_t size;              // Bytes, a whole number of sectors
+    uint32_t sector_size;
+    int (*read)(void* ctx, uint32_t offset, void* buf, size_t len);
+    int (*write)(void* ctx, uint32_t offset, const void* buf, size_t len);
+    int (*erase)(void* ctx, uint32_t offset, size_t len);
+};
+
+typedef struct flashlog flashlog;
+
+struct flashlog
+{
+    const flash_ops* flash;
+    uint32_t slots;             // Entries in the area
+    uint32_t slots_per_sector;
+
+    uint32_t head;              // Next slot to write
+    uint32_t next_seq;          // Entry sequence number for it
+    uint32_t read_slot;         // Oldest record not committed
+    uint32_t peek_slot;         // Where flashlog_replay continues
+    uint32_t committed_seq;     // Newest record entry the server has, 0 for none
+    uint32_t pending;           // Records not committed
+
+    // Counters since flashlog_open
+    uint32_t appended;
+    uint32_t replayed;
+    uint32_t lost;              // Records erased before they were committed
+    uint32_t skipped;           // Torn or corrupt entries passed over
+    uint32_t erases;
+};
+
+// Scan the area and pick up where the last run left off. -1 if the area is too
+// small (two sectors at least) or the flash fails.
+int flashlog_open(flashlog* log, const flash_ops* flash);
+// Forget everything in the area
+int flashlog_format(flashlog* log);
+
+int flashlog_append(flashlog* log, const sump_record* rec);
+
+// Copy up to max records not committed yet, oldest first, continuing after the last
+// call. Records come back without mono_us and free_mem, which are not stored.
+size_t flashlog_replay(flashlog* log, sump_record* recs, size_t max);
+// The oldest count records have been delivered. Replay starts again right after them.
+int flashlog_commit(flashlog* log, size_t count);
+// Sending failed, the next replay starts again at the oldest record not committed
+void flashlog_rewind(flashlog* log);
+
+uint32_t flashlog_pending(const flashlog* log);
+void flashlog_print(const flashlog* log);
+
+#endif
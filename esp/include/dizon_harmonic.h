@@ -0,0 +1,87 @@
+/*
+*****************************************************************
+* harmonic.h - Current Harmonics And THD From The Sample Stream *
+*****************************************************************
+
+  Every so often takes a window of a whole number of mains cycles
+  from the stream and runs one Goertzel filter per harmonic over it
+  as the blocks come in, so nothing is buffered and the RMS path
+  keeps getting every block.  Between windows a block costs one
+  addition.  The result has the RMS of each harmonic in amps, the
+  total RMS of the window and THD, the RMS of harmonics 2 and up
+  over the fundamental.
+
+  Only the harmonics asked for are computed, a pump needs few:
+  the 3rd and 5th come up with a failing winding or bearing drag,
+  the 2nd with the half-wave asymmetry of a stalled rotor.
+*/
+
+#ifndef DIZON_HARMONIC_H
+#define DIZON_HARMONIC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "dizon_EmonLib.h"
+
+#define HARMONIC_MAX        8       // Orders analysed in one window, fundamental included
+#define HARMONIC_MAX_CYCLES 60
+
+typedef struct harmonic_config harmonic_config;
+
+struct harmonic_config
+{
+  uint32_t sample_rate_hz;    // Of the channel analysed, not the whole scan
+  uint32_t mains_hz;
+  uint16_t cycles;            // Window length
+  uint32_t period_ms;         // From the start of one window to the next
+  uint8_t orders[HARMONIC_MAX];   // 1 for the fundamental, 2, 3, 5 ... 0 ends the list early
+  uint8_t stride;             // Samples per scan, channel 0 is analysed
+  double ical;                // Same as the channel's emon_current
+};
+
+typedef struct harmonic_result harmonic_result;
+
+struct harmonic_result
+{
+  uint8_t count;
+  uint8_t orders[HARMONIC_MAX];
+  float irms[HARMONIC_MAX];   // Amps, per order
+  float total_irms;           // Everything in the window, DC removed
+  float thd;                  // Harmonics above the fundamental over it, 0.05 is 5%
+  uint32_t samples;
+  uint32_t windows;           // Since harmonic_init
+};
+
+typedef struct harmonic harmonic;
+
+struct harmonic
+{
+  harmonic_config cfg;
+  uint8_t count;
+  float coeff[HARMONIC_MAX];  // 2 cos(w) of each order
+  float s1[HARMONIC_MAX];
+  float s2[HARMONIC_MAX];
+  uint32_t window_len;        // Samples in a window
+  uint32_t period_len;        // Samples from window start to window start
+  uint32_t pos;               // Into the period, the window is its start
+  uint32_t skip;              // Into a scan, when blocks end mid-scan
+  float dc;                   // Mean of the last window, taken off the next
+  int64_t sum;                // Raw samples of the window, for its total RMS and DC
+  int64_t sum_sq;
+  bool ready;
+  harmonic_result result;
+};
+
+// Returns -1 for no orders, an order past Nyquist or a window longer than the period
+int harmonic_init(harmonic* h, const harmonic_config* cfg);
+
+// Consecutive samples (scans when stride > 1), true when a window completed in them
+bool harmonic_push(harmonic* h, const uint16_t* samples, size_t len);
+
+// Copies the last completed window out once, false if there is none since the last call
+bool harmonic_take(harmonic* h, harmonic_result* out);
+
+void harmonic_print(const harmonic_result* r);
+
+#endif
@@ -0,0 +1,83 @@
+/*
+*****************************************************************
+* level.h - Sump Water Level From Ultrasonic Echo Times         *
+*****************************************************************
+
+  Turns bursts of echo times from the ultrasonic sensor into a
+  water level and a rate of rise.  Each burst is reduced to its
+  median after dropping missing echoes, echoes outside the sensor
+  range and pings too far from the median (reflections off the pit
+  wall or the pump, double bounces).  The rate of rise is the median
+  slope between pairs of recent levels, so one bad reading does not
+  swing it.  No hardware here, the echo times come from
+  dizon_ultrasonic on the device and from a simulation on the host.
+*/
+
+#ifndef DIZON_LEVEL_H
+#define DIZON_LEVEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define LEVEL_MAX_PINGS 16      // Most pings in one burst
+#define LEVEL_HISTORY   32      // Levels kept for the rate of rise
+
+typedef struct level_config level_config;
+
+struct level_config
+{
+    float mount_cm;             // Sensor face to the floor of the pit
+    float min_cm;               // Blind zone of the sensor, closer echoes are dropped
+    float max_cm;               // and so are ones from further than this
+    float temp_c;               // Air temperature for the speed of sound
+    float spread_cm;            // Pings further than this from the burst median are outliers
+    uint8_t min_pings;          // Pings that have to agree for a reading
+    uint32_t rate_window_s;     // Rate of rise is fitted over this much history
+};
+
+typedef struct level_reading level_reading;
+
+struct level_reading
+{
+    float level_cm;             // Water above the floor of the pit
+    float distance_cm;          // Sensor to the water
+    float rate_cm_h;            // Rate of rise, negative while the pump drains the pit
+    bool have_rate;             // Enough history for rate_cm_h
+    uint8_t pings;              // Pings behind the reading
+};
+
+typedef struct level level;
+
+struct level
+{
+    level_config cfg;
+    float cm_per_us;            // Round trip, so half the speed of sound
+
+    int64_t hist_us[LEVEL_HISTORY];
+    float hist_cm[LEVEL_HISTORY];
+    uint16_t hist_head;
+    uint16_t hist_count;
+    float slopes[LEVEL_HISTORY * (LEVEL_HISTORY - 1) / 2];   // Scratch for the rate fit
+
+    // Since level_init
+    uint32_t bursts;
+    uint32_t readings;
+    uint32_t pings;
+    uint32_t no_echo;
+    uint32_t out_of_range;
+    uint32_t outliers;
+};
+
+int level_init(level* lv, const level_config* cfg);
+
+// Sensor to target for a round trip echo time at temp_c
+float level_echo_cm(uint32_t echo_us, float temp_c);
+
+// Filter one burst of echo times taken at t_us, 0 for a ping that got no echo.
+// Returns 0 with *out filled, -1 if fewer than min_pings agreed.
+int level_burst(level* lv, const uint32_t* echo_us, size_t n, int64_t t_us, level_reading* out);
+
+void level_print(const level* lv);
+
+#endif
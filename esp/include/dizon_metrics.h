@@ -0,0 +1,118 @@
+/*
+*****************************************************************
+* metrics.h - Lock-Free Counters And Latency Histograms          *
+*****************************************************************
+
+  Timings go into histograms with fixed power of two buckets, so
+  recording one is a count leading zeros and two atomic adds, with
+  no lock and nothing to allocate.  Any task may record into any
+  histogram at the same time as the others.  One reader takes a
+  summary now and then, which empties the histogram for the next
+  period; a value recorded while it does so counts in one period
+  or the next, never in both.
+
+  Percentiles come back as the upper edge of the bucket they fall
+  in, never more than the largest value seen, so they are accurate
+  to a factor of two at worst.  Counters are plain uint32_t bumped
+  with metrics_add and read back with metrics_take_count.
+*/
+
+#ifndef DIZON_METRICS_H
+#define DIZON_METRICS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define METRICS_BUCKETS     16
+#define METRICS_MAX_TASKS   24
+#define METRICS_TASK_NAME   16
+#define METRICS_NO_CPU      UINT16_MAX  // Run time stats are off in FreeRTOS
+
+typedef struct metrics_hist metrics_hist;
+
+struct metrics_hist
+{
+    uint8_t shift;                      // Bucket 0 is below 2^shift, each next one twice as wide
+    uint32_t buckets[METRICS_BUCKETS];  // The last one takes everything above
+    uint32_t max;
+};
+
+typedef struct metrics_summary metrics_summary;
+
+struct metrics_summary
+{
+    uint32_t count;
+    uint32_t p50;
+    uint32_t p90;
+    uint32_t p99;
+    uint32_t max;
+};
+
+typedef struct metrics_task metrics_task;
+
+struct metrics_task
+{
+    char name[METRICS_TASK_NAME];
+    uint32_t stack_free;                // Least stack ever left, bytes
+    uint16_t cpu_permille;              // Of both CPUs over the period, METRICS_NO_CPU if unknown
+};
+
+typedef struct metrics_report metrics_report;
+
+// What goes out on the metrics topic, filled in by the firmware once a period
+struct metrics_report
+{
+    uint32_t period_s;
+    metrics_summary sample;             // Time spent on one measurement, in us
+    metrics_summary latency;            // Measurement to publish, in us
+    metrics_summary publish;            // One client publish call, in us
+    uint32_t publish_failures;
+    uint32_t connects;                  // Since power on
+    uint32_t connect_failures;
+    uint32_t connect_ms;                // Last connect
+    uint32_t heap_free;
+    uint32_t heap_min;                  // Least free ever
+    uint32_t heap_largest;              // Largest block that can be allocated now
+    uint32_t ring_waiting;
+    uint32_t ring_high_water;
+    uint32_t ring_overflows;
+    uint8_t task_count;
+    metrics_task tasks[METRICS_MAX_TASKS];
+};
+
+// shift puts the smallest value of interest in bucket 1, 2^(shift + 14) and up go in the last
+void metrics_hist_init(metrics_hist* h, uint8_t shift);
+
+static inline void metrics_record(metrics_hist* h, uint32_t value)
+{
+    uint32_t v = value >> h->shift;
+    uint32_t b = v == 0 ? 0 : 32 - (uint32_t)__builtin_clz(v);
+    uint32_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&h->buckets[b < METRICS_BUCKETS ? b : METRICS_BUCKETS - 1], 1, __ATOMIC_RELAXED);
+    while (value > max &&
+           !__atomic_compare_exchange_n(&h->max, &max, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Records the time from start_us to now_us, clamped at 0
+static inline void metrics_record_since(metrics_hist* h, int64_t start_us, int64_t now_us)
+{
+    int64_t us = now_us - start_us;
+    metrics_record(h, us <= 0 ? 0 : us >= UINT32_MAX ? UINT32_MAX : (uint32_t)us);
+}
+
+// Summarises what was recorded since the last take and empties the histogram
+void metrics_take(metrics_hist* h, metrics_summary* out);
+
+static inline void metrics_add(uint32_t* counter, uint32_t n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+// Returns the count and starts it again from 0
+uint32_t metrics_take_count(uint32_t* counter);
+
+void metrics_print(const metrics_report* r);
+
+#endif
@@ -1,12 +1,94 @@
 #ifndef DIZON_MQTT_H
 #define DIZON_MQTT_H
 
+#include <string.h>
+#include <stdbool.h>
 #include "esp_log.h"
 #include "mqtt_client.h"
 #include "aws_clientcredential_keys.h"
+#include "dizon_record.h"
+#include "dizon_pump.h"
+#include "dizon_harmonic.h"
+#include "dizon_outbox.h"
+#include "dizon_metrics.h"
+#include "dizon_rollup.h"
 
-esp_mqtt_client_handle_t mqtt_app_start(void);
+// Batched telemetry goes out here, runtime settings come in on the config topic
+#define SUMP_BATCH_TOPIC    "esptest/batch"
+#define SUMP_CONFIG_TOPIC   "esptest/config"
+// Raw waveform chunks, the device ID follows
+#define SUMP_CAPTURE_TOPIC  "esptest/capture"
+// Device health, a few times an hour
+#define SUMP_METRICS_TOPIC  "esptest/metrics"
+// Minute, hour and day aggregates, sent as they close or on request
+#define SUMP_ROLLUP_TOPIC   "esptest/rollup"
+#define SUMP_ROLLUP_GET_TOPIC "esptest/rollup/get"
 
-void send_aws_msg(esp_mqtt_client_handle_t client, char* id, char* time, double Irms, uint32_t free_mem);
+typedef void (*mqtt_config_cb)(const char* data, int len);
+typedef void (*mqtt_connected_cb)(void);
+typedef void (*mqtt_published_cb)(void);
+typedef void (*mqtt_request_cb)(const char* data, int len);
+
+typedef struct mqtt_connect_stats mqtt_connect_stats;
+
+// Kept in RTC memory, so they count across deep sleep until the next power on
+struct mqtt_connect_stats
+{
+    uint32_t attempts;
+    uint32_t failures;          // Attempts that ended before the CONNACK
+    uint32_t session_kept;      // CONNACK had session present, nothing subscribed again
+    uint32_t session_new;       // The broker started a new MQTT session
+    uint64_t session_kept_ms;   // Total connect time of each kind, TCP and a full TLS handshake included
+    uint64_t session_new_ms;
+    uint32_t last_ms;
+    uint32_t max_ms;
+    uint32_t heap_before;       // Free heap when the last attempt started
+    uint32_t heap_peak;         // Most the last connect took, 0 if the heap went lower before
+    uint32_t heap_peak_max;
+};
+
+// Connects to uri, AWS IoT with the device certificate if it is NULL or empty
+esp_mqtt_client_handle_t mqtt_app_start(const char* uri);
+
+void mqtt_on_config(mqtt_config_cb cb);
+void mqtt_on_connected(mqtt_connected_cb cb);
+// Every PUBACK, from the MQTT task
+void mqtt_on_published(mqtt_published_cb cb);
+// Subscribes to the rollup request topic on connect, from the MQTT task
+void mqtt_on_rollup_request(mqtt_request_cb cb);
+bool mqtt_connected(void);
+const mqtt_connect_stats* mqtt_get_connect_stats(void);
+void mqtt_print_connect_stats(void);
+
+// From then on every send_ below queues in ob and returns -1 if it is full, and
+// mqtt_pump_outbox sends them at QoS 1.  Without one they go straight to the client.
+void mqtt_use_outbox(outbox* ob);
+// Times every client publish call into h
+void mqtt_time_publishes(metrics_hist* h);
+// Publishes the client refused since the last call
+uint32_t mqtt_take_publish_failures(void);
+// Sends what the in-flight window has room for, while connected
+int mqtt_pump_outbox(esp_mqtt_client_handle_t client);
+// Whether a publish of len bytes on topic would be taken now, always without an outbox
+bool mqtt_can_queue(const char* topic, size_t len);
+
+// Returns the msg_id, -1 if it could not be sent
+int send_aws_msg(esp_mqtt_client_handle_t client, char* id, const char* time, const sump_record* rec);
+
+// Returns the msg_id, -1 if it could not be sent
+int send_aws_batch(esp_mqtt_client_handle_t client, const uint8_t* payload, size_t len);
+
+int send_pump_event(esp_mqtt_client_handle_t client, char* id, const char* time, const pump_event* ev);
+
+int send_harmonics(esp_mqtt_client_handle_t client, char* id, const char* time, const harmonic_result* r);
+
+int send_metrics(esp_mqtt_client_handle_t client, char* id, const char* time, const metrics_report* r);
+
+// n buckets of one level in one message, the last of them still open if open is set
+int send_rollup(esp_mqtt_client_handle_t client, char* id, rollup_level level, const rollup_bucket* b,
+                size_t n, bool open);
+
+// Returns the msg_id, -1 if it could not be sent
+int send_capture_chunk(esp_mqtt_client_handle_t client, const char* id, const uint8_t* chunk, size_t len);
 
 #endif
\ No newline at end of file
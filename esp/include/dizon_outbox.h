@@ -0,0 +1,128 @@
+/*
+*****************************************************************
+* outbox.h - Bounded QoS 1 Outbox With Ack Tracking             *
+*****************************************************************
+
+  Everything the device publishes queues here and goes out at QoS 1
+  with at most max_inflight messages waiting for their PUBACK.  The
+  window also bounds the copies esp-mqtt keeps of unacked messages,
+  so the memory held for delivery is the arena handed to
+  outbox_init plus max_inflight messages, whatever the broker does.
+
+  Messages are stored topic and payload together in the arena, in
+  the order they were queued, and the space comes back once a
+  message and all the ones queued before it are acked.  When a
+  message does not fit outbox_push refuses it and counts it; that
+  is the backpressure signal, the producer decides whether to hold
+  on to its data, merge it into the next message or spill it.
+
+  One task queues and sends (outbox_push, outbox_pump).  Acks come
+  from the MQTT event task through outbox_ack, a lock-free queue of
+  msg_ids that outbox_pump drains.  A message with no ack after
+  retry_ms is sent again, and the wait doubles with every retry up
+  to OUTBOX_MAX_BACKOFF times, so a broker slower than retry_ms
+  still gets to ack.  Delivery is at least once.
+*/
+
+#ifndef DIZON_OUTBOX_H
+#define DIZON_OUTBOX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define OUTBOX_MAX_MESSAGES 32
+#define OUTBOX_ACK_QUEUE    64          // Power of two, acks that can arrive between two pumps
+#define OUTBOX_TOPIC_MAX    64
+#define OUTBOX_MAX_BACKOFF  8           // Longest retry wait, in retry_ms
+
+// Publishes at QoS 1, returns the msg_id the ack will carry, -1 if it could not be sent
+typedef int (*outbox_send_fn)(void* ctx, const char* topic, const uint8_t* data, size_t len);
+
+typedef enum {
+    OUTBOX_QUEUED,
+    OUTBOX_INFLIGHT,            // Sent, waiting for the ack
+    OUTBOX_ACKED,               // Its space comes back with the ones ahead of it
+} outbox_state;
+
+typedef struct outbox_config outbox_config;
+
+struct outbox_config
+{
+    uint8_t max_inflight;       // 1 .. OUTBOX_MAX_MESSAGES
+    uint32_t retry_ms;          // Sent again with no ack by then
+};
+
+typedef struct outbox_msg outbox_msg;
+
+struct outbox_msg
+{
+    uint32_t offset;            // Of the topic in the arena, the payload follows its NUL
+    uint32_t span;              // Arena bytes it holds, with any left unused at the end before it
+    uint16_t topic_len;
+    uint32_t len;
+    int msg_id;
+    uint8_t state;              // outbox_state
+    uint8_t tries;              // Sends so far
+    int64_t queued_us;
+    int64_t sent_us;            // Of the last send
+};
+
+typedef struct outbox_stats outbox_stats;
+
+struct outbox_stats
+{
+    uint32_t queued;
+    uint32_t sent;              // Publishes, retries included
+    uint32_t acked;
+    uint32_t retries;
+    uint32_t rejected;          // Refused by outbox_push, no room
+    uint32_t unknown_acks;      // For no message in flight, a late ack of a retried one
+    uint32_t ack_overflows;     // Acks lost because the queue was full, the message is retried
+    uint32_t high_water_bytes;
+    uint64_t latency_sum_us;    // Queued to acked
+    uint32_t latency_max_us;
+};
+
+typedef struct outbox outbox;
+
+struct outbox
+{
+    outbox_config cfg;
+    uint8_t* arena;
+    uint32_t arena_len;
+    uint32_t used;              // Arena bytes held, from the oldest message to wr
+    uint32_t wr;                // Where the next message goes
+
+    outbox_msg msgs[OUTBOX_MAX_MESSAGES];
+    uint16_t first;             // Oldest message
+    uint16_t count;
+    uint16_t inflight;
+
+    // Written by the MQTT task only
+    int acks[OUTBOX_ACK_QUEUE];
+    uint32_t ack_head;
+    // Read by the sending task only
+    uint32_t ack_tail;
+
+    outbox_stats stats;
+};
+
+// Returns -1 for a bad config
+int outbox_init(outbox* ob, const outbox_config* cfg, uint8_t* arena, size_t arena_len);
+
+// Sending side.  Copies topic and payload in, -1 if there is no room for them.
+int outbox_push(outbox* ob, const char* topic, const uint8_t* data, size_t len, int64_t now_us);
+// Whether a message of len bytes on topic_len would be taken now
+bool outbox_room(const outbox* ob, size_t topic_len, size_t len);
+// Takes in the acks, frees what they allow, retries what timed out and sends queued
+// messages while the window has room.  Returns the number of publishes.
+int outbox_pump(outbox* ob, int64_t now_us, outbox_send_fn send, void* ctx);
+uint16_t outbox_pending(const outbox* ob);
+
+// MQTT task, on MQTT_EVENT_PUBLISHED
+void outbox_ack(outbox* ob, int msg_id);
+
+void outbox_print(const outbox* ob);
+
+#endif
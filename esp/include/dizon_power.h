@@ -0,0 +1,96 @@
+/*
+*****************************************************************
+* power.h - Sleep Scheduler For Battery Operation               *
+*****************************************************************
+
+  Decides between deep sleep, a short upload and staying up with
+  the radio on.  While the pump is idle the device wakes every
+  wake_s, takes one reading and goes back to sleep with the radio
+  off.  The readings pile up in a buffer that lives in RTC memory
+  and go out in one burst every upload_s, or sooner once
+  upload_fill of them are waiting.  A reading at or above on_amps
+  keeps the device up, publishing as usual, until the current has
+  stayed at or below off_amps for idle_s.
+
+  The state is plain data so it can sit in RTC_DATA_ATTR memory on
+  the device and be driven by a simulated clock on the host.  Times
+  are seconds from time(), which keeps counting through deep sleep.
+*/
+
+#ifndef DIZON_POWER_H
+#define DIZON_POWER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define POWER_BUFFER_SAMPLES 240    // Four hours at one reading a minute
+#define POWER_MAGIC 0x50575231      // "PWR1", anything else in RTC memory is a cold boot
+
+typedef enum {
+    POWER_SLEEP,                // Sleep for *sleep_s
+    POWER_UPLOAD,               // Bring up the radio, send the buffer, then sleep
+    POWER_ACTIVE,               // Stay up and publish as usual
+} power_action;
+
+typedef struct power_config power_config;
+
+struct power_config
+{
+    float on_amps;              // Stay up at or above this
+    float off_amps;             // Go back to sleep after idle_s at or below this
+    uint32_t wake_s;            // Sleep between readings while idle
+    uint32_t idle_s;
+    uint32_t upload_s;          // Send buffered readings at least this often
+    uint16_t upload_fill;       // or once this many are waiting
+};
+
+typedef struct power_sample power_sample;
+
+struct power_sample
+{
+    uint32_t t;                 // time() when it was taken
+    uint16_t milliamps;
+};
+
+typedef struct power_state power_state;
+
+struct power_state
+{
+    uint32_t magic;
+    bool active;                // Up with the radio on rather than duty cycling
+    bool upload_failed;         // Last upload sent nothing, wait upload_s before the next
+    uint32_t last_s;            // Time of the last decision
+    uint32_t quiet_since;       // Active: start of the current run at or below off_amps, 0 for none
+    uint32_t last_upload_s;
+    uint16_t head;              // Oldest buffered reading
+    uint16_t count;
+    power_sample samples[POWER_BUFFER_SAMPLES];
+
+    // Since the cold boot
+    uint32_t wakes;
+    uint32_t activations;
+    uint32_t uploads;
+    uint32_t overflows;         // Readings overwritten before they were sent
+};
+
+int power_check_config(const power_config* cfg);
+
+// Cold boot, starts out active so the device comes up and reports
+void power_init(power_state* ps, uint32_t now_s);
+bool power_valid(const power_state* ps);
+
+// Decide what to do after a reading. While duty cycling the reading is buffered.
+power_action power_decide(power_state* ps, const power_config* cfg, uint32_t now_s, float irms, uint32_t* sleep_s);
+
+// Readings waiting to be sent
+size_t power_pending(const power_state* ps);
+// Copy up to max of the oldest waiting readings, they stay buffered until power_sent
+size_t power_peek(const power_state* ps, power_sample* out, size_t max);
+// The n oldest went out. n of 0 with readings waiting records a failed upload.
+void power_sent(power_state* ps, size_t n, uint32_t now_s);
+
+const char* power_action_name(power_action a);
+void power_print(const power_state* ps);
+
+#endif
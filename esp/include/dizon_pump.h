@@ -0,0 +1,99 @@
+/*
+*****************************************************************
+* pump.h - Pump Run-Cycle Detector                              *
+*****************************************************************
+
+  Turns the stream of Irms values into pump start/stop events with
+  hysteresis and a debounce time, keeps run duration, duty cycle and
+  cycles per hour, and raises alarms for a pump that runs too long
+  (stuck float) or starts too often (short cycling).  Pure C so
+  recorded or synthetic current traces can be replayed on the host.
+*/
+
+#ifndef DIZON_PUMP_H
+#define DIZON_PUMP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Start times remembered for the cycles per hour count
+#define PUMP_MAX_STARTS 64
+#define PUMP_HOUR_US    (3600LL * 1000000LL)
+
+typedef enum {
+    PUMP_EVENT_START,
+    PUMP_EVENT_STOP,
+    PUMP_EVENT_SUMMARY,
+    PUMP_EVENT_ALARM,
+    PUMP_EVENT_ALARM_CLEAR,
+} pump_event_type;
+
+typedef enum {
+    PUMP_ALARM_NONE,
+    PUMP_ALARM_RUN_TIME,        // Current run is longer than max_run_s
+    PUMP_ALARM_CYCLE_RATE,      // More than max_cycles_per_hour starts in the last hour
+} pump_alarm;
+
+typedef struct pump_config pump_config;
+
+struct pump_config
+{
+    float on_amps;              // Pump is considered started at or above this
+    float off_amps;             // and stopped at or below this, must be lower
+    uint32_t debounce_ms;       // A level has to hold this long before it counts
+    uint32_t max_run_s;         // 0 disables the run time alarm
+    uint16_t max_cycles_per_hour;   // 0 disables the cycle rate alarm
+    uint32_t summary_s;         // Period of summary events, 0 for none
+};
+
+typedef struct pump_event pump_event;
+
+struct pump_event
+{
+    pump_event_type type;
+    pump_alarm alarm;           // ALARM and ALARM_CLEAR
+    int64_t t_us;               // When it happened (a start is back dated to the first sample over on_amps)
+    float amps;                 // START: Irms, STOP: peak of the run
+    uint32_t run_ms;            // STOP and run time alarm: length of the run
+    uint16_t cycles_per_hour;
+    float duty;                 // SUMMARY: fraction of the interval the pump was on
+    uint16_t starts;            // SUMMARY: starts in the interval
+    bool running;               // SUMMARY: state at the end of the interval
+};
+
+typedef struct pump_detector pump_detector;
+
+struct pump_detector
+{
+    pump_config cfg;
+    bool running;
+    bool started;               // Seen a first sample
+    int64_t last_us;
+    bool pending;               // Level has crossed towards the other state
+    int64_t pending_us;         // and has been there since
+    float pending_peak;         // Highest Irms seen while a start was being debounced
+    int64_t run_start_us;
+    float run_peak;
+    bool alarms[3];             // Latched alarms, indexed by pump_alarm
+
+    int64_t start_times[PUMP_MAX_STARTS];
+    uint16_t start_head;
+    uint16_t start_count;
+
+    int64_t summary_start_us;
+    int64_t summary_on_us;
+    uint16_t summary_starts;
+
+    uint32_t total_starts;
+};
+
+#define PUMP_MAX_EVENTS 4       // Most events one update can produce
+
+int pump_init(pump_detector* det, const pump_config* cfg);
+// Feed one Irms value, fills up to PUMP_MAX_EVENTS events and returns how many
+int pump_update(pump_detector* det, int64_t t_us, float irms, pump_event* events);
+uint16_t pump_cycles_per_hour(pump_detector* det, int64_t now_us);
+const char* pump_event_name(pump_event_type type);
+const char* pump_alarm_name(pump_alarm alarm);
+
+#endif
@@ -0,0 +1,36 @@
+/*
+*****************************************************************
+* record.h - One Measurement As It Moves Through The App        *
+*****************************************************************
+*/
+
+#ifndef DIZON_RECORD_H
+#define DIZON_RECORD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define SUMP_EXTRA_CHANNELS 3   // Pumps measured on top of the first one
+
+typedef struct sump_record sump_record;
+
+struct sump_record
+{
+    uint32_t seq;               // Incremented by the sampling task for every record
+    int64_t mono_us;            // esp_timer time at the end of the sampling window
+    int64_t epoch_us;           // UTC at the end of the window, 0 until the clock is set
+    float irms;                 // Mean over the interval when streaming
+    float irms_min;             // Smallest and largest per-cycle RMS in the interval,
+    float irms_max;             //  both equal to irms for windowed measurements
+    uint16_t cycles;            // Per-cycle values behind irms, 0 for a single window
+    uint16_t suppressed;        // Readings the deadband held back before this one
+    uint32_t free_mem;
+    bool has_level;             // Ultrasonic reading below is valid
+    float level_cm;             // Water above the floor of the pit
+    float level_rate;           // Rate of rise in cm/h
+    uint8_t extra_channels;     // Entries of irms_extra in use, 0 with a single pump
+    float irms_extra[SUMP_EXTRA_CHANNELS];  // Same as irms for the 2nd, 3rd and 4th pump
+};
+
+#endif
@@ -0,0 +1,49 @@
+/*
+*****************************************************************
+* ring.h - Lock-Free Single Producer/Single Consumer Record Ring *
+*****************************************************************
+
+  Carries sump_records from the sampling task to the publishing
+  task.  Exactly one task may push and exactly one may pop; neither
+  side ever blocks or takes a lock.  When the ring is full the new
+  record is dropped and counted, the producer never waits on the
+  network side.
+*/
+
+#ifndef DIZON_RING_H
+#define DIZON_RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "dizon_record.h"
+
+typedef struct record_ring record_ring;
+
+struct record_ring
+{
+    sump_record* slots;
+    uint32_t mask;              // Capacity - 1, capacity is a power of two
+
+    uint32_t head;              // Next slot to write, only the producer stores it
+    uint32_t tail;              // Next slot to read, only the consumer stores it
+
+    // Producer side counters
+    uint32_t pushed;
+    uint32_t overflows;         // Records dropped because the ring was full
+    uint32_t high_water;        // Most records ever waiting at once
+    // Consumer side counter
+    uint32_t popped;
+};
+
+// capacity must be a power of two, slots must hold that many records
+int ring_init(record_ring* ring, sump_record* slots, uint32_t capacity);
+
+bool ring_push(record_ring* ring, const sump_record* rec);
+bool ring_pop(record_ring* ring, sump_record* rec);
+// Look at the oldest record without removing it
+bool ring_peek(record_ring* ring, sump_record* rec);
+
+uint32_t ring_count(const record_ring* ring);
+uint32_t ring_capacity(const record_ring* ring);
+
+#endif
@@ -0,0 +1,134 @@
+/*
+*****************************************************************
+* rollup.h - Minute, Hour And Day Aggregates Of The Readings    *
+*****************************************************************
+
+  Folds every reading into the open minute, hour and day as it
+  comes in: the count, least, most, sum and sum of squares of Irms
+  and of the water level, the time the pump ran and how often it
+  started.  When a reading falls past the end of an open bucket that
+  bucket closes into a ring of the last ROLLUP_MINUTES minutes,
+  ROLLUP_HOURS hours or ROLLUP_DAYS days, the oldest making room.
+  Buckets are aligned to UTC and a bucket nothing fell in is never
+  kept, so a gap in a ring is time the device was not measuring.
+  Means and spreads come out of the sums, and sums add up across
+  buckets, so whoever reads them never needs the raw readings.
+
+  Run time is the time between two readings while the pump was
+  running at the first, split at the bucket boundaries it crosses.
+  A gap longer than ROLLUP_MAX_GAP_MS counts only that much, the
+  device was down or asleep for the rest.
+
+  The state is plain data with no pointers, so it can sit in RTC
+  memory across soft resets and be written whole to NVS.  A reset
+  in the middle of rollup_add leaves it marked as updating, and
+  rollup_valid refuses it.  rollup_seal stamps a CRC over the whole
+  state for the copy that goes to flash, rollup_intact checks it.
+*/
+
+#ifndef DIZON_ROLLUP_H
+#define DIZON_ROLLUP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "dizon_record.h"
+
+#define ROLLUP_MINUTES      60
+#define ROLLUP_HOURS        24
+#define ROLLUP_DAYS         7
+#define ROLLUP_SLOTS        (ROLLUP_MINUTES + ROLLUP_HOURS + ROLLUP_DAYS)
+#define ROLLUP_MAGIC        0x524c5531  // "RLU1", anything else in RTC memory is a cold boot
+#define ROLLUP_MAX_GAP_MS   10000       // Most run time one interval between readings can add
+
+typedef enum {
+    ROLLUP_MINUTE,
+    ROLLUP_HOUR,
+    ROLLUP_DAY,
+    ROLLUP_LEVELS
+} rollup_level;
+
+#define ROLLUP_ALL          ((1u << ROLLUP_LEVELS) - 1)
+
+typedef struct rollup_stat rollup_stat;
+
+struct rollup_stat
+{
+    float min;
+    float max;
+    float sum;
+    float sumsq;
+};
+
+typedef struct rollup_bucket rollup_bucket;
+
+// One closed minute, hour or day
+struct rollup_bucket
+{
+    uint32_t start;             // UTC seconds
+    uint32_t count;             // Readings
+    uint32_t level_count;       // Readings that carried a level
+    uint32_t on_ms;             // Pump run time
+    uint16_t starts;            // Pump starts
+    rollup_stat irms;
+    rollup_stat level;          // cm
+};
+
+typedef struct rollup_acc rollup_acc;
+
+// The open one, summed in double until it closes
+struct rollup_acc
+{
+    uint32_t start;             // 0 until the first reading
+    uint32_t count;
+    uint32_t level_count;
+    uint32_t on_ms;
+    uint16_t starts;
+    float irms_min, irms_max;
+    float level_min, level_max;
+    double irms_sum, irms_sumsq;
+    double level_sum, level_sumsq;
+};
+
+typedef struct rollup rollup;
+
+struct rollup
+{
+    uint32_t magic;
+    uint8_t updating;           // Set for the length of rollup_add
+    bool running;               // Pump state at the last reading
+    int64_t last_ms;            // UTC of the last reading, 0 for none
+    uint32_t late;              // Readings dropped for being older than the last one
+    rollup_acc open[ROLLUP_LEVELS];
+    uint16_t head[ROLLUP_LEVELS];       // Oldest closed bucket of each ring
+    uint16_t count[ROLLUP_LEVELS];
+    rollup_bucket slots[ROLLUP_SLOTS];  // The minute ring, then the hour ring, then the day ring
+    uint32_t crc;               // As of the last rollup_seal
+};
+
+// Cold boot, empty rings
+void rollup_init(rollup* r);
+bool rollup_valid(const rollup* r);
+void rollup_seal(rollup* r);
+// Valid and unchanged since rollup_seal
+bool rollup_intact(const rollup* r);
+
+// rec needs its epoch_us, running is the pump state after it.  Returns the levels that
+// closed a bucket, as a mask of 1 << rollup_level.
+unsigned rollup_add(rollup* r, const sump_record* rec, bool running);
+
+uint32_t rollup_seconds(rollup_level level);
+const char* rollup_level_name(rollup_level level);
+size_t rollup_capacity(rollup_level level);
+// Closed buckets kept, rollup_get 0 is the oldest
+size_t rollup_count(const rollup* r, rollup_level level);
+const rollup_bucket* rollup_get(const rollup* r, rollup_level level, size_t i);
+// The open bucket as it stands, false if nothing has gone into it yet
+bool rollup_current(const rollup* r, rollup_level level, rollup_bucket* out);
+
+// "minute", "hour", "day" or "all", with or without spaces around, into a level mask
+int rollup_parse_request(const char* data, int len, unsigned* levels);
+
+void rollup_print(const rollup* r);
+
+#endif
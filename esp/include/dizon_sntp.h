@@ -2,12 +2,15 @@
 #define DIZON_SNTP_H
 
 #include <string.h>
+#include <stdbool.h>
 #include <time.h>
 #include <sys/time.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
 #include "esp_sntp.h"
+#include "esp_timer.h"
+#include "dizon_timestamp.h"
 
 
 /* Variable holding number of times ESP32 restarted since first boot.
@@ -16,10 +19,22 @@
  */
 RTC_DATA_ATTR static int boot_count = 0;
 
+// Anything earlier is an RTC that has not been set since power on
+#define SNTP_VALID_AFTER 1609459200     // 2021-01-01
+
+// Called from the lwIP task on every sync, the first one included
+typedef void (*sntp_synced_cb)(void);
+
 void time_sync_notification_cb(struct timeval *tv);
 
+// Before anything stamps a reading, takes the time from the RTC if it is set
+void sntp_clock_init(void);
 void init_sntp(void);
+void sntp_on_synced(sntp_synced_cb cb);
+bool sntp_time_valid(void);
 
-char* current_iso_utc_time(void);
+// Epoch microseconds at an esp_timer time, 0 until the clock is set
+int64_t sntp_epoch_us(int64_t mono_us);
+void sntp_clock_print(void);
 
 #endif
\ No newline at end of file
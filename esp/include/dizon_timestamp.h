@@ -0,0 +1,63 @@
+/*
+*****************************************************************
+* timestamp.h - Epoch Time From The Monotonic Timer             *
+*****************************************************************
+
+  Stamps readings in integer microseconds since the epoch from the
+  esp_timer time they were taken at, so a reading needs no wall
+  clock call, no allocation and no formatting when it is taken.
+  Each sync (SNTP, or the RTC after deep sleep) ties one esp_timer
+  time to one epoch time.  The offset between the two is kept along
+  with how fast it drifts, estimated from the corrections between
+  syncs, and an esp_timer time before or after the last sync is
+  mapped along that line.  A correction larger than TS_STEP_US is a
+  step (a bad RTC, another server) and leaves the drift alone.
+
+  Text only comes out of ts_format_iso, into the caller's buffer,
+  for the encoders that send text.
+*/
+
+#ifndef DIZON_TIMESTAMP_H
+#define DIZON_TIMESTAMP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define TS_STEP_US          500000      // Corrections past this are steps, not drift
+#define TS_DRIFT_MIN_US     60000000LL  // Shorter gaps between syncs say too little about drift
+#define TS_MAX_DRIFT_PPM    500.0f      // Crystals are within 100, anything past this is noise
+#define TS_ISO_LEN          25          // "2026-10-17T12:34:56.789Z" and the terminator
+
+typedef struct timestamp_clock timestamp_clock;
+
+struct timestamp_clock
+{
+    bool synced;
+    bool have_drift;
+    int64_t offset_us;          // Epoch minus esp_timer time at the last sync
+    int64_t sync_mono_us;       // esp_timer time of the last sync
+    float drift_ppm;            // How fast the offset grows, positive for a slow esp_timer
+
+    // Since ts_init
+    uint32_t syncs;
+    uint32_t steps;
+    int64_t last_correction_us; // Epoch at the last sync minus what we had for it
+    int64_t max_correction_us;  // Largest that was not a step, by size
+};
+
+void ts_init(timestamp_clock* tc);
+
+// mono_us (esp_timer) was epoch_us
+void ts_sync(timestamp_clock* tc, int64_t mono_us, int64_t epoch_us);
+
+// Epoch microseconds at esp_timer time mono_us, earlier or later than the last sync.
+// 0 before the first sync.
+int64_t ts_epoch_us(const timestamp_clock* tc, int64_t mono_us);
+
+// ISO 8601 UTC with milliseconds into buf, returns the length or 0 if it does not fit
+size_t ts_format_iso(int64_t epoch_us, char* buf, size_t len);
+
+void ts_print(const timestamp_clock* tc);
+
+#endif
@@ -0,0 +1,53 @@
+/*
+*****************************************************************
+* ultrasonic.h - HC-SR04 Style Ultrasonic Ranging               *
+*****************************************************************
+
+  Drives the trigger pulse from the RMT peripheral and timestamps
+  both edges of the echo pulse in a GPIO interrupt, so a ping costs
+  the calling task nothing but a wait on a queue.  The echo times
+  go to dizon_level for filtering.
+
+  The trigger pin has to be able to drive an output, GPIO34-39 on
+  the ESP32 are input only.  Most of these sensors run at 5 V, the
+  echo line needs a divider down to 3.3 V.
+*/
+
+#ifndef DIZON_ULTRASONIC_H
+#define DIZON_ULTRASONIC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "driver/gpio.h"
+#include "driver/rmt.h"
+
+#define ULTRASONIC_TRIG_US      10      // Trigger pulse width the sensors ask for
+#define ULTRASONIC_TIMEOUT_MS   40      // Longer than the 38 ms "no echo" pulse
+#define ULTRASONIC_GAP_MS       60      // Between pings so the last echo has died out
+
+typedef struct ultrasonic ultrasonic;
+
+struct ultrasonic
+{
+    gpio_num_t trig;
+    gpio_num_t echo;
+    rmt_channel_t channel;
+    QueueHandle_t echoes;       // Echo widths in us from the interrupt, latest only
+    volatile int64_t rise_us;   // Rising edge of the echo in progress, 0 for none
+
+    uint32_t pings;
+    uint32_t timeouts;
+};
+
+// Returns -1 if the pins cannot be used or a driver does not install
+int ultrasonic_init(ultrasonic* us, int trig_gpio, int echo_gpio, rmt_channel_t channel);
+
+// One ping, *echo_us is the echo pulse width or 0 if none came back in time
+int ultrasonic_ping(ultrasonic* us, uint32_t* echo_us);
+
+// n pings ULTRASONIC_GAP_MS apart, sleeping in between
+int ultrasonic_burst(ultrasonic* us, uint32_t* echo_us, size_t n);
+
+#endif
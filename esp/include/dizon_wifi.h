@@ -15,7 +15,9 @@
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
+#include "nvs.h"
 
 #include "lwip/err.h"
 #include "lwip/sys.h"
@@ -34,10 +36,38 @@ static EventGroupHandle_t s_wifi_event_group;
 #define WIFI_CONNECTED_BIT BIT0
 #define WIFI_FAIL_BIT      BIT1
 
+#define WIFI_RETRY_BACKOFF_S 30    // Wait after ESP_MAXIMUM_RETRY failures in a row
+
 static int s_retry_num = 0;
+static int64_t s_connect_start_us;
+
+// Last AP we got an address from, kept in NVS for the fast connect path
+#define WIFI_CACHE_NAMESPACE "wifi_fast"
+#define WIFI_CACHE_KEY       "ap"
+#define WIFI_CACHE_VERSION   1
+
+typedef struct wifi_cache wifi_cache;
+
+struct wifi_cache
+{
+    uint8_t version;
+    uint8_t channel;
+    uint8_t bssid[6];
+    uint8_t ssid[33];           // Config the cache was made with, a new SSID drops it
+    esp_netif_ip_info_t ip;     // Last lease, reused when CONFIG_WIFI_FAST_STATIC_IP is set
+    esp_ip4_addr_t dns;
+};
 
 static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
 
+// Called from the event loop task each time the station gets an address
+typedef void (*wifi_up_cb)(void);
+
+// Starts connecting and returns, retries go on in the background for as long as it takes
+void wifi_start_sta(wifi_up_cb cb);
+bool wifi_connected(void);
+
+// Same, but waits until connected or ESP_MAXIMUM_RETRY attempts failed
 void wifi_init_sta(void);
 
 #endif
\ No newline at end of file
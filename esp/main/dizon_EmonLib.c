@@ -4,28 +4,164 @@
   by Trystan Lea, April 27 2010 GNU GPL
 */
 
+#include <string.h>
 #include "dizon_EmonLib.h"
 
+//--------------------------------------------------------------------------------------
+// Clears all state and attaches the sample provider
+//--------------------------------------------------------------------------------------
+void emon_init(energy_mon* emon, const emon_sample_provider* provider)
+{
+  memset(emon, 0, sizeof(*emon));
+  emon->provider = provider;
+  emon->syncBand = EMON_SYNC_BAND;
+}
+
+static inline int emon_read(energy_mon* emon, int channel)
+{
+  return emon->provider->read(emon->provider->ctx, channel);
+}
+
+static inline unsigned long emon_millis(energy_mon* emon)
+{
+  return emon->provider->micros(emon->provider->ctx) / 1000;
+}
+
 //--------------------------------------------------------------------------------------
 // Sets the pins to be used for voltage and current sensors
 //--------------------------------------------------------------------------------------
-void emon_voltage(energy_mon* emon, adc1_channel_t _inPinV, double _VCAL, double _PHASECAL)
+void emon_voltage(energy_mon* emon, int _inPinV, double _VCAL, double _PHASECAL)
 {
   emon->inPinV = _inPinV;
   emon->VCAL = _VCAL;
   emon->PHASECAL = _PHASECAL;
   emon->offsetV = ADC_COUNTS>>1;
-  adc1_config_width(ADC_WIDTH_BIT_12);
-  adc1_config_channel_atten(emon->inPinV,ADC_ATTEN_DB_0);
+  emon->offsetV_q = (ADC_COUNTS>>1) << EMON_Q_OFFSET;
+  emon->PHASECAL_q = (int32_t)lround(_PHASECAL * (1 << EMON_Q_PHASECAL));
+  if (emon->provider->setup)
+  {
+    emon->provider->setup(emon->provider->ctx, emon->inPinV);
+  }
 }
 
-extern void emon_current(energy_mon* emon, adc1_channel_t _inPinI, double _ICAL)
+extern void emon_current(energy_mon* emon, int _inPinI, double _ICAL)
 {
   emon->inPinI = _inPinI;
   emon->ICAL = _ICAL;
   emon->offsetI = ADC_COUNTS>>1;
-  adc1_config_width(ADC_WIDTH_BIT_12);
-  adc1_config_channel_atten(emon->inPinI,ADC_ATTEN_DB_0);
+  emon->offsetI_q = (ADC_COUNTS>>1) << EMON_Q_OFFSET;
+  if (emon->provider->setup)
+  {
+    emon->provider->setup(emon->provider->ctx, emon->inPinI);
+  }
+}
+
+//--------------------------------------------------------------------------------------
+// Picks the double precision or the fixed point per-sample math
+//--------------------------------------------------------------------------------------
+void emon_set_math(energy_mon* emon, emon_math math)
+{
+  emon->math = math;
+  emon->sumV = emon->sumI = emon->sumP = 0;
+  emon->sumV_q = emon->sumI_q = emon->sumP_q = 0;
+}
+
+//--------------------------------------------------------------------------------------
+// Per-sample voltage and current math for emon_calcVI, double precision
+//--------------------------------------------------------------------------------------
+static inline void emon_accumulateVI(energy_mon* emon)
+{
+  emon->lastFilteredV = emon->filteredV;               //Used for delay/phase compensation
+
+  //-----------------------------------------------------------------------------
+  // B) Apply digital low pass filters to extract the 2.5 V or 1.65 V dc offset,
+  //     then subtract this - signal is now centred on 0 counts.
+  //-----------------------------------------------------------------------------
+  emon->offsetV = emon->offsetV + ((emon->sampleV - emon->offsetV) / ADC_COUNTS);
+  emon->filteredV = emon->sampleV - emon->offsetV;
+  emon->offsetI = emon->offsetI + ((emon->sampleI - emon->offsetI) / ADC_COUNTS);
+  emon->filteredI = emon->sampleI - emon->offsetI;
+
+  //-----------------------------------------------------------------------------
+  // C) Root-mean-square method voltage
+  //-----------------------------------------------------------------------------
+  emon->sqV= emon->filteredV * emon->filteredV;                 //1) square voltage values
+  emon->sumV += emon->sqV;                                //2) sum
+
+  //-----------------------------------------------------------------------------
+  // D) Root-mean-square method current
+  //-----------------------------------------------------------------------------
+  emon->sqI = emon->filteredI * emon->filteredI;                //1) square current values
+  emon->sumI += emon->sqI;                                //2) sum
+
+  //-----------------------------------------------------------------------------
+  // E) Phase calibration
+  //-----------------------------------------------------------------------------
+  emon->phaseShiftedV = emon->lastFilteredV + emon->PHASECAL * (emon->filteredV - emon->lastFilteredV);
+
+  //-----------------------------------------------------------------------------
+  // F) Instantaneous power calc
+  //-----------------------------------------------------------------------------
+  emon->instP = emon->phaseShiftedV * emon->filteredI;          //Instantaneous Power
+  emon->sumP += emon->instP;                               //Sum
+}
+
+//--------------------------------------------------------------------------------------
+// Same as above with integer math, the Q4 samples give Q8 squares and products
+//--------------------------------------------------------------------------------------
+static inline void emon_accumulateVI_q(energy_mon* emon)
+{
+  emon->lastFilteredV_q = emon->filteredV_q;
+  emon->filteredV_q = emon_filter_q(&emon->offsetV_q, emon->sampleV);
+  emon->filteredI_q = emon_filter_q(&emon->offsetI_q, emon->sampleI);
+
+  emon->sumV_q += (int64_t)emon->filteredV_q * emon->filteredV_q;
+  emon->sumI_q += (int64_t)emon->filteredI_q * emon->filteredI_q;
+
+  int32_t phaseShiftedV_q = emon->lastFilteredV_q +
+      (int32_t)(((int64_t)emon->PHASECAL_q * (emon->filteredV_q - emon->lastFilteredV_q)) >> EMON_Q_PHASECAL);
+  emon->sumP_q += (int64_t)phaseShiftedV_q * emon->filteredI_q;
+}
+
+//--------------------------------------------------------------------------------------
+// At the crossings that open and close a window the last sample is split between the
+// windows either side, w is its share after the crossing.  Opening, everything before
+// is dropped and the sums start with that share; closing, it is taken back off.
+//--------------------------------------------------------------------------------------
+static void emon_edgeVI(energy_mon* emon, emon_sync_event ev, double w)
+{
+  if (emon->math == EMON_MATH_FIXED)
+  {
+    int32_t phaseShiftedV_q = emon->lastFilteredV_q +
+        (int32_t)(((int64_t)emon->PHASECAL_q * (emon->filteredV_q - emon->lastFilteredV_q)) >> EMON_Q_PHASECAL);
+    int64_t v = llround(w * ((int64_t)emon->filteredV_q * emon->filteredV_q));
+    int64_t i = llround(w * ((int64_t)emon->filteredI_q * emon->filteredI_q));
+    int64_t p = llround(w * ((int64_t)phaseShiftedV_q * emon->filteredI_q));
+    if (ev == EMON_SYNC_START)
+    {
+      emon->sumV_q = v;
+      emon->sumI_q = i;
+      emon->sumP_q = p;
+    }
+    else
+    {
+      emon->sumV_q -= v;
+      emon->sumI_q -= i;
+      emon->sumP_q -= p;
+    }
+  }
+  else if (ev == EMON_SYNC_START)
+  {
+    emon->sumV = w * emon->sqV;
+    emon->sumI = w * emon->sqI;
+    emon->sumP = w * emon->instP;
+  }
+  else
+  {
+    emon->sumV -= w * emon->sqV;
+    emon->sumI -= w * emon->sqI;
+    emon->sumP -= w * emon->instP;
+  }
 }
 
 //--------------------------------------------------------------------------------------
@@ -33,117 +169,95 @@ extern void emon_current(energy_mon* emon, adc1_channel_t _inPinI, double _ICAL)
 // Calculates realPower,apparentPower,powerFactor,Vrms,Irms,kWh increment
 // From a sample window of the mains AC voltage and current.
 // The Sample window length is defined by the number of half wavelengths or crossings we choose to measure.
+// It runs from one zero crossing of the voltage to another, both interpolated between
+// samples and found with hysteresis so noise cannot cut it short (see emon_sync.h).
 //--------------------------------------------------------------------------------------
 void emon_calcVI(energy_mon* emon, unsigned int crossings, unsigned int timeout)
 {
-  unsigned int crossCount = 0;                             //Used to measure number of times threshold is crossed.
   unsigned int numberOfSamples = 0;                        //This is now incremented
+  emon_sync* sync = &emon->syncV;
+  emon_sync_event ev = EMON_SYNC_NONE;
+  double frac;
 
   //-------------------------------------------------------------------------------------------------------------------------
-  // 1) Waits for the waveform to be close to 'zero' (mid-scale adc) part in sin curve.
+  // 1) No waiting for the waveform to be close to 'zero': the sums start over at the
+  //    first crossing, until then the samples only move the offset filters along
   //-------------------------------------------------------------------------------------------------------------------------
-  unsigned long start = esp_timer_get_time() / 1000;    //millis()-start makes sure it doesnt get stuck in the loop if there is an error.
-
-  while(1)                                   //the while loop...
-  {
-    emon->startV = adc1_get_raw(emon->inPinV);    
-    //analogRead(emon->inPinV);                    //using the voltage waveform
-    if ((emon->startV < (ADC_COUNTS*0.55)) && (emon->startV > (ADC_COUNTS*0.45))) 
-    {
-      break;  //check its within range
-    }
-    if ((esp_timer_get_time() / 1000 - start) > timeout)
-    {
-      break;
-    }
-  }
+  emon_sync_begin(sync, crossings, emon->syncBand);
+  int64_t start_us = emon->provider->micros(emon->provider->ctx);
+  unsigned long start = emon_millis(emon);    //millis()-start makes sure it doesnt get stuck in the loop if there is an error.
 
   //-------------------------------------------------------------------------------------------------------------------------
   // 2) Main measurement loop
   //-------------------------------------------------------------------------------------------------------------------------
-  start = esp_timer_get_time() / 1000;
-
-  while ((crossCount < crossings) && ((esp_timer_get_time() / 1000 - start) < timeout))
+  while (ev != EMON_SYNC_END && ((emon_millis(emon) - start) < timeout))
   {
     numberOfSamples++;                       //Count number of times looped.
-    emon->lastFilteredV = emon->filteredV;               //Used for delay/phase compensation
 
     //-----------------------------------------------------------------------------
     // A) Read in raw voltage and current samples
     //-----------------------------------------------------------------------------
-    emon->sampleV = adc1_get_raw(emon->inPinV);                 //Read in raw voltage signal
-    emon->sampleI = adc1_get_raw(emon->inPinI);                 //Read in raw current signal
-
-    //-----------------------------------------------------------------------------
-    // B) Apply digital low pass filters to extract the 2.5 V or 1.65 V dc offset,
-    //     then subtract this - signal is now centred on 0 counts.
-    //-----------------------------------------------------------------------------
-    emon->offsetV = emon->offsetV + ((emon->sampleV - emon->offsetV) / ADC_COUNTS);
-    emon->filteredV = emon->sampleV - emon->offsetV;
-    emon->offsetI = emon->offsetI + ((emon->sampleI - emon->offsetI) / ADC_COUNTS);
-    emon->filteredI = emon->sampleI - emon->offsetI;
-
-    //-----------------------------------------------------------------------------
-    // C) Root-mean-square method voltage
-    //-----------------------------------------------------------------------------
-    emon->sqV= emon->filteredV * emon->filteredV;                 //1) square voltage values
-    emon->sumV += emon->sqV;                                //2) sum
-
-    //-----------------------------------------------------------------------------
-    // D) Root-mean-square method current
-    //-----------------------------------------------------------------------------
-    emon->sqI = emon->filteredI * emon->filteredI;                //1) square current values
-    emon->sumI += emon->sqI;                                //2) sum
-
-    //-----------------------------------------------------------------------------
-    // E) Phase calibration
-    //-----------------------------------------------------------------------------
-    emon->phaseShiftedV = emon->lastFilteredV + emon->PHASECAL * (emon->filteredV - emon->lastFilteredV);
+    emon->sampleV = emon_read(emon, emon->inPinV);                 //Read in raw voltage signal
+    emon->sampleI = emon_read(emon, emon->inPinI);                 //Read in raw current signal
 
-    //-----------------------------------------------------------------------------
-    // F) Instantaneous power calc
-    //-----------------------------------------------------------------------------
-    emon->instP = emon->phaseShiftedV * emon->filteredI;          //Instantaneous Power
-    emon->sumP += emon->instP;                               //Sum
-
-    //-----------------------------------------------------------------------------
-    // G) Find the number of times the voltage has crossed the initial voltage
-    //    - every 2 crosses we will have sampled 1 wavelength
-    //    - so this method allows us to sample an integer number of half wavelengths which increases accuracy
-    //-----------------------------------------------------------------------------
-    emon->lastVCross = emon->checkVCross;
-    if (emon->sampleV > emon->startV)
+    if (emon->math == EMON_MATH_FIXED)
     {
-      emon->checkVCross = true;
+      emon_accumulateVI_q(emon);
     }
     else
     {
-      emon->checkVCross = false;
-    }
-    if (numberOfSamples==1)
-    {
-      emon->lastVCross = emon->checkVCross;
+      emon_accumulateVI(emon);
     }
-    if (emon->lastVCross != emon->checkVCross)
+
+    //-----------------------------------------------------------------------------
+    // G) Zero crossings of the voltage
+    //    - every 2 crosses we will have sampled 1 wavelength
+    //    - so this method allows us to sample an integer number of half wavelengths which increases accuracy
+    //-----------------------------------------------------------------------------
+    double v = emon->math == EMON_MATH_FIXED ? emon->filteredV_q / (double)(1 << EMON_Q_FILTER) : emon->filteredV;
+    ev = emon_sync_sample(sync, v, &frac);
+    if (ev == EMON_SYNC_START || ev == EMON_SYNC_END)
     {
-      crossCount++;
+      emon_edgeVI(emon, ev, 1 - frac);
     }
   }
 
   //-------------------------------------------------------------------------------------------------------------------------
   // 3) Post loop calculations
   //-------------------------------------------------------------------------------------------------------------------------
+  //Samples in the window, fractional when it runs crossing to crossing
+  double n = emon_sync_covered(sync);
+  if (n <= 0)
+  {
+    n = 1;
+  }
+  emon->frequency = 0;
+  if (emon_sync_closed(sync))
+  {
+    double us = (double)(emon->provider->micros(emon->provider->ctx) - start_us);
+    emon->frequency = us > 0 ? (crossings / 2.0) * numberOfSamples * 1e6 / (us * n) : 0;
+  }
+
   //Calculation of the root of the mean of the voltage and current squared (rms)
   //Calibration coefficients applied.
+  if (emon->math == EMON_MATH_FIXED)
+  {
+    //Only place the fixed point sums meet floating point, once per window
+    const double q2 = (double)(1 << (2 * EMON_Q_FILTER));
+    emon->sumV = emon->sumV_q / q2;
+    emon->sumI = emon->sumI_q / q2;
+    emon->sumP = emon->sumP_q / q2;
+    emon->sumV_q = emon->sumI_q = emon->sumP_q = 0;
+  }
 
   double V_RATIO = emon->VCAL *((SUPPLY_VOLTAGE/1000.0) / (ADC_COUNTS));
-  emon->Vrms = V_RATIO * sqrt(emon->sumV / numberOfSamples);
+  emon->Vrms = V_RATIO * sqrt(emon->sumV / n);
 
   double I_RATIO = emon->ICAL *((SUPPLY_VOLTAGE/1000.0) / (ADC_COUNTS));
-  emon->Irms = I_RATIO * sqrt(emon->sumI / numberOfSamples);
+  emon->Irms = I_RATIO * sqrt(emon->sumI / n);
 
   //Calculation power values
-  emon->realPower = V_RATIO * I_RATIO * emon->sumP / numberOfSamples;
+  emon->realPower = V_RATIO * I_RATIO * emon->sumP / n;
   emon->apparentPower = emon->Vrms * emon->Irms;
   emon->powerFactor=emon->realPower / emon->apparentPower;
 
@@ -155,40 +269,232 @@ void emon_calcVI(energy_mon* emon, unsigned int crossings, unsigned int timeout)
 }
 
 //--------------------------------------------------------------------------------------
-double emon_calcIrms(energy_mon* emon, unsigned int Number_of_Samples)
+// Current RMS building blocks shared by the polled and the streamed paths
+//--------------------------------------------------------------------------------------
+static inline void emon_accumulateI(energy_mon* emon, int sample)
 {
-  for (unsigned int n = 0; n < Number_of_Samples; n++)
+  emon->sampleI = sample;
+  // Digital low pass filter extracts the 2.5 V or 1.65 V dc offset,
+  //  then subtract this - signal is now centered on 0 counts.
+  emon->offsetI = (emon->offsetI + (emon->sampleI-emon->offsetI)/ADC_COUNTS);
+
+  emon->filteredI = emon->sampleI - emon->offsetI;
+
+  // Root-mean-square method current
+  // 1) square current values
+  emon->sqI = emon->filteredI * emon->filteredI;
+  // 2) sum
+  emon->sumI += emon->sqI;
+}
+
+static inline void emon_accumulateI_q(energy_mon* emon, int sample)
+{
+  emon->sampleI = sample;
+  emon->filteredI_q = emon_filter_q(&emon->offsetI_q, sample);
+  emon->sumI_q += (int64_t)emon->filteredI_q * emon->filteredI_q;
+}
+
+static void emon_accumulateI_block(energy_mon* emon, const uint16_t* samples, size_t len)
+{
+  if (emon->math == EMON_MATH_FIXED)
   {
-    emon->sampleI = adc1_get_raw(emon->inPinI);
-    //printf("Sample: %d\n", emon->sampleI);
-    // Digital low pass filter extracts the 2.5 V or 1.65 V dc offset,
-    //  then subtract this - signal is now centered on 0 counts.
-    emon->offsetI = (emon->offsetI + (emon->sampleI-emon->offsetI)/ADC_COUNTS);
-    
-    emon->filteredI = emon->sampleI - emon->offsetI;
-    //printf("Filter: %f\n", emon->filteredI);
+    for (size_t i = 0; i < len; i++)
+    {
+      emon_accumulateI_q(emon, samples[i]);
+    }
+  }
+  else
+  {
+    for (size_t i = 0; i < len; i++)
+    {
+      emon_accumulateI(emon, samples[i]);
+    }
+  }
+}
 
-    // Root-mean-square method current
-    // 1) square current values
-    emon->sqI = emon->filteredI * emon->filteredI;
-    // 2) sum
-    emon->sumI += emon->sqI;
+// Same split as emon_edgeVI for the current alone
+static void emon_edgeI(energy_mon* emon, emon_sync_event ev, double w)
+{
+  if (emon->math == EMON_MATH_FIXED)
+  {
+    int64_t i = llround(w * ((int64_t)emon->filteredI_q * emon->filteredI_q));
+    emon->sumI_q = ev == EMON_SYNC_START ? i : emon->sumI_q - i;
+  }
+  else
+  {
+    emon->sumI = ev == EMON_SYNC_START ? w * emon->sqI : emon->sumI - w * emon->sqI;
   }
+}
 
-  double I_RATIO = emon->ICAL *((SUPPLY_VOLTAGE/1000.0) / (ADC_COUNTS));
-  //printf("Ratio: %f\n", I_RATIO);
-  emon->Irms = I_RATIO * sqrt(emon->sumI / Number_of_Samples);
+// One current sample through the filter and the crossing detector
+static inline emon_sync_event emon_syncI(energy_mon* emon, emon_sync* sync, int sample)
+{
+  emon_sync_event ev;
+  double frac;
+
+  if (emon->math == EMON_MATH_FIXED)
+  {
+    emon_accumulateI_q(emon, sample);
+    ev = emon_sync_sample(sync, emon->filteredI_q / (double)(1 << EMON_Q_FILTER), &frac);
+  }
+  else
+  {
+    emon_accumulateI(emon, sample);
+    ev = emon_sync_sample(sync, emon->filteredI, &frac);
+  }
+  if (ev == EMON_SYNC_START || ev == EMON_SYNC_END)
+  {
+    emon_edgeI(emon, ev, 1 - frac);
+  }
+  return ev;
+}
+
+static double emon_finishIrms(energy_mon* emon, double Number_of_Samples)
+{
+  if (emon->math == EMON_MATH_FIXED)
+  {
+    emon->sumI = emon->sumI_q / (double)(1 << (2 * EMON_Q_FILTER));
+    emon->sumI_q = 0;
+  }
+
+  emon->Irms = emon_i_ratio(emon) * sqrt(emon->sumI / Number_of_Samples);
 
   //Reset accumulators
   emon->sumI = 0;
-  //--------------------------------------------------------------------------------------
 
   return emon->Irms;
 }
 
-void emon_serialprint(energy_mon* emon)
+//--------------------------------------------------------------------------------------
+double emon_calcIrms(energy_mon* emon, unsigned int Number_of_Samples)
+{
+  if (emon->math == EMON_MATH_FIXED)
+  {
+    for (unsigned int n = 0; n < Number_of_Samples; n++)
+    {
+      emon_accumulateI_q(emon, emon_read(emon, emon->inPinI));
+    }
+  }
+  else
+  {
+    for (unsigned int n = 0; n < Number_of_Samples; n++)
+    {
+      emon_accumulateI(emon, emon_read(emon, emon->inPinI));
+    }
+  }
+
+  return emon_finishIrms(emon, Number_of_Samples);
+}
+
+//--------------------------------------------------------------------------------------
+// Same as emon_calcIrms but over evenly spaced samples from a continuous ADC stream.
+// The window is rounded up to whole blocks, the caller sleeps while the DMA fills them.
+//--------------------------------------------------------------------------------------
+double emon_calcIrms_stream(energy_mon* emon, adc_stream* stream, unsigned int Number_of_Samples)
+{
+  unsigned int n = 0;
+  adc_block block;
+
+  while (n < Number_of_Samples)
+  {
+    if (!adc_stream_next(stream, &block, EMON_STREAM_TIMEOUT_MS))
+    {
+      break;
+    }
+    emon_accumulateI_block(emon, block.samples, block.len);
+    n += block.len;
+    adc_stream_release(stream, &block);
+  }
+  if (n == 0)
+  {
+    return emon->Irms;
+  }
+
+  return emon_finishIrms(emon, n);
+}
+
+//--------------------------------------------------------------------------------------
+// Current RMS over whole cycles of the current itself, from one zero crossing to
+// another, so no part cycle is left at either end whatever the sample rate.  With the
+// pump off there is nothing to cross and the window is whatever came in by the timeout.
+//--------------------------------------------------------------------------------------
+double emon_calcIrms_cycles(energy_mon* emon, unsigned int cycles, unsigned int timeout)
+{
+  emon_sync* sync = &emon->syncI;
+  unsigned int n = 0;
+
+  emon_sync_begin(sync, 2 * cycles, emon->syncBand);
+  int64_t start_us = emon->provider->micros(emon->provider->ctx);
+  unsigned long start = emon_millis(emon);
+  while ((emon_millis(emon) - start) < timeout)
+  {
+    n++;
+    if (emon_syncI(emon, sync, emon_read(emon, emon->inPinI)) == EMON_SYNC_END)
+    {
+      break;
+    }
+  }
+  if (n == 0)
+  {
+    return emon->Irms;
+  }
+
+  emon->frequency = 0;
+  double covered = emon_sync_covered(sync);
+  if (emon_sync_closed(sync))
+  {
+    double us = (double)(emon->provider->micros(emon->provider->ctx) - start_us);
+    emon->frequency = us > 0 ? cycles * n * 1e6 / (us * covered) : 0;
+  }
+  return emon_finishIrms(emon, covered);
+}
+
+//--------------------------------------------------------------------------------------
+// Same from a continuous ADC stream.  The rest of the block the window closes in only
+// moves the offset filter along, the next window starts from fresh blocks.  Left out of
+// the filter it would see part cycles only and drift off the true offset.
+//--------------------------------------------------------------------------------------
+double emon_calcIrms_stream_cycles(energy_mon* emon, adc_stream* stream, unsigned int cycles)
+{
+  const uint32_t limit = (uint32_t)((uint64_t)cycles * stream->sample_rate_hz / EMON_SYNC_MIN_HZ);
+  emon_sync* sync = &emon->syncI;
+  adc_block block;
+  bool closed = false;
+  double irms = emon->Irms;
+
+  emon_sync_begin(sync, 2 * cycles, emon->syncBand);
+  while (!closed && sync->n < limit)
+  {
+    if (!adc_stream_next(stream, &block, EMON_STREAM_TIMEOUT_MS))
+    {
+      break;
+    }
+    size_t i = 0;
+    while (i < block.len && !closed)
+    {
+      closed = emon_syncI(emon, sync, block.samples[i++]) == EMON_SYNC_END;
+    }
+    if (closed)
+    {
+      emon->frequency = cycles * (double)stream->sample_rate_hz / sync->length;
+      irms = emon_finishIrms(emon, sync->length);
+      emon_accumulateI_block(emon, block.samples + i, block.len - i);
+      emon->sumI = 0;
+      emon->sumI_q = 0;
+    }
+    adc_stream_release(stream, &block);
+  }
+  if (closed || sync->n == 0)
+  {
+    return irms;
+  }
+
+  emon->frequency = 0;
+  return emon_finishIrms(emon, emon_sync_covered(sync));
+}
+
+void emon_print(energy_mon* emon)
 {
   printf("%f %f %f %f %f \n", emon->realPower, emon->apparentPower, emon->Vrms, 
             emon->Irms, emon->powerFactor);
-  vTaskDelay(1000 / portTICK_PERIOD_MS);
 }
\ No newline at end of file
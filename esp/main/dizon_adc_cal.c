@@ -0,0 +1,52 @@
+/*
+*****************************************************************
+* adc_cal.c - ADC Non-Linearity Correction Table                *
+*****************************************************************
+*/
+
+#include "dizon_adc_cal.h"
+
+void adc_cal_identity(adc_cal* cal)
+{
+  for (int raw = 0; raw < ADC_COUNTS; raw++)
+  {
+    cal->lut[raw] = (uint16_t)raw;
+  }
+}
+
+int adc_cal_from_points(adc_cal* cal, const adc_cal_point* points, size_t n)
+{
+  if (n < 2 || n > ADC_CAL_MAX_POINTS)
+  {
+    return -1;
+  }
+  for (size_t i = 1; i < n; i++)
+  {
+    if (points[i].raw <= points[i - 1].raw)
+    {
+      return -1;
+    }
+  }
+
+  size_t seg = 0;               // Segment from points[seg] to points[seg + 1]
+  for (int raw = 0; raw < ADC_COUNTS; raw++)
+  {
+    while (seg + 2 < n && raw > points[seg + 1].raw)
+    {
+      seg++;
+    }
+    const adc_cal_point* a = &points[seg];
+    const adc_cal_point* b = &points[seg + 1];
+    double mv = a->mv + (double)(raw - a->raw) * ((double)b->mv - a->mv) / (b->raw - a->raw);
+    cal->lut[raw] = adc_cal_counts(mv);
+  }
+  return 0;
+}
+
+void adc_cal_from_fn(adc_cal* cal, uint32_t (*raw_to_mv)(void* ctx, int raw), void* ctx)
+{
+  for (int raw = 0; raw < ADC_COUNTS; raw++)
+  {
+    cal->lut[raw] = adc_cal_counts(raw_to_mv(ctx, raw));
+  }
+}
@@ -0,0 +1,170 @@
+/*
+*****************************************************************
+* adc_dma.c - Continuous ADC1 Sampling Through The DMA Driver   *
+*****************************************************************
+*/
+
+#include <string.h>
+#include "dizon_adc_dma.h"
+
+static const char *TAG = "ADC_DMA";
+
+typedef struct adc_dma_ctx {
+    adc1_channel_t channels[ADC_DMA_MAX_CHANNELS];
+    size_t n;                   // Channels in the pattern, converted in turn
+    uint32_t decimation;        // Hardware scans averaged into one output scan
+    uint32_t acc[ADC_DMA_MAX_CHANNELS];
+    uint32_t acc_n;             // Whole scans in acc
+    uint16_t scan[ADC_DMA_MAX_CHANNELS];    // The scan in progress, added to acc once complete
+    size_t next;                // Pattern position the next conversion should be
+    uint32_t resyncs;           // Conversions dropped to get back in step with the pattern
+    const adc_cal* cal;
+    uint8_t raw[ADC_DMA_FRAME_BYTES];
+} adc_dma_ctx;
+
+static adc_dma_ctx s_ctx;
+
+static int dma_start(void* ctx, uint32_t sample_rate_hz)
+{
+    adc_dma_ctx* dma = ctx;
+
+    // The converter has a minimum rate, below it we oversample and average
+    dma->decimation = 1;
+    while (sample_rate_hz * dma->decimation < SOC_ADC_SAMPLE_FREQ_THRES_LOW) {
+        dma->decimation++;
+    }
+    uint32_t hw_rate = sample_rate_hz * dma->decimation;
+    if (hw_rate > SOC_ADC_SAMPLE_FREQ_THRES_HIGH) {
+        ESP_LOGE(TAG, "Sample rate %u Hz is above what the ADC can do", sample_rate_hz);
+        return -1;
+    }
+    memset(dma->acc, 0, sizeof(dma->acc));
+    dma->acc_n = 0;
+    dma->next = 0;
+
+    adc_digi_pattern_config_t pattern[ADC_DMA_MAX_CHANNELS];
+    uint32_t mask = 0;
+    for (size_t k = 0; k < dma->n; k++) {
+        pattern[k].atten = ADC_ATTEN_DB_0;
+        pattern[k].channel = dma->channels[k];
+        pattern[k].unit = 0;        // ADC1
+        pattern[k].bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+        mask |= BIT(dma->channels[k]);
+    }
+    adc_digi_init_config_t init_cfg = {
+        .max_store_buf_size = ADC_DMA_STORE_BYTES,
+        .conv_num_each_intr = ADC_DMA_FRAME_BYTES,
+        .adc1_chan_mask = mask,
+        .adc2_chan_mask = 0,
+    };
+    if (adc_digi_initialize(&init_cfg) != ESP_OK) {
+        ESP_LOGE(TAG, "adc_digi_initialize failed");
+        return -1;
+    }
+
+    adc_digi_configuration_t dig_cfg = {
+        .conv_limit_en = 1,         // Must be set on the ESP32
+        .conv_limit_num = 250,
+        .pattern_num = dma->n,
+        .adc_pattern = pattern,
+        .sample_freq_hz = hw_rate,
+        .conv_mode = ADC_CONV_SINGLE_UNIT_1,
+        .format = ADC_DIGI_OUTPUT_FORMAT_TYPE1,
+    };
+    if (adc_digi_controller_configure(&dig_cfg) != ESP_OK) {
+        ESP_LOGE(TAG, "adc_digi_controller_configure failed");
+        adc_digi_deinitialize();
+        return -1;
+    }
+    ESP_LOGI(TAG, "Sampling %u channel(s) from %d at %u Hz (%u Hz hardware, %u:1 averaging)",
+             (unsigned)dma->n, dma->channels[0], sample_rate_hz, hw_rate, dma->decimation);
+    return adc_digi_start() == ESP_OK ? 0 : -1;
+}
+
+static int dma_read(void* ctx, uint16_t* samples, size_t max_samples, size_t* got, uint32_t timeout_ms)
+{
+    adc_dma_ctx* dma = ctx;
+    uint32_t want = (max_samples * dma->decimation - dma->acc_n * dma->n - dma->next) * SOC_ADC_DIGI_RESULT_BYTES;
+    uint32_t raw_len = 0;
+    int ret = ADC_SOURCE_OK;
+
+    *got = 0;
+    if (want > sizeof(dma->raw)) {
+        want = sizeof(dma->raw) - sizeof(dma->raw) % SOC_ADC_DIGI_RESULT_BYTES;
+    }
+    esp_err_t err = adc_digi_read_bytes(dma->raw, want, &raw_len, timeout_ms);
+    if (err == ESP_ERR_TIMEOUT) {
+        return ADC_SOURCE_TIMEOUT;
+    } else if (err == ESP_ERR_INVALID_STATE) {
+        // Driver ring buffer overflowed, what we got is still valid
+        ret = ADC_SOURCE_OVERRUN;
+    } else if (err != ESP_OK) {
+        return ADC_SOURCE_ERROR;
+    }
+
+    for (uint32_t i = 0; i + SOC_ADC_DIGI_RESULT_BYTES <= raw_len; i += SOC_ADC_DIGI_RESULT_BYTES) {
+        adc_digi_output_data_t *p = (adc_digi_output_data_t*)&dma->raw[i];
+        if (p->type1.channel != dma->channels[dma->next]) {
+            // A lost conversion, drop the partial scan and wait for channel 0
+            dma->resyncs++;
+            dma->next = 0;
+            if (p->type1.channel != dma->channels[0]) {
+                continue;
+            }
+        }
+        dma->scan[dma->next] = dma->cal ? adc_cal_apply(dma->cal, p->type1.data) : p->type1.data;
+        if (++dma->next < dma->n) {
+            continue;
+        }
+        dma->next = 0;
+        for (size_t k = 0; k < dma->n; k++) {
+            dma->acc[k] += dma->scan[k];
+        }
+        if (++dma->acc_n == dma->decimation) {
+            for (size_t k = 0; k < dma->n; k++) {
+                samples[(*got)++] = dma->acc[k] / dma->decimation;
+                dma->acc[k] = 0;
+            }
+            dma->acc_n = 0;
+        }
+    }
+    return ret;
+}
+
+static void dma_stop(void* ctx)
+{
+    adc_digi_stop();
+    adc_digi_deinitialize();
+}
+
+static int64_t dma_now_us(void* ctx)
+{
+    return esp_timer_get_time();
+}
+
+const adc_block_source* adc_dma_scan_source(const adc1_channel_t* channels, size_t n)
+{
+    static adc_block_source source = {
+        .ctx = &s_ctx,
+        .start = dma_start,
+        .read = dma_read,
+        .stop = dma_stop,
+        .now_us = dma_now_us,
+    };
+    if (n == 0 || n > ADC_DMA_MAX_CHANNELS) {
+        return NULL;
+    }
+    memcpy(s_ctx.channels, channels, n * sizeof(channels[0]));
+    s_ctx.n = n;
+    return &source;
+}
+
+void adc_dma_set_cal(const adc_cal* cal)
+{
+    s_ctx.cal = cal;
+}
+
+const adc_block_source* adc_dma_source(adc1_channel_t channel)
+{
+    return adc_dma_scan_source(&channel, 1);
+}
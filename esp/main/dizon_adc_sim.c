@@ -0,0 +1,78 @@
+/*
+*****************************************************************
+* adc_sim.c - Simulated Block Source Standing In For ADC DMA    *
+*****************************************************************
+*/
+
+#include <string.h>
+#include "dizon_adc_sim.h"
+
+static int sim_start(void* ctx, uint32_t sample_rate_hz)
+{
+  adc_sim* sim = ctx;
+  sim->sample_rate_hz = sample_rate_hz;
+  sim->running = true;
+  return 0;
+}
+
+static int sim_read(void* ctx, uint16_t* samples, size_t max_samples, size_t* got, uint32_t timeout_ms)
+{
+  adc_sim* sim = ctx;
+  (void)timeout_ms;           // Simulated samples are always there
+  *got = 0;
+  if (!sim->running)
+  {
+    return ADC_SOURCE_ERROR;
+  }
+  size_t n = max_samples < sim->chunk ? max_samples : sim->chunk;
+  for (size_t i = 0; i < n; i++)
+  {
+    samples[i] = sim->generator(sim->user, sim->n++);
+  }
+  *got = n;
+  if (sim->overrun)
+  {
+    sim->overrun = false;
+    return ADC_SOURCE_OVERRUN;
+  }
+  return ADC_SOURCE_OK;
+}
+
+static void sim_stop(void* ctx)
+{
+  adc_sim* sim = ctx;
+  sim->running = false;
+}
+
+// The clock reads as the time the last sample handed out was converted
+static int64_t sim_now_us(void* ctx)
+{
+  adc_sim* sim = ctx;
+  if (sim->sample_rate_hz == 0)
+  {
+    return 0;
+  }
+  double rate = sim->sample_rate_hz * (1.0 + sim->clock_error_ppm / 1e6);
+  return (int64_t)(sim->n * 1e6 / rate);
+}
+
+const adc_block_source* adc_sim_init(adc_sim* sim, adc_sim_generator generator, void* user, size_t chunk)
+{
+  memset(sim, 0, sizeof(*sim));
+  sim->generator = generator;
+  sim->user = user;
+  sim->chunk = chunk ? chunk : 1;
+  sim->source.ctx = sim;
+  sim->source.start = sim_start;
+  sim->source.read = sim_read;
+  sim->source.stop = sim_stop;
+  sim->source.now_us = sim_now_us;
+  return &sim->source;
+}
+
+void adc_sim_lose(adc_sim* sim, uint64_t samples)
+{
+  sim->n += samples;
+  sim->lost += samples;
+  sim->overrun = true;
+}
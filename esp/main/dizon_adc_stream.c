@@ -0,0 +1,204 @@
+/*
+*******************************************************************
+* adc_stream.c - Double Buffered Blocks of Continuous ADC Samples *
+*******************************************************************
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "dizon_adc_stream.h"
+
+// Buffer states, the producer and consumer move a buffer between these with CAS
+#define ADC_BUF_FREE    0
+#define ADC_BUF_FILLING 1
+#define ADC_BUF_READY   2
+#define ADC_BUF_BUSY    3
+
+static bool buf_cas(adc_stream* stream, uint8_t index, uint8_t from, uint8_t to)
+{
+  return __atomic_compare_exchange_n(&stream->state[index], &from, to, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+int adc_stream_init(adc_stream* stream, const adc_block_source* source, uint32_t sample_rate_hz, size_t block_len)
+{
+  if (source == NULL || sample_rate_hz == 0 || block_len == 0 || block_len > ADC_STREAM_MAX_BLOCK)
+  {
+    return -1;
+  }
+  memset(stream, 0, sizeof(*stream));
+  stream->source = source;
+  stream->sample_rate_hz = sample_rate_hz;
+  stream->block_len = block_len;
+  stream->back = 0;
+  stream->state[0] = ADC_BUF_FILLING;
+  stream->state[1] = ADC_BUF_FREE;
+  return 0;
+}
+
+int adc_stream_start(adc_stream* stream)
+{
+  stream->first_us = 0;
+  stream->last_us = 0;
+  stream->samples = 0;
+  stream->rate_samples = 0;
+  return stream->source->start(stream->source->ctx, stream->sample_rate_hz);
+}
+
+void adc_stream_stop(adc_stream* stream)
+{
+  stream->source->stop(stream->source->ctx);
+}
+
+//--------------------------------------------------------------------------------------
+// Move the completed back buffer to READY and find somewhere to put the next block.
+// A block the consumer has not taken yet is dropped in favour of fresh data, a block
+// the consumer is still working on is never touched.
+//--------------------------------------------------------------------------------------
+static void complete_block(adc_stream* stream, int64_t end_us)
+{
+  uint8_t done = stream->back;
+  uint8_t other = done ^ 1;
+
+  stream->seq[done] = stream->next_seq++;
+  stream->start_us[done] = end_us - (int64_t)((stream->block_len * 1000000ULL) / stream->sample_rate_hz);
+  stream->blocks_filled++;
+  stream->fill = 0;
+
+  if (buf_cas(stream, other, ADC_BUF_FREE, ADC_BUF_FILLING))
+  {
+    __atomic_store_n(&stream->state[done], ADC_BUF_READY, __ATOMIC_RELEASE);
+    stream->back = other;
+  }
+  else if (buf_cas(stream, other, ADC_BUF_READY, ADC_BUF_FILLING))
+  {
+    // Consumer fell behind, the older block goes
+    stream->blocks_dropped++;
+    __atomic_store_n(&stream->state[done], ADC_BUF_READY, __ATOMIC_RELEASE);
+    stream->back = other;
+  }
+  else
+  {
+    // Consumer still owns the other buffer, refill this one
+    stream->blocks_dropped++;
+  }
+}
+
+int adc_stream_fill(adc_stream* stream, uint32_t timeout_ms)
+{
+  const adc_block_source* src = stream->source;
+  size_t got = 0;
+  int ret = src->read(src->ctx, &stream->buf[stream->back][stream->fill],
+                      stream->block_len - stream->fill, &got, timeout_ms);
+  if (ret < 0)
+  {
+    if (ret != ADC_SOURCE_TIMEOUT)
+    {
+      stream->read_errors++;
+    }
+    return ret;
+  }
+  if (ret == ADC_SOURCE_OVERRUN)
+  {
+    stream->overruns++;
+  }
+  if (got == 0)
+  {
+    return 0;
+  }
+
+  int64_t now = src->now_us(src->ctx);
+  if (stream->samples == 0)
+  {
+    stream->first_us = now;
+  }
+  else
+  {
+    stream->rate_samples += got;
+  }
+  stream->samples += got;
+  stream->last_us = now;
+
+  stream->fill += got;
+  if (stream->fill < stream->block_len)
+  {
+    return 0;
+  }
+  complete_block(stream, now);
+  return 1;
+}
+
+void adc_stream_flush(adc_stream* stream)
+{
+  const adc_block_source* src = stream->source;
+  size_t got, drained = 0;
+  // A source that always has a block ready, like the simulated one, would never run dry
+  do
+  {
+    got = 0;
+    if (src->read(src->ctx, stream->buf[stream->back], stream->block_len, &got, 0) < 0)
+    {
+      break;
+    }
+    drained += got;
+  } while (got == stream->block_len && drained < ADC_STREAM_FLUSH_MAX);
+  stream->flushed += stream->fill + drained;
+  stream->fill = 0;
+  // Rate accounting restarts after a gap so the pause is not counted against the source
+  stream->samples = 0;
+  stream->rate_samples = 0;
+}
+
+bool adc_stream_take(adc_stream* stream, adc_block* block)
+{
+  for (uint8_t i = 0; i < 2; i++)
+  {
+    if (buf_cas(stream, i, ADC_BUF_READY, ADC_BUF_BUSY))
+    {
+      block->samples = stream->buf[i];
+      block->len = stream->block_len;
+      block->seq = stream->seq[i];
+      block->start_us = stream->start_us[i];
+      block->index = i;
+      stream->blocks_taken++;
+      return true;
+    }
+  }
+  return false;
+}
+
+void adc_stream_release(adc_stream* stream, const adc_block* block)
+{
+  buf_cas(stream, block->index, ADC_BUF_BUSY, ADC_BUF_FREE);
+}
+
+bool adc_stream_next(adc_stream* stream, adc_block* block, uint32_t timeout_ms)
+{
+  while (!adc_stream_take(stream, block))
+  {
+    if (adc_stream_fill(stream, timeout_ms) < 0)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+double adc_stream_measured_rate(const adc_stream* stream)
+{
+  if (stream->rate_samples == 0 || stream->last_us <= stream->first_us)
+  {
+    return 0;
+  }
+  return (stream->rate_samples * 1000000.0) / (stream->last_us - stream->first_us);
+}
+
+void adc_stream_print(const adc_stream* stream)
+{
+  printf("ADC stream: %u Hz configured, %.1f Hz measured, blocks filled %u taken %u dropped %u, "
+         "overruns %u, errors %u\n",
+         (unsigned)stream->sample_rate_hz, adc_stream_measured_rate(stream),
+         (unsigned)stream->blocks_filled, (unsigned)stream->blocks_taken,
+         (unsigned)stream->blocks_dropped, (unsigned)stream->overruns,
+         (unsigned)stream->read_errors);
+}
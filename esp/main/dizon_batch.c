@@ -0,0 +1,196 @@
+/*
+*****************************************************************
+* batch.c - Batches Telemetry Records Into Fewer Publishes      *
+*****************************************************************
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dizon_batch.h"
+
+int batch_init(telemetry_batch* b, const telemetry_encoder* encoder, const char* id, const char* topic,
+               const batch_policy* policy)
+{
+    if (encoder == NULL || id == NULL || topic == NULL) {
+        return -1;
+    }
+    memset(b, 0, sizeof(*b));
+    b->encoder = encoder;
+    b->id = id;
+    b->topic_len = strlen(topic);
+    batch_set_policy(b, policy);
+    return 0;
+}
+
+void batch_set_policy(telemetry_batch* b, const batch_policy* policy)
+{
+    b->policy = *policy;
+    if (b->policy.max_records == 0) {
+        b->policy.max_records = 1;
+    } else if (b->policy.max_records > BATCH_MAX_RECORDS) {
+        b->policy.max_records = BATCH_MAX_RECORDS;
+    }
+    if (b->policy.max_bytes == 0 || b->policy.max_bytes > BATCH_MAX_BYTES) {
+        b->policy.max_bytes = BATCH_MAX_BYTES;
+    }
+}
+
+int batch_parse_policy(const char* text, size_t len, batch_policy* policy)
+{
+    batch_policy p = *policy;
+    char buf[96];
+    char* save = NULL;
+
+    if (len >= sizeof(buf)) {
+        return -1;
+    }
+    memcpy(buf, text, len);
+    buf[len] = 0;
+    for (char* tok = strtok_r(buf, " ,\r\n", &save); tok; tok = strtok_r(NULL, " ,\r\n", &save)) {
+        char* eq = strchr(tok, '=');
+        char* end;
+        if (eq == NULL) {
+            return -1;
+        }
+        *eq = 0;
+        unsigned long v = strtoul(eq + 1, &end, 10);
+        if (*end != 0 || end == eq + 1) {
+            return -1;
+        }
+        if (strcmp(tok, "records") == 0) {
+            p.max_records = v > BATCH_MAX_RECORDS ? BATCH_MAX_RECORDS : (uint16_t)v;
+        } else if (strcmp(tok, "age_ms") == 0) {
+            p.max_age_ms = (uint32_t)v;
+        } else if (strcmp(tok, "bytes") == 0) {
+            p.max_bytes = (uint32_t)v;
+        } else {
+            return -1;
+        }
+    }
+    *policy = p;
+    return 0;
+}
+
+void batch_set_encoder(telemetry_batch* b, const telemetry_encoder* encoder)
+{
+    b->encoder = encoder;
+    b->pending_bytes = encoder->header_bytes;
+    for (uint16_t i = 0; i < b->count; i++) {
+        b->pending_bytes += encoder->record_bytes(&b->records[i]);
+    }
+}
+
+size_t batch_air_bytes(size_t payload_len, size_t topic_len)
+{
+    size_t mqtt = payload_len + topic_len + BATCH_MQTT_OVERHEAD;
+    size_t frames = (mqtt + BATCH_TLS_OVERHEAD + BATCH_WIFI_MTU - 1) / BATCH_WIFI_MTU;
+    return mqtt + BATCH_TLS_OVERHEAD + frames * (BATCH_IP_OVERHEAD + BATCH_WIFI_OVERHEAD);
+}
+
+bool batch_due(const telemetry_batch* b, int64_t now_us)
+{
+    if (b->count == 0) {
+        return false;
+    }
+    if (b->count >= b->policy.max_records || b->count >= BATCH_MAX_RECORDS) {
+        return true;
+    }
+    // Would one more record push us past the byte limit
+    if (b->pending_bytes + b->encoder->record_bytes(&b->records[b->count - 1]) > b->policy.max_bytes) {
+        return true;
+    }
+    return b->policy.max_age_ms && now_us - b->oldest_us >= (int64_t)b->policy.max_age_ms * 1000;
+}
+
+uint32_t batch_ms_until_due(const telemetry_batch* b, int64_t now_us)
+{
+    if (b->count == 0 || b->policy.max_age_ms == 0) {
+        return UINT32_MAX;
+    }
+    int64_t left = b->oldest_us + (int64_t)b->policy.max_age_ms * 1000 - now_us;
+    return left <= 0 ? 0 : (uint32_t)((left + 999) / 1000);
+}
+
+// Forget the n oldest records, the age limit then runs from the oldest one left
+static void remove_oldest(telemetry_batch* b, uint16_t n)
+{
+    b->count -= n;
+    memmove(&b->records[0], &b->records[n], b->count * sizeof(sump_record));
+    memmove(&b->added_us[0], &b->added_us[n], b->count * sizeof(int64_t));
+    b->oldest_us = b->count ? b->added_us[0] : 0;
+    batch_set_encoder(b, b->encoder);
+}
+
+bool batch_add(telemetry_batch* b, const sump_record* rec, int64_t now_us)
+{
+    if (b->count == BATCH_MAX_RECORDS) {
+        // Caller did not flush, make room by dropping the oldest
+        remove_oldest(b, 1);
+        b->stats.dropped++;
+    }
+    if (b->count == 0) {
+        b->oldest_us = now_us;
+        b->pending_bytes = b->encoder->header_bytes;
+    }
+    b->added_us[b->count] = now_us;
+    b->records[b->count++] = *rec;
+    b->pending_bytes += b->encoder->record_bytes(rec);
+    b->stats.single_air_bytes += batch_air_bytes(b->encoder->header_bytes + b->encoder->record_bytes(rec),
+                                                 b->topic_len);
+    return batch_due(b, now_us);
+}
+
+uint16_t batch_pending(const telemetry_batch* b)
+{
+    return b->count;
+}
+
+bool batch_pop(telemetry_batch* b, sump_record* rec)
+{
+    if (b->count == 0) {
+        return false;
+    }
+    *rec = b->records[0];
+    remove_oldest(b, 1);
+    return true;
+}
+
+size_t batch_take_payload(telemetry_batch* b, const uint8_t** payload)
+{
+    size_t used = 0;
+    size_t len;
+
+    *payload = b->payload;
+    if (b->count == 0) {
+        return 0;
+    }
+    len = b->encoder->encode(b->id, b->records, b->count, b->payload, b->policy.max_bytes, &used);
+    if (len == 0) {
+        // A record that does not fit on its own can never be sent, let it go
+        used = 1;
+        b->stats.dropped++;
+    }
+    remove_oldest(b, (uint16_t)used);
+
+    if (len) {
+        b->stats.publishes++;
+        b->stats.records += used;
+        b->stats.payload_bytes += len;
+        b->stats.air_bytes += batch_air_bytes(len, b->topic_len);
+    }
+    return len;
+}
+
+void batch_print_stats(const telemetry_batch* b)
+{
+    const batch_stats* s = &b->stats;
+    if (s->records == 0) {
+        printf("Batch (%s): nothing sent yet\n", b->encoder->name);
+        return;
+    }
+    printf("Batch (%s): %u records in %u publishes, %u dropped, %.1f payload bytes/record, "
+           "on air %.1f bytes/record batched vs %.1f one per publish\n",
+           b->encoder->name, s->records, s->publishes, s->dropped, (double)s->payload_bytes / s->records,
+           (double)s->air_bytes / s->records, (double)s->single_air_bytes / (s->records + b->count));
+}
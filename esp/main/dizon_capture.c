@@ -0,0 +1,286 @@
+/*
+*****************************************************************
+* capture.c - Raw Waveform Capture Around Pump Events           *
+*****************************************************************
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "dizon_capture.h"
+#include "dizon_EmonLib.h"
+
+static uint8_t slot_state(const capture_slot* s)
+{
+    return __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+}
+
+static void slot_hand_over(capture_slot* s, capture_slot_state state)
+{
+    // Everything written to the slot is visible before its new owner sees the state
+    __atomic_store_n(&s->state, (uint8_t)state, __ATOMIC_RELEASE);
+}
+
+// Takes the first free slot to record into, if there is one
+static void claim_slot(capture* c)
+{
+    for (uint8_t i = 0; i < c->n_slots; i++) {
+        capture_slot* s = &c->slots[i];
+        if (slot_state(s) == CAPTURE_SLOT_FREE) {
+            s->head = s->filled = 0;
+            slot_hand_over(s, CAPTURE_SLOT_RECORDING);
+            c->rec = s;
+            return;
+        }
+    }
+    c->rec = NULL;
+}
+
+int capture_init(capture* c, const capture_config* cfg, uint16_t* arena, size_t arena_len, uint8_t n_slots)
+{
+    uint32_t slot_len = cfg->pre_samples + cfg->post_samples;
+
+    if (arena == NULL || n_slots == 0 || n_slots > CAPTURE_MAX_SLOTS || cfg->post_samples == 0 ||
+        cfg->sample_rate_hz == 0 || cfg->mains_hz == 0 || arena_len < (size_t)slot_len * n_slots) {
+        return -1;
+    }
+    memset(c, 0, sizeof(*c));
+    c->cfg = *cfg;
+    c->n_slots = n_slots;
+    c->slot_len = slot_len;
+    c->holdoff_samples = (uint32_t)((uint64_t)cfg->holdoff_ms * cfg->sample_rate_hz / 1000);
+    c->zc_limit = cfg->zc_cycles ? (uint32_t)((uint64_t)cfg->zc_cycles * cfg->sample_rate_hz / cfg->mains_hz) : 0;
+    for (uint8_t i = 0; i < n_slots; i++) {
+        c->slots[i].samples = &arena[(size_t)i * slot_len];
+    }
+    c->dc_q16 = (ADC_COUNTS / 2) << 16;
+    c->next_id = 1;
+    claim_slot(c);
+    return 0;
+}
+
+// back is how many of the samples already pushed come after the trigger point
+static bool trigger_at(capture* c, capture_reason reason, uint32_t back, float before, float after)
+{
+    c->triggers++;
+    if (c->rec == NULL || c->triggered ||
+        (c->last_trigger != 0 && c->total - back - c->last_trigger < c->holdoff_samples)) {
+        c->dropped++;
+        return false;
+    }
+    back = back < c->rec->filled ? back : c->rec->filled;
+    c->triggered = true;
+    c->after = back;
+    c->post_left = back < c->cfg.post_samples ? c->cfg.post_samples - back : 0;
+    c->last_trigger = c->total - back;
+
+    capture_info* info = &c->rec->info;
+    info->id = c->next_id++;
+    info->reason = reason;
+    info->trigger_us = c->block_us + (int64_t)((c->block_len - (int64_t)back) * 1000000LL / c->cfg.sample_rate_hz);
+    info->irms_before = before;
+    info->irms_after = after;
+    return true;
+}
+
+static void freeze(capture* c)
+{
+    capture_slot* s = c->rec;
+    uint32_t after = c->after < s->filled ? c->after : s->filled;
+
+    s->start = (s->head + c->slot_len - s->filled) % c->slot_len;
+    s->info.len = s->filled;
+    s->info.pre = s->filled - after;
+    c->triggered = false;
+    c->captured++;
+    slot_hand_over(s, CAPTURE_SLOT_READY);
+    claim_slot(c);
+}
+
+bool capture_push(capture* c, const uint16_t* samples, size_t len, int64_t start_us)
+{
+    const int32_t band = (int32_t)c->cfg.zc_band << 16;
+    bool frozen = false;
+
+    if (c->rec == NULL) {
+        claim_slot(c);
+    }
+    if (c->triggered && c->post_left == 0) {
+        freeze(c);                  // Triggered that far back, nothing more to record
+        frozen = true;
+    }
+    c->block_us = start_us;
+    c->block_len = 0;
+    for (size_t i = 0; i < len; i++) {
+        uint16_t x = samples[i];
+        int32_t x_q16 = (int32_t)x << 16;
+
+        c->block_len++;
+        c->total++;
+        if (c->rec) {
+            capture_slot* s = c->rec;
+            s->samples[s->head] = x;
+            s->head = s->head + 1 == c->slot_len ? 0 : s->head + 1;
+            s->filled += s->filled < c->slot_len;
+            if (c->triggered) {
+                c->after++;
+                if (--c->post_left == 0) {
+                    freeze(c);
+                    frozen = true;
+                }
+            }
+        }
+
+        // Zero crossings with hysteresis around the slow mean
+        c->dc_q16 += (x_q16 - c->dc_q16) >> 12;
+        if (x_q16 > c->dc_q16 + band && c->zc_sign <= 0) {
+            c->zc_sign = 1;
+            c->since_crossing = 0;
+        } else if (x_q16 < c->dc_q16 - band && c->zc_sign >= 0) {
+            c->zc_sign = -1;
+            c->since_crossing = 0;
+        } else if (++c->since_crossing == c->zc_limit && c->zc_limit && c->have_rms &&
+                   c->last_irms >= c->cfg.zc_min_amps) {
+            trigger_at(c, CAPTURE_ZERO_CROSS, 0, c->last_irms, c->last_irms);
+        }
+    }
+    return frozen;
+}
+
+// Samples of the last block from t_us on, all of it for a time before it
+static uint32_t samples_since(const capture* c, int64_t t_us)
+{
+    int64_t into = (t_us - c->block_us) * c->cfg.sample_rate_hz / 1000000;
+    return into <= 0 ? c->block_len : into >= c->block_len ? 0 : c->block_len - (uint32_t)into;
+}
+
+void capture_rms(capture* c, int64_t t_us, float irms)
+{
+    float prev = c->last_irms;
+    const float threshold = c->cfg.threshold_amps;
+
+    c->last_irms = irms;
+    if (!c->have_rms) {
+        c->have_rms = true;
+        return;
+    }
+    if (threshold > 0 && (prev < threshold) != (irms < threshold)) {
+        trigger_at(c, CAPTURE_THRESHOLD, samples_since(c, t_us), prev, irms);
+    } else if (c->cfg.step_amps > 0 && fabsf(irms - prev) >= c->cfg.step_amps) {
+        trigger_at(c, CAPTURE_STEP, samples_since(c, t_us), prev, irms);
+    }
+}
+
+bool capture_trigger(capture* c, capture_reason reason, int64_t t_us)
+{
+    return trigger_at(c, reason, samples_since(c, t_us), c->last_irms, c->last_irms);
+}
+
+capture_slot* capture_ready(capture* c)
+{
+    capture_slot* oldest = NULL;
+    for (uint8_t i = 0; i < c->n_slots; i++) {
+        capture_slot* s = &c->slots[i];
+        if (slot_state(s) == CAPTURE_SLOT_READY && (oldest == NULL || s->info.id < oldest->info.id)) {
+            oldest = s;
+        }
+    }
+    return oldest;
+}
+
+void capture_release(capture* c, capture_slot* s)
+{
+    (void)c;
+    slot_hand_over(s, CAPTURE_SLOT_FREE);
+}
+
+static uint8_t* put_u16(uint8_t* p, uint16_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    return p + 2;
+}
+
+static uint8_t* put_u32(uint8_t* p, uint32_t v)
+{
+    return put_u16(put_u16(p, (uint16_t)v), (uint16_t)(v >> 16));
+}
+
+static uint16_t get_u16(const uint8_t* p)
+{
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t* p)
+{
+    return get_u16(p) | (uint32_t)get_u16(p + 2) << 16;
+}
+
+size_t capture_chunk(const capture_slot* s, uint32_t offset, uint32_t sample_rate_hz, int64_t trigger_epoch_us,
+                     uint32_t max_samples, uint8_t* buf, size_t size)
+{
+    uint32_t count = s->info.len > offset ? s->info.len - offset : 0;
+
+    count = count < max_samples ? count : max_samples;
+    count = count < UINT16_MAX ? count : UINT16_MAX;
+    if (count == 0 || size < CAPTURE_CHUNK_HEADER + 2 * (size_t)count) {
+        return 0;
+    }
+    // Little endian throughout, the samples in time order from offset
+    uint8_t* p = buf;
+    *p++ = CAPTURE_CHUNK_VERSION;
+    *p++ = (uint8_t)s->info.reason;
+    p = put_u16(p, (uint16_t)count);
+    p = put_u32(p, s->info.id);
+    p = put_u32(p, offset);
+    p = put_u32(p, s->info.len);
+    p = put_u32(p, s->info.pre);
+    p = put_u32(p, sample_rate_hz);
+    p = put_u32(p, (uint32_t)trigger_epoch_us);
+    p = put_u32(p, (uint32_t)((uint64_t)trigger_epoch_us >> 32));
+    // A slot that wrapped is full, so len is also where its ring wraps.  One that did not
+    // starts at 0 and never gets there.
+    uint32_t at = (s->start + offset) % s->info.len;
+    for (uint32_t i = 0; i < count; i++) {
+        p = put_u16(p, s->samples[at]);
+        at = at + 1 == s->info.len ? 0 : at + 1;
+    }
+    return (size_t)(p - buf);
+}
+
+const uint8_t* capture_chunk_parse(const uint8_t* buf, size_t len, capture_chunk_header* hdr)
+{
+    if (len < CAPTURE_CHUNK_HEADER || buf[0] != CAPTURE_CHUNK_VERSION) {
+        return NULL;
+    }
+    hdr->version = buf[0];
+    hdr->reason = (capture_reason)buf[1];
+    hdr->count = get_u16(buf + 2);
+    hdr->id = get_u32(buf + 4);
+    hdr->offset = get_u32(buf + 8);
+    hdr->len = get_u32(buf + 12);
+    hdr->pre = get_u32(buf + 16);
+    hdr->sample_rate_hz = get_u32(buf + 20);
+    hdr->trigger_epoch_us = (int64_t)((uint64_t)get_u32(buf + 28) << 32 | get_u32(buf + 24));
+    if (len != CAPTURE_CHUNK_HEADER + 2 * (size_t)hdr->count || (uint64_t)hdr->offset + hdr->count > hdr->len) {
+        return NULL;
+    }
+    return buf + CAPTURE_CHUNK_HEADER;
+}
+
+const char* capture_reason_name(capture_reason reason)
+{
+    switch (reason) {
+        case CAPTURE_MANUAL:     return "manual";
+        case CAPTURE_STEP:       return "step";
+        case CAPTURE_THRESHOLD:  return "threshold";
+        case CAPTURE_ZERO_CROSS: return "zero-cross";
+    }
+    return "?";
+}
+
+void capture_print(const capture* c)
+{
+    printf("Capture: %u triggers, %u captured, %u dropped, %s\n", c->triggers, c->captured, c->dropped,
+           c->rec ? "recording" : "all slots waiting for upload");
+}
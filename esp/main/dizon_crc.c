@@ -0,0 +1,20 @@
+/*
+*****************************************************************
+* crc.c - CRC-32 Of What The Firmware Keeps In Flash And NVS    *
+*****************************************************************
+*/
+
+#include "dizon_crc.h"
+
+uint32_t crc32_buf(const void* data, size_t len)
+{
+    const uint8_t* p = data;
+    uint32_t crc = 0xffffffff;
+    while (len--) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
@@ -0,0 +1,61 @@
+/*
+*****************************************************************
+* deadband.c - Report-By-Exception Filter For Readings          *
+*****************************************************************
+*/
+
+#include <math.h>
+#include <string.h>
+#include "dizon_deadband.h"
+
+int deadband_init(deadband* db, const deadband_config* cfg)
+{
+    if (cfg->abs_amps < 0 || cfg->rel < 0) {
+        return -1;
+    }
+    memset(db, 0, sizeof(*db));
+    db->cfg = *cfg;
+    return 0;
+}
+
+const char* deadband_verdict_name(deadband_verdict v)
+{
+    switch (v) {
+    case DEADBAND_SUPPRESS:  return "suppress";
+    case DEADBAND_FIRST:     return "first";
+    case DEADBAND_CHANGE:    return "change";
+    case DEADBAND_HEARTBEAT: return "heartbeat";
+    }
+    return "?";
+}
+
+deadband_verdict deadband_check(deadband* db, float value, int64_t t_us, uint32_t* suppressed)
+{
+    deadband_verdict v;
+    float band = fmaxf(db->cfg.abs_amps, db->cfg.rel * fabsf(db->last));
+
+    if (!db->have_last) {
+        v = DEADBAND_FIRST;
+    } else if (fabsf(value - db->last) > band) {
+        v = DEADBAND_CHANGE;
+    } else if (db->cfg.heartbeat_s && t_us - db->last_us >= (int64_t)db->cfg.heartbeat_s * 1000000) {
+        v = DEADBAND_HEARTBEAT;
+        db->heartbeats++;
+    } else {
+        db->suppressed++;
+        db->suppressed_total++;
+        return DEADBAND_SUPPRESS;
+    }
+    deadband_pass(db, value, t_us, suppressed);
+    return v;
+}
+
+void deadband_pass(deadband* db, float value, int64_t t_us, uint32_t* suppressed)
+{
+    *suppressed = db->suppressed;
+    db->suppressed = 0;
+    db->have_last = true;
+    db->last = value;
+    db->last_us = t_us;
+    db->passed++;
+}
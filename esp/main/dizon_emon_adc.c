@@ -0,0 +1,109 @@
+/*
+*****************************************************************
+* emon_adc.c - ADC1 Sample Provider For The Energy Monitor      *
+*****************************************************************
+*/
+
+#include <string.h>
+#include "esp_log.h"
+#include "nvs.h"
+#include "esp_adc_cal.h"
+#include "dizon_emon_adc.h"
+
+static const char *TAG = "EMON_ADC";
+
+#define DEFAULT_VREF_MV 1100      // For chips with nothing burnt into eFuse
+
+#ifdef CONFIG_EMON_ADC_CAL
+static adc_cal s_cal;
+#endif
+
+static void adc_setup(void* ctx, int channel)
+{
+    adc1_config_width(ADC_WIDTH_BIT_12);
+    adc1_config_channel_atten((adc1_channel_t)channel, ADC_ATTEN_DB_0);
+}
+
+static int adc_read(void* ctx, int channel)
+{
+#ifdef CONFIG_EMON_ADC_CAL
+    return adc_cal_apply(&s_cal, adc1_get_raw((adc1_channel_t)channel));
+#else
+    return adc1_get_raw((adc1_channel_t)channel);
+#endif
+}
+
+static int64_t adc_micros(void* ctx)
+{
+    return esp_timer_get_time();
+}
+
+const emon_sample_provider* emon_adc_provider(void)
+{
+    static const emon_sample_provider provider = {
+        .ctx = NULL,
+        .setup = adc_setup,
+        .read = adc_read,
+        .micros = adc_micros,
+    };
+    return &provider;
+}
+
+#ifdef CONFIG_EMON_ADC_CAL
+static uint32_t efuse_mv(void* ctx, int raw)
+{
+    return esp_adc_cal_raw_to_voltage((uint32_t)raw, ctx);
+}
+
+static bool load_points(adc_cal_blob* blob)
+{
+    nvs_handle_t nvs;
+    size_t len = sizeof(*blob);
+
+    if (nvs_open(ADC_CAL_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return false;
+    }
+    esp_err_t err = nvs_get_blob(nvs, ADC_CAL_KEY, blob, &len);
+    nvs_close(nvs);
+    return err == ESP_OK && len == sizeof(*blob) && blob->version == ADC_CAL_VERSION;
+}
+
+const adc_cal* emon_adc_calibrate(void)
+{
+    static const char* const kinds[] = { "eFuse Vref", "eFuse two point", "default Vref" };
+    esp_adc_cal_characteristics_t chars;
+    adc_cal_blob blob;
+
+    if (load_points(&blob) && adc_cal_from_points(&s_cal, blob.points, blob.count) == 0) {
+        ESP_LOGI(TAG, "ADC corrected from %u bench points", blob.count);
+        return &s_cal;
+    }
+    esp_adc_cal_value_t kind = esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTEN_DB_0, ADC_WIDTH_BIT_12,
+                                                        DEFAULT_VREF_MV, &chars);
+    adc_cal_from_fn(&s_cal, efuse_mv, &chars);
+    ESP_LOGI(TAG, "ADC corrected from the %s characterization, raw 2048 is %u counts",
+             kind <= ESP_ADC_CAL_VAL_DEFAULT_VREF ? kinds[kind] : "unknown", s_cal.lut[ADC_COUNTS / 2]);
+    return &s_cal;
+}
+
+esp_err_t emon_adc_save_points(const adc_cal_point* points, size_t n)
+{
+    adc_cal_blob blob = { .version = ADC_CAL_VERSION, .count = (uint8_t)n };
+    nvs_handle_t nvs;
+
+    if (n > ADC_CAL_MAX_POINTS || adc_cal_from_points(&s_cal, points, n) != 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(blob.points, points, n * sizeof(points[0]));
+    esp_err_t err = nvs_open(ADC_CAL_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_blob(nvs, ADC_CAL_KEY, &blob, sizeof(blob));
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return err;
+}
+#endif
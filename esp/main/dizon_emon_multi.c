@@ -0,0 +1,196 @@
+/*
+*****************************************************************
+* emon_multi.c - Current RMS For Several Pumps From One Scan     *
+*****************************************************************
+*/
+
+#include <string.h>
+#include "dizon_emon_multi.h"
+
+int emon_multi_init(emon_multi* m, const emon_sample_provider* provider, const emon_multi_channel* channels, size_t n)
+{
+  if (n == 0 || n > EMON_MULTI_MAX)
+  {
+    return -1;
+  }
+  memset(m, 0, sizeof(*m));
+  m->provider = provider;
+  m->n = n;
+  for (size_t k = 0; k < n; k++)
+  {
+    m->pin[k] = channels[k].pin;
+    m->ratio[k] = channels[k].ical * ((SUPPLY_VOLTAGE / 1000.0) / ADC_COUNTS);
+    m->lag[k] = (double)k / n;
+    m->lag_q[k] = (int32_t)lround(m->lag[k] * (1 << EMON_Q_PHASECAL));
+    m->offset[k] = ADC_COUNTS >> 1;
+    m->offset_q[k] = (ADC_COUNTS >> 1) << EMON_Q_OFFSET;
+    if (provider && provider->setup)
+    {
+      provider->setup(provider->ctx, m->pin[k]);
+    }
+  }
+  for (size_t k = 0; k < n; k++)
+  {
+    m->weight_q[k] = (int32_t)lround(m->ratio[k] / m->ratio[0] * (1 << EMON_Q_PHASECAL));
+  }
+  return 0;
+}
+
+void emon_multi_set_math(emon_multi* m, emon_math math)
+{
+  m->math = math;
+  memset(m->sum, 0, sizeof(m->sum));
+  memset(m->sum_q, 0, sizeof(m->sum_q));
+  m->sum_total = 0;
+  m->sum_total_q = 0;
+  m->scans = 0;
+}
+
+//--------------------------------------------------------------------------------------
+// One scan, one sample per channel.  Channel k is pulled back onto channel 0's time by
+// going lag[k] of the way towards its previous sample before it joins the total.
+//--------------------------------------------------------------------------------------
+static inline void scan(emon_multi* m, const uint16_t* s)
+{
+  double total = 0;
+  for (size_t k = 0; k < m->n; k++)
+  {
+    m->offset[k] += (s[k] - m->offset[k]) / ADC_COUNTS;
+    double f = s[k] - m->offset[k];
+    m->sum[k] += f * f;
+    total += m->ratio[k] * (f - m->lag[k] * (f - m->last[k]));
+    m->last[k] = f;
+  }
+  m->sum_total += total * total;
+}
+
+// Same with integer math, the total is in channel 0 counts
+static inline void scan_q(emon_multi* m, const uint16_t* s)
+{
+  int32_t total = 0;
+  for (size_t k = 0; k < m->n; k++)
+  {
+    int32_t f = emon_filter_q(&m->offset_q[k], s[k]);
+    m->sum_q[k] += (int64_t)f * f;
+    int32_t aligned = f - (int32_t)(((int64_t)m->lag_q[k] * (f - m->last_q[k])) >> EMON_Q_PHASECAL);
+    total += (int32_t)(((int64_t)m->weight_q[k] * aligned) >> EMON_Q_PHASECAL);
+    m->last_q[k] = f;
+  }
+  m->sum_total_q += (int64_t)total * total;
+}
+
+void emon_multi_push(emon_multi* m, const uint16_t* samples, size_t len)
+{
+  size_t scans = len / m->n;
+
+  if (m->math == EMON_MATH_FIXED)
+  {
+    for (size_t j = 0; j < scans; j++)
+    {
+      scan_q(m, &samples[j * m->n]);
+    }
+  }
+  else
+  {
+    for (size_t j = 0; j < scans; j++)
+    {
+      scan(m, &samples[j * m->n]);
+    }
+  }
+  m->scans += scans;
+}
+
+unsigned emon_multi_finish(emon_multi* m)
+{
+  unsigned scans = m->scans;
+
+  if (scans == 0)
+  {
+    return 0;
+  }
+  if (m->math == EMON_MATH_FIXED)
+  {
+    const double q2 = (double)(1 << (2 * EMON_Q_FILTER));
+    for (size_t k = 0; k < m->n; k++)
+    {
+      m->sum[k] = m->sum_q[k] / q2;
+      m->sum_q[k] = 0;
+    }
+    m->sum_total = m->sum_total_q / q2 * m->ratio[0] * m->ratio[0];
+    m->sum_total_q = 0;
+  }
+  for (size_t k = 0; k < m->n; k++)
+  {
+    m->irms[k] = m->ratio[k] * sqrt(m->sum[k] / scans);
+    m->sum[k] = 0;
+  }
+  m->total_irms = sqrt(m->sum_total / scans);
+  m->sum_total = 0;
+  m->scans = 0;
+  return scans;
+}
+
+void emon_multi_calc(emon_multi* m, unsigned samples)
+{
+  const emon_sample_provider* p = m->provider;
+  uint16_t s[EMON_MULTI_MAX];
+
+  m->start_us = p->micros(p->ctx);
+  for (unsigned j = 0; j < samples; j++)
+  {
+    for (size_t k = 0; k < m->n; k++)
+    {
+      s[k] = (uint16_t)p->read(p->ctx, m->pin[k]);
+    }
+    if (m->math == EMON_MATH_FIXED)
+    {
+      scan_q(m, s);
+    }
+    else
+    {
+      scan(m, s);
+    }
+  }
+  m->scans += samples;
+  if (samples)
+  {
+    m->slot_us = (double)(p->micros(p->ctx) - m->start_us) / ((double)samples * m->n);
+  }
+  emon_multi_finish(m);
+}
+
+//--------------------------------------------------------------------------------------
+// Blocks have to hold whole scans, otherwise the channels slip against each other
+//--------------------------------------------------------------------------------------
+unsigned emon_multi_calc_stream(emon_multi* m, adc_stream* stream, unsigned samples)
+{
+  adc_block block;
+  bool first = true;
+
+  while (m->scans < samples)
+  {
+    if (!adc_stream_next(stream, &block, EMON_STREAM_TIMEOUT_MS))
+    {
+      break;
+    }
+    if (first)
+    {
+      m->start_us = block.start_us;
+      first = false;
+    }
+    emon_multi_push(m, block.samples, block.len);
+    adc_stream_release(stream, &block);
+  }
+  m->slot_us = 1e6 / stream->sample_rate_hz;
+  return emon_multi_finish(m);
+}
+
+void emon_multi_print(const emon_multi* m)
+{
+  printf("Irms");
+  for (size_t k = 0; k < m->n; k++)
+  {
+    printf(" ch%d %f", m->pin[k], m->irms[k]);
+  }
+  printf(", total %f, %.1f us between channels\n", m->total_irms, m->slot_us);
+}
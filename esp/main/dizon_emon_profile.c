@@ -0,0 +1,159 @@
+/*
+*****************************************************************
+* emon_profile.c - Jitter Profiler For Polled ADC Sampling      *
+*****************************************************************
+*/
+
+#include <string.h>
+#include "dizon_emon_profile.h"
+
+static void profile_setup(void* ctx, int channel)
+{
+  emon_profile* p = ctx;
+  if (p->inner->setup)
+  {
+    p->inner->setup(p->inner->ctx, channel);
+  }
+}
+
+static inline void profile_gap(emon_profile* p, uint32_t dt)
+{
+  uint8_t i = p->gap_count < EMON_PROFILE_GAPS ? p->gap_count++ : EMON_PROFILE_GAPS - 1;
+  while (i > 0 && p->gaps[i - 1].ticks < dt)
+  {
+    p->gaps[i] = p->gaps[i - 1];
+    i--;
+  }
+  p->gaps[i].index = p->n;
+  p->gaps[i].ticks = dt;
+}
+
+//--------------------------------------------------------------------------------------
+// Stamped as the conversion starts, so the time the read itself takes lands in the
+// interval to the next one
+//--------------------------------------------------------------------------------------
+static int profile_read(void* ctx, int channel)
+{
+  emon_profile* p = ctx;
+  uint32_t now = p->ticks(p->ticks_ctx);
+
+  if (p->n > 0)
+  {
+    uint32_t dt = now - p->last;
+    uint32_t bin = dt / p->bin_ticks;
+    p->bins[bin < EMON_PROFILE_BINS ? bin : EMON_PROFILE_BINS - 1]++;
+    p->min = dt < p->min ? dt : p->min;
+    p->max = dt > p->max ? dt : p->max;
+    p->sum += dt;
+    p->sumsq += (uint64_t)dt * dt;
+    if (p->gap_count < EMON_PROFILE_GAPS || dt > p->gaps[EMON_PROFILE_GAPS - 1].ticks)
+    {
+      profile_gap(p, dt);
+    }
+  }
+  p->n++;
+  p->last = now;
+  return p->inner->read(p->inner->ctx, channel);
+}
+
+static int64_t profile_micros(void* ctx)
+{
+  emon_profile* p = ctx;
+  return p->inner->micros(p->inner->ctx);
+}
+
+int emon_profile_init(emon_profile* p, const emon_sample_provider* inner, emon_profile_ticks ticks,
+                      void* ticks_ctx, uint32_t ticks_per_us, uint32_t bin_ns)
+{
+  if (inner == NULL || ticks == NULL || ticks_per_us == 0 || (uint64_t)bin_ns * ticks_per_us < 1000)
+  {
+    return -1;
+  }
+  memset(p, 0, sizeof(*p));
+  p->inner = inner;
+  p->ticks = ticks;
+  p->ticks_ctx = ticks_ctx;
+  p->ticks_per_us = ticks_per_us;
+  p->bin_ns = bin_ns;
+  p->bin_ticks = (uint32_t)((uint64_t)bin_ns * ticks_per_us / 1000);
+  p->provider.ctx = p;
+  p->provider.setup = profile_setup;
+  p->provider.read = profile_read;
+  p->provider.micros = profile_micros;
+  emon_profile_begin(p);
+  return 0;
+}
+
+void emon_profile_begin(emon_profile* p)
+{
+  p->n = 0;
+  memset(p->bins, 0, sizeof(p->bins));
+  p->min = UINT32_MAX;
+  p->max = 0;
+  p->sum = p->sumsq = 0;
+  p->gap_count = 0;
+}
+
+// Upper edge of the bin the rank-th shortest interval is in, the longest gap past the last bin
+static double profile_percentile(const emon_profile* p, uint32_t intervals, uint32_t per_mille)
+{
+  uint32_t rank = (uint32_t)(((uint64_t)intervals * per_mille + 999) / 1000);
+  uint32_t seen = 0;
+
+  for (uint32_t b = 0; b < EMON_PROFILE_BINS - 1; b++)
+  {
+    seen += p->bins[b];
+    if (seen >= rank)
+    {
+      return (b + 1) * p->bin_ns / 1000.0;
+    }
+  }
+  return (double)p->max / p->ticks_per_us;
+}
+
+void emon_profile_summarize(const emon_profile* p, emon_profile_stats* s)
+{
+  const double us = 1.0 / p->ticks_per_us;
+  uint32_t intervals = p->n > 1 ? p->n - 1 : 0;
+
+  memset(s, 0, sizeof(*s));
+  s->samples = p->n;
+  if (intervals == 0)
+  {
+    return;
+  }
+  double mean = (double)p->sum / intervals;
+  double var = (double)p->sumsq / intervals - mean * mean;
+  s->span_us = p->sum * us;
+  s->rate_hz = intervals * 1e6 / s->span_us;
+  s->mean_us = mean * us;
+  s->sd_us = var > 0 ? sqrt(var) * us : 0;
+  s->min_us = p->min * us;
+  s->max_us = p->max * us;
+  s->p50_us = profile_percentile(p, intervals, 500);
+  s->p99_us = profile_percentile(p, intervals, 990);
+  s->p999_us = profile_percentile(p, intervals, 999);
+}
+
+void emon_profile_print(const emon_profile* p)
+{
+  emon_profile_stats s;
+  const double us = 1.0 / p->ticks_per_us;
+
+  emon_profile_summarize(p, &s);
+  printf("Sampling: %u conversions in %.1f ms, %.0f Hz, interval mean %.2f us sd %.2f min %.2f "
+         "p50 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+         s.samples, s.span_us / 1000, s.rate_hz, s.mean_us, s.sd_us, s.min_us, s.p50_us, s.p99_us,
+         s.p999_us, s.max_us);
+  printf("JITTER bin_ns=%u n=%u bins=", p->bin_ns, p->n);
+  for (uint32_t b = 0; b < EMON_PROFILE_BINS; b++)
+  {
+    printf(b ? ",%u" : "%u", p->bins[b]);
+  }
+  printf(" gaps=");
+  for (uint8_t i = 0; i < p->gap_count; i++)
+  {
+    printf(i ? ",%u:%.2f" : "%u:%.2f", p->gaps[i].index, p->gaps[i].ticks * us);
+  }
+  printf("\n");
+}
@@ -0,0 +1,123 @@
+/*
+*****************************************************************
+* emon_window.c - Sliding Window Per-Cycle Current RMS          *
+*****************************************************************
+*/
+
+#include <string.h>
+#include "dizon_emon_window.h"
+
+static void reset_stats(emon_window* w)
+{
+  memset(&w->stats, 0, sizeof(w->stats));
+  w->stats_sum = 0;
+}
+
+int emon_window_init(emon_window* w, energy_mon* emon, uint32_t sample_rate_hz, uint32_t mains_hz,
+                     uint16_t window_cycles, uint16_t emit_cycles)
+{
+  if (emon == NULL || mains_hz == 0 || sample_rate_hz < 2 * mains_hz ||
+      window_cycles == 0 || window_cycles > EMON_WINDOW_MAX_CYCLES || emit_cycles == 0)
+  {
+    return -1;
+  }
+  memset(w, 0, sizeof(*w));
+  w->emon = emon;
+  w->sample_rate_hz = sample_rate_hz;
+  w->mains_hz = mains_hz;
+  w->window_cycles = window_cycles;
+  w->emit_cycles = emit_cycles;
+  return 0;
+}
+
+void emon_window_set_callback(emon_window* w, emon_window_cb callback, void* user)
+{
+  w->callback = callback;
+  w->user = user;
+}
+
+//--------------------------------------------------------------------------------------
+// Slide the window on by one cycle and emit if it is time to
+//--------------------------------------------------------------------------------------
+static bool end_cycle(emon_window* w, int64_t t_us)
+{
+  if (w->filled == w->window_cycles)
+  {
+    w->window_sum -= w->sums[w->next];
+    w->window_n -= w->counts[w->next];
+  }
+  else
+  {
+    w->filled++;
+  }
+  w->sums[w->next] = w->cycle_sum;
+  w->counts[w->next] = w->cycle_n;
+  w->window_sum += w->cycle_sum;
+  w->window_n += w->cycle_n;
+  if (++w->next == w->window_cycles)
+  {
+    w->next = 0;
+  }
+  w->cycle_sum = 0;
+  w->cycle_n = 0;
+  w->cycles++;
+
+  if (w->filled < w->window_cycles || ++w->since_emit < w->emit_cycles)
+  {
+    return false;
+  }
+  w->since_emit = 0;
+
+  const double q2 = (double)(1 << (2 * EMON_Q_FILTER));
+  float irms = (float)(emon_i_ratio(w->emon) * sqrt(w->window_sum / q2 / w->window_n));
+  w->last_irms = irms;
+
+  if (w->stats.count == 0 || irms < w->stats.min)
+  {
+    w->stats.min = irms;
+  }
+  if (w->stats.count == 0 || irms > w->stats.max)
+  {
+    w->stats.max = irms;
+  }
+  w->stats.count++;
+  w->stats_sum += irms;
+
+  if (w->callback)
+  {
+    w->callback(w->user, t_us, irms);
+  }
+  return true;
+}
+
+int emon_window_push(emon_window* w, const uint16_t* samples, size_t len, int64_t start_us)
+{
+  energy_mon* emon = w->emon;
+  int emitted = 0;
+
+  for (size_t i = 0; i < len; i++)
+  {
+    int32_t f = emon_filter_q(&emon->offsetI_q, samples[i]);
+    w->cycle_sum += (int64_t)f * f;
+    w->cycle_n++;
+
+    w->phase += w->mains_hz;
+    if (w->phase >= w->sample_rate_hz)
+    {
+      w->phase -= w->sample_rate_hz;
+      int64_t t_us = start_us + (int64_t)((i * 1000000ULL) / w->sample_rate_hz);
+      emitted += end_cycle(w, t_us);
+    }
+  }
+  return emitted;
+}
+
+void emon_window_take_stats(emon_window* w, emon_window_stats* stats)
+{
+  *stats = w->stats;
+  if (stats->count)
+  {
+    stats->mean = (float)(w->stats_sum / stats->count);
+  }
+  reset_stats(w);
+}
@@ -0,0 +1,506 @@
+/*
+*****************************************************************
+* encode.c - Telemetry Payload Encoders                         *
+*****************************************************************
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "dizon_encode.h"
+#include "dizon_timestamp.h"
+
+//--------------------------------------------------------------------------------------
+// JSON
+//--------------------------------------------------------------------------------------
+#define JSON_ID_MAX      32
+#define JSON_TRAILER     "]}"
+
+static int json_record(char* buf, size_t len, const sump_record* rec, bool first)
+{
+    char tbuf[TS_ISO_LEN];
+    char extra[208] = "";
+    ts_format_iso(rec->epoch_us, tbuf, sizeof(tbuf));
+
+    if (rec->cycles) {
+        snprintf(extra, sizeof(extra), ",\"IrmsMin\":\"%f\",\"IrmsMax\":\"%f\",\"cycles\":\"%u\"",
+                 rec->irms_min, rec->irms_max, rec->cycles);
+    }
+    if (rec->suppressed) {
+        size_t used = strlen(extra);
+        snprintf(extra + used, sizeof(extra) - used, ",\"suppressed\":\"%u\"", rec->suppressed);
+    }
+    if (rec->has_level) {
+        size_t used = strlen(extra);
+        snprintf(extra + used, sizeof(extra) - used, ",\"level\":\"%.1f\",\"levelRate\":\"%.1f\"",
+                 rec->level_cm, rec->level_rate);
+    }
+    for (uint8_t k = 0; k < rec->extra_channels && k < SUMP_EXTRA_CHANNELS; k++) {
+        size_t used = strlen(extra);
+        snprintf(extra + used, sizeof(extra) - used, ",\"Irms%u\":\"%f\"", k + 2u, rec->irms_extra[k]);
+    }
+    return snprintf(buf, len, "%s{\"seq\":\"%u\",\"time\":\"%s\",\"Irms\":\"%f\"%s,\"memFree\":\"%u\"}",
+                    first ? "" : ",", (unsigned)rec->seq, tbuf, rec->irms, extra, (unsigned)rec->free_mem);
+}
+
+static size_t json_record_bytes(const sump_record* rec)
+{
+    return json_record(NULL, 0, rec, false);
+}
+
+static size_t json_encode(const char* id, const sump_record* recs, size_t n, uint8_t* buf, size_t len, size_t* used)
+{
+    char* out = (char*)buf;
+    size_t room = len - sizeof(JSON_TRAILER);       // Always leave space to close the document
+    int pos;
+
+    *used = 0;
+    if (len <= sizeof(JSON_TRAILER)) {
+        return 0;
+    }
+    pos = snprintf(out, room, "{\"ID\":\"%s\",\"records\":[", id);
+    if (pos < 0 || (size_t)pos >= room) {
+        return 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+        int w = json_record(out + pos, room - pos, &recs[i], i == 0);
+        if (w < 0 || (size_t)(pos + w) >= room) {
+            break;
+        }
+        pos += w;
+        (*used)++;
+    }
+    if (*used == 0) {
+        return 0;
+    }
+    memcpy(out + pos, JSON_TRAILER, sizeof(JSON_TRAILER));
+    return pos + sizeof(JSON_TRAILER) - 1;
+}
+
+const telemetry_encoder telemetry_json = {
+    .name = "json",
+    .header_bytes = 24 + JSON_ID_MAX,
+    .record_bytes = json_record_bytes,
+    .encode = json_encode,
+    .decode = NULL,
+};
+
+//--------------------------------------------------------------------------------------
+// CBOR
+//--------------------------------------------------------------------------------------
+#define CBOR_UINT    0
+#define CBOR_NINT    1
+#define CBOR_TEXT    3
+#define CBOR_ARRAY   4
+#define CBOR_MAP     5
+
+#define CBOR_KEY_VERSION 0
+#define CBOR_KEY_ID      1
+#define CBOR_KEY_BASE    2
+#define CBOR_KEY_RECORDS 3
+
+#define CBOR_RECORD_SHORT 4
+#define CBOR_RECORD_LONG  7
+#define CBOR_RECORD_SUPP  8     // Long plus the suppressed count
+#define CBOR_RECORD_LEVEL 10    // All of that plus level and rate of rise
+#define CBOR_RECORD_MAX   CBOR_RECORD_LEVEL
+
+// The first version each record form appeared in, older payloads decode as records without it
+#define CBOR_VERSION_SUPP  2
+#define CBOR_VERSION_LEVEL 3
+#define CBOR_VERSION_EXTRA 4
+
+typedef struct cbor_writer {
+    uint8_t* buf;
+    size_t len;
+    size_t pos;
+} cbor_writer;
+
+// Bytes for an initial byte carrying val
+static size_t cbor_head_len(uint64_t val)
+{
+    return val < 24 ? 1 : val <= 0xff ? 2 : val <= 0xffff ? 3 : val <= 0xffffffff ? 5 : 9;
+}
+
+static size_t cbor_int_len(int64_t val)
+{
+    return cbor_head_len(val < 0 ? (uint64_t)(-1 - val) : (uint64_t)val);
+}
+
+// Caller has checked the room
+static void cbor_head(cbor_writer* w, uint8_t major, uint64_t val)
+{
+    size_t n = cbor_head_len(val);
+    uint8_t* p = w->buf + w->pos;
+    major <<= 5;
+    if (n == 1) {
+        p[0] = major | (uint8_t)val;
+    } else {
+        p[0] = major | (n == 2 ? 24 : n == 3 ? 25 : n == 5 ? 26 : 27);
+        for (size_t i = 1; i < n; i++) {
+            p[i] = (uint8_t)(val >> (8 * (n - 1 - i)));
+        }
+    }
+    w->pos += n;
+}
+
+static void cbor_int(cbor_writer* w, int64_t val)
+{
+    if (val < 0) {
+        cbor_head(w, CBOR_NINT, (uint64_t)(-1 - val));
+    } else {
+        cbor_head(w, CBOR_UINT, (uint64_t)val);
+    }
+}
+
+// Rounded and clamped, A to mA and cm to mm
+static int32_t scaled(float val, float scale)
+{
+    float v = val * scale;
+    if (v >= 2147483647.0f) {
+        return INT32_MAX;
+    } else if (v <= -2147483648.0f) {
+        return INT32_MIN;
+    }
+    return (int32_t)(v < 0 ? v - 0.5f : v + 0.5f);
+}
+
+static int32_t milliamps(float amps)
+{
+    return scaled(amps, 1000.0f);
+}
+
+static int32_t tenths(float val)
+{
+    return scaled(val, 10.0f);
+}
+
+// The wire carries whole seconds
+static int64_t epoch_s(const sump_record* rec)
+{
+    return rec->epoch_us / 1000000;
+}
+
+static size_t cbor_record_len(const sump_record* rec, int64_t base)
+{
+    bool is_long = rec->cycles || rec->has_level;
+    size_t len = 1 + cbor_head_len(rec->seq) + cbor_int_len(epoch_s(rec) - base) +
+                 cbor_int_len(milliamps(rec->irms)) + cbor_head_len(rec->free_mem);
+    if (is_long) {
+        len += cbor_int_len(milliamps(rec->irms_min)) + cbor_int_len(milliamps(rec->irms_max)) +
+               cbor_head_len(rec->cycles);
+    }
+    if (rec->suppressed || rec->has_level) {
+        len += cbor_head_len(rec->suppressed);
+    }
+    if (rec->has_level) {
+        len += cbor_int_len(tenths(rec->level_cm)) + cbor_int_len(tenths(rec->level_rate));
+    }
+    if (rec->extra_channels) {
+        len += 1;
+        for (uint8_t k = 0; k < rec->extra_channels; k++) {
+            len += cbor_int_len(milliamps(rec->irms_extra[k]));
+        }
+    }
+    return len;
+}
+
+static void cbor_record(cbor_writer* w, const sump_record* rec, int64_t base)
+{
+    bool is_long = rec->cycles || rec->has_level;
+    size_t items = rec->has_level ? CBOR_RECORD_LEVEL :
+                   (is_long ? CBOR_RECORD_LONG : CBOR_RECORD_SHORT) + (rec->suppressed ? 1 : 0);
+    items += rec->extra_channels ? 1 : 0;
+
+    cbor_head(w, CBOR_ARRAY, items);
+    cbor_head(w, CBOR_UINT, rec->seq);
+    cbor_int(w, epoch_s(rec) - base);
+    cbor_int(w, milliamps(rec->irms));
+    cbor_head(w, CBOR_UINT, rec->free_mem);
+    if (is_long) {
+        cbor_int(w, milliamps(rec->irms_min));
+        cbor_int(w, milliamps(rec->irms_max));
+        cbor_head(w, CBOR_UINT, rec->cycles);
+    }
+    if (rec->suppressed || rec->has_level) {
+        cbor_head(w, CBOR_UINT, rec->suppressed);
+    }
+    if (rec->has_level) {
+        cbor_int(w, tenths(rec->level_cm));
+        cbor_int(w, tenths(rec->level_rate));
+    }
+    if (rec->extra_channels) {
+        cbor_head(w, CBOR_ARRAY, rec->extra_channels);
+        for (uint8_t k = 0; k < rec->extra_channels; k++) {
+            cbor_int(w, milliamps(rec->irms_extra[k]));
+        }
+    }
+}
+
+// Worst case, time offsets can be anything once the clock steps
+static size_t cbor_record_bytes(const sump_record* rec)
+{
+    return cbor_record_len(rec, epoch_s(rec)) - 1 + 9;
+}
+
+static size_t cbor_encode(const char* id, const sump_record* recs, size_t n, uint8_t* buf, size_t len, size_t* used)
+{
+    cbor_writer w = { .buf = buf, .len = len, .pos = 0 };
+    size_t id_len = strlen(id);
+    int64_t base = n ? epoch_s(&recs[0]) : 0;
+    size_t fixed = 1 + 1 + 1 + 1 + cbor_head_len(id_len) + id_len + 1 + cbor_int_len(base) + 1 + 1;
+    size_t total = fixed;
+    size_t count = 0;
+
+    *used = 0;
+    // Work out how many records fit, the array length goes in front of them.  Its head
+    // grows from 1 to 2 bytes at 24 records, to 3 past 255.
+    while (count < n) {
+        size_t next = cbor_record_len(&recs[count], base);
+        size_t head = cbor_head_len(count + 1) - 1;
+        if (total + head + next > len) {
+            break;
+        }
+        total += next;
+        count++;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    cbor_head(&w, CBOR_MAP, 4);
+    cbor_head(&w, CBOR_UINT, CBOR_KEY_VERSION);
+    cbor_head(&w, CBOR_UINT, CBOR_BATCH_VERSION);
+    cbor_head(&w, CBOR_UINT, CBOR_KEY_ID);
+    cbor_head(&w, CBOR_TEXT, id_len);
+    memcpy(w.buf + w.pos, id, id_len);
+    w.pos += id_len;
+    cbor_head(&w, CBOR_UINT, CBOR_KEY_BASE);
+    cbor_int(&w, base);
+    cbor_head(&w, CBOR_UINT, CBOR_KEY_RECORDS);
+    cbor_head(&w, CBOR_ARRAY, count);
+    for (size_t i = 0; i < count; i++) {
+        cbor_record(&w, &recs[i], base);
+    }
+    *used = count;
+    return w.pos;
+}
+
+typedef struct cbor_reader {
+    const uint8_t* buf;
+    size_t len;
+    size_t pos;
+} cbor_reader;
+
+static int cbor_read_head(cbor_reader* r, uint8_t* major, uint64_t* val)
+{
+    if (r->pos >= r->len) {
+        return -1;
+    }
+    uint8_t ib = r->buf[r->pos++];
+    uint8_t info = ib & 0x1f;
+    size_t n;
+
+    *major = ib >> 5;
+    if (info < 24) {
+        *val = info;
+        return 0;
+    }
+    switch (info) {
+    case 24: n = 1; break;
+    case 25: n = 2; break;
+    case 26: n = 4; break;
+    case 27: n = 8; break;
+    default: return -1;         // Indefinite lengths and reserved values are not ours
+    }
+    if (r->len - r->pos < n) {
+        return -1;
+    }
+    *val = 0;
+    for (size_t i = 0; i < n; i++) {
+        *val = (*val << 8) | r->buf[r->pos++];
+    }
+    return 0;
+}
+
+// An integer from a head that has already been read
+static int cbor_head_int(uint8_t major, uint64_t val, int64_t* out)
+{
+    if (val > INT64_MAX) {
+        return -1;
+    }
+    if (major == CBOR_UINT) {
+        *out = (int64_t)val;
+    } else if (major == CBOR_NINT) {
+        *out = -1 - (int64_t)val;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static int cbor_read_int(cbor_reader* r, int64_t* out)
+{
+    uint8_t major;
+    uint64_t val;
+    if (cbor_read_head(r, &major, &val) != 0) {
+        return -1;
+    }
+    return cbor_head_int(major, val, out);
+}
+
+// The other pumps, the array that may end a record
+static int cbor_read_extra(cbor_reader* r, uint64_t count, sump_record* rec)
+{
+    int64_t ma;
+    if (count == 0 || count > SUMP_EXTRA_CHANNELS) {
+        return -1;
+    }
+    for (uint64_t k = 0; k < count; k++) {
+        if (cbor_read_int(r, &ma) != 0) {
+            return -1;
+        }
+        rec->irms_extra[k] = ma / 1000.0f;
+    }
+    rec->extra_channels = (uint8_t)count;
+    return 0;
+}
+
+// *version is the oldest payload version that has this record's form
+static int cbor_read_record(cbor_reader* r, int64_t base, sump_record* rec, int64_t* version)
+{
+    uint8_t major;
+    uint64_t items, val;
+    int64_t v[CBOR_RECORD_MAX];
+    bool is_long;
+
+    if (cbor_read_head(r, &major, &items) != 0 || major != CBOR_ARRAY ||
+        items < CBOR_RECORD_SHORT || items > CBOR_RECORD_MAX + 1) {
+        return -1;
+    }
+    memset(rec, 0, sizeof(*rec));
+    for (uint64_t i = 0; i < items; i++) {
+        if (cbor_read_head(r, &major, &val) != 0) {
+            return -1;
+        }
+        // Only the last element can be the other pumps, it is the only array
+        if (major == CBOR_ARRAY && i == items - 1) {
+            if (cbor_read_extra(r, val, rec) != 0) {
+                return -1;
+            }
+            items--;
+        } else if (i == CBOR_RECORD_MAX || cbor_head_int(major, val, &v[i]) != 0) {
+            return -1;
+        }
+    }
+    if (items < CBOR_RECORD_SHORT || items == CBOR_RECORD_SHORT + 2 || items == CBOR_RECORD_SUPP + 1) {
+        return -1;
+    }
+    *version = rec->extra_channels ? CBOR_VERSION_EXTRA :
+               items == CBOR_RECORD_LEVEL ? CBOR_VERSION_LEVEL :
+               items == CBOR_RECORD_SHORT + 1 || items == CBOR_RECORD_SUPP ? CBOR_VERSION_SUPP : 1;
+    is_long = items >= CBOR_RECORD_LONG;
+    rec->seq = (uint32_t)v[0];
+    rec->epoch_us = (base + v[1]) * 1000000;
+    rec->irms = v[2] / 1000.0f;
+    rec->free_mem = (uint32_t)v[3];
+    if (is_long) {
+        rec->irms_min = v[4] / 1000.0f;
+        rec->irms_max = v[5] / 1000.0f;
+        rec->cycles = (uint16_t)v[6];
+    } else {
+        rec->irms_min = rec->irms_max = rec->irms;
+    }
+    if (items == CBOR_RECORD_SHORT + 1 || items >= CBOR_RECORD_SUPP) {
+        rec->suppressed = (uint16_t)v[items == CBOR_RECORD_SHORT + 1 ? CBOR_RECORD_SHORT : CBOR_RECORD_LONG];
+    }
+    if (items == CBOR_RECORD_LEVEL) {
+        rec->has_level = true;
+        rec->level_cm = v[8] / 10.0f;
+        rec->level_rate = v[9] / 10.0f;
+    }
+    return 0;
+}
+
+static int cbor_decode(const uint8_t* buf, size_t len, char* id, size_t id_len,
+                       sump_record* recs, size_t max, size_t* n)
+{
+    cbor_reader r = { .buf = buf, .len = len, .pos = 0 };
+    uint8_t major;
+    uint64_t pairs, key, count = 0;
+    int64_t version = -1, base = 0, needs = 1, record_version;
+    size_t records_at = 0;
+
+    *n = 0;
+    if (cbor_read_head(&r, &major, &pairs) != 0 || major != CBOR_MAP) {
+        return -1;
+    }
+    // Records are relative to the base time, which may come after them
+    for (uint64_t i = 0; i < pairs; i++) {
+        uint64_t val;
+        if (cbor_read_head(&r, &major, &key) != 0 || major != CBOR_UINT) {
+            return -1;
+        }
+        switch (key) {
+        case CBOR_KEY_VERSION:
+            if (cbor_read_int(&r, &version) != 0) {
+                return -1;
+            }
+            break;
+        case CBOR_KEY_BASE:
+            if (cbor_read_int(&r, &base) != 0) {
+                return -1;
+            }
+            break;
+        case CBOR_KEY_ID:
+            if (cbor_read_head(&r, &major, &val) != 0 || major != CBOR_TEXT ||
+                val > r.len - r.pos || val >= id_len) {
+                return -1;
+            }
+            memcpy(id, r.buf + r.pos, val);
+            id[val] = 0;
+            r.pos += val;
+            break;
+        case CBOR_KEY_RECORDS:
+            if (cbor_read_head(&r, &major, &count) != 0 || major != CBOR_ARRAY || count > max) {
+                return -1;
+            }
+            records_at = r.pos;
+            for (uint64_t k = 0; k < count; k++) {
+                if (cbor_read_record(&r, 0, &recs[k], &record_version) != 0) {
+                    return -1;
+                }
+                needs = record_version > needs ? record_version : needs;
+            }
+            break;
+        default:
+            return -1;
+        }
+    }
+    // Every version so far only added record forms, a record newer than its payload is corrupt
+    if (version < 1 || version > CBOR_BATCH_VERSION || needs > version || records_at == 0 || r.pos != r.len) {
+        return -1;
+    }
+    for (uint64_t k = 0; k < count; k++) {
+        recs[k].epoch_us += base * 1000000;
+    }
+    *n = count;
+    return 0;
+}
+
+const telemetry_encoder telemetry_cbor = {
+    .name = "cbor",
+    .header_bytes = 1 + 1 + 1 + 1 + 1 + 32 + 1 + 9 + 1 + 3,
+    .record_bytes = cbor_record_bytes,
+    .encode = cbor_encode,
+    .decode = cbor_decode,
+};
+
+const telemetry_encoder* telemetry_encoder_find(const char* name)
+{
+    if (strcmp(name, telemetry_cbor.name) == 0) {
+        return &telemetry_cbor;
+    } else if (strcmp(name, telemetry_json.name) == 0) {
+        return &telemetry_json;
+    }
+    return NULL;
+}
@@ -0,0 +1,43 @@
+/*
+*****************************************************************
+* flash_part.c - Flash Log Storage In A Data Partition          *
+*****************************************************************
+*/
+
+#include "dizon_flash_part.h"
+
+static const char *TAG = "FLASH_PART";
+
+static int part_read(void* ctx, uint32_t offset, void* buf, size_t len)
+{
+    return esp_partition_read(ctx, offset, buf, len) == ESP_OK ? 0 : -1;
+}
+
+static int part_write(void* ctx, uint32_t offset, const void* buf, size_t len)
+{
+    return esp_partition_write(ctx, offset, buf, len) == ESP_OK ? 0 : -1;
+}
+
+static int part_erase(void* ctx, uint32_t offset, size_t len)
+{
+    return esp_partition_erase_range(ctx, offset, len) == ESP_OK ? 0 : -1;
+}
+
+const flash_ops* flash_partition_ops(const char* label)
+{
+    static flash_ops ops;
+    const esp_partition_t* part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                           FLASH_PART_SUBTYPE, label);
+    if (part == NULL) {
+        ESP_LOGE(TAG, "No data partition \"%s\", is partitions.csv in use?", label);
+        return NULL;
+    }
+    ESP_LOGI(TAG, "Partition \"%s\" at 0x%x, %u bytes", label, part->address, part->size);
+    ops.ctx = (void*)part;
+    ops.size = part->size;
+    ops.sector_size = SPI_FLASH_SEC_SIZE;
+    ops.read = part_read;
+    ops.write = part_write;
+    ops.erase = part_erase;
+    return &ops;
+}
@@ -0,0 +1,104 @@
+/*
+*****************************************************************
+* flash_sim.c - RAM Flash Standing In For A Flash Partition     *
+*****************************************************************
+*/
+
+#include <string.h>
+#include "dizon_flash_sim.h"
+
+// How much of len happens before the power goes, -1 if all of it does
+static int64_t cut_point(flash_sim* sim, size_t len)
+{
+    if (!sim->powered) {
+        return 0;
+    }
+    if (sim->cut_after < 0 || (uint64_t)sim->cut_after >= len) {
+        if (sim->cut_after >= 0) {
+            sim->cut_after -= len;
+        }
+        return -1;
+    }
+    int64_t done = sim->cut_after;
+    sim->cut_after = -1;
+    sim->powered = false;
+    return done;
+}
+
+static int sim_read(void* ctx, uint32_t offset, void* buf, size_t len)
+{
+    flash_sim* sim = ctx;
+    if (!sim->powered || offset + len > sim->ops.size) {
+        return -1;
+    }
+    memcpy(buf, sim->mem + offset, len);
+    return 0;
+}
+
+static int sim_write(void* ctx, uint32_t offset, const void* buf, size_t len)
+{
+    flash_sim* sim = ctx;
+    const uint8_t* src = buf;
+    if (offset + len > sim->ops.size) {
+        return -1;
+    }
+    int64_t cut = cut_point(sim, len);
+    size_t n = cut < 0 ? len : (size_t)cut;
+    for (size_t i = 0; i < n; i++) {
+        sim->mem[offset + i] &= src[i];
+    }
+    sim->bytes_written += n;
+    return cut < 0 ? 0 : -1;
+}
+
+static int sim_erase(void* ctx, uint32_t offset, size_t len)
+{
+    flash_sim* sim = ctx;
+    uint32_t sector = sim->ops.sector_size;
+    if (offset % sector || len % sector || offset + len > sim->ops.size) {
+        return -1;
+    }
+    int64_t cut = cut_point(sim, len);
+    size_t n = cut < 0 ? len : (size_t)cut;
+    if (cut >= 0) {
+        // Interrupted erase: the bytes it reached are cleared, the rest garbage
+        for (size_t i = n; i < len && i < n + sector; i++) {
+            sim->mem[offset + i] ^= 0x5a;
+        }
+    }
+    memset(sim->mem + offset, 0xff, n);
+    if (sim->erase_counts) {
+        for (uint32_t s = offset / sector; s < (offset + n + sector - 1) / sector; s++) {
+            sim->erase_counts[s]++;
+        }
+    }
+    return cut < 0 ? 0 : -1;
+}
+
+const flash_ops* flash_sim_init(flash_sim* sim, uint8_t* mem, uint32_t size, uint32_t sector_size,
+                                uint32_t* erase_counts)
+{
+    memset(sim, 0, sizeof(*sim));
+    sim->mem = mem;
+    sim->erase_counts = erase_counts;
+    sim->cut_after = -1;
+    sim->powered = true;
+    sim->ops.ctx = sim;
+    sim->ops.size = size;
+    sim->ops.sector_size = sector_size;
+    sim->ops.read = sim_read;
+    sim->ops.write = sim_write;
+    sim->ops.erase = sim_erase;
+    return &sim->ops;
+}
+
+void flash_sim_cut_after(flash_sim* sim, int64_t bytes)
+{
+    sim->cut_after = bytes;
+}
+
+void flash_sim_power_on(flash_sim* sim)
+{
+    sim->powered = true;
+    sim->cut_after = -1;
+}
@@ -0,0 +1,300 @@
+/*
+*****************************************************************
+* flashlog.c - Store-And-Forward Record Log In A Flash Ring     *
+*****************************************************************
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "dizon_flashlog.h"
+#include "dizon_crc.h"
+
+#define ENTRY_RECORD  0x52      // 'R'
+#define ENTRY_COMMIT  0x43      // 'C', rec_seq holds the committed entry sequence
+#define ENTRY_DONE    0x00
+
+typedef struct flashlog_entry {
+    uint8_t type;
+    uint8_t done;               // Programmed on its own once the rest is in flash
+    uint16_t cycles;
+    uint32_t seq;               // Entry sequence, one per entry of any type, starts at 1
+    uint32_t rec_seq;
+    uint32_t wall_time;         // Whole seconds, like the CBOR payload
+    float irms;
+    float irms_min;
+    float irms_max;
+    uint32_t crc;               // Over everything before it
+} flashlog_entry;
+
+typedef char flashlog_entry_is_32_bytes[sizeof(flashlog_entry) == FLASHLOG_ENTRY_SIZE ? 1 : -1];
+
+typedef enum {
+    SLOT_BLANK,
+    SLOT_VALID,
+    SLOT_BAD,
+} slot_state;
+
+static slot_state read_slot(flashlog* log, uint32_t slot, flashlog_entry* e)
+{
+    const uint8_t* p = (const uint8_t*)e;
+    size_t i = 0;
+    if (log->flash->read(log->flash->ctx, slot * FLASHLOG_ENTRY_SIZE, e, sizeof(*e)) != 0) {
+        return SLOT_BAD;
+    }
+    while (i < sizeof(*e) && p[i] == 0xff) {
+        i++;
+    }
+    if (i == sizeof(*e)) {
+        return SLOT_BLANK;
+    }
+    if (e->done != ENTRY_DONE || (e->type != ENTRY_RECORD && e->type != ENTRY_COMMIT) ||
+        e->crc != crc32_buf(e, offsetof(flashlog_entry, crc))) {
+        return SLOT_BAD;
+    }
+    return SLOT_VALID;
+}
+
+// A record the server does not have yet
+static bool unsent(const flashlog* log, const flashlog_entry* e)
+{
+    return e->type == ENTRY_RECORD && e->seq > log->committed_seq;
+}
+
+static uint32_t next_slot(const flashlog* log, uint32_t slot)
+{
+    return slot + 1 == log->slots ? 0 : slot + 1;
+}
+
+// The done byte goes last, so an entry cut short by a power loss never reads as valid
+// even if its missing bytes happen to match the CRC
+static int write_slot(flashlog* log, flashlog_entry* e)
+{
+    static const uint8_t done = ENTRY_DONE;
+    uint32_t offset = log->head * FLASHLOG_ENTRY_SIZE;
+    int ret;
+
+    e->done = ENTRY_DONE;
+    e->seq = log->next_seq++;
+    e->crc = crc32_buf(e, offsetof(flashlog_entry, crc));
+    e->done = 0xff;
+    ret = log->flash->write(log->flash->ctx, offset, e, sizeof(*e));
+    if (ret == 0) {
+        ret = log->flash->write(log->flash->ctx, offset + offsetof(flashlog_entry, done), &done, 1);
+    }
+    // A failed write may have left half an entry, never try that slot again
+    log->head = next_slot(log, log->head);
+    return ret;
+}
+
+static void commit_entry(const flashlog* log, flashlog_entry* e)
+{
+    memset(e, 0, sizeof(*e));
+    e->type = ENTRY_COMMIT;
+    e->rec_seq = log->committed_seq;
+}
+
+// The head is about to enter the oldest sector: give up what is left in it, erase it
+// and start it with the commit cursor
+static int enter_sector(flashlog* log)
+{
+    uint32_t start = log->head;
+    uint32_t end = start + log->slots_per_sector;
+    flashlog_entry e;
+
+    if (log->read_slot >= start && log->read_slot < end) {
+        for (uint32_t s = log->read_slot; s < end && log->pending; s++) {
+            if (read_slot(log, s, &e) == SLOT_VALID && unsent(log, &e)) {
+                log->pending--;
+                log->lost++;
+            }
+        }
+        log->read_slot = log->pending ? end % log->slots : start;
+    }
+    if (log->peek_slot >= start && log->peek_slot < end) {
+        log->peek_slot = log->read_slot;
+    }
+    log->erases++;
+    if (log->flash->erase(log->flash->ctx, start * FLASHLOG_ENTRY_SIZE, log->flash->sector_size) != 0) {
+        return -1;
+    }
+    commit_entry(log, &e);
+    return write_slot(log, &e);
+}
+
+static int put_entry(flashlog* log, flashlog_entry* e)
+{
+    if (log->head % log->slots_per_sector == 0 && enter_sector(log) != 0) {
+        return -1;
+    }
+    return write_slot(log, e);
+}
+
+int flashlog_format(flashlog* log)
+{
+    const flash_ops* flash = log->flash;
+    memset(log, 0, sizeof(*log));
+    log->flash = flash;
+    log->slots = flash->size / FLASHLOG_ENTRY_SIZE;
+    log->slots_per_sector = flash->sector_size / FLASHLOG_ENTRY_SIZE;
+    log->next_seq = 1;
+    return flash->erase(flash->ctx, 0, flash->size);
+}
+
+int flashlog_open(flashlog* log, const flash_ops* flash)
+{
+    flashlog_entry e;
+    uint32_t newest = 0, newest_slot = 0;
+    uint32_t bad = 0, used = 0;
+
+    if (flash->sector_size % FLASHLOG_ENTRY_SIZE != 0 || flash->size % flash->sector_size != 0 ||
+        flash->size < 2 * flash->sector_size) {
+        return -1;
+    }
+    memset(log, 0, sizeof(*log));
+    log->flash = flash;
+    log->slots = flash->size / FLASHLOG_ENTRY_SIZE;
+    log->slots_per_sector = flash->sector_size / FLASHLOG_ENTRY_SIZE;
+
+    // Newest entry and newest commit cursor
+    for (uint32_t s = 0; s < log->slots; s++) {
+        switch (read_slot(log, s, &e)) {
+        case SLOT_BLANK:
+            break;
+        case SLOT_BAD:
+            bad++;
+            used++;
+            break;
+        case SLOT_VALID:
+            used++;
+            if (e.seq > newest) {
+                newest = e.seq;
+                newest_slot = s;
+            }
+            if (e.type == ENTRY_COMMIT && e.rec_seq > log->committed_seq) {
+                log->committed_seq = e.rec_seq;
+            }
+            break;
+        }
+    }
+    if (newest == 0) {
+        // Never used, or nothing in it we can read
+        return used ? flashlog_format(log) : (log->next_seq = 1, 0);
+    }
+    log->skipped = bad;
+    log->next_seq = newest + 1;
+
+    // Step over whatever a power cut left right after the newest entry
+    log->head = next_slot(log, newest_slot);
+    while (log->head % log->slots_per_sector != 0 && read_slot(log, log->head, &e) != SLOT_BLANK) {
+        log->head = next_slot(log, log->head);
+    }
+
+    // Oldest sector first, find the first record not committed and count the rest
+    uint32_t first = (newest_slot / log->slots_per_sector + 1) * log->slots_per_sector % log->slots;
+    bool found = false;
+    log->read_slot = log->head;
+    for (uint32_t s = first, n = 0; n < log->slots; s = next_slot(log, s), n++) {
+        if (read_slot(log, s, &e) == SLOT_VALID && unsent(log, &e)) {
+            if (!found) {
+                log->read_slot = s;
+                found = true;
+            }
+            log->pending++;
+        }
+    }
+    log->peek_slot = log->read_slot;
+    return 0;
+}
+
+int flashlog_append(flashlog* log, const sump_record* rec)
+{
+    flashlog_entry e;
+    memset(&e, 0, sizeof(e));
+    e.type = ENTRY_RECORD;
+    e.cycles = rec->cycles;
+    e.rec_seq = rec->seq;
+    e.wall_time = (uint32_t)(rec->epoch_us / 1000000);
+    e.irms = rec->irms;
+    e.irms_min = rec->irms_min;
+    e.irms_max = rec->irms_max;
+
+    bool was_empty = log->pending == 0;
+    uint32_t slot = log->head % log->slots_per_sector ? log->head : (log->head + 1) % log->slots;
+    if (put_entry(log, &e) != 0) {
+        log->skipped++;
+        return -1;
+    }
+    if (was_empty) {
+        log->read_slot = log->peek_slot = slot;
+    }
+    log->pending++;
+    log->appended++;
+    return 0;
+}
+
+size_t flashlog_replay(flashlog* log, sump_record* recs, size_t max)
+{
+    flashlog_entry e;
+    size_t n = 0;
+
+    while (n < max && log->pending && log->peek_slot != log->head) {
+        if (read_slot(log, log->peek_slot, &e) == SLOT_VALID && unsent(log, &e)) {
+            sump_record* rec = &recs[n++];
+            memset(rec, 0, sizeof(*rec));
+            rec->seq = e.rec_seq;
+            rec->epoch_us = e.wall_time * 1000000LL;
+            rec->irms = e.irms;
+            rec->irms_min = e.irms_min;
+            rec->irms_max = e.irms_max;
+            rec->cycles = e.cycles;
+        }
+        log->peek_slot = next_slot(log, log->peek_slot);
+    }
+    log->replayed += n;
+    return n;
+}
+
+void flashlog_rewind(flashlog* log)
+{
+    log->peek_slot = log->read_slot;
+}
+
+int flashlog_commit(flashlog* log, size_t count)
+{
+    flashlog_entry e;
+    uint32_t s = log->read_slot;
+
+    if (count > log->pending) {
+        return -1;
+    }
+    while (count && s != log->head) {
+        if (read_slot(log, s, &e) == SLOT_VALID && unsent(log, &e)) {
+            log->committed_seq = e.seq;
+            log->pending--;
+            count--;
+        }
+        s = next_slot(log, s);
+    }
+    log->read_slot = log->peek_slot = s;
+    commit_entry(log, &e);
+    if (put_entry(log, &e) != 0) {
+        return -1;
+    }
+    if (log->pending == 0) {
+        log->read_slot = log->peek_slot = log->head;
+    }
+    return 0;
+}
+
+uint32_t flashlog_pending(const flashlog* log)
+{
+    return log->pending;
+}
+
+void flashlog_print(const flashlog* log)
+{
+    printf("Flash log: %u pending, %u appended, %u replayed, %u lost, %u skipped, %u erases, "
+           "entry %u committed %u\n",
+           log->pending, log->appended, log->replayed, log->lost, log->skipped, log->erases,
+           log->next_seq, log->committed_seq);
+}
@@ -0,0 +1,189 @@
+/*
+*****************************************************************
+* harmonic.c - Current Harmonics And THD From The Sample Stream *
+*****************************************************************
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "dizon_harmonic.h"
+
+int harmonic_init(harmonic* h, const harmonic_config* cfg)
+{
+  memset(h, 0, sizeof(*h));
+  h->cfg = *cfg;
+  if (h->cfg.stride == 0)
+  {
+    h->cfg.stride = 1;
+  }
+  while (h->count < HARMONIC_MAX && cfg->orders[h->count])
+  {
+    if (2u * cfg->orders[h->count] * cfg->mains_hz >= cfg->sample_rate_hz)
+    {
+      return -1;
+    }
+    h->count++;
+  }
+  if (h->count == 0 || cfg->mains_hz == 0 || cfg->cycles == 0 || cfg->cycles > HARMONIC_MAX_CYCLES)
+  {
+    return -1;
+  }
+  h->window_len = (uint32_t)(((uint64_t)cfg->cycles * cfg->sample_rate_hz + cfg->mains_hz / 2) / cfg->mains_hz);
+  h->period_len = (uint32_t)((uint64_t)cfg->period_ms * cfg->sample_rate_hz / 1000);
+  if (h->period_len < h->window_len)
+  {
+    return -1;
+  }
+  // On the DFT bins of the window as it really is, whole cycles of the fundamental when
+  // the rate is not a multiple of the mains, so the DC left in the samples drops out
+  for (uint8_t k = 0; k < h->count; k++)
+  {
+    h->coeff[k] = (float)(2 * cos(2 * M_PI * cfg->orders[k] * cfg->cycles / h->window_len));
+  }
+  h->dc = ADC_COUNTS / 2;
+  return 0;
+}
+
+// n samples of the window.  The filters are independent, running them side by side
+// two at a time keeps two multiply-add chains in flight instead of waiting on one.
+static void window_run(harmonic* h, const uint16_t* samples, size_t n)
+{
+  const size_t stride = h->cfg.stride;
+  const float dc = h->dc;
+  int64_t sum = 0, sum_sq = 0;
+  uint8_t k = 0;
+
+  for (; k + 1 < h->count; k += 2)
+  {
+    float c0 = h->coeff[k], a1 = h->s1[k], a2 = h->s2[k];
+    float c1 = h->coeff[k + 1], b1 = h->s1[k + 1], b2 = h->s2[k + 1];
+    for (size_t i = 0; i < n; i++)
+    {
+      float x = samples[i * stride] - dc;
+      float a0 = x + c0 * a1 - a2;
+      float b0 = x + c1 * b1 - b2;
+      a2 = a1;
+      a1 = a0;
+      b2 = b1;
+      b1 = b0;
+    }
+    h->s1[k] = a1;
+    h->s2[k] = a2;
+    h->s1[k + 1] = b1;
+    h->s2[k + 1] = b2;
+  }
+  if (k < h->count)
+  {
+    float c = h->coeff[k], s1 = h->s1[k], s2 = h->s2[k];
+    for (size_t i = 0; i < n; i++)
+    {
+      float s0 = (samples[i * stride] - dc) + c * s1 - s2;
+      s2 = s1;
+      s1 = s0;
+    }
+    h->s1[k] = s1;
+    h->s2[k] = s2;
+  }
+  for (size_t i = 0; i < n; i++)
+  {
+    int32_t s = samples[i * stride];
+    sum += s;
+    sum_sq += s * s;
+  }
+  h->sum += sum;
+  h->sum_sq += sum_sq;
+}
+
+static void window_finish(harmonic* h)
+{
+  const double ratio = h->cfg.ical * ((SUPPLY_VOLTAGE / 1000.0) / ADC_COUNTS);
+  const double n = h->window_len;
+  harmonic_result* r = &h->result;
+  double fundamental = 0, above = 0;
+
+  r->count = h->count;
+  for (uint8_t k = 0; k < h->count; k++)
+  {
+    double s1 = h->s1[k], s2 = h->s2[k];
+    double power = s1 * s1 + s2 * s2 - h->coeff[k] * s1 * s2;
+    double rms = sqrt(power > 0 ? 2 * power : 0) / n;
+    r->orders[k] = h->cfg.orders[k];
+    r->irms[k] = (float)(ratio * rms);
+    if (r->orders[k] == 1)
+    {
+      fundamental = rms;
+    }
+    else
+    {
+      above += rms * rms;
+    }
+    h->s1[k] = h->s2[k] = 0;
+  }
+  double mean = h->sum / n;
+  double var = h->sum_sq / n - mean * mean;
+  r->total_irms = (float)(ratio * sqrt(var > 0 ? var : 0));
+  r->thd = fundamental > 0 ? (float)(sqrt(above) / fundamental) : 0;
+  r->samples = h->window_len;
+  r->windows++;
+  h->dc = (float)mean;
+  h->sum = h->sum_sq = 0;
+  h->ready = true;
+}
+
+bool harmonic_push(harmonic* h, const uint16_t* samples, size_t len)
+{
+  const size_t stride = h->cfg.stride;
+  size_t i = h->skip;
+  bool done = false;
+
+  while (i < len)
+  {
+    size_t avail = (len - i + stride - 1) / stride;
+    if (h->pos < h->window_len)
+    {
+      size_t n = h->window_len - h->pos < avail ? h->window_len - h->pos : avail;
+      window_run(h, &samples[i], n);
+      h->pos += n;
+      i += n * stride;
+      if (h->pos == h->window_len)
+      {
+        window_finish(h);
+        done = true;
+      }
+    }
+    else
+    {
+      // Between windows, only counting
+      size_t n = h->period_len - h->pos < avail ? h->period_len - h->pos : avail;
+      h->pos += n;
+      i += n * stride;
+    }
+    if (h->pos == h->period_len)
+    {
+      h->pos = 0;
+    }
+  }
+  h->skip = i - len;
+  return done;
+}
+
+bool harmonic_take(harmonic* h, harmonic_result* out)
+{
+  if (!h->ready)
+  {
+    return false;
+  }
+  *out = h->result;
+  h->ready = false;
+  return true;
+}
+
+void harmonic_print(const harmonic_result* r)
+{
+  printf("Harmonics: total %.3f A, THD %.2f%%,", r->total_irms, 100 * r->thd);
+  for (uint8_t k = 0; k < r->count; k++)
+  {
+    printf(" h%u %.3f A", r->orders[k], r->irms[k]);
+  }
+  printf("\n");
+}
@@ -0,0 +1,152 @@
+/*
+*****************************************************************
+* level.c - Sump Water Level From Ultrasonic Echo Times         *
+*****************************************************************
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "dizon_level.h"
+
+// Speed of sound in dry air, m/s
+static float sound_speed(float temp_c)
+{
+    return 331.3f + 0.606f * temp_c;
+}
+
+float level_echo_cm(uint32_t echo_us, float temp_c)
+{
+    // m/s is 1e-4 cm/us, and the sound goes there and back
+    return echo_us * sound_speed(temp_c) * 0.5e-4f;
+}
+
+int level_init(level* lv, const level_config* cfg)
+{
+    if (cfg->mount_cm <= 0 || cfg->min_cm < 0 || cfg->max_cm <= cfg->min_cm ||
+        cfg->min_pings == 0 || cfg->min_pings > LEVEL_MAX_PINGS) {
+        return -1;
+    }
+    memset(lv, 0, sizeof(*lv));
+    lv->cfg = *cfg;
+    lv->cm_per_us = sound_speed(cfg->temp_c) * 0.5e-4f;
+    return 0;
+}
+
+static void sort(float* v, size_t n)
+{
+    for (size_t i = 1; i < n; i++) {
+        float x = v[i];
+        size_t j = i;
+        for (; j > 0 && v[j - 1] > x; j--) {
+            v[j] = v[j - 1];
+        }
+        v[j] = x;
+    }
+}
+
+static float median(const float* sorted, size_t n)
+{
+    return n & 1 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+}
+
+// Median of the slopes between every pair of levels inside the window (Theil-Sen).  A
+// least squares line gets dragged a long way by the odd reading that came off the wall.
+static bool fit_rate(level* lv, int64_t t_us, float* rate_cm_h)
+{
+    int64_t window_us = (int64_t)lv->cfg.rate_window_s * 1000000;
+    unsigned idx[LEVEL_HISTORY];
+    unsigned n = 0;
+    size_t pairs = 0;
+
+    for (unsigned i = 0; i < lv->hist_count; i++) {
+        unsigned k = (lv->hist_head + LEVEL_HISTORY - 1 - i) % LEVEL_HISTORY;
+        if (t_us - lv->hist_us[k] > window_us) {
+            break;
+        }
+        idx[n++] = k;
+    }
+    // Three points at least, and half a window so a couple of close readings do not
+    // turn noise into a rate
+    if (n < 3 || (t_us - lv->hist_us[idx[n - 1]]) / 1e6 < lv->cfg.rate_window_s / 2.0) {
+        return false;
+    }
+    for (unsigned a = 0; a < n; a++) {
+        for (unsigned b = a + 1; b < n; b++) {
+            int64_t dt = lv->hist_us[idx[a]] - lv->hist_us[idx[b]];
+            if (dt > 0) {
+                lv->slopes[pairs++] = (lv->hist_cm[idx[a]] - lv->hist_cm[idx[b]]) / (dt / 1e6f);
+            }
+        }
+    }
+    if (pairs == 0) {
+        return false;
+    }
+    // At most a few hundred, once per reading
+    sort(lv->slopes, pairs);
+    *rate_cm_h = median(lv->slopes, pairs) * 3600;
+    return true;
+}
+
+int level_burst(level* lv, const uint32_t* echo_us, size_t n, int64_t t_us, level_reading* out)
+{
+    float d[LEVEL_MAX_PINGS];
+    size_t valid = 0, kept = 0;
+
+    lv->bursts++;
+    if (n > LEVEL_MAX_PINGS) {
+        n = LEVEL_MAX_PINGS;
+    }
+    lv->pings += n;
+    for (size_t i = 0; i < n; i++) {
+        if (echo_us[i] == 0) {
+            lv->no_echo++;
+            continue;
+        }
+        float cm = echo_us[i] * lv->cm_per_us;
+        if (cm < lv->cfg.min_cm || cm > lv->cfg.max_cm) {
+            lv->out_of_range++;
+            continue;
+        }
+        d[valid++] = cm;
+    }
+    if (valid < lv->cfg.min_pings) {
+        return -1;
+    }
+
+    sort(d, valid);
+    float mid = median(d, valid);
+    for (size_t i = 0; i < valid; i++) {
+        if (fabsf(d[i] - mid) <= lv->cfg.spread_cm) {
+            d[kept++] = d[i];           // Still sorted
+        } else {
+            lv->outliers++;
+        }
+    }
+    if (kept < lv->cfg.min_pings) {
+        return -1;
+    }
+
+    out->distance_cm = median(d, kept);
+    out->level_cm = lv->cfg.mount_cm - out->distance_cm;
+    out->pings = (uint8_t)kept;
+
+    lv->hist_us[lv->hist_head] = t_us;
+    lv->hist_cm[lv->hist_head] = out->level_cm;
+    lv->hist_head = (lv->hist_head + 1) % LEVEL_HISTORY;
+    if (lv->hist_count < LEVEL_HISTORY) {
+        lv->hist_count++;
+    }
+    out->have_rate = fit_rate(lv, t_us, &out->rate_cm_h);
+    if (!out->have_rate) {
+        out->rate_cm_h = 0;
+    }
+    lv->readings++;
+    return 0;
+}
+
+void level_print(const level* lv)
+{
+    printf("Level: %u of %u bursts read, %u pings, %u no echo, %u out of range, %u outliers\n",
+           lv->readings, lv->bursts, lv->pings, lv->no_echo, lv->out_of_range, lv->outliers);
+}
@@ -0,0 +1,81 @@
+/*
+*****************************************************************
+* metrics.c - Lock-Free Counters And Latency Histograms          *
+*****************************************************************
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "dizon_metrics.h"
+
+void metrics_hist_init(metrics_hist* h, uint8_t shift)
+{
+    memset(h, 0, sizeof(*h));
+    h->shift = shift < 32 - METRICS_BUCKETS ? shift : 32 - METRICS_BUCKETS;
+}
+
+// Largest value bucket b holds
+static uint32_t bucket_top(const metrics_hist* h, uint32_t b, uint32_t max)
+{
+    if (b == METRICS_BUCKETS - 1) {
+        return max;
+    }
+    uint32_t top = (uint32_t)((1ull << (b + h->shift)) - 1);
+    return top < max ? top : max;
+}
+
+void metrics_take(metrics_hist* h, metrics_summary* out)
+{
+    static const uint32_t per_mille[3] = { 500, 900, 990 };
+    uint32_t counts[METRICS_BUCKETS];
+    uint32_t* const p[3] = { &out->p50, &out->p90, &out->p99 };
+
+    out->count = 0;
+    for (uint32_t b = 0; b < METRICS_BUCKETS; b++) {
+        counts[b] = __atomic_exchange_n(&h->buckets[b], 0, __ATOMIC_RELAXED);
+        out->count += counts[b];
+    }
+    out->max = __atomic_exchange_n(&h->max, 0, __ATOMIC_RELAXED);
+
+    uint32_t b = 0, seen = counts[0];
+    for (int k = 0; k < 3; k++) {
+        // Rank of the percentile, 1 based and rounded up
+        uint32_t rank = (uint32_t)(((uint64_t)out->count * per_mille[k] + 999) / 1000);
+        while (seen < rank && b < METRICS_BUCKETS - 1) {
+            seen += counts[++b];
+        }
+        *p[k] = out->count ? bucket_top(h, b, out->max) : 0;
+    }
+}
+
+uint32_t metrics_take_count(uint32_t* counter)
+{
+    return __atomic_exchange_n(counter, 0, __ATOMIC_RELAXED);
+}
+
+static void print_summary(const char* name, const metrics_summary* s)
+{
+    printf("  %-8s %6u  p50 %8.1f  p90 %8.1f  p99 %8.1f  max %8.1f ms\n",
+           name, s->count, s->p50 / 1000.0, s->p90 / 1000.0, s->p99 / 1000.0, s->max / 1000.0);
+}
+
+void metrics_print(const metrics_report* r)
+{
+    printf("Metrics over %u s:\n", r->period_s);
+    print_summary("sample", &r->sample);
+    print_summary("latency", &r->latency);
+    print_summary("publish", &r->publish);
+    printf("  %u publish failures, %u connects (%u failed, last %u ms)\n",
+           r->publish_failures, r->connects, r->connect_failures, r->connect_ms);
+    printf("  heap %u free, %u least ever, %u largest block\n", r->heap_free, r->heap_min, r->heap_largest);
+    printf("  ring %u waiting, high water %u, %u overflows\n", r->ring_waiting, r->ring_high_water,
+           r->ring_overflows);
+    for (uint8_t i = 0; i < r->task_count; i++) {
+        const metrics_task* t = &r->tasks[i];
+        if (t->cpu_permille == METRICS_NO_CPU) {
+            printf("  task %-16s stack %5u free\n", t->name, t->stack_free);
+        } else {
+            printf("  task %-16s stack %5u free  cpu %5.1f%%\n", t->name, t->stack_free, t->cpu_permille / 10.0);
+        }
+    }
+}
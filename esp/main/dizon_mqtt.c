@@ -1,7 +1,183 @@
+#include "esp_timer.h"
+#include "esp_attr.h"
 #include "dizon_mqtt.h"
+#include "dizon_timestamp.h"
 
 static const char *TAG = "DIZON_MQTT";
 
+static mqtt_config_cb s_config_cb;
+static mqtt_connected_cb s_connected_cb;
+static mqtt_published_cb s_published_cb;
+static mqtt_request_cb s_rollup_cb;
+static volatile bool s_connected;
+static outbox* s_outbox;
+static metrics_hist* s_publish_time;
+static uint32_t s_publish_failures;
+static RTC_DATA_ATTR mqtt_connect_stats s_connect_stats;
+static bool s_connecting;
+static int64_t s_connect_start_us;
+static uint32_t s_heap_low_before;
+
+void mqtt_on_config(mqtt_config_cb cb)
+{
+    s_config_cb = cb;
+}
+
+void mqtt_on_connected(mqtt_connected_cb cb)
+{
+    s_connected_cb = cb;
+}
+
+void mqtt_on_rollup_request(mqtt_request_cb cb)
+{
+    s_rollup_cb = cb;
+}
+
+void mqtt_on_published(mqtt_published_cb cb)
+{
+    s_published_cb = cb;
+}
+
+bool mqtt_connected(void)
+{
+    return s_connected;
+}
+
+const mqtt_connect_stats* mqtt_get_connect_stats(void)
+{
+    return &s_connect_stats;
+}
+
+void mqtt_print_connect_stats(void)
+{
+    const mqtt_connect_stats* c = &s_connect_stats;
+    printf("MQTT connects: %u attempts, %u failed, %u kept the session avg %.0f ms, %u new session avg %.0f ms, "
+           "max %u ms, heap peak max %u\n",
+           c->attempts, c->failures, c->session_kept,
+           c->session_kept ? (double)c->session_kept_ms / c->session_kept : 0.0, c->session_new,
+           c->session_new ? (double)c->session_new_ms / c->session_new : 0.0, c->max_ms, c->heap_peak_max);
+}
+
+//--------------------------------------------------------------------------------------
+// Connect cost, from BEFORE_CONNECT (TCP, TLS and the MQTT CONNECT still to come) to the
+// CONNACK.  The handshake peak is how far the heap low water mark moved meanwhile.
+//--------------------------------------------------------------------------------------
+static void connect_started(void)
+{
+    if (s_connecting) {
+        s_connect_stats.failures++;     // The last one never got its CONNACK
+    }
+    s_connecting = true;
+    s_connect_stats.attempts++;
+    s_connect_stats.heap_before = esp_get_free_heap_size();
+    s_heap_low_before = esp_get_minimum_free_heap_size();
+    s_connect_start_us = esp_timer_get_time();
+}
+
+static void connect_done(bool session_present)
+{
+    mqtt_connect_stats* c = &s_connect_stats;
+    uint32_t ms = (uint32_t)((esp_timer_get_time() - s_connect_start_us) / 1000);
+    uint32_t low = esp_get_minimum_free_heap_size();
+
+    s_connecting = false;
+    c->heap_peak = low < s_heap_low_before ? c->heap_before - low : 0;
+    c->heap_peak_max = c->heap_peak > c->heap_peak_max ? c->heap_peak : c->heap_peak_max;
+    c->last_ms = ms;
+    c->max_ms = ms > c->max_ms ? ms : c->max_ms;
+    if (session_present) {
+        c->session_kept++;
+        c->session_kept_ms += ms;
+    } else {
+        c->session_new++;
+        c->session_new_ms += ms;
+    }
+    ESP_LOGI(TAG, "Connected in %u ms, MQTT session %s, %u bytes free before, handshake peak %u bytes",
+             ms, session_present ? "kept" : "new", c->heap_before, c->heap_peak);
+}
+
+void mqtt_use_outbox(outbox* ob)
+{
+    s_outbox = ob;
+}
+
+void mqtt_time_publishes(metrics_hist* h)
+{
+    s_publish_time = h;
+}
+
+uint32_t mqtt_take_publish_failures(void)
+{
+    return metrics_take_count(&s_publish_failures);
+}
+
+static int client_publish(esp_mqtt_client_handle_t client, const char* topic, const char* data, size_t len, int qos)
+{
+    int64_t start = esp_timer_get_time();
+    int msg_id = esp_mqtt_client_publish(client, topic, data, len, qos, 0);
+    if (s_publish_time) {
+        metrics_record_since(s_publish_time, start, esp_timer_get_time());
+    }
+    if (msg_id < 0) {
+        metrics_add(&s_publish_failures, 1);
+    }
+    return msg_id;
+}
+
+// len 0 takes data as a string, like esp_mqtt_client_publish
+static int publish(esp_mqtt_client_handle_t client, const char* topic, const char* data, size_t len, int qos)
+{
+    len = len ? len : strlen(data);
+    if (s_outbox == NULL) {
+        return client_publish(client, topic, data, len, qos);
+    }
+    if (outbox_push(s_outbox, topic, (const uint8_t*)data, len, esp_timer_get_time()) != 0) {
+        ESP_LOGW(TAG, "Outbox full, %u bytes for %s not queued", (unsigned)len, topic);
+        return -1;
+    }
+    return 0;
+}
+
+static int outbox_send(void* ctx, const char* topic, const uint8_t* data, size_t len)
+{
+    return client_publish((esp_mqtt_client_handle_t)ctx, topic, (const char*)data, len, 1);
+}
+
+int mqtt_pump_outbox(esp_mqtt_client_handle_t client)
+{
+    if (s_outbox == NULL || !s_connected) {
+        return 0;
+    }
+    return outbox_pump(s_outbox, esp_timer_get_time(), outbox_send, client);
+}
+
+bool mqtt_can_queue(const char* topic, size_t len)
+{
+    return s_outbox == NULL || outbox_room(s_outbox, strlen(topic), len);
+}
+
+
+static void subscribe(esp_mqtt_client_handle_t client)
+{
+    int msg_id;
+
+    msg_id = esp_mqtt_client_subscribe(client, "/topic/qos0", 0);
+    ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
+
+    msg_id = esp_mqtt_client_subscribe(client, "/topic/qos1", 1);
+    ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
+
+    msg_id = esp_mqtt_client_unsubscribe(client, "/topic/qos1");
+    ESP_LOGI(TAG, "sent unsubscribe successful, msg_id=%d", msg_id);
+
+    msg_id = esp_mqtt_client_subscribe(client, SUMP_CONFIG_TOPIC, 1);
+    ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
+
+    if (s_rollup_cb) {
+        msg_id = esp_mqtt_client_subscribe(client, SUMP_ROLLUP_GET_TOPIC, 1);
+        ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
+    }
+}
 
 static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
 {
@@ -9,19 +185,32 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
     int msg_id;
     // your_context_t *context = event->context;
     switch (event->event_id) {
+        case MQTT_EVENT_BEFORE_CONNECT:
+            connect_started();
+            break;
         case MQTT_EVENT_CONNECTED:
             ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
-            msg_id = esp_mqtt_client_subscribe(client, "/topic/qos0", 0);
-            ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
-
-            msg_id = esp_mqtt_client_subscribe(client, "/topic/qos1", 1);
-            ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
-
-            msg_id = esp_mqtt_client_unsubscribe(client, "/topic/qos1");
-            ESP_LOGI(TAG, "sent unsubscribe successful, msg_id=%d", msg_id);
+            connect_done(event->session_present);
+#ifdef CONFIG_SUMP_MQTT_PERSISTENT_SESSION
+            // The broker kept the subscriptions, and held what came for them meanwhile
+            if (!event->session_present) {
+                subscribe(client);
+            }
+#else
+            subscribe(client);
+#endif
+            s_connected = true;
+            if (s_connected_cb) {
+                s_connected_cb();
+            }
             break;
         case MQTT_EVENT_DISCONNECTED:
             ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
+            s_connected = false;
+            if (s_connecting) {
+                s_connecting = false;
+                s_connect_stats.failures++;
+            }
             break;
 
         case MQTT_EVENT_SUBSCRIBED:
@@ -33,12 +222,26 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
             ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
             break;
         case MQTT_EVENT_PUBLISHED:
-            ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+            ESP_LOGD(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+            if (s_outbox) {
+                outbox_ack(s_outbox, event->msg_id);
+            }
+            if (s_published_cb) {
+                s_published_cb();
+            }
             break;
         case MQTT_EVENT_DATA:
             ESP_LOGI(TAG, "MQTT_EVENT_DATA");
             printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
             printf("DATA=%.*s\r\n", event->data_len, event->data);
+            if (s_config_cb && event->topic_len == strlen(SUMP_CONFIG_TOPIC) &&
+                strncmp(event->topic, SUMP_CONFIG_TOPIC, event->topic_len) == 0) {
+                s_config_cb(event->data, event->data_len);
+            }
+            if (s_rollup_cb && event->topic_len == strlen(SUMP_ROLLUP_GET_TOPIC) &&
+                strncmp(event->topic, SUMP_ROLLUP_GET_TOPIC, event->topic_len) == 0) {
+                s_rollup_cb(event->data, event->data_len);
+            }
             break;
         case MQTT_EVENT_ERROR:
             ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
@@ -50,26 +253,207 @@ static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
     return ESP_OK;
 }
 
-esp_mqtt_client_handle_t mqtt_app_start(void)
+esp_mqtt_client_handle_t mqtt_app_start(const char* uri)
 {
-    const esp_mqtt_client_config_t mqtt_cfg = {
+    esp_mqtt_client_config_t mqtt_cfg = {
         .uri = "mqtts://a21tu0thpdooch-ats.iot.us-east-1.amazonaws.com:8883",
         .event_handle = mqtt_event_handler,
         .client_cert_pem = keyCLIENT_CERTIFICATE_PEM,
-        .client_key_pem = keyCLIENT_PRIVATE_KEY_PEM
+        .client_key_pem = keyCLIENT_PRIVATE_KEY_PEM,
+#ifdef CONFIG_SUMP_MQTT_PERSISTENT_SESSION
+        // The default client ID comes from the MAC, so the broker finds the session again
+        .disable_clean_session = 1,
+#endif
     };
 
-    ESP_LOGI(TAG, "[APP] Free memory: %d bytes", esp_get_free_heap_size());
+    if (uri != NULL && uri[0] != 0) {
+        // A local broker for testing, the certificate is only sent if it asks for one
+        mqtt_cfg.uri = uri;
+    }
+    ESP_LOGI(TAG, "[APP] Free memory: %d bytes, broker %s", esp_get_free_heap_size(), mqtt_cfg.uri);
     esp_mqtt_client_handle_t client = esp_mqtt_client_init(&mqtt_cfg);
     esp_mqtt_client_start(client);
     return client;
 }
 
-void send_aws_msg(esp_mqtt_client_handle_t client, char* id, char* time, double Irms, uint32_t free_mem)
+int send_aws_msg(esp_mqtt_client_handle_t client, char* id, const char* time, const sump_record* rec)
 {
-    char buf[100];
-    sprintf(buf, "{ \"ID\":\"%s\", \"time\":\"%s\",\"Irms\":\"%f\", \"memFree\":\"%d\" }", id, time, Irms, free_mem);
-    esp_mqtt_client_publish(client, "esptest/", buf, 0, 0, 0);
+    char buf[352];
+    int len;
+    if (rec->cycles) {
+        len = snprintf(buf, sizeof(buf), "{ \"ID\":\"%s\", \"time\":\"%s\",\"Irms\":\"%f\", \"IrmsMin\":\"%f\", "
+                       "\"IrmsMax\":\"%f\", \"cycles\":\"%u\", \"memFree\":\"%d\"",
+                       id, time, rec->irms, rec->irms_min, rec->irms_max, rec->cycles, rec->free_mem);
+    } else {
+        len = snprintf(buf, sizeof(buf), "{ \"ID\":\"%s\", \"time\":\"%s\",\"Irms\":\"%f\", \"memFree\":\"%d\"",
+                       id, time, rec->irms, rec->free_mem);
+    }
+    if (rec->suppressed && len < (int)sizeof(buf)) {
+        len += snprintf(buf + len, sizeof(buf) - len, ", \"suppressed\":\"%u\"", rec->suppressed);
+    }
+    if (rec->has_level && len < (int)sizeof(buf)) {
+        len += snprintf(buf + len, sizeof(buf) - len, ", \"level\":\"%.1f\", \"levelRate\":\"%.1f\"",
+                        rec->level_cm, rec->level_rate);
+    }
+    for (uint8_t k = 0; k < rec->extra_channels && len < (int)sizeof(buf); k++) {
+        len += snprintf(buf + len, sizeof(buf) - len, ", \"Irms%u\":\"%f\"", k + 2u, rec->irms_extra[k]);
+    }
+    if (len < (int)sizeof(buf)) {
+        snprintf(buf + len, sizeof(buf) - len, " }");
+    }
+    int msg_id = publish(client, "esptest/", buf, 0, 0);
     ESP_LOGI(TAG, "Message Sent: %s", time);
-    free(time);
-}
\ No newline at end of file
+    return msg_id;
+}
+
+int send_aws_batch(esp_mqtt_client_handle_t client, const uint8_t* payload, size_t len)
+{
+    int msg_id = publish(client, SUMP_BATCH_TOPIC, (const char*)payload, len, 0);
+    ESP_LOGI(TAG, "Batch sent: %u bytes, msg_id=%d", (unsigned)len, msg_id);
+    return msg_id;
+}
+
+int send_capture_chunk(esp_mqtt_client_handle_t client, const char* id, const uint8_t* chunk, size_t len)
+{
+    char topic[48];
+    snprintf(topic, sizeof(topic), SUMP_CAPTURE_TOPIC "/%s", id);
+    int msg_id = publish(client, topic, (const char*)chunk, len, 1);
+    ESP_LOGD(TAG, "Capture chunk sent: %u bytes, msg_id=%d", (unsigned)len, msg_id);
+    return msg_id;
+}
+
+int send_pump_event(esp_mqtt_client_handle_t client, char* id, const char* time, const pump_event* ev)
+{
+    char buf[200];
+    int len = snprintf(buf, sizeof(buf), "{ \"ID\":\"%s\", \"time\":\"%s\", \"event\":\"%s\"",
+                       id, time, pump_event_name(ev->type));
+    switch (ev->type) {
+        case PUMP_EVENT_START:
+            len += snprintf(buf + len, sizeof(buf) - len, ", \"Irms\":\"%.2f\", \"cph\":\"%u\"",
+                            ev->amps, ev->cycles_per_hour);
+            break;
+        case PUMP_EVENT_STOP:
+            len += snprintf(buf + len, sizeof(buf) - len, ", \"IrmsPeak\":\"%.2f\", \"runMs\":\"%u\", \"cph\":\"%u\"",
+                            ev->amps, ev->run_ms, ev->cycles_per_hour);
+            break;
+        case PUMP_EVENT_SUMMARY:
+            len += snprintf(buf + len, sizeof(buf) - len, ", \"duty\":\"%.3f\", \"starts\":\"%u\", \"cph\":\"%u\", \"running\":\"%d\"",
+                            ev->duty, ev->starts, ev->cycles_per_hour, ev->running);
+            break;
+        case PUMP_EVENT_ALARM:
+        case PUMP_EVENT_ALARM_CLEAR:
+            len += snprintf(buf + len, sizeof(buf) - len, ", \"alarm\":\"%s\", \"runMs\":\"%u\", \"cph\":\"%u\"",
+                            pump_alarm_name(ev->alarm), ev->run_ms, ev->cycles_per_hour);
+            break;
+    }
+    if (len < (int)sizeof(buf)) {
+        snprintf(buf + len, sizeof(buf) - len, " }");
+    }
+    int msg_id = publish(client, "esptest/events", buf, 0, 1);
+    ESP_LOGI(TAG, "Pump event %s sent: %s", pump_event_name(ev->type), time);
+    return msg_id;
+}
+
+int send_harmonics(esp_mqtt_client_handle_t client, char* id, const char* time, const harmonic_result* r)
+{
+    char buf[320];
+    int len = snprintf(buf, sizeof(buf), "{ \"ID\":\"%s\", \"time\":\"%s\", \"Irms\":\"%.3f\", \"thd\":\"%.4f\"",
+                       id, time, r->total_irms, r->thd);
+    for (uint8_t k = 0; k < r->count && len < (int)sizeof(buf); k++) {
+        len += snprintf(buf + len, sizeof(buf) - len, ", \"h%u\":\"%.3f\"", r->orders[k], r->irms[k]);
+    }
+    if (len < (int)sizeof(buf)) {
+        snprintf(buf + len, sizeof(buf) - len, " }");
+    }
+    int msg_id = publish(client, "esptest/harmonics", buf, 0, 1);
+    ESP_LOGI(TAG, "Harmonics sent: %s, THD %.2f%%", time, 100 * r->thd);
+    return msg_id;
+}
+
+static int json_summary(char* buf, size_t size, const char* name, const metrics_summary* m)
+{
+    return snprintf(buf, size, ", \"%sN\":\"%u\", \"%sP50\":\"%.1f\", \"%sP90\":\"%.1f\", \"%sP99\":\"%.1f\", "
+                    "\"%sMax\":\"%.1f\"", name, m->count, name, m->p50 / 1000.0, name, m->p90 / 1000.0,
+                    name, m->p99 / 1000.0, name, m->max / 1000.0);
+}
+
+int send_metrics(esp_mqtt_client_handle_t client, char* id, const char* time, const metrics_report* r)
+{
+    static char buf[1536];              // Too big for the publishing task's stack
+    int len = snprintf(buf, sizeof(buf), "{ \"ID\":\"%s\", \"time\":\"%s\", \"period\":\"%u\"",
+                       id, time, r->period_s);
+    if (len < (int)sizeof(buf)) {
+        len += json_summary(buf + len, sizeof(buf) - len, "sample", &r->sample);
+    }
+    if (len < (int)sizeof(buf)) {
+        len += json_summary(buf + len, sizeof(buf) - len, "latency", &r->latency);
+    }
+    if (len < (int)sizeof(buf)) {
+        len += json_summary(buf + len, sizeof(buf) - len, "publish", &r->publish);
+    }
+    if (len < (int)sizeof(buf)) {
+        len += snprintf(buf + len, sizeof(buf) - len, ", \"publishFailures\":\"%u\", \"connects\":\"%u\", "
+                        "\"connectFailures\":\"%u\", \"connectMs\":\"%u\", \"memFree\":\"%u\", "
+                        "\"memMin\":\"%u\", \"memLargest\":\"%u\", \"ring\":\"%u\", "
+                        "\"ringHigh\":\"%u\", \"ringOverflows\":\"%u\"",
+                        r->publish_failures, r->connects, r->connect_failures, r->connect_ms, r->heap_free,
+                        r->heap_min, r->heap_largest, r->ring_waiting, r->ring_high_water, r->ring_overflows);
+    }
+    for (uint8_t i = 0; i < r->task_count && len < (int)sizeof(buf); i++) {
+        const metrics_task* t = &r->tasks[i];
+        len += snprintf(buf + len, sizeof(buf) - len, ", \"stack_%s\":\"%u\"", t->name, t->stack_free);
+        if (t->cpu_permille != METRICS_NO_CPU && len < (int)sizeof(buf)) {
+            len += snprintf(buf + len, sizeof(buf) - len, ", \"cpu_%s\":\"%.1f\"", t->name, t->cpu_permille / 10.0);
+        }
+    }
+    if (len < (int)sizeof(buf)) {
+        snprintf(buf + len, sizeof(buf) - len, " }");
+    }
+    int msg_id = publish(client, SUMP_METRICS_TOPIC, buf, 0, 0);
+    ESP_LOGI(TAG, "Metrics sent: %s", time);
+    return msg_id;
+}
+
+static int json_stat(char* buf, size_t size, const char* name, const rollup_stat* st)
+{
+    return snprintf(buf, size, ", \"%sMin\":\"%.3f\", \"%sMax\":\"%.3f\", \"%sSum\":\"%.3f\", "
+                    "\"%sSumSq\":\"%.3f\"", name, st->min, name, st->max, name, st->sum, name, st->sumsq);
+}
+
+int send_rollup(esp_mqtt_client_handle_t client, char* id, rollup_level level, const rollup_bucket* b,
+                size_t n, bool open)
+{
+    static char buf[1536];              // Too big for the publishing task's stack
+    char tbuf[TS_ISO_LEN];
+    int len = snprintf(buf, sizeof(buf), "{ \"ID\":\"%s\", \"level\":\"%s\", \"buckets\":[",
+                       id, rollup_level_name(level));
+
+    for (size_t i = 0; i < n && len < (int)sizeof(buf); i++) {
+        ts_format_iso(b[i].start * 1000000LL, tbuf, sizeof(tbuf));
+        len += snprintf(buf + len, sizeof(buf) - len, "%s{ \"start\":\"%s\", \"n\":\"%u\", \"onS\":\"%.3f\", "
+                        "\"starts\":\"%u\"", i ? ", " : " ", tbuf, b[i].count, b[i].on_ms / 1000.0, b[i].starts);
+        if (len < (int)sizeof(buf)) {
+            len += json_stat(buf + len, sizeof(buf) - len, "Irms", &b[i].irms);
+        }
+        if (b[i].level_count > 0 && len < (int)sizeof(buf)) {
+            len += snprintf(buf + len, sizeof(buf) - len, ", \"levelN\":\"%u\"", b[i].level_count);
+        }
+        if (b[i].level_count > 0 && len < (int)sizeof(buf)) {
+            len += json_stat(buf + len, sizeof(buf) - len, "level", &b[i].level);
+        }
+        if (open && i == n - 1 && len < (int)sizeof(buf)) {
+            len += snprintf(buf + len, sizeof(buf) - len, ", \"open\":\"1\"");
+        }
+        if (len < (int)sizeof(buf)) {
+            len += snprintf(buf + len, sizeof(buf) - len, " }");
+        }
+    }
+    if (len + (int)sizeof(" ] }") > (int)sizeof(buf)) {
+        ESP_LOGW(TAG, "Rollup of %u %ss does not fit", (unsigned)n, rollup_level_name(level));
+        return -1;
+    }
+    snprintf(buf + len, sizeof(buf) - len, " ] }");
+    int msg_id = publish(client, SUMP_ROLLUP_TOPIC, buf, 0, 1);
+    ESP_LOGI(TAG, "Rollup sent: %u %ss", (unsigned)n, rollup_level_name(level));
+    return msg_id;
+}
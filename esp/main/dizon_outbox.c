@@ -0,0 +1,199 @@
+/*
+*****************************************************************
+* outbox.c - Bounded QoS 1 Outbox With Ack Tracking             *
+*****************************************************************
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "dizon_outbox.h"
+
+int outbox_init(outbox* ob, const outbox_config* cfg, uint8_t* arena, size_t arena_len)
+{
+    if (arena == NULL || arena_len == 0 || arena_len > UINT32_MAX || cfg->max_inflight == 0 ||
+        cfg->max_inflight > OUTBOX_MAX_MESSAGES) {
+        return -1;
+    }
+    memset(ob, 0, sizeof(*ob));
+    ob->cfg = *cfg;
+    ob->arena = arena;
+    ob->arena_len = (uint32_t)arena_len;
+    return 0;
+}
+
+//--------------------------------------------------------------------------------------
+// The arena is a ring of whole messages.  One that does not fit between wr and the end
+// goes to the start, and the bytes skipped at the end count against it until it is
+// freed.  Held bytes always run from wr - used round to wr.
+//--------------------------------------------------------------------------------------
+static bool arena_fit(const outbox* ob, uint32_t need, uint32_t* offset, uint32_t* span)
+{
+    uint32_t wr = ob->used == 0 ? 0 : ob->wr;
+    uint32_t rd = (wr + ob->arena_len - ob->used) % ob->arena_len;
+
+    if (ob->used + need > ob->arena_len) {
+        return false;
+    }
+    if (ob->used != 0 && wr < rd) {
+        *offset = wr;                   // Free space is the gap up to rd
+        *span = need;
+        return true;
+    }
+    if (need <= ob->arena_len - wr) {
+        *offset = wr;
+        *span = need;
+        return true;
+    }
+    if (ob->used + (ob->arena_len - wr) + need > ob->arena_len) {
+        return false;
+    }
+    *offset = 0;
+    *span = (ob->arena_len - wr) + need;
+    return true;
+}
+
+bool outbox_room(const outbox* ob, size_t topic_len, size_t len)
+{
+    uint32_t offset, span;
+
+    if (ob->count == OUTBOX_MAX_MESSAGES || topic_len > OUTBOX_TOPIC_MAX || len > ob->arena_len) {
+        return false;
+    }
+    return arena_fit(ob, (uint32_t)(topic_len + 1 + len), &offset, &span);
+}
+
+int outbox_push(outbox* ob, const char* topic, const uint8_t* data, size_t len, int64_t now_us)
+{
+    size_t topic_len = strlen(topic);
+    uint32_t offset, span;
+
+    if (ob->count == OUTBOX_MAX_MESSAGES || topic_len > OUTBOX_TOPIC_MAX || len > ob->arena_len ||
+        !arena_fit(ob, (uint32_t)(topic_len + 1 + len), &offset, &span)) {
+        ob->stats.rejected++;
+        return -1;
+    }
+    outbox_msg* m = &ob->msgs[(ob->first + ob->count) % OUTBOX_MAX_MESSAGES];
+    memcpy(ob->arena + offset, topic, topic_len + 1);
+    memcpy(ob->arena + offset + topic_len + 1, data, len);
+    m->offset = offset;
+    m->span = span;
+    m->topic_len = (uint16_t)topic_len;
+    m->len = (uint32_t)len;
+    m->msg_id = 0;
+    m->state = OUTBOX_QUEUED;
+    m->tries = 0;
+    m->queued_us = now_us;
+    m->sent_us = 0;
+
+    ob->count++;
+    ob->used += span;
+    ob->wr = offset + (uint32_t)(topic_len + 1 + len);
+    ob->wr = ob->wr == ob->arena_len ? 0 : ob->wr;
+    ob->stats.queued++;
+    if (ob->used > ob->stats.high_water_bytes) {
+        ob->stats.high_water_bytes = ob->used;
+    }
+    return 0;
+}
+
+void outbox_ack(outbox* ob, int msg_id)
+{
+    uint32_t head = ob->ack_head;
+
+    if (head - __atomic_load_n(&ob->ack_tail, __ATOMIC_ACQUIRE) == OUTBOX_ACK_QUEUE) {
+        ob->stats.ack_overflows++;
+        return;
+    }
+    ob->acks[head % OUTBOX_ACK_QUEUE] = msg_id;
+    __atomic_store_n(&ob->ack_head, head + 1, __ATOMIC_RELEASE);
+}
+
+static outbox_msg* msg_at(outbox* ob, uint16_t i)
+{
+    return &ob->msgs[(ob->first + i) % OUTBOX_MAX_MESSAGES];
+}
+
+static void take_acks(outbox* ob, int64_t now_us)
+{
+    uint32_t head = __atomic_load_n(&ob->ack_head, __ATOMIC_ACQUIRE);
+
+    for (uint32_t tail = ob->ack_tail; tail != head; tail++) {
+        int msg_id = ob->acks[tail % OUTBOX_ACK_QUEUE];
+        uint16_t i = 0;
+        while (i < ob->count && !(msg_at(ob, i)->state == OUTBOX_INFLIGHT && msg_at(ob, i)->msg_id == msg_id)) {
+            i++;
+        }
+        if (i == ob->count) {
+            ob->stats.unknown_acks++;
+            continue;
+        }
+        outbox_msg* m = msg_at(ob, i);
+        uint32_t latency = (uint32_t)(now_us - m->queued_us);
+        m->state = OUTBOX_ACKED;
+        ob->inflight--;
+        ob->stats.acked++;
+        ob->stats.latency_sum_us += latency;
+        ob->stats.latency_max_us = latency > ob->stats.latency_max_us ? latency : ob->stats.latency_max_us;
+    }
+    __atomic_store_n(&ob->ack_tail, head, __ATOMIC_RELEASE);
+
+    // Space only comes back from the oldest end
+    while (ob->count > 0 && ob->msgs[ob->first].state == OUTBOX_ACKED) {
+        ob->used -= ob->msgs[ob->first].span;
+        ob->first = (ob->first + 1) % OUTBOX_MAX_MESSAGES;
+        ob->count--;
+    }
+}
+
+int outbox_pump(outbox* ob, int64_t now_us, outbox_send_fn send, void* ctx)
+{
+    const int64_t retry_us = (int64_t)ob->cfg.retry_ms * 1000;
+    int sent = 0;
+
+    take_acks(ob, now_us);
+    for (uint16_t i = 0; i < ob->count; i++) {
+        outbox_msg* m = msg_at(ob, i);
+        uint32_t backoff = m->tries > 1 ? 1u << (m->tries - 1) : 1;
+        backoff = backoff < OUTBOX_MAX_BACKOFF ? backoff : OUTBOX_MAX_BACKOFF;
+        if (m->state == OUTBOX_INFLIGHT && retry_us > 0 && now_us - m->sent_us >= retry_us * backoff) {
+            m->state = OUTBOX_QUEUED;
+            ob->inflight--;
+            ob->stats.retries++;
+        }
+    }
+    // Oldest first, retries go out ahead of newer messages
+    for (uint16_t i = 0; i < ob->count && ob->inflight < ob->cfg.max_inflight; i++) {
+        outbox_msg* m = msg_at(ob, i);
+        if (m->state != OUTBOX_QUEUED) {
+            continue;
+        }
+        const char* topic = (const char*)ob->arena + m->offset;
+        int msg_id = send(ctx, topic, ob->arena + m->offset + m->topic_len + 1, m->len);
+        if (msg_id < 0) {
+            break;                      // Not connected, try again on the next pump
+        }
+        m->msg_id = msg_id;
+        m->state = OUTBOX_INFLIGHT;
+        m->sent_us = now_us;
+        m->tries += m->tries < UINT8_MAX;
+        ob->inflight++;
+        ob->stats.sent++;
+        sent++;
+    }
+    return sent;
+}
+
+uint16_t outbox_pending(const outbox* ob)
+{
+    return ob->count;
+}
+
+void outbox_print(const outbox* ob)
+{
+    const outbox_stats* s = &ob->stats;
+    printf("Outbox: %u waiting, %u in flight, %u/%u bytes (high water %u), %u queued, %u sent, %u acked, "
+           "%u retries, %u rejected, %u unknown acks, ack latency avg %.1f ms max %.1f ms\n",
+           ob->count, ob->inflight, ob->used, ob->arena_len, s->high_water_bytes, s->queued, s->sent, s->acked,
+           s->retries, s->rejected, s->unknown_acks, s->acked ? s->latency_sum_us / 1000.0 / s->acked : 0.0,
+           s->latency_max_us / 1000.0);
+}
@@ -0,0 +1,141 @@
+/*
+*****************************************************************
+* power.c - Sleep Scheduler For Battery Operation               *
+*****************************************************************
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "dizon_power.h"
+
+int power_check_config(const power_config* cfg)
+{
+    if (cfg->off_amps >= cfg->on_amps || cfg->wake_s == 0 || cfg->upload_fill == 0 ||
+        cfg->upload_fill > POWER_BUFFER_SAMPLES) {
+        return -1;
+    }
+    return 0;
+}
+
+void power_init(power_state* ps, uint32_t now_s)
+{
+    memset(ps, 0, sizeof(*ps));
+    ps->magic = POWER_MAGIC;
+    ps->active = true;
+    ps->last_s = now_s;
+    ps->last_upload_s = now_s;
+}
+
+bool power_valid(const power_state* ps)
+{
+    return ps->magic == POWER_MAGIC && ps->head < POWER_BUFFER_SAMPLES && ps->count <= POWER_BUFFER_SAMPLES;
+}
+
+const char* power_action_name(power_action a)
+{
+    switch (a) {
+    case POWER_SLEEP:  return "sleep";
+    case POWER_UPLOAD: return "upload";
+    case POWER_ACTIVE: return "active";
+    }
+    return "?";
+}
+
+static void buffer(power_state* ps, uint32_t now_s, float irms)
+{
+    float ma = irms * 1000.0f;
+    power_sample* s;
+
+    if (ps->count == POWER_BUFFER_SAMPLES) {
+        ps->head = (ps->head + 1) % POWER_BUFFER_SAMPLES;
+        ps->count--;
+        ps->overflows++;
+    }
+    s = &ps->samples[(ps->head + ps->count) % POWER_BUFFER_SAMPLES];
+    s->t = now_s;
+    s->milliamps = ma <= 0 ? 0 : ma >= UINT16_MAX ? UINT16_MAX : (uint16_t)(ma + 0.5f);
+    ps->count++;
+}
+
+static void go_active(power_state* ps, uint32_t quiet_since)
+{
+    ps->active = true;
+    ps->quiet_since = quiet_since;
+    ps->activations++;
+}
+
+power_action power_decide(power_state* ps, const power_config* cfg, uint32_t now_s, float irms, uint32_t* sleep_s)
+{
+    // SNTP can step the clock back, start the timers again rather than wait out the gap
+    if (now_s < ps->last_s) {
+        ps->last_upload_s = now_s;
+        ps->quiet_since = ps->quiet_since ? now_s : 0;
+    }
+    ps->last_s = now_s;
+    *sleep_s = cfg->wake_s;
+
+    if (ps->active) {
+        if (irms > cfg->off_amps) {
+            ps->quiet_since = 0;
+            return POWER_ACTIVE;
+        }
+        if (ps->quiet_since == 0) {
+            ps->quiet_since = now_s;
+        }
+        if (now_s - ps->quiet_since < cfg->idle_s) {
+            return POWER_ACTIVE;
+        }
+        ps->active = false;
+        ps->quiet_since = 0;
+        return POWER_SLEEP;
+    }
+
+    ps->wakes++;
+    buffer(ps, now_s, irms);
+    if (irms >= cfg->on_amps) {
+        go_active(ps, 0);
+        return POWER_ACTIVE;
+    }
+    if (now_s - ps->last_upload_s >= cfg->upload_s ||
+        (!ps->upload_failed && ps->count >= cfg->upload_fill)) {
+        // Up for idle_s at most unless the pump starts meanwhile
+        go_active(ps, now_s);
+        return POWER_UPLOAD;
+    }
+    return POWER_SLEEP;
+}
+
+size_t power_pending(const power_state* ps)
+{
+    return ps->count;
+}
+
+size_t power_peek(const power_state* ps, power_sample* out, size_t max)
+{
+    size_t n = ps->count < max ? ps->count : max;
+    for (size_t i = 0; i < n; i++) {
+        out[i] = ps->samples[(ps->head + i) % POWER_BUFFER_SAMPLES];
+    }
+    return n;
+}
+
+void power_sent(power_state* ps, size_t n, uint32_t now_s)
+{
+    if (n > ps->count) {
+        n = ps->count;
+    }
+    ps->upload_failed = n == 0 && ps->count > 0;
+    ps->head = (ps->head + n) % POWER_BUFFER_SAMPLES;
+    ps->count -= n;
+    ps->last_upload_s = now_s;
+    if (n) {
+        ps->uploads++;
+    }
+}
+
+void power_print(const power_state* ps)
+{
+    printf("Power: %s, %u buffered, %u wakes, %u activations, %u uploads, %u overwritten\n",
+           ps->active ? "active" : "duty cycling", ps->count, ps->wakes, ps->activations,
+           ps->uploads, ps->overflows);
+}
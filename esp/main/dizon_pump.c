@@ -0,0 +1,177 @@
+/*
+*****************************************************************
+* pump.c - Pump Run-Cycle Detector                              *
+*****************************************************************
+*/
+
+#include <string.h>
+#include "dizon_pump.h"
+
+int pump_init(pump_detector* det, const pump_config* cfg)
+{
+    if (cfg->off_amps >= cfg->on_amps) {
+        return -1;
+    }
+    memset(det, 0, sizeof(*det));
+    det->cfg = *cfg;
+    return 0;
+}
+
+const char* pump_event_name(pump_event_type type)
+{
+    switch (type) {
+    case PUMP_EVENT_START:       return "start";
+    case PUMP_EVENT_STOP:        return "stop";
+    case PUMP_EVENT_SUMMARY:     return "summary";
+    case PUMP_EVENT_ALARM:       return "alarm";
+    case PUMP_EVENT_ALARM_CLEAR: return "alarm_clear";
+    }
+    return "?";
+}
+
+const char* pump_alarm_name(pump_alarm alarm)
+{
+    switch (alarm) {
+    case PUMP_ALARM_NONE:       return "none";
+    case PUMP_ALARM_RUN_TIME:   return "run_time";
+    case PUMP_ALARM_CYCLE_RATE: return "cycle_rate";
+    }
+    return "?";
+}
+
+// Forget starts older than an hour
+static void prune_starts(pump_detector* det, int64_t now_us)
+{
+    while (det->start_count) {
+        uint16_t oldest = (det->start_head + PUMP_MAX_STARTS - det->start_count) % PUMP_MAX_STARTS;
+        if (now_us - det->start_times[oldest] < PUMP_HOUR_US) {
+            break;
+        }
+        det->start_count--;
+    }
+}
+
+uint16_t pump_cycles_per_hour(pump_detector* det, int64_t now_us)
+{
+    prune_starts(det, now_us);
+    return det->start_count;
+}
+
+// On time between a back dated transition and now that falls in the current summary
+static int64_t in_summary(const pump_detector* det, int64_t at, int64_t now)
+{
+    return now - (at > det->summary_start_us ? at : det->summary_start_us);
+}
+
+static pump_event* new_event(pump_event* events, int* n, pump_event_type type, int64_t t_us)
+{
+    pump_event* ev = &events[(*n)++];
+    memset(ev, 0, sizeof(*ev));
+    ev->type = type;
+    ev->t_us = t_us;
+    return ev;
+}
+
+static void set_alarm(pump_detector* det, pump_alarm alarm, bool active, int64_t t_us,
+                      pump_event* events, int* n)
+{
+    if (active == det->alarms[alarm]) {
+        return;
+    }
+    det->alarms[alarm] = active;
+    pump_event* ev = new_event(events, n, active ? PUMP_EVENT_ALARM : PUMP_EVENT_ALARM_CLEAR, t_us);
+    ev->alarm = alarm;
+    ev->run_ms = det->running ? (uint32_t)((t_us - det->run_start_us) / 1000) : 0;
+    ev->cycles_per_hour = det->start_count;
+}
+
+int pump_update(pump_detector* det, int64_t t_us, float irms, pump_event* events)
+{
+    const pump_config* cfg = &det->cfg;
+    int n = 0;
+
+    if (!det->started) {
+        det->started = true;
+        det->last_us = t_us;
+        det->summary_start_us = t_us;
+    }
+    if (det->running) {
+        det->summary_on_us += t_us - det->last_us;
+        if (irms > det->run_peak) {
+            det->run_peak = irms;
+        }
+    }
+    det->last_us = t_us;
+
+    //-----------------------------------------------------------------------------
+    // Hysteresis and debounce
+    //-----------------------------------------------------------------------------
+    bool toward_other = det->running ? (irms <= cfg->off_amps) : (irms >= cfg->on_amps);
+    if (!toward_other) {
+        det->pending = false;
+    } else {
+        if (!det->pending) {
+            det->pending = true;
+            det->pending_us = t_us;
+            det->pending_peak = irms;
+        } else if (irms > det->pending_peak) {
+            det->pending_peak = irms;
+        }
+        if (t_us - det->pending_us >= (int64_t)cfg->debounce_ms * 1000) {
+            int64_t at = det->pending_us;
+            det->pending = false;
+            if (!det->running) {
+                det->running = true;
+                det->run_start_us = at;
+                det->run_peak = det->pending_peak;
+                det->summary_on_us += in_summary(det, at, t_us);
+                det->start_times[det->start_head] = at;
+                det->start_head = (det->start_head + 1) % PUMP_MAX_STARTS;
+                if (det->start_count < PUMP_MAX_STARTS) {
+                    det->start_count++;
+                }
+                det->summary_starts++;
+                det->total_starts++;
+                pump_event* ev = new_event(events, &n, PUMP_EVENT_START, at);
+                ev->amps = irms;
+                ev->cycles_per_hour = pump_cycles_per_hour(det, t_us);
+            } else {
+                det->running = false;
+                det->summary_on_us -= in_summary(det, at, t_us);
+                pump_event* ev = new_event(events, &n, PUMP_EVENT_STOP, at);
+                ev->amps = det->run_peak;
+                ev->run_ms = (uint32_t)((at - det->run_start_us) / 1000);
+                ev->cycles_per_hour = pump_cycles_per_hour(det, t_us);
+            }
+        }
+    }
+
+    //-----------------------------------------------------------------------------
+    // Alarms, raised once and cleared when the condition goes away
+    //-----------------------------------------------------------------------------
+    if (cfg->max_run_s) {
+        bool too_long = det->running && (t_us - det->run_start_us) > (int64_t)cfg->max_run_s * 1000000;
+        set_alarm(det, PUMP_ALARM_RUN_TIME, too_long, t_us, events, &n);
+    }
+    if (cfg->max_cycles_per_hour) {
+        bool too_often = pump_cycles_per_hour(det, t_us) > cfg->max_cycles_per_hour;
+        set_alarm(det, PUMP_ALARM_CYCLE_RATE, too_often, t_us, events, &n);
+    }
+
+    //-----------------------------------------------------------------------------
+    // Periodic summary
+    //-----------------------------------------------------------------------------
+    int64_t elapsed = t_us - det->summary_start_us;
+    if (cfg->summary_s && elapsed >= (int64_t)cfg->summary_s * 1000000) {
+        pump_event* ev = new_event(events, &n, PUMP_EVENT_SUMMARY, t_us);
+        ev->duty = (float)det->summary_on_us / elapsed;
+        ev->starts = det->summary_starts;
+        ev->cycles_per_hour = pump_cycles_per_hour(det, t_us);
+        ev->running = det->running;
+        ev->run_ms = det->running ? (uint32_t)((t_us - det->run_start_us) / 1000) : 0;
+        det->summary_start_us = t_us;
+        det->summary_on_us = 0;
+        det->summary_starts = 0;
+    }
+    return n;
+}
@@ -0,0 +1,71 @@
+/*
+*****************************************************************
+* ring.c - Lock-Free Single Producer/Single Consumer Record Ring *
+*****************************************************************
+*/
+
+#include <string.h>
+#include "dizon_ring.h"
+
+int ring_init(record_ring* ring, sump_record* slots, uint32_t capacity)
+{
+    if (slots == NULL || capacity < 2 || (capacity & (capacity - 1)) != 0) {
+        return -1;
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->slots = slots;
+    ring->mask = capacity - 1;
+    return 0;
+}
+
+bool ring_push(record_ring* ring, const sump_record* rec)
+{
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t used = head - tail;
+
+    if (used > ring->mask) {
+        ring->overflows++;
+        return false;
+    }
+    ring->slots[head & ring->mask] = *rec;
+    // Publish the slot contents before the new head
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    ring->pushed++;
+    if (used + 1 > ring->high_water) {
+        ring->high_water = used + 1;
+    }
+    return true;
+}
+
+bool ring_peek(record_ring* ring, sump_record* rec)
+{
+    uint32_t tail = ring->tail;
+    if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *rec = ring->slots[tail & ring->mask];
+    return true;
+}
+
+bool ring_pop(record_ring* ring, sump_record* rec)
+{
+    if (!ring_peek(ring, rec)) {
+        return false;
+    }
+    // Hand the slot back only after we are done copying it out
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+    ring->popped++;
+    return true;
+}
+
+uint32_t ring_count(const record_ring* ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+uint32_t ring_capacity(const record_ring* ring)
+{
+    return ring->mask + 1;
+}
@@ -0,0 +1,240 @@
+/*
+*****************************************************************
+* rollup.c - Minute, Hour And Day Aggregates Of The Readings    *
+*****************************************************************
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include "dizon_rollup.h"
+#include "dizon_crc.h"
+
+static const uint32_t SECONDS[ROLLUP_LEVELS] = { 60, 3600, 86400 };
+static const uint16_t CAPACITY[ROLLUP_LEVELS] = { ROLLUP_MINUTES, ROLLUP_HOURS, ROLLUP_DAYS };
+static const uint16_t FIRST_SLOT[ROLLUP_LEVELS] = { 0, ROLLUP_MINUTES, ROLLUP_MINUTES + ROLLUP_HOURS };
+
+void rollup_init(rollup* r)
+{
+    memset(r, 0, sizeof(*r));
+    r->magic = ROLLUP_MAGIC;
+}
+
+bool rollup_valid(const rollup* r)
+{
+    if (r->magic != ROLLUP_MAGIC || r->updating) {
+        return false;
+    }
+    for (int l = 0; l < ROLLUP_LEVELS; l++) {
+        if (r->head[l] >= CAPACITY[l] || r->count[l] > CAPACITY[l] || r->open[l].start % SECONDS[l] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void rollup_seal(rollup* r)
+{
+    r->crc = crc32_buf(r, offsetof(rollup, crc));
+}
+
+bool rollup_intact(const rollup* r)
+{
+    return rollup_valid(r) && r->crc == crc32_buf(r, offsetof(rollup, crc));
+}
+
+uint32_t rollup_seconds(rollup_level level)
+{
+    return SECONDS[level];
+}
+
+const char* rollup_level_name(rollup_level level)
+{
+    switch (level) {
+    case ROLLUP_MINUTE: return "minute";
+    case ROLLUP_HOUR:   return "hour";
+    case ROLLUP_DAY:    return "day";
+    default:            break;
+    }
+    return "?";
+}
+
+size_t rollup_capacity(rollup_level level)
+{
+    return CAPACITY[level];
+}
+
+size_t rollup_count(const rollup* r, rollup_level level)
+{
+    return r->count[level];
+}
+
+const rollup_bucket* rollup_get(const rollup* r, rollup_level level, size_t i)
+{
+    if (i >= r->count[level]) {
+        return NULL;
+    }
+    return &r->slots[FIRST_SLOT[level] + (r->head[level] + i) % CAPACITY[level]];
+}
+
+// A bucket can hold run time and no readings, or readings and no level, min and max are 0 then
+static void to_bucket(const rollup_acc* a, rollup_bucket* b)
+{
+    b->start = a->start;
+    b->count = a->count;
+    b->level_count = a->level_count;
+    b->on_ms = a->on_ms;
+    b->starts = a->starts;
+    b->irms.min = a->count ? a->irms_min : 0;
+    b->irms.max = a->count ? a->irms_max : 0;
+    b->irms.sum = (float)a->irms_sum;
+    b->irms.sumsq = (float)a->irms_sumsq;
+    b->level.min = a->level_count ? a->level_min : 0;
+    b->level.max = a->level_count ? a->level_max : 0;
+    b->level.sum = (float)a->level_sum;
+    b->level.sumsq = (float)a->level_sumsq;
+}
+
+bool rollup_current(const rollup* r, rollup_level level, rollup_bucket* out)
+{
+    if (r->open[level].start == 0) {
+        return false;
+    }
+    to_bucket(&r->open[level], out);
+    return true;
+}
+
+static void start_bucket(rollup_acc* a, uint32_t start)
+{
+    memset(a, 0, sizeof(*a));
+    a->start = start;
+    a->irms_min = a->level_min = INFINITY;
+    a->irms_max = a->level_max = -INFINITY;
+}
+
+// Moves level on to the bucket starting at start, closing the open one.  Returns whether
+// one was kept.
+static bool advance(rollup* r, rollup_level level, uint32_t start)
+{
+    rollup_acc* a = &r->open[level];
+    bool closed = false;
+
+    if (a->start == start) {
+        return false;
+    }
+    if (a->count > 0 || a->on_ms > 0 || a->starts > 0) {
+        uint16_t cap = CAPACITY[level];
+        if (r->count[level] == cap) {
+            r->head[level] = (r->head[level] + 1) % cap;
+            r->count[level]--;
+        }
+        to_bucket(a, &r->slots[FIRST_SLOT[level] + (r->head[level] + r->count[level]) % cap]);
+        r->count[level]++;
+        closed = true;
+    }
+    start_bucket(a, start);
+    return closed;
+}
+
+static uint32_t bucket_start(rollup_level level, int64_t ms)
+{
+    uint32_t s = (uint32_t)(ms / 1000);
+    return s - s % SECONDS[level];
+}
+
+//--------------------------------------------------------------------------------------
+// Run time from from_ms to to_ms, a piece into each bucket it crosses
+//--------------------------------------------------------------------------------------
+static unsigned add_run(rollup* r, rollup_level level, int64_t from_ms, int64_t to_ms)
+{
+    unsigned closed = 0;
+
+    while (from_ms < to_ms) {
+        if (advance(r, level, bucket_start(level, from_ms))) {
+            closed = 1u << level;
+        }
+        rollup_acc* a = &r->open[level];
+        int64_t end_ms = (int64_t)(a->start + SECONDS[level]) * 1000;
+        end_ms = end_ms < to_ms ? end_ms : to_ms;
+        a->on_ms += (uint32_t)(end_ms - from_ms);
+        from_ms = end_ms;
+    }
+    return closed;
+}
+
+unsigned rollup_add(rollup* r, const sump_record* rec, bool running)
+{
+    int64_t ms = rec->epoch_us / 1000;
+    unsigned closed = 0;
+
+    if (ms <= 0 || isnan(rec->irms)) {
+        return 0;
+    }
+    if (ms < r->last_ms) {
+        r->late++;
+        return 0;
+    }
+    int64_t run_ms = r->running && r->last_ms > 0 ? ms - r->last_ms : 0;
+    run_ms = run_ms < ROLLUP_MAX_GAP_MS ? run_ms : ROLLUP_MAX_GAP_MS;
+
+    // Stored before and after the update, so a reset in between shows
+    __atomic_store_n(&r->updating, 1, __ATOMIC_SEQ_CST);
+    for (int l = 0; l < ROLLUP_LEVELS; l++) {
+        rollup_level level = (rollup_level)l;
+        closed |= add_run(r, level, r->last_ms, r->last_ms + run_ms);
+        if (advance(r, level, bucket_start(level, ms))) {
+            closed |= 1u << level;
+        }
+        rollup_acc* a = &r->open[level];
+        a->count++;
+        a->irms_min = rec->irms < a->irms_min ? rec->irms : a->irms_min;
+        a->irms_max = rec->irms > a->irms_max ? rec->irms : a->irms_max;
+        a->irms_sum += rec->irms;
+        a->irms_sumsq += (double)rec->irms * rec->irms;
+        if (rec->has_level) {
+            a->level_count++;
+            a->level_min = rec->level_cm < a->level_min ? rec->level_cm : a->level_min;
+            a->level_max = rec->level_cm > a->level_max ? rec->level_cm : a->level_max;
+            a->level_sum += rec->level_cm;
+            a->level_sumsq += (double)rec->level_cm * rec->level_cm;
+        }
+        if (running && !r->running) {
+            a->starts++;
+        }
+    }
+    r->running = running;
+    r->last_ms = ms;
+    __atomic_store_n(&r->updating, 0, __ATOMIC_SEQ_CST);
+    return closed;
+}
+
+int rollup_parse_request(const char* data, int len, unsigned* levels)
+{
+    static const struct { const char* name; unsigned levels; } names[] = {
+        { "minute", 1u << ROLLUP_MINUTE }, { "hour", 1u << ROLLUP_HOUR }, { "day", 1u << ROLLUP_DAY },
+        { "all", ROLLUP_ALL },
+    };
+
+    while (len > 0 && isspace((unsigned char)*data)) {
+        data++;
+        len--;
+    }
+    while (len > 0 && isspace((unsigned char)data[len - 1])) {
+        len--;
+    }
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if ((size_t)len == strlen(names[i].name) && strncmp(data, names[i].name, len) == 0) {
+            *levels = names[i].levels;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void rollup_print(const rollup* r)
+{
+    printf("Rollups: %u minutes, %u hours, %u days kept, %u late readings dropped, pump %s\n",
+           r->count[ROLLUP_MINUTE], r->count[ROLLUP_HOUR], r->count[ROLLUP_DAY], r->late,
+           r->running ? "running" : "idle");
+}
@@ -3,9 +3,70 @@
 static const char *TAG = "sntp";
 static void initialize_sntp(void);
 
+static sntp_synced_cb s_synced_cb;
+
+// Written from the lwIP task on a sync, read by every task that stamps something
+static portMUX_TYPE s_clock_lock = portMUX_INITIALIZER_UNLOCKED;
+static timestamp_clock s_clock;
+
+void sntp_on_synced(sntp_synced_cb cb)
+{
+    s_synced_cb = cb;
+}
+
+void sntp_clock_init(void)
+{
+    struct timeval tv;
+
+    ts_init(&s_clock);
+    // The RTC keeps counting through deep sleep, so a wake up can have good time before SNTP
+    gettimeofday(&tv, NULL);
+    if (tv.tv_sec >= SNTP_VALID_AFTER) {
+        ts_sync(&s_clock, esp_timer_get_time(), tv.tv_sec * 1000000LL + tv.tv_usec);
+    }
+}
+
+bool sntp_time_valid(void)
+{
+    taskENTER_CRITICAL(&s_clock_lock);
+    bool synced = s_clock.synced;
+    taskEXIT_CRITICAL(&s_clock_lock);
+    return synced;
+}
+
+int64_t sntp_epoch_us(int64_t mono_us)
+{
+    taskENTER_CRITICAL(&s_clock_lock);
+    int64_t epoch_us = ts_epoch_us(&s_clock, mono_us);
+    taskEXIT_CRITICAL(&s_clock_lock);
+    return epoch_us;
+}
+
+void sntp_clock_print(void)
+{
+    timestamp_clock tc;
+
+    taskENTER_CRITICAL(&s_clock_lock);
+    tc = s_clock;
+    taskEXIT_CRITICAL(&s_clock_lock);
+    ts_print(&tc);
+}
+
 void time_sync_notification_cb(struct timeval *tv)
 {
+    char tbuf[TS_ISO_LEN];
+    int64_t epoch_us = tv->tv_sec * 1000000LL + tv->tv_usec;
+
     ESP_LOGI(TAG, "Notification of a time synchronization event");
+    taskENTER_CRITICAL(&s_clock_lock);
+    ts_sync(&s_clock, esp_timer_get_time(), epoch_us);
+    taskEXIT_CRITICAL(&s_clock_lock);
+    ts_format_iso(epoch_us, tbuf, sizeof(tbuf));
+    ESP_LOGI(TAG, "Current Time is: %s", tbuf);
+    sntp_clock_print();
+    if (s_synced_cb) {
+        s_synced_cb();
+    }
 }
 
 static void obtain_time(void)
@@ -36,35 +97,6 @@ static void initialize_sntp(void)
 
 void init_sntp(void)
 {
+    // Does not wait for the time, sntp_on_synced hears about it once the network is up
     initialize_sntp();
-
-    // wait for time to be set
-    time_t now = 0;
-    struct tm timeinfo = { 0 };
-    int retry = 0;
-    const int retry_count = 10;
-    while (sntp_get_sync_status() == SNTP_SYNC_STATUS_RESET && ++retry < retry_count) {
-        ESP_LOGI(TAG, "Waiting for system time to be set... (%d/%d)", retry, retry_count);
-        vTaskDelay(2000 / portTICK_PERIOD_MS);
-    }
-    time(&now);
-    char tbuf[80];
-    struct tm *info;
-    info = gmtime( &now);
-    strftime(tbuf, 80, "%xT%X", info);
-    ESP_LOGI(TAG, "Current Time is: %s", tbuf);
-    localtime_r(&now, &timeinfo);
-    //free(info);
 }
-
-char* current_iso_utc_time(void)
-{
-    time_t now = 0;
-    char* buf=malloc(20 * sizeof(char));
-    time(&now);
-    struct tm *info;
-    info = gmtime( &now);
-    strftime(buf, 20, "%Y-%m-%dT%H:%M:%SZ", info);
-    ESP_LOGI(TAG, "Returning Time: %s", buf);
-    return buf;
-}
\ No newline at end of file
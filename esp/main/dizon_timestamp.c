@@ -0,0 +1,91 @@
+/*
+*****************************************************************
+* timestamp.c - Epoch Time From The Monotonic Timer             *
+*****************************************************************
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "dizon_timestamp.h"
+
+#define DRIFT_GAIN 0.5f             // Share of a new drift measurement taken in
+
+void ts_init(timestamp_clock* tc)
+{
+    memset(tc, 0, sizeof(*tc));
+}
+
+int64_t ts_epoch_us(const timestamp_clock* tc, int64_t mono_us)
+{
+    if (!tc->synced) {
+        return 0;
+    }
+    return tc->offset_us + mono_us + (int64_t)((float)(mono_us - tc->sync_mono_us) * tc->drift_ppm * 1e-6f);
+}
+
+void ts_sync(timestamp_clock* tc, int64_t mono_us, int64_t epoch_us)
+{
+    if (tc->synced) {
+        int64_t correction = epoch_us - ts_epoch_us(tc, mono_us);
+        int64_t since = mono_us - tc->sync_mono_us;
+        int64_t size = correction < 0 ? -correction : correction;
+
+        tc->last_correction_us = correction;
+        if (size > TS_STEP_US) {
+            tc->steps++;
+        } else {
+            if (size > (tc->max_correction_us < 0 ? -tc->max_correction_us : tc->max_correction_us)) {
+                tc->max_correction_us = correction;
+            }
+            if (since >= TS_DRIFT_MIN_US) {
+                // What is left over after the drift we already had is the error in it
+                float drift = tc->drift_ppm + (float)correction * 1e6f / (float)since * (tc->have_drift ? DRIFT_GAIN : 1.0f);
+                tc->drift_ppm = drift > TS_MAX_DRIFT_PPM ? TS_MAX_DRIFT_PPM :
+                                drift < -TS_MAX_DRIFT_PPM ? -TS_MAX_DRIFT_PPM : drift;
+                tc->have_drift = true;
+            }
+        }
+    }
+    tc->offset_us = epoch_us - mono_us;
+    tc->sync_mono_us = mono_us;
+    tc->synced = true;
+    tc->syncs++;
+}
+
+// Days since 1970-01-01 to a proleptic Gregorian date, no tables and no gmtime
+static void civil_from_days(int64_t days, int* year, unsigned* month, unsigned* day)
+{
+    days += 719468;
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    unsigned doe = (unsigned)(days - era * 146097);
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+
+    *day = doy - (153 * mp + 2) / 5 + 1;
+    *month = mp < 10 ? mp + 3 : mp - 9;
+    *year = (int)(yoe + era * 400 + (*month <= 2));
+}
+
+size_t ts_format_iso(int64_t epoch_us, char* buf, size_t len)
+{
+    int64_t ms = epoch_us >= 0 ? epoch_us / 1000 : (epoch_us - 999) / 1000;
+    int64_t s = ms >= 0 ? ms / 1000 : (ms - 999) / 1000;
+    int64_t days = s >= 0 ? s / 86400 : (s - 86399) / 86400;
+    unsigned sod = (unsigned)(s - days * 86400);
+    unsigned month, day;
+    int year;
+
+    civil_from_days(days, &year, &month, &day);
+    int n = snprintf(buf, len, "%04d-%02u-%02uT%02u:%02u:%02u.%03uZ", year, month, day,
+                     sod / 3600, sod / 60 % 60, sod % 60, (unsigned)(ms - s * 1000));
+    return n < 0 || (size_t)n >= len ? 0 : (size_t)n;
+}
+
+void ts_print(const timestamp_clock* tc)
+{
+    printf("Clock: %s, %u syncs, %u steps, drift %.2f ppm%s, last correction %lld us, largest %lld us\n",
+           tc->synced ? "synced" : "not synced", tc->syncs, tc->steps, tc->drift_ppm,
+           tc->have_drift ? "" : " (not yet measured)",
+           (long long)tc->last_correction_us, (long long)tc->max_correction_us);
+}
@@ -0,0 +1,113 @@
+/*
+*****************************************************************
+* ultrasonic.c - HC-SR04 Style Ultrasonic Ranging               *
+*****************************************************************
+*/
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+#include "dizon_ultrasonic.h"
+
+static const char *TAG = "ULTRASONIC";
+
+static void IRAM_ATTR echo_isr(void* arg)
+{
+    ultrasonic* us = arg;
+    int64_t now = esp_timer_get_time();
+    BaseType_t woken = pdFALSE;
+
+    if (gpio_get_level(us->echo)) {
+        us->rise_us = now;
+        return;
+    }
+    if (us->rise_us == 0) {
+        return;                 // Falling edge of a pulse we did not see start
+    }
+    uint32_t width = (uint32_t)(now - us->rise_us);
+    us->rise_us = 0;
+    xQueueOverwriteFromISR(us->echoes, &width, &woken);
+    if (woken) {
+        portYIELD_FROM_ISR();
+    }
+}
+
+int ultrasonic_init(ultrasonic* us, int trig_gpio, int echo_gpio, rmt_channel_t channel)
+{
+    if (!GPIO_IS_VALID_OUTPUT_GPIO(trig_gpio)) {
+        ESP_LOGE(TAG, "GPIO%d cannot drive the trigger, it is input only or does not exist", trig_gpio);
+        return -1;
+    }
+    if (!GPIO_IS_VALID_GPIO(echo_gpio) || echo_gpio == trig_gpio) {
+        ESP_LOGE(TAG, "GPIO%d cannot be the echo input", echo_gpio);
+        return -1;
+    }
+    us->trig = trig_gpio;
+    us->echo = echo_gpio;
+    us->channel = channel;
+    us->rise_us = 0;
+    us->pings = 0;
+    us->timeouts = 0;
+    us->echoes = xQueueCreate(1, sizeof(uint32_t));
+    if (us->echoes == NULL) {
+        return -1;
+    }
+
+    // 1 us RMT ticks, the whole trigger pulse is one item
+    rmt_config_t rmt_cfg = RMT_DEFAULT_CONFIG_TX(us->trig, channel);
+    rmt_cfg.clk_div = 80;
+    if (rmt_config(&rmt_cfg) != ESP_OK || rmt_driver_install(channel, 0, 0) != ESP_OK) {
+        ESP_LOGE(TAG, "RMT channel %d for the trigger did not install", channel);
+        return -1;
+    }
+
+    gpio_config_t io_cfg = {
+        .pin_bit_mask = 1ULL << us->echo,
+        .mode = GPIO_MODE_INPUT,
+        .pull_up_en = GPIO_PULLUP_DISABLE,
+        .pull_down_en = GPIO_PULLDOWN_ENABLE,     // Reads as no echo with the sensor unplugged
+        .intr_type = GPIO_INTR_ANYEDGE,
+    };
+    esp_err_t err = gpio_install_isr_service(0);
+    if (gpio_config(&io_cfg) != ESP_OK || (err != ESP_OK && err != ESP_ERR_INVALID_STATE) ||
+        gpio_isr_handler_add(us->echo, echo_isr, us) != ESP_OK) {
+        ESP_LOGE(TAG, "Echo interrupt on GPIO%d did not install", us->echo);
+        rmt_driver_uninstall(channel);
+        return -1;
+    }
+    ESP_LOGI(TAG, "Trigger on GPIO%d (RMT %d), echo on GPIO%d", us->trig, channel, us->echo);
+    return 0;
+}
+
+int ultrasonic_ping(ultrasonic* us, uint32_t* echo_us)
+{
+    const rmt_item32_t pulse = {{{ ULTRASONIC_TRIG_US, 1, 1, 0 }}};
+    uint32_t width;
+
+    *echo_us = 0;
+    xQueueReset(us->echoes);
+    us->rise_us = 0;
+    if (rmt_write_items(us->channel, &pulse, 1, false) != ESP_OK) {
+        return -1;
+    }
+    us->pings++;
+    if (xQueueReceive(us->echoes, &width, pdMS_TO_TICKS(ULTRASONIC_TIMEOUT_MS)) != pdTRUE) {
+        us->timeouts++;
+        return 0;
+    }
+    *echo_us = width;
+    return 0;
+}
+
+int ultrasonic_burst(ultrasonic* us, uint32_t* echo_us, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (i > 0) {
+            vTaskDelay(pdMS_TO_TICKS(ULTRASONIC_GAP_MS));
+        }
+        if (ultrasonic_ping(us, &echo_us[i]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
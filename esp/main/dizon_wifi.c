@@ -8,52 +8,183 @@
 
 static const char *TAG = "WiFi";
 
+static esp_netif_t* s_sta_netif;
+static wifi_config_t s_wifi_config;     // The full scan-and-associate config
+static bool s_fast_path;                // Trying the cached AP, no retries on this path
+static wifi_up_cb s_up_cb;
+static esp_timer_handle_t s_retry_timer;
+#ifdef CONFIG_WIFI_FAST_CONNECT
+static wifi_cache s_cache;
+static bool s_have_cache;
+#endif
+
+#ifdef CONFIG_WIFI_FAST_CONNECT
+//--------------------------------------------------------------------------------------
+// Last good AP (and lease) in NVS, so the next boot can skip the scan
+//--------------------------------------------------------------------------------------
+static int wifi_cache_load(wifi_cache* cache)
+{
+    nvs_handle_t nvs;
+    size_t len = sizeof(*cache);
+
+    if (nvs_open(WIFI_CACHE_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return -1;
+    }
+    esp_err_t err = nvs_get_blob(nvs, WIFI_CACHE_KEY, cache, &len);
+    nvs_close(nvs);
+    // A different SSID in the config makes the cache useless
+    if (err != ESP_OK || len != sizeof(*cache) || cache->version != WIFI_CACHE_VERSION ||
+        strncmp((const char*)cache->ssid, EXAMPLE_ESP_WIFI_SSID, sizeof(cache->ssid)) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static void wifi_cache_save(const wifi_cache* old, bool have_old)
+{
+    wifi_cache cache;
+    wifi_ap_record_t ap;
+    esp_netif_dns_info_t dns;
+    nvs_handle_t nvs;
+
+    if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK) {
+        return;
+    }
+    memset(&cache, 0, sizeof(cache));
+    cache.version = WIFI_CACHE_VERSION;
+    strncpy((char*)cache.ssid, EXAMPLE_ESP_WIFI_SSID, sizeof(cache.ssid) - 1);
+    memcpy(cache.bssid, ap.bssid, sizeof(cache.bssid));
+    cache.channel = ap.primary;
+    esp_netif_get_ip_info(s_sta_netif, &cache.ip);
+    if (esp_netif_get_dns_info(s_sta_netif, ESP_NETIF_DNS_MAIN, &dns) == ESP_OK) {
+        cache.dns = dns.ip.u_addr.ip4;
+    }
+    // Only write when something changed, this runs on every boot
+    if (have_old && memcmp(old, &cache, sizeof(cache)) == 0) {
+        return;
+    }
+    if (nvs_open(WIFI_CACHE_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+    if (nvs_set_blob(nvs, WIFI_CACHE_KEY, &cache, sizeof(cache)) == ESP_OK) {
+        nvs_commit(nvs);
+        ESP_LOGI(TAG, "Cached AP " MACSTR " on channel %u", MAC2STR(cache.bssid), cache.channel);
+    }
+    nvs_close(nvs);
+}
+
+#ifdef CONFIG_WIFI_FAST_STATIC_IP
+// Reuse the last lease and skip DHCP, lwIP still posts IP_EVENT_STA_GOT_IP on association
+static void wifi_use_lease(const wifi_cache* cache)
+{
+    esp_netif_dns_info_t dns = { 0 };
+
+    if (cache->ip.ip.addr == 0) {
+        return;
+    }
+    esp_netif_dhcpc_stop(s_sta_netif);
+    esp_netif_set_ip_info(s_sta_netif, &cache->ip);
+    if (cache->dns.addr != 0) {
+        dns.ip.u_addr.ip4 = cache->dns;
+        esp_netif_set_dns_info(s_sta_netif, ESP_NETIF_DNS_MAIN, &dns);
+    }
+}
+#endif
+
+// The cached AP did not take us, go through the scan like a first boot
+static void wifi_fall_back(void)
+{
+    ESP_LOGW(TAG, "Fast connect failed after %d ms, scanning",
+             (int)((esp_timer_get_time() - s_connect_start_us) / 1000));
+    s_fast_path = false;
+#ifdef CONFIG_WIFI_FAST_STATIC_IP
+    esp_netif_dhcpc_start(s_sta_netif);
+#endif
+    esp_wifi_set_config(ESP_IF_WIFI_STA, &s_wifi_config);
+    esp_wifi_connect();
+}
+#endif
+
+// Out of quick retries, the AP may be down for a while (a power cut takes it too)
+static void retry_later(void* arg)
+{
+    s_retry_num = 0;
+    xEventGroupClearBits(s_wifi_event_group, WIFI_FAIL_BIT);
+    esp_wifi_connect();
+}
+
 static void event_handler(void* arg, esp_event_base_t event_base,
                                 int32_t event_id, void* event_data)
 {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
         esp_wifi_connect();
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+        xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+#ifdef CONFIG_WIFI_FAST_CONNECT
+        if (s_fast_path) {
+            wifi_fall_back();
+            return;
+        }
+#endif
         if (s_retry_num < EXAMPLE_ESP_MAXIMUM_RETRY) {
             esp_wifi_connect();
             s_retry_num++;
             ESP_LOGI(TAG, "retry to connect to the AP");
         } else {
             xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
+            ESP_LOGW(TAG, "Failed to connect to SSID:%s, trying again in %d s",
+                     EXAMPLE_ESP_WIFI_SSID, WIFI_RETRY_BACKOFF_S);
+            esp_timer_start_once(s_retry_timer, WIFI_RETRY_BACKOFF_S * 1000000LL);
         }
         ESP_LOGI(TAG,"connect to the AP fail");
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
+        int64_t now = esp_timer_get_time();
         ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
+        // Compare the two paths across reboots with these
+        ESP_LOGI(TAG, "Connected by the %s path in %d ms, %d ms after boot",
+                 s_fast_path ? "fast" : "full", (int)((now - s_connect_start_us) / 1000), (int)(now / 1000));
+#ifdef CONFIG_WIFI_FAST_CONNECT
+        wifi_cache_save(&s_cache, s_have_cache);
+#endif
+        s_fast_path = false;
         s_retry_num = 0;
         xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+        if (s_up_cb) {
+            s_up_cb();
+        }
     }
 }
 
-void wifi_init_sta(void)
+void wifi_start_sta(wifi_up_cb cb)
 {
+    s_up_cb = cb;
     s_wifi_event_group = xEventGroupCreate();
+    const esp_timer_create_args_t retry_args = {
+        .callback = retry_later,
+        .name = "wifi_retry",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&retry_args, &s_retry_timer));
 
     ESP_ERROR_CHECK(esp_netif_init());
 
     ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_sta();
+    s_sta_netif = esp_netif_create_default_wifi_sta();
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
 
-    esp_event_handler_instance_t instance_any_id;
-    esp_event_handler_instance_t instance_got_ip;
+    // Stay registered, the handler also reconnects after the AP drops us later on
     ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
                                                         ESP_EVENT_ANY_ID,
                                                         &event_handler,
                                                         NULL,
-                                                        &instance_any_id));
+                                                        NULL));
     ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
                                                         IP_EVENT_STA_GOT_IP,
                                                         &event_handler,
                                                         NULL,
-                                                        &instance_got_ip));
+                                                        NULL));
 
     wifi_config_t wifi_config = {
         .sta = {
@@ -70,11 +201,38 @@ void wifi_init_sta(void)
             },
         },
     };
+    s_wifi_config = wifi_config;
+#ifdef CONFIG_WIFI_FAST_CONNECT
+    s_have_cache = wifi_cache_load(&s_cache) == 0;
+    if (s_have_cache) {
+        // Straight to the AP that worked last time, no scan
+        wifi_config.sta.bssid_set = true;
+        memcpy(wifi_config.sta.bssid, s_cache.bssid, sizeof(s_cache.bssid));
+        wifi_config.sta.channel = s_cache.channel;
+        wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+#ifdef CONFIG_WIFI_FAST_STATIC_IP
+        wifi_use_lease(&s_cache);
+#endif
+        ESP_LOGI(TAG, "Trying cached AP " MACSTR " on channel %u", MAC2STR(s_cache.bssid), s_cache.channel);
+    }
+    s_fast_path = s_have_cache;
+#endif
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
     ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config) );
+    s_connect_start_us = esp_timer_get_time();
     ESP_ERROR_CHECK(esp_wifi_start() );
 
-    ESP_LOGI(TAG, "wifi_init_sta finished.");
+    ESP_LOGI(TAG, "wifi_start_sta finished.");
+}
+
+bool wifi_connected(void)
+{
+    return s_wifi_event_group && (xEventGroupGetBits(s_wifi_event_group) & WIFI_CONNECTED_BIT);
+}
+
+void wifi_init_sta(void)
+{
+    wifi_start_sta(NULL);
 
     /* Waiting until either the connection is established (WIFI_CONNECTED_BIT) or connection failed for the maximum
      * number of re-tries (WIFI_FAIL_BIT). The bits are set by event_handler() (see above) */
@@ -95,9 +253,4 @@ void wifi_init_sta(void)
     } else {
         ESP_LOGE(TAG, "UNEXPECTED EVENT");
     }
-
-    /* The event will not be processed after unregister */
-    ESP_ERROR_CHECK(esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, instance_got_ip));
-    ESP_ERROR_CHECK(esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, instance_any_id));
-    vEventGroupDelete(s_wifi_event_group);
-}
\ No newline at end of file
+}
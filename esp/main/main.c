@@ -5,40 +5,1126 @@
 */
 
 #include <stdio.h>
+#include <math.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_system.h"
 #include "esp_spi_flash.h"
+#include "esp_sleep.h"
+#include "esp_heap_caps.h"
+#include "esp_cpu.h"
 #include "nvs_flash.h"
 #include "dizon_scan.h"
 #include "dizon_wifi.h"
 #include "dizon_http.h"
 #include "dizon_EmonLib.h"
+#include "dizon_emon_adc.h"
+#include "dizon_emon_profile.h"
+#include "dizon_adc_dma.h"
+#include "dizon_ring.h"
+#include "dizon_emon_window.h"
+#include "dizon_emon_multi.h"
+#include "dizon_harmonic.h"
+#include "dizon_capture.h"
+#include "dizon_pump.h"
+#include "dizon_batch.h"
+#include "dizon_deadband.h"
+#include "dizon_flashlog.h"
+#include "dizon_flash_part.h"
+#include "dizon_level.h"
+#include "dizon_ultrasonic.h"
+#include "dizon_power.h"
+#include "dizon_outbox.h"
+#include "dizon_metrics.h"
+#include "dizon_rollup.h"
 #include "aws_clientcredential_keys.h"
 
 #include "dizon_sntp.h"
 #include "dizon_mqtt.h"
 
-#define TRIG_GPIO 35
-#define ECHO_GPIO 32
-
 static const char *TAG = "Template App";
 
 // Current Calibration Constant
 // 246.9136 is what the math says this should be
 // 190 is what I figured out for my setup using an ammeter
 // and a portable electric heater
-static const double ICALIBRATION = 29.0;
+// A macro so the channel table below can use it in its initializer
+#define ICALIBRATION        29.0
+#define ICAL_ADC_CHANNEL    ADC1_CHANNEL_6  // The CT that s_emon measures
+
+// Sampling stays on the APP CPU, Wi-Fi/lwIP/MQTT live on the PRO CPU
+#define SAMPLE_TASK_CORE    1
+#define PUBLISH_TASK_CORE   0
+#define SAMPLE_TASK_PRIO    5
+#define PUBLISH_TASK_PRIO   4
+#define LEVEL_TASK_PRIO     3
+#define TASK_STACK_SIZE     4096
+
+#define SAMPLE_PERIOD_MS    1000
+#define SYNC_TIMEOUT_MS     (1000 * CONFIG_EMON_SYNC_CYCLES / EMON_SYNC_MIN_HZ)  // Gives up on crossings, pump off
+#define RECORD_RING_SIZE    64          // Power of two, about a minute of records
+
+static energy_mon s_emon;
+
+#ifdef CONFIG_EMON_PROFILE
+#define PROFILE_BIN_NS      1000        // Intervals to 63 us in 1 us bins, the rest in the last
+// Between s_emon and the ADC, the sampling task stays on one core so its cycle counter is steady
+static emon_profile s_profile;
+
+static uint32_t profile_ticks(void* ctx)
+{
+    return esp_cpu_get_ccount();
+}
+#endif
+#if CONFIG_EMON_CHANNELS > 1
+// One CT per pump, the first is the one s_emon measures
+static const emon_multi_channel s_channels[] = {
+    { ICAL_ADC_CHANNEL, ICALIBRATION },
+    { CONFIG_EMON_CH2_ADC_CHANNEL, CONFIG_EMON_CH2_ICAL / 100.0 },
+#if CONFIG_EMON_CHANNELS > 2
+    { CONFIG_EMON_CH3_ADC_CHANNEL, CONFIG_EMON_CH3_ICAL / 100.0 },
+#endif
+#if CONFIG_EMON_CHANNELS > 3
+    { CONFIG_EMON_CH4_ADC_CHANNEL, CONFIG_EMON_CH4_ICAL / 100.0 },
+#endif
+};
+static emon_multi s_multi;
+#endif
+#ifdef CONFIG_EMON_SAMPLE_DMA
+static adc_stream s_adc_stream;
+#endif
+#ifdef CONFIG_EMON_STREAMING
+static emon_window s_window;
+#endif
+#ifdef CONFIG_EMON_HARMONICS
+// Run by the sampling task, the last window waits here for the publishing task
+static harmonic s_harmonic;
+static portMUX_TYPE s_harmonic_lock = portMUX_INITIALIZER_UNLOCKED;
+static harmonic_result s_harmonic_out;
+static int64_t s_harmonic_us;
+static bool s_harmonic_fresh;
+#endif
+#ifdef CONFIG_EMON_CAPTURE
+#define CAPTURE_PRE_SAMPLES     (CONFIG_EMON_CAPTURE_PRE_MS * CONFIG_EMON_SAMPLE_RATE_HZ / 1000)
+#define CAPTURE_POST_SAMPLES    (CONFIG_EMON_CAPTURE_POST_MS * CONFIG_EMON_SAMPLE_RATE_HZ / 1000)
+#define CAPTURE_CHUNK_SAMPLES   512
+#define CAPTURE_CHUNKS_PER_WAKE 4
+#define CAPTURE_HOLDOFF_MS      5000
+#define CAPTURE_ZC_BAND         20      // Counts, well above the idle noise
+// Recorded by the sampling task, uploaded by the publishing task
+static uint16_t s_capture_arena[CONFIG_EMON_CAPTURE_SLOTS * (CAPTURE_PRE_SAMPLES + CAPTURE_POST_SAMPLES)];
+static capture s_capture;
+static capture_slot* s_capture_up;
+static uint32_t s_capture_offset;
+static uint8_t s_capture_buf[CAPTURE_CHUNK_HEADER + 2 * CAPTURE_CHUNK_SAMPLES];
+#endif
+
+#ifdef CONFIG_SUMP_OUTBOX
+#define OUTBOX_DRAIN_MS         2000    // Waited for acks before deep sleep
+// Everything published waits here for its ack, filled and sent by the publishing task
+static outbox s_outbox;
+static uint8_t s_outbox_arena[CONFIG_SUMP_OUTBOX_KB * 1024];
+#endif
+
+static sump_record s_ring_slots[RECORD_RING_SIZE];
+static record_ring s_ring;
+static TaskHandle_t s_publish_task;
+static TaskHandle_t s_sample_task;
+static TaskHandle_t s_level_task;
+
+// Recorded from any task, they cost a few atomic adds and stay on.  The publishing task
+// sends a summary every CONFIG_SUMP_METRICS_PERIOD_S.
+static metrics_hist s_sample_time;      // One measurement, or one DMA block when streaming
+static metrics_hist s_latency;          // Measurement to publish, the oldest one when batched
+static metrics_hist s_publish_time;     // Client publish calls
+#if CONFIG_SUMP_METRICS_PERIOD_S > 0
+static int64_t s_metrics_start;
+#ifdef CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+static TaskStatus_t s_task_status[METRICS_MAX_TASKS];
+static UBaseType_t s_task_numbers[METRICS_MAX_TASKS];   // As of the last report
+static uint32_t s_task_run_time[METRICS_MAX_TASKS];
+static UBaseType_t s_task_seen;
+static uint32_t s_total_run_time;
+#endif
+#endif
+
+static pump_detector s_pump;
+
+#ifdef CONFIG_SUMP_DEADBAND
+static deadband s_deadband;
+#endif
+
+#ifdef CONFIG_SUMP_LEVEL
+#define LEVEL_MIN_CM        2.0f        // Blind zone of the sensor
+#define LEVEL_SPREAD_CM     2.0f        // Pings further than this from the burst median are dropped
+#define LEVEL_STALE_PERIODS 3           // Records stop carrying a level this many periods after the last one
+#define LEVEL_DEADBAND_CM   1.0f        // A level that moved this much goes out past the deadband
+static ultrasonic s_ultrasonic;
+static level s_level;
+// Latest reading, written by the level task and copied into every record
+static portMUX_TYPE s_level_lock = portMUX_INITIALIZER_UNLOCKED;
+static level_reading s_level_now;
+static int64_t s_level_us;
+#ifdef CONFIG_SUMP_DEADBAND
+static bool s_level_sent_ok;
+static float s_level_sent;
+#endif
+#endif
+
+#ifdef CONFIG_SUMP_BATCH
+static telemetry_batch s_batch;
+static bool s_batch_blocked;       // The outbox had no room at the last flush
+// Written from the MQTT task, picked up by the publishing task
+static portMUX_TYPE s_policy_lock = portMUX_INITIALIZER_UNLOCKED;
+static batch_policy s_new_policy;
+static bool s_policy_changed;
+#endif
+
+#if defined(CONFIG_SUMP_BATCH_CBOR)
+static const telemetry_encoder* const s_encoder = &telemetry_cbor;
+#elif defined(CONFIG_SUMP_BATCH) || defined(CONFIG_SUMP_FLASH_LOG)
+static const telemetry_encoder* const s_encoder = &telemetry_json;
+#endif
+
+#ifdef CONFIG_SUMP_FLASH_LOG
+// Records land here while the broker cannot be reached and go out in bulk later
+#define REPLAY_PAYLOADS_PER_WAKE 8
+static flashlog s_flashlog;
+static bool s_flashlog_ok;
+static sump_record s_replay_recs[BATCH_MAX_RECORDS];
+static uint8_t s_replay_buf[BATCH_MAX_BYTES];
+#endif
+
+#ifdef CONFIG_SUMP_LOW_POWER
+#define POWER_WAKE_SAMPLES  1480
+#define POWER_UPLOAD_CHUNK  32
+// Survives deep sleep, including the readings taken while the radio was off
+static RTC_DATA_ATTR power_state s_power;
+static const power_config s_power_cfg = {
+    .on_amps = CONFIG_PUMP_ON_MILLIAMPS / 1000.0f,
+    .off_amps = CONFIG_PUMP_OFF_MILLIAMPS / 1000.0f,
+    .wake_s = CONFIG_SUMP_WAKE_S,
+    .idle_s = CONFIG_SUMP_IDLE_S,
+    .upload_s = CONFIG_SUMP_UPLOAD_S,
+    .upload_fill = CONFIG_SUMP_UPLOAD_FILL,
+};
+#endif
+
+#ifdef CONFIG_SUMP_ROLLUP
+#define ROLLUP_NAMESPACE    "rollup"
+#define ROLLUP_KEY          "state"
+#define ROLLUP_CHUNK        4           // Buckets to a message
+// Survives soft resets and deep sleep, and goes to NVS whenever an hour closes.  Only the
+// publishing task touches it, after boot.
+static RTC_NOINIT_ATTR rollup s_rollup;
+static unsigned s_rollup_wanted;        // Levels asked for, set from the MQTT task
+static unsigned s_rollup_sending;       // Levels on their way out, the lowest first
+static uint32_t s_rollup_sent;          // Start of the last bucket of it that went
+#endif
+
+// Sampling starts before the network.  Records and pump events from before the clock and
+// the broker are up wait here, then go out with their times rebased to UTC.
+#define HOLD_RECORDS        256         // Power of two, a bit over four minutes
+#define HOLD_EVENTS         16
+static sump_record s_hold_slots[HOLD_RECORDS];
+static record_ring s_hold;
+static pump_event s_hold_events[HOLD_EVENTS];
+static int s_hold_event_count;
+static bool s_started;                  // Held records went out, nothing is held from then on
+
+static char s_macstr[13];
+static esp_mqtt_client_handle_t volatile s_mqtt_client;
+
+// Every address, including after a drop.  esp-mqtt reconnects by itself once started.
+static void on_wifi_up(void)
+{
+    if (s_mqtt_client == NULL) {
+        s_mqtt_client = mqtt_app_start(CONFIG_SUMP_MQTT_BROKER_URI);
+    }
+}
+
+//--------------------------------------------------------------------------------------
+// Stamp a finished measurement and hand it to the publishing task
+//--------------------------------------------------------------------------------------
+static void queue_record(sump_record* rec)
+{
+    rec->mono_us = esp_timer_get_time();
+    rec->epoch_us = sntp_epoch_us(rec->mono_us);
+    rec->free_mem = esp_get_free_heap_size();
+#ifdef CONFIG_SUMP_LEVEL
+    taskENTER_CRITICAL(&s_level_lock);
+    rec->has_level = s_level_us != 0 &&
+                     rec->mono_us - s_level_us < LEVEL_STALE_PERIODS * CONFIG_SUMP_LEVEL_PERIOD_MS * 1000LL;
+    rec->level_cm = s_level_now.level_cm;
+    rec->level_rate = s_level_now.rate_cm_h;
+    taskEXIT_CRITICAL(&s_level_lock);
+#endif
+    if (!ring_push(&s_ring, rec)) {
+        ESP_LOGW(TAG, "Record ring full, dropped record %u (%u dropped so far)", rec->seq, s_ring.overflows);
+    }
+    rec->seq++;
+    xTaskNotifyGive(s_publish_task);
+}
+
+#ifdef CONFIG_EMON_STREAMING
+//--------------------------------------------------------------------------------------
+// Producer, streaming: every DMA block goes through the per-cycle window, nothing is
+// skipped between publish intervals
+//--------------------------------------------------------------------------------------
+static void sample_task(void *pvParameters)
+{
+    sump_record rec = { 0 };
+    emon_window_stats stats;
+    adc_block block;
+    int64_t interval_start = esp_timer_get_time();
+
+    while(true) {
+        if (!adc_stream_next(&s_adc_stream, &block, EMON_STREAM_TIMEOUT_MS)) {
+            ESP_LOGW(TAG, "No ADC block within %d ms", EMON_STREAM_TIMEOUT_MS);
+            continue;
+        }
+        int64_t work_start = esp_timer_get_time();
+#ifdef CONFIG_EMON_CAPTURE
+        // Ahead of the window, whose RMS values trigger somewhere in this block
+        if (capture_push(&s_capture, block.samples, block.len, block.start_us)) {
+            xTaskNotifyGive(s_publish_task);
+        }
+#endif
+        emon_window_push(&s_window, block.samples, block.len, block.start_us);
+#ifdef CONFIG_EMON_HARMONICS
+        if (harmonic_push(&s_harmonic, block.samples, block.len)) {
+            taskENTER_CRITICAL(&s_harmonic_lock);
+            harmonic_take(&s_harmonic, &s_harmonic_out);
+            s_harmonic_us = block.start_us;
+            s_harmonic_fresh = true;
+            taskEXIT_CRITICAL(&s_harmonic_lock);
+            xTaskNotifyGive(s_publish_task);
+        }
+#endif
+        adc_stream_release(&s_adc_stream, &block);
+        metrics_record_since(&s_sample_time, work_start, esp_timer_get_time());
+        if (block.start_us - interval_start < SAMPLE_PERIOD_MS * 1000LL) {
+            continue;
+        }
+        interval_start += SAMPLE_PERIOD_MS * 1000LL;
+        if (block.start_us - interval_start >= SAMPLE_PERIOD_MS * 1000LL) {
+            // Stream stalled, do not try to catch up with empty intervals
+            interval_start = block.start_us;
+        }
+
+        emon_window_take_stats(&s_window, &stats);
+        rec.irms = stats.count ? stats.mean : s_window.last_irms;
+        rec.irms_min = stats.count ? stats.min : rec.irms;
+        rec.irms_max = stats.count ? stats.max : rec.irms;
+        rec.cycles = stats.count;
+        queue_record(&rec);
+    }
+}
+#else
+//--------------------------------------------------------------------------------------
+// Producer: measures once per SAMPLE_PERIOD_MS and never waits on the network
+//--------------------------------------------------------------------------------------
+static void sample_task(void *pvParameters)
+{
+    sump_record rec = { 0 };
+    TickType_t last_wake = xTaskGetTickCount();
+
+    while(true) {
+        int64_t work_start = esp_timer_get_time();
+#ifdef CONFIG_EMON_PROFILE
+        emon_profile_begin(&s_profile);
+#endif
+#if CONFIG_EMON_CHANNELS > 1
+        // Every pump from one interleaved scan, the first one drives the pump detector
+#ifdef CONFIG_EMON_SAMPLE_DMA
+        adc_stream_flush(&s_adc_stream);
+        emon_multi_calc_stream(&s_multi, &s_adc_stream, 1480);
+#else
+        emon_multi_calc(&s_multi, 1480);
+#endif
+        rec.irms = s_multi.irms[0];
+        rec.extra_channels = s_multi.n - 1;
+        for (size_t k = 1; k < s_multi.n; k++) {
+            rec.irms_extra[k - 1] = s_multi.irms[k];
+        }
+#elif defined(CONFIG_EMON_SAMPLE_DMA)
+        // Drop what piled up while we were asleep so the window is fresh
+        adc_stream_flush(&s_adc_stream);
+#if CONFIG_EMON_SYNC_CYCLES > 0
+        rec.irms = emon_calcIrms_stream_cycles(&s_emon, &s_adc_stream, CONFIG_EMON_SYNC_CYCLES);
+#else
+        rec.irms = emon_calcIrms_stream(&s_emon, &s_adc_stream, 1480);
+#endif
+#elif CONFIG_EMON_SYNC_CYCLES > 0
+        rec.irms = emon_calcIrms_cycles(&s_emon, CONFIG_EMON_SYNC_CYCLES, SYNC_TIMEOUT_MS);
+#else
+        rec.irms = emon_calcIrms(&s_emon, 1480);
+#endif
+#if CONFIG_EMON_SYNC_CYCLES > 0
+        ESP_LOGD(TAG, "Irms %.3f A over %d cycles at %.2f Hz", rec.irms, CONFIG_EMON_SYNC_CYCLES, s_emon.frequency);
+#endif
+        metrics_record_since(&s_sample_time, work_start, esp_timer_get_time());
+#ifdef CONFIG_EMON_PROFILE
+        emon_profile_print(&s_profile);
+#endif
+        rec.irms_min = rec.irms_max = rec.irms;
+        queue_record(&rec);
+        vTaskDelayUntil(&last_wake, SAMPLE_PERIOD_MS / portTICK_PERIOD_MS);
+    }
+}
+#endif
+
+#ifdef CONFIG_SUMP_LEVEL
+//--------------------------------------------------------------------------------------
+// Ranging runs on its own, a burst of pings every CONFIG_SUMP_LEVEL_PERIOD_MS.  The pings
+// are timed by the RMT and the echo interrupt, this task only sleeps between them.
+//--------------------------------------------------------------------------------------
+static void level_task(void *pvParameters)
+{
+    uint32_t echo_us[LEVEL_MAX_PINGS];
+    level_reading reading;
+    TickType_t last_wake = xTaskGetTickCount();
+
+    while(true) {
+        if (ultrasonic_burst(&s_ultrasonic, echo_us, CONFIG_SUMP_LEVEL_PINGS) == 0) {
+            int64_t now = esp_timer_get_time();
+            if (level_burst(&s_level, echo_us, CONFIG_SUMP_LEVEL_PINGS, now, &reading) == 0) {
+                taskENTER_CRITICAL(&s_level_lock);
+                s_level_now = reading;
+                s_level_us = now;
+                taskEXIT_CRITICAL(&s_level_lock);
+                ESP_LOGD(TAG, "Level %.1f cm, %.1f cm/h from %u pings",
+                         reading.level_cm, reading.rate_cm_h, reading.pings);
+            } else {
+                level_print(&s_level);
+            }
+        }
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(CONFIG_SUMP_LEVEL_PERIOD_MS));
+    }
+}
+#endif
+
+#ifdef CONFIG_SUMP_DEADBAND
+//--------------------------------------------------------------------------------------
+// Report by exception on Irms, a moving water level also gets a reading out
+//--------------------------------------------------------------------------------------
+static bool deadband_lets_through(sump_record* rec)
+{
+    bool level_moved = false;
+    uint32_t held;
+
+#ifdef CONFIG_SUMP_LEVEL
+    level_moved = rec->has_level &&
+                  (!s_level_sent_ok || fabsf(rec->level_cm - s_level_sent) >= LEVEL_DEADBAND_CM);
+#endif
+    if (level_moved) {
+        deadband_pass(&s_deadband, rec->irms, rec->mono_us, &held);
+    } else if (deadband_check(&s_deadband, rec->irms, rec->mono_us, &held) == DEADBAND_SUPPRESS) {
+        return false;
+    }
+#ifdef CONFIG_SUMP_LEVEL
+    if (rec->has_level) {
+        s_level_sent_ok = true;
+        s_level_sent = rec->level_cm;
+    }
+#endif
+    rec->suppressed = held > UINT16_MAX ? UINT16_MAX : held;
+    return true;
+}
+#endif
+
+#ifdef CONFIG_SUMP_BATCH
+//--------------------------------------------------------------------------------------
+// "records=30 age_ms=30000 bytes=2048" on the config topic changes the flush policy
+//--------------------------------------------------------------------------------------
+static void on_config(const char* data, int len)
+{
+    taskENTER_CRITICAL(&s_policy_lock);
+    batch_policy policy = s_policy_changed ? s_new_policy : s_batch.policy;
+    taskEXIT_CRITICAL(&s_policy_lock);
+
+    if (batch_parse_policy(data, len, &policy) != 0) {
+        ESP_LOGW(TAG, "Ignoring config: %.*s", len, data);
+        return;
+    }
+    taskENTER_CRITICAL(&s_policy_lock);
+    s_new_policy = policy;
+    s_policy_changed = true;
+    taskEXIT_CRITICAL(&s_policy_lock);
+    xTaskNotifyGive(s_publish_task);
+}
+
+#ifdef CONFIG_SUMP_FLASH_LOG
+// Readings waiting in the batch go ahead of the ones that follow them into flash
+static void batch_to_flash(void)
+{
+    sump_record rec;
+    while (batch_pop(&s_batch, &rec)) {
+        flashlog_append(&s_flashlog, &rec);
+    }
+}
+#endif
+
+static void flush_batch(void)
+{
+    const uint8_t* payload;
+    size_t len;
+#ifdef CONFIG_SUMP_FLASH_LOG
+    if (s_flashlog_ok && !mqtt_connected()) {
+        batch_to_flash();
+        return;
+    }
+#endif
+    unsigned sent = 0;
+    s_batch_blocked = false;
+    while (batch_pending(&s_batch) > 0) {
+        if (!mqtt_can_queue(SUMP_BATCH_TOPIC, s_batch.policy.max_bytes)) {
+            // Backpressure: the records wait in the batch and go out in fewer, fuller
+            // payloads, or move on to flash if there is one
+            s_batch_blocked = true;
+#ifdef CONFIG_SUMP_FLASH_LOG
+            if (s_flashlog_ok) {
+                batch_to_flash();
+            }
+#endif
+            break;
+        }
+        int64_t oldest_us = s_batch.oldest_us;
+        len = batch_take_payload(&s_batch, &payload);
+        if (len == 0) {
+            break;
+        }
+        send_aws_batch(s_mqtt_client, payload, len);
+        metrics_record_since(&s_latency, oldest_us, esp_timer_get_time());
+        sent++;
+    }
+    if (sent > 0) {
+        batch_print_stats(&s_batch);
+    }
+}
+
+static TickType_t batch_wait(void)
+{
+#ifdef CONFIG_SUMP_OUTBOX
+    // An overdue batch would wake us every tick while the outbox is full.  An ack makes
+    // room and notifies, the retry time bounds the wait if none comes.
+    if (s_batch_blocked) {
+        return pdMS_TO_TICKS(CONFIG_SUMP_OUTBOX_RETRY_S * 1000);
+    }
+#endif
+    uint32_t ms = batch_ms_until_due(&s_batch, esp_timer_get_time());
+    return ms == UINT32_MAX ? portMAX_DELAY : pdMS_TO_TICKS(ms) + 1;
+}
+#endif
+
+#ifdef CONFIG_SUMP_OUTBOX
+// MQTT task: an ack opened the window, the publishing task sends what is queued
+static void on_published(void)
+{
+    if (s_publish_task) {
+        xTaskNotifyGive(s_publish_task);
+    }
+}
+#endif
+
+#ifdef CONFIG_SUMP_FLASH_LOG
+static void on_connected(void)
+{
+    if (s_publish_task) {
+        xTaskNotifyGive(s_publish_task);
+    }
+}
+
+//--------------------------------------------------------------------------------------
+// Send what piled up in flash while offline, oldest first, a few payloads per wake up
+// so new readings are not held back for long
+//--------------------------------------------------------------------------------------
+static void replay_flash_log(void)
+{
+    size_t n, len, used;
+
+    for (int i = 0; i < REPLAY_PAYLOADS_PER_WAKE && mqtt_connected(); i++) {
+        n = flashlog_replay(&s_flashlog, s_replay_recs, BATCH_MAX_RECORDS);
+        if (n == 0) {
+            flashlog_print(&s_flashlog);
+            return;
+        }
+        len = s_encoder->encode(s_macstr, s_replay_recs, n, s_replay_buf, sizeof(s_replay_buf), &used);
+        if (len == 0 || send_aws_batch(s_mqtt_client, s_replay_buf, len) < 0) {
+            flashlog_rewind(&s_flashlog);
+            return;
+        }
+        flashlog_commit(&s_flashlog, used);
+    }
+    if (flashlog_pending(&s_flashlog)) {
+        xTaskNotifyGive(s_publish_task);
+    }
+}
+#endif
+
+#ifdef CONFIG_SUMP_ROLLUP
+//--------------------------------------------------------------------------------------
+// Rollups: the copy in RTC memory after a soft reset or deep sleep, else the one NVS
+// had at the last hour, else empty
+//--------------------------------------------------------------------------------------
+static bool rollup_load(void)
+{
+    nvs_handle_t nvs;
+    size_t len = sizeof(s_rollup);
+
+    if (nvs_open(ROLLUP_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return false;
+    }
+    esp_err_t err = nvs_get_blob(nvs, ROLLUP_KEY, &s_rollup, &len);
+    nvs_close(nvs);
+    return err == ESP_OK && len == sizeof(s_rollup) && rollup_intact(&s_rollup);
+}
+
+static void rollup_restore(void)
+{
+    if (rollup_valid(&s_rollup)) {
+        ESP_LOGI(TAG, "Rollups kept in RTC memory");
+    } else if (rollup_load()) {
+        ESP_LOGI(TAG, "Rollups restored from NVS");
+    } else {
+        rollup_init(&s_rollup);
+    }
+    rollup_print(&s_rollup);
+}
+
+static void rollup_checkpoint(void)
+{
+    nvs_handle_t nvs;
+
+    rollup_seal(&s_rollup);
+    esp_err_t err = nvs_open(ROLLUP_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(nvs, ROLLUP_KEY, &s_rollup, sizeof(s_rollup));
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Rollup checkpoint failed: %s", esp_err_to_name(err));
+    }
+}
+
+// An hour or a day that just closed goes out by itself, minutes only when asked for
+static void rollup_closed(unsigned closed)
+{
+    if (closed & (1u << ROLLUP_HOUR)) {
+        rollup_checkpoint();
+    }
+    for (int l = ROLLUP_HOUR; l < ROLLUP_LEVELS; l++) {
+        rollup_level level = (rollup_level)l;
+        if ((closed & (1u << level)) && s_started && mqtt_connected()) {
+            send_rollup(s_mqtt_client, s_macstr, level,
+                        rollup_get(&s_rollup, level, rollup_count(&s_rollup, level) - 1), 1, false);
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------
+// "minute", "hour", "day" or "all" on the request topic sends those rings
+//--------------------------------------------------------------------------------------
+static void on_rollup_request(const char* data, int len)
+{
+    unsigned levels;
+
+    if (rollup_parse_request(data, len, &levels) != 0) {
+        ESP_LOGW(TAG, "Ignoring rollup request: %.*s", len, data);
+        return;
+    }
+    __atomic_fetch_or(&s_rollup_wanted, levels, __ATOMIC_RELAXED);
+    xTaskNotifyGive(s_publish_task);
+}
+
+// A few buckets to a message, oldest first and the open one last.  Picks up where it
+// left off when the outbox fills.
+static void publish_rollups(void)
+{
+    rollup_bucket chunk[ROLLUP_CHUNK];
+
+    s_rollup_sending |= __atomic_exchange_n(&s_rollup_wanted, 0, __ATOMIC_RELAXED);
+    while (s_rollup_sending != 0 && mqtt_connected()) {
+        rollup_level level = (rollup_level)__builtin_ctz(s_rollup_sending);
+        size_t count = rollup_count(&s_rollup, level), i = 0, n = 0;
+
+        // By start time, a minute may have closed and moved the ring on since the last chunk
+        while (i < count && rollup_get(&s_rollup, level, i)->start <= s_rollup_sent) {
+            i++;
+        }
+        while (n < ROLLUP_CHUNK && i < count) {
+            chunk[n++] = *rollup_get(&s_rollup, level, i++);
+        }
+        bool open = n < ROLLUP_CHUNK && rollup_current(&s_rollup, level, &chunk[n]);
+        n += open;
+        if (n > 0 && send_rollup(s_mqtt_client, s_macstr, level, chunk, n, open) < 0) {
+            return;
+        }
+        if (n == 0 || open || (i == count && n < ROLLUP_CHUNK)) {
+            s_rollup_sending &= ~(1u << level);
+            s_rollup_sent = 0;
+        } else {
+            s_rollup_sent = chunk[n - 1].start;
+        }
+    }
+}
+#endif
+
+#ifdef CONFIG_SUMP_LOW_POWER
+static void deep_sleep(uint32_t sleep_s)
+{
+#ifdef CONFIG_SUMP_OUTBOX
+    // What is still waiting for an ack would be lost with RAM
+    for (int ms = 0; ms < OUTBOX_DRAIN_MS && outbox_pending(&s_outbox) > 0 && mqtt_connected(); ms += 10) {
+        mqtt_pump_outbox(s_mqtt_client);
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    outbox_print(&s_outbox);
+#endif
+    power_print(&s_power);
+    mqtt_print_connect_stats();
+    ESP_LOGI(TAG, "Sleeping for %u s", sleep_s);
+    esp_wifi_stop();
+    esp_sleep_enable_timer_wakeup((uint64_t)sleep_s * 1000000);
+    esp_deep_sleep_start();
+}
+
+//--------------------------------------------------------------------------------------
+// After a timer wake up: one reading with the radio off, and straight back to sleep
+// unless the pump is running or the buffered readings are due to go out
+//--------------------------------------------------------------------------------------
+static void power_wake(void)
+{
+    energy_mon emon;
+    uint32_t sleep_s;
+
+    if (esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_TIMER || !power_valid(&s_power)) {
+        power_init(&s_power, (uint32_t)time(NULL));
+        return;
+    }
+    emon_init(&emon, emon_adc_provider());
+    emon_current(&emon, ICAL_ADC_CHANNEL, ICALIBRATION);
+    emon_calcIrms(&emon, POWER_WAKE_SAMPLES);       // Lets the offset filter settle
+    float irms = emon_calcIrms(&emon, POWER_WAKE_SAMPLES);
+    power_action action = power_decide(&s_power, &s_power_cfg, (uint32_t)time(NULL), irms, &sleep_s);
+    ESP_LOGI(TAG, "Woke up: %f A, %s", irms, power_action_name(action));
+#ifdef CONFIG_SUMP_ROLLUP
+    const sump_record rec = { .epoch_us = (int64_t)time(NULL) * 1000000, .irms = irms };
+    rollup_closed(rollup_add(&s_rollup, &rec, irms >= s_power_cfg.on_amps));
+#endif
+    if (action == POWER_SLEEP) {
+        deep_sleep(sleep_s);
+    }
+}
+#endif
+
+//--------------------------------------------------------------------------------------
+// Publish one reading now, put it in the next batch, or keep it in flash while offline.
+// Returns -1 if it went nowhere.
+//--------------------------------------------------------------------------------------
+static int publish_record(const sump_record* rec)
+{
+#ifdef CONFIG_SUMP_FLASH_LOG
+    // Once something is in flash everything goes through it, to keep the order
+    if (s_flashlog_ok && (!mqtt_connected() || flashlog_pending(&s_flashlog))) {
+#ifdef CONFIG_SUMP_BATCH
+        batch_to_flash();
+#endif
+        if (flashlog_append(&s_flashlog, rec) != 0) {
+            ESP_LOGW(TAG, "Flash log write failed for record %u", rec->seq);
+            return -1;
+        }
+        return 0;
+    }
+#endif
+#ifdef CONFIG_SUMP_BATCH
+    if (batch_add(&s_batch, rec, esp_timer_get_time())) {
+        flush_batch();
+    }
+    return 0;
+#else
+    char tbuf[TS_ISO_LEN];
+    int ret = 0;
+    ts_format_iso(rec->epoch_us, tbuf, sizeof(tbuf));
+    int msg_id = send_aws_msg(s_mqtt_client, s_macstr, tbuf, rec);
+    metrics_record_since(&s_latency, rec->mono_us, esp_timer_get_time());
+    if (msg_id < 0) {
+        ret = -1;
+#ifdef CONFIG_SUMP_FLASH_LOG
+        // Outbox full, it goes out with the replay
+        if (s_flashlog_ok && flashlog_append(&s_flashlog, rec) == 0) {
+            ret = 0;
+        }
+#endif
+    }
+    ESP_LOGI(TAG, "[APP] Free memory: %d bytes", rec->free_mem);
+    return ret;
+#endif
+}
+
+#ifdef CONFIG_SUMP_LOW_POWER
+// Readings taken while asleep go out like any other once the broker is up
+static void power_upload(void)
+{
+    power_sample samples[POWER_UPLOAD_CHUNK];
+    sump_record rec = { 0 };        // seq 0, they are outside the sampling task's count
+    size_t n;
+
+    while (mqtt_connected() && (n = power_peek(&s_power, samples, POWER_UPLOAD_CHUNK)) > 0) {
+        // Only what made it out leaves the buffer, the rest waits for the next burst
+        size_t sent = 0;
+        while (sent < n && mqtt_connected()) {
+            rec.epoch_us = samples[sent].t * 1000000LL;
+            rec.irms = rec.irms_min = rec.irms_max = samples[sent].milliamps / 1000.0f;
+            if (publish_record(&rec) != 0) {
+                break;
+            }
+            sent++;
+        }
+        power_sent(&s_power, sent, (uint32_t)time(NULL));
+        if (sent < n) {
+            break;
+        }
+    }
+}
+
+static void power_step(const sump_record* rec)
+{
+    uint32_t sleep_s;
+
+    if (power_decide(&s_power, &s_power_cfg, (uint32_t)(rec->epoch_us / 1000000), rec->irms, &sleep_s) != POWER_SLEEP) {
+        return;
+    }
+#ifdef CONFIG_SUMP_BATCH
+    flush_batch();
+#endif
+    if (power_pending(&s_power)) {
+        // Never got through, wait upload_s before trying again
+        power_sent(&s_power, 0, (uint32_t)time(NULL));
+    }
+    deep_sleep(sleep_s);
+}
+#endif
+
+//--------------------------------------------------------------------------------------
+// Startup: hold on to readings until there is a clock to stamp them with and somewhere
+// to send them.  A full hold with a good clock stops waiting for the broker, from then
+// on it is the same as losing the connection later.
+//--------------------------------------------------------------------------------------
+static bool startup_ready(void)
+{
+    if (!sntp_time_valid()) {
+        return false;
+    }
+#ifdef CONFIG_SUMP_FLASH_LOG
+    // The flash log keeps them in order until the broker is there
+    if (s_flashlog_ok) {
+        return true;
+    }
+#endif
+    return mqtt_connected() || ring_count(&s_hold) == ring_capacity(&s_hold);
+}
+
+// Events can be back dated, they carry their own esp_timer time
+static void send_event(const pump_event* ev)
+{
+    char tbuf[TS_ISO_LEN];
+    ts_format_iso(sntp_epoch_us(ev->t_us), tbuf, sizeof(tbuf));
+    send_pump_event(s_mqtt_client, s_macstr, tbuf, ev);
+}
+
+static void release_held(void)
+{
+    sump_record rec;
+
+    ESP_LOGI(TAG, "Up %d ms after boot, sending %u held records and %d events (%u dropped)",
+             (int)(esp_timer_get_time() / 1000), ring_count(&s_hold), s_hold_event_count, s_hold.overflows);
+    s_started = true;
+    while (ring_pop(&s_hold, &rec)) {
+        rec.epoch_us = sntp_epoch_us(rec.mono_us);
+        publish_record(&rec);
+    }
+    for (int i = 0; i < s_hold_event_count; i++) {
+        send_event(&s_hold_events[i]);
+    }
+    s_hold_event_count = 0;
+}
+
+static void publish_or_hold(const sump_record* rec)
+{
+    if (s_started) {
+        publish_record(rec);
+    } else {
+        ring_push(&s_hold, rec);
+    }
+}
+
+static void event_or_hold(const pump_event* ev)
+{
+    if (s_started) {
+        send_event(ev);
+    } else if (s_hold_event_count < HOLD_EVENTS) {
+        s_hold_events[s_hold_event_count++] = *ev;
+    }
+}
+
+#ifdef CONFIG_EMON_HARMONICS
+// A diagnostic, one that comes before startup or while offline is not kept
+static void publish_harmonics(void)
+{
+    harmonic_result r;
+    int64_t t_us;
+    bool fresh;
+
+    taskENTER_CRITICAL(&s_harmonic_lock);
+    fresh = s_harmonic_fresh;
+    r = s_harmonic_out;
+    t_us = s_harmonic_us;
+    s_harmonic_fresh = false;
+    taskEXIT_CRITICAL(&s_harmonic_lock);
+    if (!fresh) {
+        return;
+    }
+    harmonic_print(&r);
+    if (s_started && mqtt_connected()) {
+        char tbuf[TS_ISO_LEN];
+        ts_format_iso(sntp_epoch_us(t_us), tbuf, sizeof(tbuf));
+        send_harmonics(s_mqtt_client, s_macstr, tbuf, &r);
+    }
+}
+#endif
+
+#ifdef CONFIG_EMON_CAPTURE
+static void capture_on_rms(void* user, int64_t t_us, float irms)
+{
+    capture_rms(user, t_us, irms);
+}
+
+//--------------------------------------------------------------------------------------
+// Captures go out a few chunks per wake up, oldest first, so readings queued meanwhile
+// are not held back.  The sampling task keeps recording into whatever slots are free.
+//--------------------------------------------------------------------------------------
+static void upload_capture(void)
+{
+    for (int i = 0; i < CAPTURE_CHUNKS_PER_WAKE && mqtt_connected(); i++) {
+        if (s_capture_up == NULL) {
+            if ((s_capture_up = capture_ready(&s_capture)) == NULL) {
+                return;
+            }
+            s_capture_offset = 0;
+            ESP_LOGI(TAG, "Uploading capture %u (%s), %u samples", s_capture_up->info.id,
+                     capture_reason_name(s_capture_up->info.reason), s_capture_up->info.len);
+        }
+        size_t len = capture_chunk(s_capture_up, s_capture_offset, CONFIG_EMON_SAMPLE_RATE_HZ,
+                                   sntp_epoch_us(s_capture_up->info.trigger_us), CAPTURE_CHUNK_SAMPLES,
+                                   s_capture_buf, sizeof(s_capture_buf));
+        if (len == 0) {
+            capture_release(&s_capture, s_capture_up);
+            s_capture_up = NULL;
+            capture_print(&s_capture);
+            continue;
+        }
+        if (send_capture_chunk(s_mqtt_client, s_macstr, s_capture_buf, len) < 0) {
+            return;             // Same chunk again on the next wake up
+        }
+        s_capture_offset += (len - CAPTURE_CHUNK_HEADER) / 2;
+    }
+    if (s_capture_up != NULL || capture_ready(&s_capture) != NULL) {
+        xTaskNotifyGive(s_publish_task);
+    }
+}
+#endif
+
+#if CONFIG_SUMP_METRICS_PERIOD_S > 0
+//--------------------------------------------------------------------------------------
+// Stack left for every task, and with FreeRTOS run time stats on its share of both CPUs
+// since the last report.  Without them only our own tasks, and no CPU share.
+//--------------------------------------------------------------------------------------
+static void metrics_tasks(metrics_report* r)
+{
+#ifdef CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    uint32_t total;
+    UBaseType_t n = uxTaskGetSystemState(s_task_status, METRICS_MAX_TASKS, &total);
+    if (n > 0) {
+        uint64_t span = (uint64_t)(total - s_total_run_time) * portNUM_PROCESSORS;
+        for (UBaseType_t i = 0; i < n; i++) {
+            const TaskStatus_t* t = &s_task_status[i];
+            uint32_t before = 0;            // A task started since the last report ran all its time since
+            for (UBaseType_t j = 0; j < s_task_seen; j++) {
+                if (s_task_numbers[j] == t->xTaskNumber) {
+                    before = s_task_run_time[j];
+                }
+            }
+            snprintf(r->tasks[i].name, METRICS_TASK_NAME, "%s", t->pcTaskName);
+            r->tasks[i].stack_free = t->usStackHighWaterMark;
+            r->tasks[i].cpu_permille = span ? (uint16_t)(1000 * (uint64_t)(t->ulRunTimeCounter - before) / span) : 0;
+        }
+        for (UBaseType_t i = 0; i < n; i++) {
+            s_task_numbers[i] = s_task_status[i].xTaskNumber;
+            s_task_run_time[i] = s_task_status[i].ulRunTimeCounter;
+        }
+        s_task_seen = n;
+        s_total_run_time = total;
+        r->task_count = (uint8_t)n;
+        return;
+    }
+#endif
+    const struct { const char* name; TaskHandle_t task; } own[] = {
+        { "publish", s_publish_task }, { "sample", s_sample_task }, { "level", s_level_task },
+    };
+    r->task_count = 0;
+    for (size_t i = 0; i < sizeof(own) / sizeof(own[0]); i++) {
+        if (own[i].task != NULL) {
+            metrics_task* t = &r->tasks[r->task_count++];
+            snprintf(t->name, METRICS_TASK_NAME, "%s", own[i].name);
+            t->stack_free = uxTaskGetStackHighWaterMark(own[i].task);
+            t->cpu_permille = METRICS_NO_CPU;
+        }
+    }
+}
+
+// Once a period, on a topic of its own so the telemetry stays as it was
+static void publish_metrics(void)
+{
+    static metrics_report r;            // Too big for the stack
+    int64_t now = esp_timer_get_time();
+
+    if (now - s_metrics_start < CONFIG_SUMP_METRICS_PERIOD_S * 1000000LL) {
+        return;
+    }
+    r.period_s = (uint32_t)((now - s_metrics_start) / 1000000);
+    s_metrics_start = now;
+    metrics_take(&s_sample_time, &r.sample);
+    metrics_take(&s_latency, &r.latency);
+    metrics_take(&s_publish_time, &r.publish);
+    r.publish_failures = mqtt_take_publish_failures();
+    const mqtt_connect_stats* c = mqtt_get_connect_stats();
+    r.connects = c->session_kept + c->session_new;
+    r.connect_failures = c->failures;
+    r.connect_ms = c->last_ms;
+    r.heap_free = esp_get_free_heap_size();
+    r.heap_min = esp_get_minimum_free_heap_size();
+    r.heap_largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    r.ring_waiting = ring_count(&s_ring);
+    r.ring_high_water = s_ring.high_water;
+    r.ring_overflows = s_ring.overflows;
+    metrics_tasks(&r);
+    metrics_print(&r);
+    if (s_started && mqtt_connected()) {
+        char tbuf[TS_ISO_LEN];
+        ts_format_iso(sntp_epoch_us(now), tbuf, sizeof(tbuf));
+        send_metrics(s_mqtt_client, s_macstr, tbuf, &r);
+    }
+}
+#endif
+
+//--------------------------------------------------------------------------------------
+// Consumer: formats and publishes whatever the sampling task has queued
+//--------------------------------------------------------------------------------------
+static void publish_task(void *pvParameters)
+{
+    sump_record rec;
+    pump_event events[PUMP_MAX_EVENTS];
+
+    while(true) {
+#ifdef CONFIG_SUMP_BATCH
+        // Also wake up when the oldest batched record reaches its age limit
+        ulTaskNotifyTake(pdTRUE, batch_wait());
+        taskENTER_CRITICAL(&s_policy_lock);
+        if (s_policy_changed) {
+            batch_set_policy(&s_batch, &s_new_policy);
+            s_policy_changed = false;
+        }
+        taskEXIT_CRITICAL(&s_policy_lock);
+#else
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+#endif
+        while (ring_pop(&s_ring, &rec)) {
+            printf("Irms: %f \n", rec.irms);
+            if (!s_started && startup_ready()) {
+                release_held();
+            }
+            if (rec.epoch_us == 0 && s_started) {
+                rec.epoch_us = sntp_epoch_us(rec.mono_us);  // Queued just before the clock was set
+            }
+#if defined(CONFIG_SUMP_PUBLISH_RAW) && defined(CONFIG_SUMP_DEADBAND)
+            if (deadband_lets_through(&rec)) {
+                publish_or_hold(&rec);
+            }
+#elif defined(CONFIG_SUMP_PUBLISH_RAW)
+            publish_or_hold(&rec);
+#endif
+            int n = pump_update(&s_pump, rec.mono_us, rec.irms, events);
+            for (int i = 0; i < n; i++) {
+                event_or_hold(&events[i]);
+            }
+#ifdef CONFIG_SUMP_ROLLUP
+            // Readings from before the clock was set stay out of it
+            if (rec.epoch_us != 0) {
+                rollup_closed(rollup_add(&s_rollup, &rec, s_pump.running));
+            }
+#endif
+#ifdef CONFIG_SUMP_LOW_POWER
+            if (s_started) {
+                power_step(&rec);
+            }
+#endif
+        }
+#ifdef CONFIG_EMON_HARMONICS
+        publish_harmonics();
+#endif
+#ifdef CONFIG_EMON_CAPTURE
+        if (s_started && mqtt_connected()) {
+            upload_capture();
+        }
+#endif
+#ifdef CONFIG_SUMP_LOW_POWER
+        if (s_started && power_pending(&s_power) && mqtt_connected()) {
+            power_upload();
+        }
+#endif
+#ifdef CONFIG_SUMP_ROLLUP
+        if (s_started) {
+            publish_rollups();
+        }
+#endif
+#ifdef CONFIG_SUMP_BATCH
+        if (batch_due(&s_batch, esp_timer_get_time())) {
+            flush_batch();
+        }
+#endif
+#ifdef CONFIG_SUMP_FLASH_LOG
+        if (s_flashlog_ok && flashlog_pending(&s_flashlog) && mqtt_connected()) {
+            replay_flash_log();
+        }
+#endif
+#ifdef CONFIG_SUMP_OUTBOX
+        uint16_t waiting = outbox_pending(&s_outbox);
+        mqtt_pump_outbox(s_mqtt_client);
+        if (waiting > 0 && outbox_pending(&s_outbox) == 0) {
+            outbox_print(&s_outbox);
+        }
+#endif
+#ifdef CONFIG_EMON_SAMPLE_DMA
+        ESP_LOGD(TAG, "ADC stream: %.1f Hz measured, blocks filled %u taken %u dropped %u, overruns %u",
+                 adc_stream_measured_rate(&s_adc_stream), (unsigned)s_adc_stream.blocks_filled,
+                 (unsigned)s_adc_stream.blocks_taken, (unsigned)s_adc_stream.blocks_dropped,
+                 (unsigned)s_adc_stream.overruns);
+#endif
+#if CONFIG_SUMP_METRICS_PERIOD_S > 0
+        publish_metrics();
+#endif
+        ESP_LOGD(TAG, "Ring: pushed %u popped %u overflows %u high water %u",
+                 s_ring.pushed, s_ring.popped, s_ring.overflows, s_ring.high_water);
+    }
+}
 
 void app_main(void)
 {
     uint8_t mac[6] = {0};
-    char macstr[13];
-    energy_mon emon;
-    double Irms;
-    char* timestr;
-    esp_mqtt_client_handle_t mqtt_client;
-    uint32_t free_mem;
 
     printf("Hello world!\n");
 
@@ -50,6 +1136,21 @@ void app_main(void)
         ret = nvs_flash_init();
     }
     ESP_ERROR_CHECK( ret );
+    sntp_clock_init();
+#ifdef CONFIG_EMON_ADC_CAL
+    // Before anything reads the ADC, the wake check included
+    adc_dma_set_cal(emon_adc_calibrate());
+#endif
+
+#ifdef CONFIG_SUMP_ROLLUP
+    // Before the wake check, which adds its reading
+    rollup_restore();
+#endif
+#ifdef CONFIG_SUMP_LOW_POWER
+    // Does not come back if it is going straight to sleep again
+    ESP_ERROR_CHECK(power_check_config(&s_power_cfg));
+    power_wake();
+#endif
 
     // Using hardcoded WiFi Information for now
     // TODO: Add app-based configuration / provisioning of creds
@@ -70,28 +1171,174 @@ void app_main(void)
 
 
     esp_efuse_mac_get_default(mac);    
-    sprintf(macstr, "%X%X%X%X%X%X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-    ESP_LOGI(TAG, "MAC Address: %s", macstr);
-    ESP_LOGI(TAG, "ESP_WIFI_MODE_STA");
-    printf("Doing Wifi init...");
-    wifi_init_sta();
-    printf("WiFi Init Done!");
+    sprintf(s_macstr, "%X%X%X%X%X%X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    ESP_LOGI(TAG, "MAC Address: %s", s_macstr);
     //do_http_get();
     //ESP_LOGI(TAG, "HTTP_GET");
     
     //printf("HTTP DONE");
 
-    init_sntp();
-    mqtt_client=mqtt_app_start();
-    emon_current(&emon, ADC1_CHANNEL_6, ICALIBRATION);
+#ifdef CONFIG_EMON_PROFILE
+    ESP_ERROR_CHECK(emon_profile_init(&s_profile, emon_adc_provider(), profile_ticks, NULL,
+                                      CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ, PROFILE_BIN_NS));
+    emon_init(&s_emon, &s_profile.provider);
+#else
+    emon_init(&s_emon, emon_adc_provider());
+#endif
+    emon_current(&s_emon, ICAL_ADC_CHANNEL, ICALIBRATION);
+#ifdef CONFIG_EMON_FIXED_POINT
+    emon_set_math(&s_emon, EMON_MATH_FIXED);
+#endif
+#if CONFIG_EMON_CHANNELS > 1
+    ESP_ERROR_CHECK(emon_multi_init(&s_multi, emon_adc_provider(), s_channels, CONFIG_EMON_CHANNELS));
+#ifdef CONFIG_EMON_FIXED_POINT
+    emon_multi_set_math(&s_multi, EMON_MATH_FIXED);
+#endif
+#endif
+#if defined(CONFIG_EMON_SAMPLE_DMA) && CONFIG_EMON_CHANNELS > 1
+    adc1_channel_t scan[CONFIG_EMON_CHANNELS];
+    for (size_t k = 0; k < CONFIG_EMON_CHANNELS; k++) {
+        scan[k] = (adc1_channel_t)s_channels[k].pin;
+    }
+    // Blocks hold whole scans
+    ESP_ERROR_CHECK(adc_stream_init(&s_adc_stream, adc_dma_scan_source(scan, CONFIG_EMON_CHANNELS),
+                                    CONFIG_EMON_SAMPLE_RATE_HZ,
+                                    CONFIG_EMON_BLOCK_SAMPLES - CONFIG_EMON_BLOCK_SAMPLES % CONFIG_EMON_CHANNELS));
+    ESP_ERROR_CHECK(adc_stream_start(&s_adc_stream));
+#elif defined(CONFIG_EMON_SAMPLE_DMA)
+    ESP_ERROR_CHECK(adc_stream_init(&s_adc_stream, adc_dma_source(ICAL_ADC_CHANNEL),
+                                    CONFIG_EMON_SAMPLE_RATE_HZ, CONFIG_EMON_BLOCK_SAMPLES));
+    ESP_ERROR_CHECK(adc_stream_start(&s_adc_stream));
+#endif
+#ifdef CONFIG_EMON_STREAMING
+    ESP_ERROR_CHECK(emon_window_init(&s_window, &s_emon, CONFIG_EMON_SAMPLE_RATE_HZ, CONFIG_EMON_MAINS_HZ,
+                                     CONFIG_EMON_WINDOW_CYCLES, CONFIG_EMON_EMIT_CYCLES));
+#endif
+#ifdef CONFIG_EMON_HARMONICS
+    const harmonic_config harmonic_cfg = {
+        .sample_rate_hz = CONFIG_EMON_SAMPLE_RATE_HZ,
+        .mains_hz = CONFIG_EMON_MAINS_HZ,
+        .cycles = CONFIG_EMON_HARMONIC_CYCLES,
+        .period_ms = CONFIG_EMON_HARMONIC_PERIOD_S * 1000,
+        .orders = { 1, 2, 3, 5, 7 },
+        .stride = 1,
+        .ical = ICALIBRATION,
+    };
+    ESP_ERROR_CHECK(harmonic_init(&s_harmonic, &harmonic_cfg));
+#endif
+#ifdef CONFIG_EMON_CAPTURE
+    const capture_config capture_cfg = {
+        .sample_rate_hz = CONFIG_EMON_SAMPLE_RATE_HZ,
+        .mains_hz = CONFIG_EMON_MAINS_HZ,
+        .pre_samples = CAPTURE_PRE_SAMPLES,
+        .post_samples = CAPTURE_POST_SAMPLES,
+        .step_amps = CONFIG_EMON_CAPTURE_STEP_MILLIAMPS / 1000.0f,
+        .threshold_amps = CONFIG_PUMP_ON_MILLIAMPS / 1000.0f,
+        .zc_cycles = CONFIG_EMON_CAPTURE_ZC_CYCLES,
+        .zc_band = CAPTURE_ZC_BAND,
+        .zc_min_amps = CONFIG_PUMP_ON_MILLIAMPS / 1000.0f,
+        .holdoff_ms = CAPTURE_HOLDOFF_MS,
+    };
+    ESP_ERROR_CHECK(capture_init(&s_capture, &capture_cfg, s_capture_arena,
+                                 sizeof(s_capture_arena) / sizeof(s_capture_arena[0]), CONFIG_EMON_CAPTURE_SLOTS));
+    emon_window_set_callback(&s_window, capture_on_rms, &s_capture);
+#endif
 
-    while(true) {
-        Irms = emon_calcIrms(&emon, 1480);
-        printf("Irms: %f \n", Irms);
-        timestr = current_iso_utc_time();
-        free_mem = esp_get_free_heap_size();
-        send_aws_msg(mqtt_client, macstr, timestr, Irms, free_mem);
-        ESP_LOGI(TAG, "[APP] Free memory: %d bytes", free_mem);
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
+    const pump_config pump_cfg = {
+        .on_amps = CONFIG_PUMP_ON_MILLIAMPS / 1000.0f,
+        .off_amps = CONFIG_PUMP_OFF_MILLIAMPS / 1000.0f,
+        .debounce_ms = CONFIG_PUMP_DEBOUNCE_MS,
+        .max_run_s = CONFIG_PUMP_MAX_RUN_S,
+        .max_cycles_per_hour = CONFIG_PUMP_MAX_CYCLES_PER_HOUR,
+        .summary_s = CONFIG_PUMP_SUMMARY_S,
+    };
+    ESP_ERROR_CHECK(pump_init(&s_pump, &pump_cfg));
+
+#ifdef CONFIG_SUMP_DEADBAND
+    const deadband_config deadband_cfg = {
+        .abs_amps = CONFIG_SUMP_DEADBAND_MILLIAMPS / 1000.0f,
+        .rel = CONFIG_SUMP_DEADBAND_PERCENT / 100.0f,
+        .heartbeat_s = CONFIG_SUMP_HEARTBEAT_S,
+    };
+    ESP_ERROR_CHECK(deadband_init(&s_deadband, &deadband_cfg));
+#endif
+
+#ifdef CONFIG_SUMP_BATCH
+    const batch_policy policy = {
+        .max_records = CONFIG_SUMP_BATCH_RECORDS,
+        .max_age_ms = CONFIG_SUMP_BATCH_AGE_MS,
+        .max_bytes = CONFIG_SUMP_BATCH_BYTES,
+    };
+    ESP_ERROR_CHECK(batch_init(&s_batch, s_encoder, s_macstr, SUMP_BATCH_TOPIC, &policy));
+    mqtt_on_config(on_config);
+#endif
+#ifdef CONFIG_SUMP_FLASH_LOG
+    // Without the partition we carry on, offline readings are just lost as before
+    const flash_ops* flash = flash_partition_ops(FLASH_PART_LABEL);
+    s_flashlog_ok = flash != NULL && flashlog_open(&s_flashlog, flash) == 0;
+    if (s_flashlog_ok) {
+        flashlog_print(&s_flashlog);
+    } else {
+        ESP_LOGW(TAG, "No flash log, readings taken offline will be lost");
     }
+    mqtt_on_connected(on_connected);
+#endif
+#ifdef CONFIG_EMON_STREAMING
+    metrics_hist_init(&s_sample_time, 6);       // 64 us up, a block takes well under a millisecond
+#else
+    metrics_hist_init(&s_sample_time, 10);      // 1 ms up
+#endif
+    metrics_hist_init(&s_latency, 14);          // 16 ms up to 4 minutes, batches wait that long
+    metrics_hist_init(&s_publish_time, 6);      // 64 us up
+    mqtt_time_publishes(&s_publish_time);
+#ifdef CONFIG_SUMP_ROLLUP
+    mqtt_on_rollup_request(on_rollup_request);
+#endif
+#ifdef CONFIG_SUMP_OUTBOX
+    const outbox_config outbox_cfg = {
+        .max_inflight = CONFIG_SUMP_OUTBOX_INFLIGHT,
+        .retry_ms = CONFIG_SUMP_OUTBOX_RETRY_S * 1000,
+    };
+    ESP_ERROR_CHECK(outbox_init(&s_outbox, &outbox_cfg, s_outbox_arena, sizeof(s_outbox_arena)));
+    mqtt_use_outbox(&s_outbox);
+    mqtt_on_published(on_published);
+#endif
+
+#ifdef CONFIG_SUMP_LEVEL
+    const level_config level_cfg = {
+        .mount_cm = CONFIG_SUMP_LEVEL_MOUNT_CM,
+        .min_cm = LEVEL_MIN_CM,
+        .max_cm = CONFIG_SUMP_LEVEL_MOUNT_CM + LEVEL_SPREAD_CM,
+        .temp_c = CONFIG_SUMP_LEVEL_TEMP_C,
+        .spread_cm = LEVEL_SPREAD_CM,
+        .min_pings = (CONFIG_SUMP_LEVEL_PINGS + 1) / 2,
+        .rate_window_s = CONFIG_SUMP_LEVEL_RATE_WINDOW_S,
+    };
+    // A sensor that is missing or wired to the wrong pins costs the level, not the current
+    bool level_ok = level_init(&s_level, &level_cfg) == 0 &&
+                    ultrasonic_init(&s_ultrasonic, CONFIG_SUMP_LEVEL_TRIG_GPIO, CONFIG_SUMP_LEVEL_ECHO_GPIO,
+                                    RMT_CHANNEL_0) == 0;
+    if (!level_ok) {
+        ESP_LOGW(TAG, "No water level, records will carry Irms only");
+    }
+#endif
+
+    ESP_ERROR_CHECK(ring_init(&s_ring, s_ring_slots, RECORD_RING_SIZE));
+    ESP_ERROR_CHECK(ring_init(&s_hold, s_hold_slots, HOLD_RECORDS));
+    xTaskCreatePinnedToCore(publish_task, "publish", TASK_STACK_SIZE, NULL,
+                            PUBLISH_TASK_PRIO, &s_publish_task, PUBLISH_TASK_CORE);
+    xTaskCreatePinnedToCore(sample_task, "sample", TASK_STACK_SIZE, NULL,
+                            SAMPLE_TASK_PRIO, &s_sample_task, SAMPLE_TASK_CORE);
+#ifdef CONFIG_SUMP_LEVEL
+    // Kept off the sampling CPU
+    if (level_ok) {
+        xTaskCreatePinnedToCore(level_task, "level", TASK_STACK_SIZE, NULL,
+                                LEVEL_TASK_PRIO, &s_level_task, PUBLISH_TASK_CORE);
+    }
+#endif
+
+    // Measuring already, the network catches up in the background
+    ESP_LOGI(TAG, "ESP_WIFI_MODE_STA");
+    wifi_start_sta(on_wifi_up);
+    init_sntp();
 }